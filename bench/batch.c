@@ -0,0 +1,233 @@
+/**
+ * @file      batch.c
+ * @brief     Benchmark comparing batch decoding of same-PID frame runs across
+ *            SIMD instruction sets and batch sizes.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-private/batch.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/parser.h>
+#include <yobd-test/assert.h>
+
+/* Each measurement decodes about this many frames. */
+#define TOTAL_FRAMES (1 << 22)
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+static const size_t BATCH_SIZES[] = { 8, 64, 512, 4096 };
+
+/* The frames for one PID. */
+struct pid_run {
+    const struct pid_ctx *pid_ctx;
+    struct can_frame *frames;
+};
+
+/* Decodes one frame at a time, as a baseline. */
+static
+void decode_frames(
+    const struct pid_ctx *pid_ctx,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        errs[i] = YOBD_OK;
+        vals[i] = decode_pid(pid_ctx, &frames[i].data[pid_ctx->data_offset]);
+    }
+}
+
+static
+void bench_impl(
+    const struct pid_run *runs,
+    size_t run_count,
+    size_t batch_size,
+    const struct batch_impl *impl,
+    float *vals,
+    yobd_err *errs)
+{
+    size_t i;
+    size_t iterations;
+    size_t j;
+    char name[64];
+    uint64_t start;
+
+    iterations = TOTAL_FRAMES / (batch_size * run_count);
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; ++i) {
+        for (j = 0; j < run_count; ++j) {
+            if (impl == NULL) {
+                decode_frames(
+                    runs[j].pid_ctx,
+                    runs[j].frames,
+                    batch_size,
+                    vals,
+                    errs);
+            }
+            else {
+                decode_batch(
+                    runs[j].pid_ctx,
+                    impl->func,
+                    runs[j].frames,
+                    batch_size,
+                    vals,
+                    errs);
+            }
+        }
+    }
+
+    snprintf(
+        name,
+        sizeof(name),
+        "batch size %zu: %s",
+        batch_size,
+        (impl == NULL) ? "per frame" : impl->name);
+    bench_report(
+        name,
+        iterations * run_count * batch_size,
+        bench_now_ns() - start);
+}
+
+/* Checks that an evaluator matches decoding one frame at a time. */
+static
+void check_impl(
+    const struct pid_run *runs,
+    size_t run_count,
+    size_t batch_size,
+    const struct batch_impl *impl,
+    float *vals,
+    yobd_err *errs)
+{
+    size_t i;
+    size_t j;
+    float *ref_vals;
+
+    ref_vals = malloc(batch_size * sizeof(*ref_vals));
+    XASSERT_NOT_NULL(ref_vals);
+
+    for (i = 0; i < run_count; ++i) {
+        decode_frames(
+            runs[i].pid_ctx,
+            runs[i].frames,
+            batch_size,
+            ref_vals,
+            errs);
+        decode_batch(
+            runs[i].pid_ctx,
+            impl->func,
+            runs[i].frames,
+            batch_size,
+            vals,
+            errs);
+        for (j = 0; j < batch_size; ++j) {
+            XASSERT_OK(errs[j]);
+            XASSERT_EQ(memcmp(&vals[j], &ref_vals[j], sizeof(vals[j])), 0);
+        }
+    }
+
+    free(ref_vals);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    yobd_err *errs;
+    size_t i;
+    size_t j;
+    struct bench_pid_list list;
+    size_t max_batch;
+    size_t run_count;
+    struct pid_run *runs;
+    float *vals;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    bench_get_pids(ctx, &list);
+
+    /* Only PIDs that can be vectorized are interesting here. */
+    max_batch = BATCH_SIZES[ARRAYLEN(BATCH_SIZES) - 1];
+    runs = malloc(list.count * sizeof(*runs));
+    XASSERT_NOT_NULL(runs);
+    run_count = 0;
+    srand(0);
+    for (i = 0; i < list.count; ++i) {
+        runs[run_count].pid_ctx = get_pid_ctx(
+            ctx,
+            list.pids[i].mode,
+            list.pids[i].pid);
+        XASSERT_NOT_NULL(runs[run_count].pid_ctx);
+        if (!batch_can_vectorize(runs[run_count].pid_ctx)) {
+            continue;
+        }
+
+        runs[run_count].frames = malloc(
+            max_batch * sizeof(*runs[run_count].frames));
+        XASSERT_NOT_NULL(runs[run_count].frames);
+        for (j = 0; j < max_batch; ++j) {
+            bench_make_response(ctx, &list.pids[i], &runs[run_count].frames[j]);
+        }
+        ++run_count;
+    }
+    XASSERT_GT(run_count, 0);
+    printf("%zu of %zu PIDs can be vectorized\n", run_count, list.count);
+
+    vals = malloc(max_batch * sizeof(*vals));
+    XASSERT_NOT_NULL(vals);
+    errs = malloc(max_batch * sizeof(*errs));
+    XASSERT_NOT_NULL(errs);
+
+    for (i = 0; i < ARRAYLEN(BATCH_SIZES); ++i) {
+        bench_impl(runs, run_count, BATCH_SIZES[i], NULL, vals, errs);
+        for (j = 0; j < batch_impl_count; ++j) {
+            if (!batch_impls[j].supported()) {
+                continue;
+            }
+            check_impl(
+                runs,
+                run_count,
+                BATCH_SIZES[i],
+                &batch_impls[j],
+                vals,
+                errs);
+            bench_impl(
+                runs,
+                run_count,
+                BATCH_SIZES[i],
+                &batch_impls[j],
+                vals,
+                errs);
+        }
+    }
+
+    for (i = 0; i < run_count; ++i) {
+        free(runs[i].frames);
+    }
+    free(runs);
+    free(vals);
+    free(errs);
+    free(list.pids);
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
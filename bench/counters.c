@@ -0,0 +1,212 @@
+/**
+ * @file      counters.c
+ * @brief     Benchmark measuring cache misses and branch mispredictions per
+ *            decoded frame with hardware performance counters.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _DEFAULT_SOURCE
+#include <linux/limits.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define FRAME_COUNT (1 << 16)
+#define ITERATIONS (20)
+#define SYNTHETIC_SAE_COUNT (256)
+#define SYNTHETIC_MFR_COUNT (10000 - SYNTHETIC_SAE_COUNT)
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+struct counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+};
+
+static struct counter counters[] = {
+    {
+        "L1D misses",
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        -1
+    },
+    {
+        "LLC misses",
+        PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_CACHE_MISSES,
+        -1
+    },
+    {
+        "branch misses",
+        PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        -1
+    },
+};
+
+/*
+ * Opens the counters for this thread. Counters the kernel or the machine
+ * doesn't support (which is common in VMs) are left closed and skipped.
+ */
+static
+void open_counters(void)
+{
+    struct perf_event_attr attr;
+    size_t i;
+
+    for (i = 0; i < ARRAYLEN(counters); ++i) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters[i].fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters[i].fd == -1) {
+            printf("%s: counter unavailable\n", counters[i].name);
+        }
+    }
+}
+
+static
+void close_counters(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAYLEN(counters); ++i) {
+        if (counters[i].fd != -1) {
+            close(counters[i].fd);
+        }
+    }
+}
+
+static
+void set_counters(bool enable)
+{
+    size_t i;
+    int ret;
+
+    for (i = 0; i < ARRAYLEN(counters); ++i) {
+        if (counters[i].fd == -1) {
+            continue;
+        }
+        if (enable) {
+            ret = ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            XASSERT_NEQ(ret, -1);
+        }
+        ret = ioctl(
+            counters[i].fd,
+            enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+            0);
+        XASSERT_NEQ(ret, -1);
+    }
+}
+
+static
+void report_counters(const char *label, size_t frames)
+{
+    uint64_t count;
+    size_t i;
+    ssize_t ret;
+
+    for (i = 0; i < ARRAYLEN(counters); ++i) {
+        if (counters[i].fd == -1) {
+            continue;
+        }
+        ret = read(counters[i].fd, &count, sizeof(count));
+        XASSERT_EQ(ret, (ssize_t) sizeof(count));
+        printf(
+            "%-40s %12.3f %s/frame\n",
+            label,
+            ((double) count) / frames,
+            counters[i].name);
+    }
+}
+
+/*
+ * Decodes frames for PIDs picked uniformly at random, so that consecutive
+ * frames rarely share PID records or decoders. This shows both the records'
+ * cache footprint and how well the decode path's branches predict on mixed
+ * traffic.
+ */
+static
+void run(const char *schema, const char *label)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    static struct can_frame frames[FRAME_COUNT];
+    size_t i;
+    size_t j;
+    struct bench_pid_list list;
+    uint64_t start;
+    float sum;
+    float val;
+
+    err = yobd_parse_schema(schema, &ctx);
+    XASSERT_OK(err);
+    bench_get_pids(ctx, &list);
+
+    srand(0);
+    for (i = 0; i < FRAME_COUNT; ++i) {
+        bench_make_response(ctx, &list.pids[rand() % list.count], &frames[i]);
+    }
+
+    sum = 0;
+    set_counters(true);
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < FRAME_COUNT; ++j) {
+            err = yobd_parse_can_response(ctx, &frames[j], &val);
+            XASSERT_OK(err);
+            sum += val;
+        }
+    }
+    set_counters(false);
+    bench_report(label, FRAME_COUNT * ITERATIONS, bench_now_ns() - start);
+    report_counters(label, FRAME_COUNT * ITERATIONS);
+
+    /* Use the results so the compiler can't skip the work. */
+    XASSERT_NEQ(sum, 0);
+
+    free(list.pids);
+    yobd_free_ctx(ctx);
+}
+
+int main(int argc, const char **argv)
+{
+    char synthetic_path[PATH_MAX];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    open_counters();
+
+    run(argv[1], "example schema");
+
+    bench_write_schema(
+        SYNTHETIC_SAE_COUNT,
+        SYNTHETIC_MFR_COUNT,
+        synthetic_path);
+    run(synthetic_path, "10k-PID schema");
+    unlink(synthetic_path);
+
+    close_counters();
+
+    return EXIT_SUCCESS;
+}
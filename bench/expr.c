@@ -0,0 +1,350 @@
+/**
+ * @file      expr.c
+ * @brief     Benchmark comparing the token-based expression evaluator with the
+ *            bytecode evaluator.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yaml.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/expr.h>
+#include <yobd-test/assert.h>
+
+#define INPUT_COUNT (256)
+#define ITERATIONS (500)
+#define MAX_EXPRS (1024)
+#define MAX_DEPTH (32)
+#define REPEATS (10)
+
+/** An expression in both the token and the bytecode representation. */
+struct bench_expr {
+    pid_data_type type;
+    struct expr_token toks[EXPR_MAX_TOKENS];
+    size_t tok_count;
+    struct expr expr;
+};
+
+/*
+ * This is the evaluator that the bytecode replaced, kept here as a baseline.
+ * It tags every stack value with its type and checks the tags on every pop.
+ */
+#define DEFINE_LEGACY_EVAL_FUNC(stack_type, enum_type) \
+static \
+float legacy_eval_##stack_type( \
+    const struct expr_token *toks, \
+    size_t size, \
+    struct EXPR_STACK *stack, \
+    const unsigned char *data) \
+{ \
+    size_t i; \
+    struct expr_token tok1; \
+    struct expr_token tok2; \
+    struct expr_token result; \
+    stack_type val; \
+    \
+    for (i = 0; i < size; ++i) { \
+        switch (toks[i].type) { \
+            case EXPR_A: \
+            case EXPR_B: \
+            case EXPR_C: \
+            case EXPR_D: \
+                result.type = enum_type; \
+                result.as_##stack_type = data[toks[i].type - EXPR_A]; \
+                PUSH_STACK(EXPR_STACK, stack, &result); \
+                break; \
+            case EXPR_OP: \
+                tok1 = POP_STACK(EXPR_STACK, stack); \
+                tok2 = POP_STACK(EXPR_STACK, stack); \
+                XASSERT_EQ(tok1.type, enum_type); \
+                XASSERT_EQ(tok2.type, enum_type); \
+                result.type = enum_type; \
+                switch (toks[i].as_op) { \
+                    case EXPR_OP_ADD: \
+                        result.as_##stack_type = tok2.as_##stack_type + tok1.as_##stack_type; \
+                        break; \
+                    case EXPR_OP_SUB: \
+                        result.as_##stack_type = tok2.as_##stack_type - tok1.as_##stack_type; \
+                        break; \
+                    case EXPR_OP_MUL: \
+                        result.as_##stack_type = tok2.as_##stack_type * tok1.as_##stack_type; \
+                        break; \
+                    case EXPR_OP_DIV: \
+                        XASSERT_NEQ(tok1.as_##stack_type, 0); \
+                        result.as_##stack_type = tok2.as_##stack_type / tok1.as_##stack_type; \
+                        break; \
+                } \
+                PUSH_STACK(EXPR_STACK, stack, &result); \
+                break; \
+            case enum_type: \
+                result = toks[i]; \
+                PUSH_STACK(EXPR_STACK, stack, &result); \
+                break; \
+            default: \
+                XASSERT_ERROR; \
+        } \
+    } \
+    \
+    XASSERT_EQ(STACK_SIZE(EXPR_STACK, stack), 1); \
+    result = POP_STACK(EXPR_STACK, stack); \
+    XASSERT_EQ(result.type, enum_type); \
+    \
+    val = result.as_##stack_type; \
+    return (float) val; \
+}
+
+DEFINE_LEGACY_EVAL_FUNC(int32_t, EXPR_INT32)
+DEFINE_LEGACY_EVAL_FUNC(float, EXPR_FLOAT)
+
+/*
+ * Keep this out of line, as the bytecode evaluator is in another translation
+ * unit and can't be inlined either.
+ */
+static __attribute__ ((noinline))
+float legacy_eval(const struct bench_expr *bexpr, const unsigned char *data)
+{
+    struct EXPR_STACK stack;
+    struct expr_token stack_data[bexpr->tok_count];
+
+    INIT_STACK(EXPR_STACK, &stack, stack_data, bexpr->tok_count);
+
+    if (bexpr->type == PID_DATA_TYPE_FLOAT) {
+        return legacy_eval_float(bexpr->toks, bexpr->tok_count, &stack, data);
+    }
+    else {
+        return legacy_eval_int32_t(bexpr->toks, bexpr->tok_count, &stack, data);
+    }
+}
+
+static
+pid_data_type find_type(const char *str)
+{
+    if (strcmp(str, "float") == 0) {
+        return PID_DATA_TYPE_FLOAT;
+    }
+    else {
+        /* All integer types are evaluated as int32. */
+        return PID_DATA_TYPE_INT32;
+    }
+}
+
+static
+void add_expr(
+    pid_data_type type,
+    const char *val,
+    struct bench_expr *exprs,
+    size_t *count)
+{
+    struct bench_expr *bexpr;
+    yobd_err err;
+
+    if (strcmp(val, "nop") == 0) {
+        /* nop expressions are never evaluated by either machine. */
+        return;
+    }
+
+    XASSERT_LT(*count, MAX_EXPRS);
+    bexpr = &exprs[*count];
+    bexpr->type = type;
+    bexpr->tok_count = parse_expr_tokens(val, type, bexpr->toks);
+    /* Compile to bytecode even if the expression is linear. */
+    err = compile_expr(bexpr->toks, bexpr->tok_count, &bexpr->expr);
+    XASSERT_OK(err);
+    XASSERT_LTE(bexpr->expr.max_depth, MAX_DEPTH);
+    ++*count;
+}
+
+/*
+ * Collects the expression of every PID in a schema. Each expression is a
+ * mapping with "type" and "val" keys.
+ */
+static
+size_t read_exprs(const char *path, struct bench_expr *exprs)
+{
+    size_t count;
+    bool done;
+    yaml_event_t event;
+    FILE *file;
+    bool is_key[MAX_DEPTH];
+    size_t level;
+    const char *key;
+    yaml_parser_t parser;
+    int ret;
+    const char *scalar;
+    pid_data_type type;
+
+    file = fopen(path, "r");
+    XASSERT_NOT_NULL(file);
+    ret = yaml_parser_initialize(&parser);
+    XASSERT_EQ(ret, 1);
+    yaml_parser_set_input_file(&parser, file);
+
+    count = 0;
+    key = "";
+    level = 0;
+    type = PID_DATA_TYPE_FLOAT;
+    done = false;
+    while (!done) {
+        ret = yaml_parser_parse(&parser, &event);
+        XASSERT_EQ(ret, 1);
+
+        switch (event.type) {
+            case YAML_MAPPING_START_EVENT:
+                if (level > 0) {
+                    /* This mapping is the value of the enclosing key. */
+                    is_key[level-1] = true;
+                }
+                XASSERT_LT(level, MAX_DEPTH);
+                is_key[level++] = true;
+                break;
+            case YAML_MAPPING_END_EVENT:
+                --level;
+                break;
+            case YAML_SCALAR_EVENT:
+                scalar = (const char *) event.data.scalar.value;
+                if (level == 0) {
+                    break;
+                }
+                if (is_key[level-1]) {
+                    if (strcmp(scalar, "type") == 0) {
+                        key = "type";
+                    }
+                    else if (strcmp(scalar, "val") == 0) {
+                        key = "val";
+                    }
+                    else {
+                        key = "";
+                    }
+                }
+                else if (strcmp(key, "type") == 0) {
+                    type = find_type(scalar);
+                }
+                else if (strcmp(key, "val") == 0) {
+                    add_expr(type, scalar, exprs, &count);
+                }
+                is_key[level-1] = !is_key[level-1];
+                break;
+            case YAML_STREAM_END_EVENT:
+                done = true;
+                break;
+            default:
+                break;
+        }
+
+        yaml_event_delete(&event);
+    }
+
+    yaml_parser_delete(&parser);
+    fclose(file);
+
+    return count;
+}
+
+/* Evaluates every expression over every input, returning the elapsed time. */
+static
+uint64_t time_eval(
+    const struct bench_expr *exprs,
+    size_t count,
+    unsigned char (*inputs)[4],
+    bool legacy)
+{
+    size_t i;
+    size_t j;
+    size_t k;
+    uint64_t start;
+    float sum;
+
+    sum = 0;
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < INPUT_COUNT; ++j) {
+            for (k = 0; k < count; ++k) {
+                if (legacy) {
+                    sum += legacy_eval(&exprs[k], inputs[j]);
+                }
+                else {
+                    sum += stack_eval(exprs[k].type, &exprs[k].expr, inputs[j]);
+                }
+            }
+        }
+    }
+
+    /* Use the results so the compiler can't skip the work. */
+    XASSERT_NEQ(sum, 0);
+
+    return bench_now_ns() - start;
+}
+
+int main(int argc, const char **argv)
+{
+    uint64_t best_bytecode;
+    uint64_t best_legacy;
+    size_t count;
+    uint64_t elapsed;
+    static struct bench_expr exprs[MAX_EXPRS];
+    size_t i;
+    static unsigned char inputs[INPUT_COUNT][4];
+    size_t j;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    count = read_exprs(argv[1], exprs);
+    XASSERT_GT(count, 0);
+
+    /*
+     * Keep inputs nonzero so that expressions dividing by a data byte are
+     * defined everywhere.
+     */
+    srand(0);
+    for (i = 0; i < INPUT_COUNT; ++i) {
+        for (j = 0; j < sizeof(inputs[i]); ++j) {
+            inputs[i][j] = 1 + rand() % 0xff;
+        }
+    }
+
+    /* Both machines must agree exactly before we bother timing them. */
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < INPUT_COUNT; ++j) {
+            XASSERT_EQ(
+                legacy_eval(&exprs[i], inputs[j]),
+                stack_eval(exprs[i].type, &exprs[i].expr, inputs[j]));
+        }
+    }
+
+    /*
+     * Alternate between the machines and keep the best run of each, so that
+     * scheduling noise affects both alike.
+     */
+    best_legacy = UINT64_MAX;
+    best_bytecode = UINT64_MAX;
+    for (i = 0; i < REPEATS; ++i) {
+        elapsed = time_eval(exprs, count, inputs, true);
+        if (elapsed < best_legacy) {
+            best_legacy = elapsed;
+        }
+        elapsed = time_eval(exprs, count, inputs, false);
+        if (elapsed < best_bytecode) {
+            best_bytecode = elapsed;
+        }
+    }
+
+    printf("%zu expressions\n", count);
+    bench_report("tokens", ITERATIONS * INPUT_COUNT * count, best_legacy);
+    bench_report("bytecode", ITERATIONS * INPUT_COUNT * count, best_bytecode);
+
+    for (i = 0; i < count; ++i) {
+        destroy_expr(&exprs[i].expr);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file      bench.h
+ * @brief     Shared helpers for yobd benchmarks.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_BENCH_BENCH_H_
+#define YOBD_BENCH_BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/** A mode-PID taken from a schema, along with its CAN byte count. */
+struct bench_pid {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint_fast8_t can_bytes;
+};
+
+/** A list of mode-PIDs collected from a schema. */
+struct bench_pid_list {
+    struct bench_pid *pids;
+    size_t count;
+};
+
+static inline __attribute__ ((__unused__))
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    int ret;
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    XASSERT_EQ(ret, 0);
+
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline __attribute__ ((__unused__))
+bool bench_add_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct bench_pid_list *list;
+
+    list = data;
+    list->pids[list->count].mode = mode;
+    list->pids[list->count].pid = pid;
+    list->pids[list->count].can_bytes = desc->can_bytes;
+    ++list->count;
+
+    return false;
+}
+
+/**
+ * Fills in a list with every mode-PID known to a context. The list must be
+ * freed with free(list->pids).
+ */
+static inline __attribute__ ((__unused__))
+void bench_get_pids(struct yobd_ctx *ctx, struct bench_pid_list *list)
+{
+    size_t count;
+    yobd_err err;
+
+    err = yobd_get_pid_count(ctx, &count);
+    XASSERT_OK(err);
+
+    list->pids = malloc(count * sizeof(*list->pids));
+    XASSERT_NOT_NULL(list->pids);
+    list->count = 0;
+
+    err = yobd_pid_foreach(ctx, bench_add_pid, list);
+    XASSERT_OK(err);
+    XASSERT_EQ(list->count, count);
+}
+
+/**
+ * Fills in a response frame for the given PID with pseudo-random data bytes.
+ */
+static inline __attribute__ ((__unused__))
+void bench_make_response(
+    struct yobd_ctx *ctx,
+    const struct bench_pid *pid,
+    struct can_frame *frame)
+{
+    unsigned char data[4];
+    yobd_err err;
+    uint_fast8_t i;
+
+    for (i = 0; i < pid->can_bytes; ++i) {
+        data[i] = rand() & 0xff;
+    }
+
+    err = yobd_make_can_response(
+        ctx,
+        pid->mode,
+        pid->pid,
+        data,
+        pid->can_bytes,
+        frame);
+    XASSERT_OK(err);
+}
+
+/**
+ * Writes a synthetic schema to a temporary file, returning its path in path
+ * (which must hold at least PATH_MAX bytes). The schema has sae_count PIDs in
+ * mode 0x1 (at most 256) and mfr_count two-byte PIDs spread over manufacturer
+ * modes starting at 0x22. The caller should unlink the file when done.
+ */
+static inline __attribute__ ((__unused__))
+void bench_write_schema(size_t sae_count, size_t mfr_count, char *path)
+{
+    FILE *file;
+    int fd;
+    size_t i;
+    size_t per_mode;
+
+    XASSERT_LTE(sae_count, 0x100);
+
+    strcpy(path, "/tmp/yobd-bench-XXXXXX");
+    fd = mkstemp(path);
+    XASSERT_NEQ(fd, -1);
+    file = fdopen(fd, "w");
+    XASSERT_NOT_NULL(file);
+
+    fprintf(file, "---\nendian: big\nmodepid:\n");
+    if (sae_count > 0) {
+        fprintf(file, "  \"0x1\":\n");
+    }
+    for (i = 0; i < sae_count; ++i) {
+        fprintf(
+            file,
+            "    \"0x%zx\":\n"
+            "      name: synthetic %zu\n"
+            "      bytes: 2\n"
+            "      raw-unit: rpm\n"
+            "      si-unit: rad/s\n"
+            "      expr:\n"
+            "        type: float\n"
+            "        val: %s\n",
+            i,
+            i,
+            (i % 2 == 0) ? "(256*A + B) / 4" : "A * B / 4");
+    }
+
+    /* Spread PIDs evenly over up to 8 manufacturer modes. */
+    per_mode = (mfr_count + 7) / 8;
+    for (i = 0; i < mfr_count; ++i) {
+        if (i % per_mode == 0) {
+            fprintf(file, "  \"0x%zx\":\n", 0x22 + i / per_mode);
+        }
+        fprintf(
+            file,
+            "    \"0x%zx\":\n"
+            "      name: synthetic manufacturer %zu\n"
+            "      bytes: 2\n"
+            "      raw-unit: km/h\n"
+            "      si-unit: m/s\n"
+            "      expr:\n"
+            "        type: float\n"
+            "        val: %s\n",
+            /* Scatter the PIDs over the 16-bit PID space. */
+            ((i % per_mode) * 40503) & 0xffff,
+            i,
+            (i % 2 == 0) ? "(256*A + B) / 100" : "(A + 1) * (B + 1)");
+    }
+
+    fclose(file);
+}
+
+/** Prints a throughput result in a consistent format. */
+static inline __attribute__ ((__unused__))
+void bench_report(const char *name, size_t items, uint64_t ns)
+{
+    printf(
+        "%-40s %12.0f items/s %10.2f ns/item\n",
+        name,
+        ((double) items) * 1e9 / ns,
+        ((double) ns) / items);
+}
+
+#endif /* YOBD_BENCH_BENCH_H_ */
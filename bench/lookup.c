@@ -0,0 +1,129 @@
+/**
+ * @file      lookup.c
+ * @brief     Benchmark for mode-PID lookups in standard and manufacturer modes.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define LOOKUP_COUNT (4096)
+#define ITERATIONS (2000)
+#define MFR_PID_COUNT (10000)
+
+static
+void bench_descriptor(
+    struct yobd_ctx *ctx,
+    const struct bench_pid *lookups,
+    const char *name)
+{
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    size_t hits;
+    size_t i;
+    size_t j;
+    uint64_t start;
+
+    hits = 0;
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < LOOKUP_COUNT; ++j) {
+            err = yobd_get_pid_descriptor(
+                ctx,
+                lookups[j].mode,
+                lookups[j].pid,
+                &desc);
+            hits += (err == YOBD_OK);
+        }
+    }
+    bench_report(name, LOOKUP_COUNT * ITERATIONS, bench_now_ns() - start);
+    XASSERT_GT(hits, 0);
+}
+
+static
+void bench_decode(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    const char *name)
+{
+    yobd_err err;
+    size_t i;
+    size_t j;
+    uint64_t start;
+    float val;
+
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < LOOKUP_COUNT; ++j) {
+            err = yobd_parse_can_response(ctx, &frames[j], &val);
+            XASSERT_OK(err);
+        }
+    }
+    bench_report(name, LOOKUP_COUNT * ITERATIONS, bench_now_ns() - start);
+}
+
+static
+void run(struct yobd_ctx *ctx, const char *label)
+{
+    static struct can_frame frames[LOOKUP_COUNT];
+    size_t i;
+    struct bench_pid_list list;
+    static struct bench_pid lookups[LOOKUP_COUNT];
+    char name[64];
+
+    bench_get_pids(ctx, &list);
+
+    /* Lookups of PIDs that exist. */
+    for (i = 0; i < LOOKUP_COUNT; ++i) {
+        lookups[i] = list.pids[rand() % list.count];
+        bench_make_response(ctx, &lookups[i], &frames[i]);
+    }
+    snprintf(name, sizeof(name), "%s: descriptor hit", label);
+    bench_descriptor(ctx, lookups, name);
+    snprintf(name, sizeof(name), "%s: decode", label);
+    bench_decode(ctx, frames, name);
+
+    /* Half of the lookups miss. */
+    for (i = 0; i < LOOKUP_COUNT; i += 2) {
+        lookups[i].pid ^= 0x5a;
+    }
+    snprintf(name, sizeof(name), "%s: descriptor 50%% miss", label);
+    bench_descriptor(ctx, lookups, name);
+
+    free(list.pids);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    char path[PATH_MAX];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    run(ctx, "SAE schema");
+    yobd_free_ctx(ctx);
+
+    bench_write_schema(0x100, MFR_PID_COUNT, path);
+    err = yobd_parse_schema(path, &ctx);
+    XASSERT_OK(err);
+    unlink(path);
+    run(ctx, "synthetic schema");
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
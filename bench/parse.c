@@ -0,0 +1,224 @@
+/**
+ * @file      parse.c
+ * @brief     Benchmark comparing single-frame, batch, and handle-based CAN
+ *            response parsing.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <yobd/handle.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define FRAME_COUNT (4096)
+#define ITERATIONS (500)
+
+/** How many consecutive frames carry the same mode-PID. */
+static const size_t RUN_LENGTHS[] = { 1, 8, 64 };
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+static
+void make_frames(
+    struct yobd_ctx *ctx,
+    const struct bench_pid_list *list,
+    size_t run_length,
+    struct can_frame *frames,
+    yobd_pid_handle *handles)
+{
+    yobd_err err;
+    size_t i;
+    const struct bench_pid *pid;
+
+    pid = NULL;
+    for (i = 0; i < FRAME_COUNT; ++i) {
+        if (i % run_length == 0) {
+            pid = &list->pids[rand() % list->count];
+        }
+        bench_make_response(ctx, pid, &frames[i]);
+        err = yobd_get_pid_handle(ctx, pid->mode, pid->pid, &handles[i]);
+        XASSERT_OK(err);
+    }
+}
+
+static
+void bench_single(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    float *vals,
+    const char *name)
+{
+    yobd_err err;
+    size_t i;
+    size_t j;
+    uint64_t start;
+
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < FRAME_COUNT; ++j) {
+            err = yobd_parse_can_response(ctx, &frames[j], &vals[j]);
+            XASSERT_OK(err);
+        }
+    }
+    bench_report(name, FRAME_COUNT * ITERATIONS, bench_now_ns() - start);
+}
+
+static
+void bench_batch(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    float *vals,
+    yobd_err *errs,
+    const char *name)
+{
+    yobd_err err;
+    size_t i;
+    size_t j;
+    uint64_t start;
+
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        err = yobd_parse_can_responses(
+            ctx,
+            frames,
+            FRAME_COUNT,
+            vals,
+            errs,
+            NULL,
+            NULL);
+        XASSERT_OK(err);
+    }
+    bench_report(name, FRAME_COUNT * ITERATIONS, bench_now_ns() - start);
+
+    for (j = 0; j < FRAME_COUNT; ++j) {
+        XASSERT_OK(errs[j]);
+    }
+}
+
+/*
+ * Decodes with handles resolved ahead of time, as a caller that filters on
+ * mode-PID would.
+ */
+static
+void bench_handle(
+    const struct can_frame *frames,
+    const yobd_pid_handle *handles,
+    float *vals,
+    bool inline_decode,
+    const char *name)
+{
+    yobd_err err;
+    size_t i;
+    size_t j;
+    uint64_t start;
+
+    start = bench_now_ns();
+    for (i = 0; i < ITERATIONS; ++i) {
+        for (j = 0; j < FRAME_COUNT; ++j) {
+            if (inline_decode) {
+                err = yobd_decode_with_handle_inline(
+                    &handles[j],
+                    &frames[j],
+                    &vals[j]);
+            }
+            else {
+                err = yobd_decode_with_handle(&handles[j], &frames[j], &vals[j]);
+            }
+            XASSERT_OK(err);
+        }
+    }
+    bench_report(name, FRAME_COUNT * ITERATIONS, bench_now_ns() - start);
+}
+
+static
+void run(struct yobd_ctx *ctx, const char *label)
+{
+    static yobd_err errs[FRAME_COUNT];
+    static struct can_frame frames[FRAME_COUNT];
+    static yobd_pid_handle handles[FRAME_COUNT];
+    size_t i;
+    struct bench_pid_list list;
+    char name[64];
+    static float vals[FRAME_COUNT];
+
+    bench_get_pids(ctx, &list);
+
+    srand(0);
+    for (i = 0; i < ARRAYLEN(RUN_LENGTHS); ++i) {
+        make_frames(ctx, &list, RUN_LENGTHS[i], frames, handles);
+
+        snprintf(
+            name,
+            sizeof(name),
+            "%s: single, run length %zu",
+            label,
+            RUN_LENGTHS[i]);
+        bench_single(ctx, frames, vals, name);
+
+        snprintf(
+            name,
+            sizeof(name),
+            "%s: batch, run length %zu",
+            label,
+            RUN_LENGTHS[i]);
+        bench_batch(ctx, frames, vals, errs, name);
+
+        snprintf(
+            name,
+            sizeof(name),
+            "%s: handle, run length %zu",
+            label,
+            RUN_LENGTHS[i]);
+        bench_handle(frames, handles, vals, false, name);
+
+        snprintf(
+            name,
+            sizeof(name),
+            "%s: inline handle, run length %zu",
+            label,
+            RUN_LENGTHS[i]);
+        bench_handle(frames, handles, vals, true, name);
+    }
+
+    free(list.pids);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    struct yobd_schema_opts opts;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    run(ctx, "default");
+    yobd_free_ctx(ctx);
+
+    yobd_schema_opts_init(&opts);
+    opts.lut_max_bytes = 2;
+    opts.lut_budget = SIZE_MAX;
+    err = yobd_parse_schema_opts(argv[1], &opts, &ctx);
+    XASSERT_OK(err);
+    run(ctx, "LUT");
+    yobd_free_ctx(ctx);
+
+    yobd_schema_opts_init(&opts);
+    opts.jit = true;
+    err = yobd_parse_schema_opts(argv[1], &opts, &ctx);
+    XASSERT_OK(err);
+    run(ctx, "JIT");
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
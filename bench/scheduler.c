@@ -0,0 +1,204 @@
+/**
+ * @file      scheduler.c
+ * @brief     Simulation benchmark for the query scheduler: achieved polling
+ *            rates against requested ones as the PID count grows, with and
+ *            without multi-PID packing.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <yobd/scheduler.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* The simulated run time. */
+#define RUN_TIME (60*S)
+
+/* The most frames to take from the scheduler per call. */
+#define MAX_FRAMES (16)
+
+/* The bus: 500 kbit/s, of which polling may use 30%. */
+#define BITRATE (500000)
+#define BUS_SHARE (30)
+
+/* The bytes of every PID in the synthetic schema. */
+#define PID_BYTES (2)
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+/* PIDs are spread evenly over these classes, from fast and urgent to slow. */
+struct pid_class {
+    const char *name;
+    uint64_t period;
+    uint8_t priority;
+};
+
+static const struct pid_class CLASSES[] = {
+    { "20 Hz", 50*MS, 3 },
+    { "10 Hz", 100*MS, 2 },
+    { "1 Hz", 1*S, 1 },
+    { "0.2 Hz", 5*S, 0 },
+};
+
+static const size_t PID_COUNTS[] = { 8, 32, 64, 128, 256 };
+
+/* Returns the frames a query for count PIDs costs, as the scheduler counts. */
+static
+size_t query_frames(size_t count)
+{
+    size_t payload;
+
+    payload = 1 + count * (1 + PID_BYTES);
+    if (payload <= 7) {
+        return 2;
+    }
+
+    /* The query, a first frame, consecutive frames, and flow control. */
+    return 1 + 1 + (payload - 6 + 6) / 7 + 1;
+}
+
+static
+void simulate(struct yobd_ctx *ctx, size_t pid_count, bool multi_pid)
+{
+    double achieved;
+    size_t bus_frames;
+    size_t c;
+    size_t calls;
+    size_t class_polls[ARRAYLEN(CLASSES)];
+    size_t count;
+    uint64_t cpu_end;
+    uint64_t cpu_start;
+    uint64_t cpu_time;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    size_t j;
+    size_t k;
+    uint64_t now;
+    struct yobd_scheduler_opts opts;
+    size_t queries;
+    double requested;
+    struct yobd_scheduler *sched;
+    uint64_t wake;
+
+    yobd_scheduler_opts_init(&opts);
+    opts.bitrate = BITRATE;
+    opts.bus_share = BUS_SHARE;
+    opts.multi_pid = multi_pid;
+    err = yobd_new_scheduler(ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    requested = 0;
+    for (i = 0; i < pid_count; ++i) {
+        c = i % ARRAYLEN(CLASSES);
+        err = yobd_scheduler_add_pid(
+            sched,
+            0x1,
+            i,
+            CLASSES[c].period,
+            CLASSES[c].priority);
+        XASSERT_OK(err);
+        requested += (double) S / CLASSES[c].period;
+    }
+
+    memset(class_polls, 0, sizeof(class_polls));
+    bus_frames = 0;
+    calls = 0;
+    queries = 0;
+    cpu_time = 0;
+    now = 0;
+    while (now < RUN_TIME) {
+        cpu_start = bench_now_ns();
+        err = yobd_scheduler_next(
+            sched,
+            now,
+            frames,
+            MAX_FRAMES,
+            &count,
+            &wake);
+        cpu_end = bench_now_ns();
+        XASSERT_OK(err);
+        cpu_time += cpu_end - cpu_start;
+        ++calls;
+
+        for (j = 0; j < count; ++j) {
+            k = frames[j].data[0] - 1;
+            for (i = 0; i < k; ++i) {
+                ++class_polls[frames[j].data[2+i] % ARRAYLEN(CLASSES)];
+            }
+            bus_frames += query_frames(k);
+        }
+        queries += count;
+        now = wake;
+    }
+
+    achieved = 0;
+    for (c = 0; c < ARRAYLEN(CLASSES); ++c) {
+        achieved += (double) class_polls[c] * S / RUN_TIME;
+    }
+    printf(
+        "%4zu PIDs %-6s requested %7.1f polls/s achieved %7.1f "
+        "(%5.1f%%) bus %6.1f frames/s %6.1f ns/query\n",
+        pid_count,
+        multi_pid ? "multi" : "single",
+        requested,
+        achieved,
+        100 * achieved / requested,
+        (double) bus_frames * S / RUN_TIME,
+        queries > 0 ? (double) cpu_time / queries : 0.0);
+
+    /* Break down achieved against requested by class. */
+    printf("          ");
+    for (c = 0; c < ARRAYLEN(CLASSES); ++c) {
+        requested = (double) ((pid_count + ARRAYLEN(CLASSES) - 1 - c) /
+                              ARRAYLEN(CLASSES)) * S / CLASSES[c].period;
+        achieved = (double) class_polls[c] * S / RUN_TIME;
+        printf(
+            " %s %5.1f%%",
+            CLASSES[c].name,
+            requested > 0 ? 100 * achieved / requested : 0.0);
+    }
+    printf("\n");
+
+    yobd_free_scheduler(sched);
+}
+
+int main(void)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    size_t i;
+    char path[PATH_MAX];
+
+    /* PID numbers double as indices, so use a synthetic schema. */
+    bench_write_schema(256, 0, path);
+    err = yobd_parse_schema(path, &ctx);
+    XASSERT_OK(err);
+    unlink(path);
+
+    printf(
+        "%u bit/s bus, %u%% for polling (%u frames/s), %llu s simulated\n",
+        BITRATE,
+        BUS_SHARE,
+        BITRATE * BUS_SHARE / 100 / YOBD_CAN_FRAME_BITS,
+        RUN_TIME / S);
+    for (i = 0; i < ARRAYLEN(PID_COUNTS); ++i) {
+        simulate(ctx, PID_COUNTS[i], false);
+        simulate(ctx, PID_COUNTS[i], true);
+    }
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,440 @@
+/**
+ * @file      sim.c
+ * @brief     Load benchmark driving the scheduler, correlator and decoder
+ *            against simulated ECUs at the rate of a saturated 1 Mbit/s bus,
+ *            along with the raw throughput of the simulator itself.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <yobd/correlator.h>
+#include <yobd/scheduler.h>
+#include <yobd/sim.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define US (1000ULL)
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* The bus, which the pipeline fills with queries and responses. */
+#define BITRATE (1000000)
+#define BUS_FRAMES_PER_SEC (BITRATE / YOBD_CAN_FRAME_BITS)
+
+/* The simulated run time of the pipeline. */
+#define RUN_TIME (60*S)
+
+/* How long the correlator waits, and how the simulated ECUs answer. */
+#define TIMEOUT (50*MS)
+#define LATENCY (2*MS)
+#define JITTER (1*MS)
+#define DROP_PPM (1000)
+
+/* Every PID asks to be polled this often, far more than the bus allows. */
+#define PERIOD (1*MS)
+
+/* The most frames moved per call. */
+#define MAX_FRAMES (64)
+
+/* The queries pushed into the simulator per round of the engine benchmark. */
+#define ENGINE_QUERIES (1000)
+#define ENGINE_ROUNDS (200)
+
+/* The queries sent per round over the socketpair, and the rounds. */
+#define PUMP_QUERIES (50)
+#define PUMP_ROUNDS (2000)
+
+static const size_t ECU_COUNTS[] = { 1, 3, 8 };
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+/* CPU time spent in each stage of the pipeline. */
+struct stage_times {
+    uint64_t sched;
+    uint64_t sim;
+    uint64_t corr;
+    uint64_t decode;
+};
+
+static
+struct yobd_sim *new_sim(struct yobd_ctx *ctx, size_t ecus, uint64_t latency)
+{
+    size_t ecu;
+    yobd_err err;
+    size_t i;
+    struct yobd_sim_ecu_opts opts;
+    struct yobd_sim *sim;
+
+    err = yobd_new_sim(ctx, 1, &sim);
+    XASSERT_OK(err);
+    yobd_sim_ecu_opts_init(&opts);
+    opts.latency = latency;
+    opts.jitter = latency > 0 ? JITTER : 0;
+    opts.drop_ppm = latency > 0 ? DROP_PPM : 0;
+    for (i = 0; i < ecus; ++i) {
+        err = yobd_sim_add_ecu(sim, &opts, &ecu);
+        XASSERT_OK(err);
+    }
+
+    return sim;
+}
+
+static inline
+uint64_t min_time(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+/*
+ * Runs the whole tester against simulated ECUs in simulated time: the
+ * scheduler picks queries, the correlator tracks them, the simulator answers
+ * and the responses are matched and decoded. The scheduler's budget is scaled
+ * so that queries and every ECU's responses together fill the bus.
+ */
+static
+void run_pipeline(
+    struct yobd_ctx *ctx,
+    const struct bench_pid_list *list,
+    size_t ecus)
+{
+    size_t busy;
+    uint64_t corr_wake;
+    struct yobd_correlator *corr;
+    size_t count;
+    uint64_t end;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    size_t j;
+    struct yobd_correlation match;
+    uint64_t now;
+    struct yobd_scheduler_opts opts;
+    size_t queries;
+    size_t responses;
+    struct yobd_scheduler *sched;
+    uint64_t sched_wake;
+    struct yobd_sim *sim;
+    uint64_t sim_wake;
+    uint64_t start;
+    struct yobd_sim_stats stats;
+    struct yobd_correlator_stats cstats;
+    struct stage_times times;
+    struct yobd_correlator_timeout timeouts[MAX_FRAMES];
+    double total;
+    float val;
+
+    yobd_scheduler_opts_init(&opts);
+    opts.max_frames_per_sec = 2 * BUS_FRAMES_PER_SEC / (1 + ecus);
+    err = yobd_new_scheduler(ctx, &opts, &sched);
+    XASSERT_OK(err);
+    for (i = 0; i < list->count; ++i) {
+        if (list->pids[i].mode != 0x1) {
+            continue;
+        }
+        err = yobd_scheduler_add_pid(sched, 0x1, list->pids[i].pid, PERIOD, 0);
+        XASSERT_OK(err);
+    }
+    err = yobd_new_correlator(ctx, TIMEOUT, &corr);
+    XASSERT_OK(err);
+    sim = new_sim(ctx, ecus, LATENCY);
+
+    memset(&times, 0, sizeof(times));
+    busy = 0;
+    queries = 0;
+    responses = 0;
+    sim_wake = UINT64_MAX;
+    now = 0;
+    while (now < RUN_TIME) {
+        start = bench_now_ns();
+        err = yobd_scheduler_next(
+            sched,
+            now,
+            frames,
+            MAX_FRAMES,
+            &count,
+            &sched_wake);
+        end = bench_now_ns();
+        XASSERT_OK(err);
+        times.sched += end - start;
+
+        /* A PID still waiting on its last query is skipped this time. */
+        for (i = 0; i < count; ++i) {
+            start = bench_now_ns();
+            err = yobd_correlator_add_query(corr, &frames[i], 0, now);
+            end = bench_now_ns();
+            times.corr += end - start;
+            if (err == YOBD_QUERY_IN_FLIGHT) {
+                ++busy;
+                continue;
+            }
+            XASSERT_OK(err);
+
+            start = bench_now_ns();
+            err = yobd_sim_push(sim, &frames[i], now);
+            end = bench_now_ns();
+            XASSERT_OK(err);
+            times.sim += end - start;
+            ++queries;
+        }
+
+        do {
+            start = bench_now_ns();
+            err = yobd_sim_next(
+                sim,
+                now,
+                frames,
+                MAX_FRAMES,
+                &count,
+                &sim_wake);
+            end = bench_now_ns();
+            XASSERT_OK(err);
+            times.sim += end - start;
+
+            for (j = 0; j < count; ++j) {
+                start = bench_now_ns();
+                err = yobd_correlator_match_response(
+                    corr,
+                    &frames[j],
+                    now,
+                    &match);
+                end = bench_now_ns();
+                XASSERT_OK(err);
+                times.corr += end - start;
+
+                start = bench_now_ns();
+                err = yobd_parse_can_response(ctx, &frames[j], &val);
+                end = bench_now_ns();
+                XASSERT_OK(err);
+                times.decode += end - start;
+            }
+            responses += count;
+        } while (count == MAX_FRAMES);
+
+        do {
+            start = bench_now_ns();
+            err = yobd_correlator_expire(
+                corr,
+                now,
+                timeouts,
+                MAX_FRAMES,
+                &count,
+                &corr_wake);
+            end = bench_now_ns();
+            XASSERT_OK(err);
+            times.corr += end - start;
+        } while (count == MAX_FRAMES);
+
+        now = min_time(min_time(sched_wake, sim_wake), corr_wake);
+    }
+
+    err = yobd_sim_get_stats(sim, &stats);
+    XASSERT_OK(err);
+    err = yobd_correlator_get_stats(corr, &cstats);
+    XASSERT_OK(err);
+
+    total = times.sched + times.sim + times.corr + times.decode;
+    printf(
+        "%zu ECU%s: bus %6.0f frames/s (%5.1f%%), %6.0f queries/s, "
+        "%zu timeouts, %zu skipped busy\n",
+        ecus,
+        ecus == 1 ? " " : "s",
+        (double) (queries + responses) * S / RUN_TIME,
+        100.0 * (queries + responses) * S / RUN_TIME / BUS_FRAMES_PER_SEC,
+        (double) queries * S / RUN_TIME,
+        (size_t) cstats.timeouts,
+        busy);
+    printf(
+        "        ns/frame: scheduler %6.1f simulator %6.1f "
+        "correlator %6.1f decode %6.1f; CPU %5.2f%% of real time\n",
+        (double) times.sched / (queries + responses),
+        (double) times.sim / (queries + responses),
+        (double) times.corr / (queries + responses),
+        (double) times.decode / (queries + responses),
+        100 * total / RUN_TIME);
+    XASSERT_EQ(stats.frames, responses);
+
+    yobd_free_sim(sim);
+    yobd_free_correlator(corr);
+    yobd_free_scheduler(sched);
+}
+
+/* Measures how fast the simulator alone turns queries into responses. */
+static
+void run_engine(
+    struct yobd_ctx *ctx,
+    const struct bench_pid_list *list,
+    size_t ecus)
+{
+    size_t count;
+    uint64_t end;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    char name[64];
+    size_t responses;
+    size_t round;
+    struct can_frame *queries;
+    struct yobd_sim *sim;
+    uint64_t start;
+    uint64_t wake;
+
+    queries = malloc(list->count * sizeof(*queries));
+    XASSERT_NEQ(queries, NULL);
+    for (i = 0; i < list->count; ++i) {
+        err = yobd_make_can_query(
+            ctx,
+            list->pids[i].mode,
+            list->pids[i].pid,
+            &queries[i]);
+        XASSERT_OK(err);
+    }
+    sim = new_sim(ctx, ecus, 0);
+
+    responses = 0;
+    start = bench_now_ns();
+    for (round = 0; round < ENGINE_ROUNDS; ++round) {
+        for (i = 0; i < ENGINE_QUERIES; ++i) {
+            err = yobd_sim_push(sim, &queries[i % list->count], round);
+            XASSERT_OK(err);
+        }
+        do {
+            err = yobd_sim_next(
+                sim,
+                round,
+                frames,
+                MAX_FRAMES,
+                &count,
+                &wake);
+            XASSERT_OK(err);
+            responses += count;
+        } while (count > 0);
+    }
+    end = bench_now_ns();
+    XASSERT_EQ(responses, ENGINE_ROUNDS * ENGINE_QUERIES * ecus);
+
+    snprintf(name, sizeof(name), "simulator, %zu ECU%s", ecus,
+             ecus == 1 ? "" : "s");
+    bench_report(name, responses, end - start);
+
+    yobd_free_sim(sim);
+    free(queries);
+}
+
+/* Reads and counts every frame waiting on a socket. */
+static
+size_t drain(int fd)
+{
+    size_t count;
+    struct can_frame frame;
+    ssize_t ret;
+
+    count = 0;
+    for (;;) {
+        ret = recv(fd, &frame, sizeof(frame), MSG_DONTWAIT);
+        if (ret == -1) {
+            XASSERT_EQ(errno, EAGAIN);
+            break;
+        }
+        ++count;
+    }
+
+    return count;
+}
+
+/* Measures wall-clock throughput serving an AF_UNIX socketpair. */
+static
+void run_pump(struct yobd_ctx *ctx)
+{
+    uint64_t end;
+    yobd_err err;
+    int fds[2];
+    struct can_frame frame;
+    size_t i;
+    size_t received;
+    int ret;
+    size_t round;
+    struct yobd_sim *sim;
+    uint64_t start;
+    uint64_t wake;
+
+    /* SOCK_SEQPACKET keeps datagram boundaries, as CAN_RAW does. */
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds);
+    XASSERT_EQ(ret, 0);
+    sim = new_sim(ctx, 1, 0);
+    err = yobd_make_can_query(ctx, 0x1, 0x0c, &frame);
+    XASSERT_OK(err);
+
+    received = 0;
+    start = bench_now_ns();
+    for (round = 0; round < PUMP_ROUNDS; ++round) {
+        for (i = 0; i < PUMP_QUERIES; ++i) {
+            ret = send(fds[1], &frame, sizeof(frame), 0);
+            XASSERT_EQ(ret, sizeof(frame));
+        }
+        do {
+            err = yobd_sim_pump(sim, fds[0], bench_now_ns(), &wake);
+            XASSERT_OK(err);
+            received += drain(fds[1]);
+        } while (wake != UINT64_MAX);
+    }
+    end = bench_now_ns();
+    XASSERT_EQ(received, PUMP_ROUNDS * PUMP_QUERIES);
+
+    /* Count both directions, as a bus would. */
+    bench_report("socketpair, query and response", 2 * received, end - start);
+
+    yobd_free_sim(sim);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    size_t i;
+    struct bench_pid_list list;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    bench_get_pids(ctx, &list);
+
+    for (i = 0; i < ARRAYLEN(ECU_COUNTS); ++i) {
+        run_engine(ctx, &list, ECU_COUNTS[i]);
+    }
+    run_pump(ctx);
+
+    printf(
+        "\n%u bit/s bus (%u frames/s), %llu s simulated, "
+        "latency %llu-%llu us, %u ppm dropped\n",
+        BITRATE,
+        BUS_FRAMES_PER_SEC,
+        RUN_TIME / S,
+        LATENCY / US,
+        (LATENCY + JITTER) / US,
+        DROP_PPM);
+    for (i = 0; i < ARRAYLEN(ECU_COUNTS); ++i) {
+        run_pipeline(ctx, &list, ECU_COUNTS[i]);
+    }
+
+    free(list.pids);
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file      socketcan.c
+ * @brief     Benchmark comparing a read()-per-frame loop with batched
+ *            recvmmsg receive, in system calls and time per decoded frame.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <yobd/socketcan.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+/* The number of frames each measurement receives. */
+#define TOTAL_FRAMES (1 << 19)
+
+/* The number of frames the sender hands to each sendmmsg. */
+#define SEND_BATCH (256)
+
+/* The number of distinct frames to cycle through. */
+#define FRAME_POOL (4096)
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+static const size_t BATCH_SIZES[] = { 1, 8, 64, 256 };
+
+struct sender {
+    int fd;
+    const struct can_frame *frames;
+};
+
+/* Sends TOTAL_FRAMES frames as fast as the receiver drains them. */
+static
+void *send_frames(void *data)
+{
+    struct iovec iovs[SEND_BATCH];
+    size_t i;
+    struct mmsghdr msgs[SEND_BATCH];
+    size_t n;
+    int ret;
+    size_t sent;
+    struct sender *sender;
+
+    sender = data;
+    memset(msgs, 0, sizeof(msgs));
+    for (sent = 0; sent < TOTAL_FRAMES; sent += ret) {
+        n = TOTAL_FRAMES - sent;
+        if (n > SEND_BATCH) {
+            n = SEND_BATCH;
+        }
+        for (i = 0; i < n; ++i) {
+            iovs[i].iov_base =
+                (void *) &sender->frames[(sent + i) % FRAME_POOL];
+            iovs[i].iov_len = sizeof(struct can_frame);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        ret = sendmmsg(sender->fd, msgs, n, 0);
+        XASSERT_GT(ret, 0);
+    }
+
+    return NULL;
+}
+
+static
+void start_sender(
+    struct sender *sender,
+    const struct can_frame *frames,
+    int fds[2],
+    pthread_t *thread)
+{
+    int ret;
+
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    XASSERT_EQ(ret, 0);
+
+    sender->fd = fds[0];
+    sender->frames = frames;
+    ret = pthread_create(thread, NULL, send_frames, sender);
+    XASSERT_EQ(ret, 0);
+}
+
+static
+void stop_sender(int fds[2], pthread_t thread)
+{
+    int ret;
+
+    ret = pthread_join(thread, NULL);
+    XASSERT_EQ(ret, 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static
+void report(const char *name, size_t calls, uint64_t ns)
+{
+    printf(
+        "%-16s %10.4f syscalls/frame %10.1f ns/frame\n",
+        name,
+        (double) calls / TOTAL_FRAMES,
+        (double) ns / TOTAL_FRAMES);
+}
+
+/* The loop every consumer writes: one read() and one decode per frame. */
+static
+void bench_read(struct yobd_ctx *ctx, const struct can_frame *frames)
+{
+    uint64_t end;
+    int fds[2];
+    struct can_frame frame;
+    size_t i;
+    ssize_t ret;
+    struct sender sender;
+    uint64_t start;
+    pthread_t thread;
+    float val;
+
+    start_sender(&sender, frames, fds, &thread);
+
+    start = bench_now_ns();
+    for (i = 0; i < TOTAL_FRAMES; ++i) {
+        ret = read(fds[1], &frame, sizeof(frame));
+        XASSERT_EQ(ret, (ssize_t) sizeof(frame));
+        yobd_parse_can_response(ctx, &frame, &val);
+    }
+    end = bench_now_ns();
+
+    stop_sender(fds, thread);
+    report("read()", TOTAL_FRAMES, end - start);
+}
+
+static
+void bench_recvmmsg(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    size_t batch)
+{
+    size_t calls;
+    size_t count;
+    uint64_t end;
+    yobd_err err;
+    yobd_err *errs;
+    int fds[2];
+    char name[32];
+    size_t received;
+    struct sender sender;
+    struct yobd_socketcan *sock;
+    uint64_t start;
+    pthread_t thread;
+    float *vals;
+
+    vals = malloc(batch * sizeof(*vals));
+    XASSERT_NOT_NULL(vals);
+    errs = malloc(batch * sizeof(*errs));
+    XASSERT_NOT_NULL(errs);
+
+    start_sender(&sender, frames, fds, &thread);
+    err = yobd_socketcan_from_fd(fds[1], batch, &sock);
+    XASSERT_OK(err);
+
+    calls = 0;
+    received = 0;
+    start = bench_now_ns();
+    while (received < TOTAL_FRAMES) {
+        err = yobd_socketcan_recv_responses(
+            sock,
+            ctx,
+            true,
+            vals,
+            errs,
+            NULL,
+            NULL,
+            &count);
+        XASSERT_OK(err);
+        received += count;
+        ++calls;
+    }
+    end = bench_now_ns();
+
+    yobd_socketcan_close(sock);
+    stop_sender(fds, thread);
+    free(errs);
+    free(vals);
+
+    snprintf(name, sizeof(name), "recvmmsg(%zu)", batch);
+    report(name, calls, end - start);
+}
+
+int main(int argc, const char **argv)
+{
+    unsigned char bytes[4];
+    struct yobd_ctx *ctx;
+    const struct bench_pid *entry;
+    yobd_err err;
+    struct can_frame *frames;
+    size_t i;
+    uint_fast8_t j;
+    struct bench_pid_list list;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    bench_get_pids(ctx, &list);
+
+    frames = malloc(FRAME_POOL * sizeof(*frames));
+    XASSERT_NOT_NULL(frames);
+    srand(0);
+    for (i = 0; i < FRAME_POOL; ++i) {
+        entry = &list.pids[rand() % list.count];
+        for (j = 0; j < entry->can_bytes; ++j) {
+            bytes[j] = rand() & 0xff;
+        }
+        err = yobd_make_can_response(
+            ctx,
+            entry->mode,
+            entry->pid,
+            bytes,
+            entry->can_bytes,
+            &frames[i]);
+        XASSERT_OK(err);
+    }
+
+    printf("%d frames over an AF_UNIX socketpair\n", TOTAL_FRAMES);
+    bench_read(ctx, frames);
+    for (i = 0; i < ARRAYLEN(BATCH_SIZES); ++i) {
+        bench_recvmmsg(ctx, frames, BATCH_SIZES[i]);
+    }
+
+    free(frames);
+    free(list.pids);
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file      startup.c
+ * @brief     Benchmark comparing YAML schema parsing with compiled schema
+ *            loading.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-bench/bench.h>
+#include <yobd-test/assert.h>
+
+#define REPEATS (5)
+#define SYNTHETIC_SAE_COUNT (256)
+#define SYNTHETIC_MFR_COUNT (10000 - SYNTHETIC_SAE_COUNT)
+
+/* Returns the best time to load a schema out of several runs. */
+static
+uint64_t time_load(const char *path, size_t iterations, bool compiled)
+{
+    uint64_t best;
+    struct yobd_ctx *ctx;
+    uint64_t elapsed;
+    yobd_err err;
+    size_t i;
+    size_t j;
+    uint64_t start;
+
+    best = UINT64_MAX;
+    for (i = 0; i < REPEATS; ++i) {
+        start = bench_now_ns();
+        for (j = 0; j < iterations; ++j) {
+            if (compiled) {
+                err = yobd_load_compiled_schema(path, &ctx);
+            }
+            else {
+                err = yobd_parse_schema(path, &ctx);
+            }
+            XASSERT_OK(err);
+            yobd_free_ctx(ctx);
+        }
+        elapsed = bench_now_ns() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+static
+void run(const char *schema, size_t iterations, const char *label)
+{
+    char compiled_path[PATH_MAX];
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    int fd;
+    char name[64];
+
+    strcpy(compiled_path, "/tmp/yobd-bench-XXXXXX");
+    fd = mkstemp(compiled_path);
+    XASSERT_NEQ(fd, -1);
+    close(fd);
+
+    err = yobd_parse_schema(schema, &ctx);
+    XASSERT_OK(err);
+    err = yobd_save_compiled_schema(ctx, compiled_path);
+    XASSERT_OK(err);
+    yobd_free_ctx(ctx);
+
+    snprintf(name, sizeof(name), "%s: YAML", label);
+    bench_report(name, iterations, time_load(schema, iterations, false));
+    snprintf(name, sizeof(name), "%s: compiled", label);
+    bench_report(name, iterations, time_load(compiled_path, iterations, true));
+
+    unlink(compiled_path);
+}
+
+int main(int argc, const char **argv)
+{
+    char synthetic_path[PATH_MAX];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    run(argv[1], 200, "example schema");
+
+    bench_write_schema(
+        SYNTHETIC_SAE_COUNT,
+        SYNTHETIC_MFR_COUNT,
+        synthetic_path);
+    run(synthetic_path, 2, "10k-PID schema");
+    unlink(synthetic_path);
+
+    return EXIT_SUCCESS;
+}
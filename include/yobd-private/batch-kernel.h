@@ -0,0 +1,277 @@
+/**
+ * @file      batch-kernel.h
+ * @brief     yobd batch evaluator template, instantiated once per instruction
+ *            set by batch.c.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ *
+ * Before including this, define:
+ * - BATCH_SUFFIX, which is appended to every name defined here
+ * - BATCH_WIDTH, the vector width in bytes
+ * - BATCH_ATTR, attributes enabling the instruction set for each function
+ *
+ * Every operation matches the scalar decoders in eval.c lane for lane, so
+ * results are bitwise identical: float arithmetic is done in float, unit
+ * conversion in double, and integer expressions in 32-bit unsigned arithmetic,
+ * which wraps exactly like truncating the scalar path's wider result.
+ */
+
+#define BATCH_CAT_(name, suffix) name##_##suffix
+#define BATCH_CAT(name, suffix) BATCH_CAT_(name, suffix)
+#define BATCH_NAME(name) BATCH_CAT(name, BATCH_SUFFIX)
+
+#define BATCH_LANES (BATCH_WIDTH / sizeof(float))
+
+typedef float BATCH_NAME(vfloat) __attribute__ ((vector_size (BATCH_WIDTH)));
+typedef int32_t BATCH_NAME(vint) __attribute__ ((vector_size (BATCH_WIDTH)));
+typedef uint32_t BATCH_NAME(vuint) __attribute__ ((vector_size (BATCH_WIDTH)));
+typedef double BATCH_NAME(vdouble)
+    __attribute__ ((vector_size (2*BATCH_WIDTH)));
+
+#define vfloat BATCH_NAME(vfloat)
+#define vint BATCH_NAME(vint)
+#define vuint BATCH_NAME(vuint)
+#define vdouble BATCH_NAME(vdouble)
+
+_Static_assert(
+    BATCH_LANE_MULTIPLE % BATCH_LANES == 0,
+    "frames must be rounded up to a whole number of vectors");
+
+/* Loads data byte j of the frames in lanes i through i + BATCH_LANES - 1. */
+BATCH_ATTR
+static inline
+vuint BATCH_NAME(load_byte)(
+    const struct batch_input *in,
+    size_t j,
+    size_t i)
+{
+    vuint byte;
+
+    memcpy(&byte, &in->bytes[j][i], sizeof(byte));
+
+    return byte;
+}
+
+BATCH_ATTR
+static inline
+vfloat BATCH_NAME(unit_convert)(const struct unit_conv *conv, vfloat val)
+{
+    vdouble wide;
+
+    wide = __builtin_convertvector(val, vdouble);
+    wide = conv->scale*wide + conv->offset;
+
+    return __builtin_convertvector(wide, vfloat);
+}
+
+BATCH_ATTR
+static inline
+vfloat BATCH_NAME(nop_eval)(
+    const struct pid_ctx *pid_ctx,
+    const struct batch_input *in,
+    size_t i)
+{
+    vuint a;
+    vuint b;
+    vuint c;
+    vuint d;
+    vuint num;
+    vfloat val;
+
+    /* Only the PID's rows of the input are filled in. */
+    a = BATCH_NAME(load_byte)(in, 0, i);
+    b = (pid_ctx->can_bytes > 1) ? BATCH_NAME(load_byte)(in, 1, i) : a;
+    c = (pid_ctx->can_bytes > 2) ? BATCH_NAME(load_byte)(in, 2, i) : a;
+    d = (pid_ctx->can_bytes > 3) ? BATCH_NAME(load_byte)(in, 3, i) : a;
+
+    switch (pid_ctx->can_bytes) {
+        case 1:
+            num = a;
+            break;
+        case 2:
+            num = pid_ctx->big_endian ? (a << 8) | b : (b << 8) | a;
+            break;
+        case 3:
+            num = pid_ctx->big_endian ?
+                (a << 16) | (b << 8) | c :
+                (c << 16) | (b << 8) | a;
+            break;
+        default:
+            num = pid_ctx->big_endian ?
+                (a << 24) | (b << 16) | (c << 8) | d :
+                (d << 24) | (c << 16) | (b << 8) | a;
+            break;
+    }
+
+    if (pid_ctx->can_bytes == 4 && pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+        /* Reinterpret the bits as IEEE 754 floats. */
+        val = (vfloat) num;
+    }
+    else {
+        val = __builtin_convertvector(num, vfloat);
+    }
+
+    return BATCH_NAME(unit_convert)(&pid_ctx->conv, val);
+}
+
+BATCH_ATTR
+static inline
+vfloat BATCH_NAME(linear_eval)(
+    const struct expr *expr,
+    const struct batch_input *in,
+    size_t i)
+{
+    size_t j;
+    vfloat val;
+
+    val = (vfloat) {0} + expr->coeffs[0];
+    for (j = 0; j < expr->size; ++j) {
+        val += expr->coeffs[j+1] *
+            __builtin_convertvector(BATCH_NAME(load_byte)(in, j, i), vfloat);
+    }
+
+    return val;
+}
+
+BATCH_ATTR
+static inline
+vfloat BATCH_NAME(stack_eval_float)(
+    const struct expr *expr,
+    const struct batch_input *in,
+    size_t i)
+{
+    const uint8_t *code;
+    const uint8_t *end;
+    vfloat stack[EXPR_MAX_TOKENS];
+    vfloat *top;
+
+    top = stack;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch ((bytecode_op) *code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                *top++ = __builtin_convertvector(
+                    BATCH_NAME(load_byte)(in, *code - BC_PUSH_A, i),
+                    vfloat);
+                break;
+            case BC_PUSH_CONST:
+                ++code;
+                *top++ = (vfloat) {0} + expr->consts[*code].as_float;
+                break;
+            case BC_ADD:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case BC_SUB:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case BC_MUL:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case BC_DIV:
+                --top;
+                top[-1] = top[-1] / top[0];
+                break;
+        }
+    }
+
+    return stack[0];
+}
+
+BATCH_ATTR
+static inline
+vfloat BATCH_NAME(stack_eval_int)(
+    const struct expr *expr,
+    const struct batch_input *in,
+    size_t i)
+{
+    const uint8_t *code;
+    const uint8_t *end;
+    vuint stack[EXPR_MAX_TOKENS];
+    vuint *top;
+
+    top = stack;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch ((bytecode_op) *code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                *top++ = BATCH_NAME(load_byte)(in, *code - BC_PUSH_A, i);
+                break;
+            case BC_PUSH_CONST:
+                ++code;
+                *top++ =
+                    (vuint) {0} + (uint32_t) expr->consts[*code].as_int32_t;
+                break;
+            case BC_ADD:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case BC_SUB:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case BC_MUL:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case BC_DIV:
+                /* batch_can_vectorize rules this out. */
+                XASSERT_ERROR;
+                break;
+        }
+    }
+
+    return __builtin_convertvector((vint) stack[0], vfloat);
+}
+
+BATCH_ATTR
+static
+void BATCH_NAME(batch_eval)(
+    const struct pid_ctx *pid_ctx,
+    const struct batch_input *in,
+    size_t count,
+    float *out)
+{
+    const struct expr *expr;
+    size_t i;
+    vfloat val;
+
+    expr = &pid_ctx->expr;
+    for (i = 0; i < count; i += BATCH_LANES) {
+        switch (expr->type) {
+            case EXPR_NOP:
+                val = BATCH_NAME(nop_eval)(pid_ctx, in, i);
+                break;
+            case EXPR_LINEAR:
+                val = BATCH_NAME(linear_eval)(expr, in, i);
+                break;
+            case EXPR_STACK:
+                if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                    val = BATCH_NAME(stack_eval_float)(expr, in, i);
+                }
+                else {
+                    val = BATCH_NAME(stack_eval_int)(expr, in, i);
+                }
+                val = BATCH_NAME(unit_convert)(&pid_ctx->conv, val);
+                break;
+        }
+        memcpy(&out[i], &val, sizeof(val));
+    }
+}
+
+#undef vfloat
+#undef vint
+#undef vuint
+#undef vdouble
+#undef BATCH_LANES
+#undef BATCH_NAME
+#undef BATCH_CAT
+#undef BATCH_CAT_
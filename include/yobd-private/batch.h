@@ -0,0 +1,103 @@
+/**
+ * @file      batch.h
+ * @brief     yobd vectorized batch evaluation header.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_BATCH_H_
+#define YOBD_PRIVATE_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+#include <yobd-private/parser.h>
+
+/**
+ * The number of frames evaluated together. This is a multiple of the number
+ * of lanes in every vector width we use.
+ */
+#define BATCH_CHUNK (64)
+
+/**
+ * Evaluators round the number of frames up to a multiple of this, which is a
+ * multiple of the number of lanes in every vector width we use.
+ */
+#define BATCH_LANE_MULTIPLE (8)
+
+/**
+ * Runs shorter than this are decoded one frame at a time, as transposing them
+ * costs more than vectorizing saves.
+ */
+#define BATCH_MIN_FRAMES (48)
+
+/*
+ * The data bytes of up to BATCH_CHUNK frames in struct-of-arrays form: bytes[j]
+ * holds data byte j (A, B, C, D) of every frame, widened so it loads straight
+ * into a vector.
+ */
+struct batch_input {
+    uint32_t bytes[4][BATCH_CHUNK];
+} __attribute__ ((aligned (64)));
+
+/**
+ * Evaluates a PID over a chunk of frames.
+ *
+ * @param pid_ctx a PID for which batch_can_vectorize is true
+ * @param in the data bytes of the frames, with the PID's can_bytes rows filled
+ *           in up to count rounded up to BATCH_LANE_MULTIPLE
+ * @param count the number of frames, at most BATCH_CHUNK
+ * @param out values to fill in, in SI units, with room for count rounded up
+ *            to BATCH_LANE_MULTIPLE
+ */
+typedef void (*batch_func)(
+    const struct pid_ctx *pid_ctx,
+    const struct batch_input *in,
+    size_t count,
+    float *out);
+
+/** A batch evaluator for one instruction set. */
+struct batch_impl {
+    const char *name;
+    batch_func func;
+    /* Returns true if the CPU we are running on can use this evaluator. */
+    bool (*supported)(void);
+};
+
+/**
+ * All batch evaluators built into the library, fastest first and ending with
+ * the portable fallback, which is always supported.
+ */
+extern const struct batch_impl batch_impls[];
+extern const size_t batch_impl_count;
+
+/** Returns the fastest batch evaluator the CPU supports. */
+batch_func get_best_batch_func(void);
+
+/**
+ * Returns true if a PID can be evaluated by a batch evaluator with exactly the
+ * same results as decode_pid. Other PIDs are decoded one frame at a time.
+ */
+bool batch_can_vectorize(const struct pid_ctx *pid_ctx);
+
+/**
+ * Decodes a run of frames for one PID.
+ *
+ * @param pid_ctx the PID's decode record
+ * @param func the batch evaluator to use
+ * @param frames frames carrying the PID
+ * @param count the number of frames
+ * @param vals filled in with the value of each frame in SI units. Entries for
+ *             frames that failed to parse are left untouched.
+ * @param errs filled in with the result of parsing each frame
+ */
+void decode_batch(
+    const struct pid_ctx *pid_ctx,
+    batch_func func,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs);
+
+#endif /* YOBD_PRIVATE_BATCH_H_ */
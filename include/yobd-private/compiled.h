@@ -0,0 +1,101 @@
+/**
+ * @file      compiled.h
+ * @brief     The precompiled binary schema format.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_COMPILED_H_
+#define YOBD_PRIVATE_COMPILED_H_
+
+#include <stdint.h>
+#include <yobd-private/expr.h>
+
+/*
+ * A compiled schema is a parsed context laid out so that it can be mapped
+ * read-only and used in place. It contains only offsets, never pointers, so it
+ * works at any address. All offsets are from the start of the file, and every
+ * section starts on a COMPILED_ALIGN boundary. The layout is:
+ *
+ * - struct compiled_header
+ * - pid_count struct compiled_pid, sorted by modepid
+ * - pid_count uint32_t modepids, in the same order
+ * - the SAE standard index, as in struct yobd_ctx
+ * - the string table, holding NUL-terminated PID names
+ * - the code section, holding the constant pool and bytecode of each stack
+ *   expression, with each constant pool aligned for union expr_const
+ *
+ * Multi-byte fields use the byte order of the machine that wrote the file.
+ * Loaders reject files whose byte_order field doesn't read as
+ * COMPILED_BYTE_ORDER, so compile schemas for the byte order of the target.
+ */
+
+/** Identifies a compiled schema. */
+#define COMPILED_MAGIC "YOBDBIN"
+
+/** Bump this for any change to the layout. */
+#define COMPILED_VERSION (1)
+
+/** Reads back differently if the file was written with another byte order. */
+#define COMPILED_BYTE_ORDER (0x01020304)
+
+/** The alignment of each section. */
+#define COMPILED_ALIGN (8)
+
+/** Set in flags if the CAN bus is big-endian. */
+#define COMPILED_FLAG_BIG_ENDIAN (1 << 0)
+
+struct compiled_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t flags;
+    /* The total size of the file. */
+    uint32_t size;
+    uint32_t pid_count;
+    /* The index of the first manufacturer-mode PID. */
+    uint32_t mfr_start;
+    uint32_t pids_offset;
+    uint32_t modepids_offset;
+    uint32_t sae_index_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    uint32_t code_offset;
+    uint32_t code_size;
+    uint32_t reserved;
+};
+
+struct compiled_pid {
+    /* The unit conversion, used only for non-linear expressions. */
+    double scale;
+    double offset;
+    /* For linear expressions, the coefficients. */
+    float coeffs[EXPR_LINEAR_COEFFS];
+    /* The offset of the name in the string table. */
+    uint32_t name;
+    /*
+     * For stack expressions, the offset in the code section of the constant
+     * pool, which the bytecode immediately follows.
+     */
+    uint32_t code;
+    /* As in struct expr. */
+    uint32_t size;
+    /* For stack expressions, the number of constants in the pool. */
+    uint16_t const_count;
+    /* For stack expressions, as in struct expr. */
+    uint8_t max_depth;
+    uint8_t expr_type;
+    uint8_t pid_type;
+    uint8_t can_bytes;
+    uint8_t unit;
+    uint8_t reserved;
+};
+
+_Static_assert(
+    sizeof(struct compiled_header) % COMPILED_ALIGN == 0,
+    "compiled_header must preserve section alignment");
+_Static_assert(
+    sizeof(struct compiled_pid) % COMPILED_ALIGN == 0,
+    "compiled_pid must preserve section alignment");
+
+#endif /* YOBD_PRIVATE_COMPILED_H_ */
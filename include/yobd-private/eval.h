@@ -0,0 +1,158 @@
+/**
+ * @file      eval.h
+ * @brief     yobd expression evaluation header.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_EVAL_H_
+#define YOBD_PRIVATE_EVAL_H_
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+#include <yobd-private/types.h>
+#include <yobd-private/unit.h>
+
+/**
+ * Evaluates a stack expression over the data bytes of a CAN response, without
+ * unit conversion.
+ *
+ * @param pid_type the data type in which the expression is evaluated
+ * @param expr the expression to evaluate, which must be of type EXPR_STACK
+ * @param data the data bytes of the response
+ *
+ * @return the value in raw units
+ */
+float stack_eval(
+    pid_data_type pid_type,
+    const struct expr *expr,
+    const unsigned char *data);
+
+/**
+ * Evaluates an integer stack expression over the data bytes of a CAN response,
+ * without unit conversion or the final conversion to float.
+ *
+ * @param expr the expression to evaluate, which must be of type EXPR_STACK
+ * @param data the data bytes of the response
+ *
+ * @return the value in raw units
+ */
+int32_t stack_eval_int(const struct expr *expr, const unsigned char *data);
+
+/**
+ * Decodes the data bytes of a CAN response for one PID into SI units.
+ *
+ * @param pid_ctx the PID's decode record
+ * @param data the data bytes of the response
+ *
+ * @return the value in SI units
+ */
+typedef float (*decode_func)(
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data);
+
+/** The decoder for each decoder_id. */
+extern const decode_func decoders[DECODER_COUNT];
+
+/**
+ * Chooses the decoder for a PID that has neither a lookup table nor native
+ * code.
+ *
+ * @param big_endian whether or not the CAN bus is big-endian
+ * @param pid_ctx the PID's decode record, with everything but the decoder
+ *                filled in
+ *
+ * @return a decoder
+ */
+decoder_id select_decoder(bool big_endian, const struct pid_ctx *pid_ctx);
+
+/**
+ * Decodes the data bytes of a CAN response for one PID into SI units, using
+ * the PID's decoder.
+ *
+ * @param pid_ctx the PID's decode record
+ * @param data the data bytes of the response
+ *
+ * @return the value in SI units
+ */
+static inline
+float decode_pid(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return decoders[pid_ctx->decoder](pid_ctx, data);
+}
+
+/**
+ * Decodes the data bytes of one PID from a buffer that may end right after
+ * them. An expression may read any of A through D whatever the PID's byte
+ * count, so bytes past the end of the buffer read as padding, as they would
+ * in a padded CAN frame.
+ *
+ * @param pid_ctx the PID's decode record
+ * @param data the data bytes of the response
+ * @param size the number of bytes from data to the end of the buffer
+ *
+ * @return the value in SI units
+ */
+static inline
+float decode_pid_bounded(
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data,
+    size_t size)
+{
+    unsigned char padded[EXPR_LINEAR_COEFFS - 1];
+
+    if (size >= sizeof(padded)) {
+        return decode_pid(pid_ctx, data);
+    }
+
+    memset(padded, OBD_II_PAD_VALUE, sizeof(padded));
+    memcpy(padded, data, size);
+
+    return decode_pid(pid_ctx, padded);
+}
+
+/**
+ * Checks the CAN ID and DLC of a CAN response and parses its mode and PID,
+ * without looking the mode-PID up.
+ *
+ * @param big_endian whether or not the CAN bus is big-endian
+ * @param frame a CAN frame
+ * @param mode filled in with the response's mode
+ * @param pid filled in with the response's PID
+ *
+ * @return an error code
+ */
+yobd_err parse_response_headers(
+    bool big_endian,
+    const struct can_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pid);
+
+/**
+ * Parses the mode and PID at the start of an OBD II payload, which is a frame
+ * without its ISO-TP header, without looking the mode-PID up.
+ *
+ * @param big_endian whether or not the CAN bus is big-endian
+ * @param response true if the payload is a response, false if a query
+ * @param payload the payload
+ * @param size the payload size
+ * @param mode filled in with the query mode
+ * @param pid filled in with the PID
+ *
+ * @return an error code
+ */
+yobd_err parse_payload_headers(
+    bool big_endian,
+    bool response,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pid);
+
+#endif /* YOBD_PRIVATE_EVAL_H_ */
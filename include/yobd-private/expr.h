@@ -8,11 +8,13 @@
 #ifndef YOBD_PRIVATE_EXPR_H_
 #define YOBD_PRIVATE_EXPR_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <yobd/yobd.h>
 #include <yobd-private/stack.h>
 #include <yobd-private/types.h>
+#include <yobd-private/unit.h>
 
 struct expr_token {
     enum {
@@ -38,19 +40,185 @@ struct expr_token {
 
 DEFINE_STACK(EXPR_STACK, struct expr_token)
 
+/* The maximum number of RPN tokens in an expression. */
+#define EXPR_MAX_TOKENS (50)
+
 typedef enum {
     EXPR_NOP,
-    EXPR_STACK
+    EXPR_STACK,
+    EXPR_LINEAR
 } expr_type;
 
+/*
+ * Bytecode for stack expressions. Each opcode is one byte, except that
+ * BC_PUSH_CONST is followed by a one-byte index into the constant pool.
+ */
+typedef enum {
+    BC_PUSH_A,
+    BC_PUSH_B,
+    BC_PUSH_C,
+    BC_PUSH_D,
+    BC_PUSH_CONST,
+    BC_ADD,
+    BC_SUB,
+    BC_MUL,
+    BC_DIV
+} bytecode_op;
+
+/*
+ * A constant pool entry. All constants in an expression have the type in which
+ * the expression is evaluated, so the pool needs no type tags.
+ */
+union expr_const {
+    float as_float;
+    int32_t as_int32_t;
+};
+
+/*
+ * The number of coefficients in a linear expression: a constant term plus one
+ * term for each of A, B, C, and D.
+ */
+#define EXPR_LINEAR_COEFFS (5)
+
 struct expr {
     expr_type type;
-    /* The byte count of the CAN response, not of the OBD II response. */
-    size_t size;
-    struct expr_token *data;
+    /*
+     * For stack expressions, the number of bytecode bytes. For linear
+     * expressions, the number of data bytes (starting at A) that the
+     * expression uses.
+     */
+    uint32_t size;
+    union {
+        /* Stack expressions. */
+        struct {
+            /*
+             * The constant pool. The bytecode follows it in the same
+             * allocation.
+             */
+            union expr_const *consts;
+            const uint8_t *code;
+            /* The deepest the evaluation stack gets. */
+            uint32_t max_depth;
+        };
+        /*
+         * For linear expressions, the value is:
+         * coeffs[0] + coeffs[1]*A + coeffs[2]*B + coeffs[3]*C + coeffs[4]*D
+         * with the unit conversion already folded in.
+         */
+        float coeffs[EXPR_LINEAR_COEFFS];
+    };
 };
 
-yobd_err parse_expr_val(const char *str, struct expr *expr, pid_data_type type);
+/**
+ * Converts an infix expression string into RPN tokens.
+ *
+ * @param str an infix expression string
+ * @param type the data type in which the expression is evaluated
+ * @param toks an array of at least EXPR_MAX_TOKENS tokens to fill in
+ *
+ * @return the number of tokens
+ */
+size_t parse_expr_tokens(
+    const char *str,
+    pid_data_type type,
+    struct expr_token *toks);
+
+/**
+ * Compiles RPN tokens into a bytecode stack expression.
+ *
+ * @param toks RPN tokens, as produced by parse_expr_tokens
+ * @param count the number of tokens
+ * @param expr the expression to fill in
+ *
+ * @return an error code
+ */
+yobd_err compile_expr(
+    const struct expr_token *toks,
+    size_t count,
+    struct expr *expr);
+
+/**
+ * Parses an expression string. If the expression is linear in the data bytes,
+ * it is compiled along with the unit conversion into a single linear form, so
+ * evaluating it needs no further unit conversion. Otherwise, the caller must
+ * apply the unit conversion after evaluating the expression.
+ *
+ * @param str an infix expression string, or "nop"
+ * @param expr the expression to fill in
+ * @param type the data type in which the expression is evaluated
+ * @param conv the unit conversion for the PID
+ *
+ * @return an error code
+ */
+yobd_err parse_expr_val(
+    const char *str,
+    struct expr *expr,
+    pid_data_type type,
+    const struct unit_conv *conv);
+
+/**
+ * Returns true if an expression can be evaluated for every possible input. An
+ * expression may fail to be total only if it divides by something that is not
+ * a constant, as that might be zero.
+ *
+ * @param expr a parsed expression
+ * @param type the data type in which the expression is evaluated
+ *
+ * @return true if the expression is total, false otherwise
+ */
+bool expr_is_total(const struct expr *expr, pid_data_type type);
+
+/**
+ * Returns the number of data bytes an expression reads, counting from A up to
+ * the last byte it uses. Nop expressions read the PID's bytes implicitly and
+ * so count as reading none.
+ *
+ * @param expr a parsed expression
+ *
+ * @return the number of data bytes the expression reads
+ */
+size_t expr_data_bytes(const struct expr *expr);
+
+/**
+ * Returns true if a stack expression contains a division.
+ *
+ * @param expr a stack expression
+ *
+ * @return true if the expression divides, false otherwise
+ */
+bool stack_expr_divides(const struct expr *expr);
+
+/**
+ * Returns the number of entries in the constant pool of a stack expression.
+ */
+size_t stack_expr_const_count(const struct expr *expr);
+
+/**
+ * Returns the number of bytes that the constant pool and bytecode of a stack
+ * expression occupy together.
+ */
+size_t stack_expr_bytes(const struct expr *expr);
+
+/**
+ * Copies the constant pool and bytecode of a stack expression to new storage
+ * and points the expression at the copy. The old storage is not freed.
+ *
+ * @param expr a stack expression
+ * @param dest stack_expr_bytes(expr) bytes, aligned for union expr_const
+ */
+void relocate_stack_expr(struct expr *expr, void *dest);
+
+/**
+ * Returns true if a stack expression from an untrusted source, such as a
+ * compiled schema file, is safe to evaluate: every opcode and constant index
+ * is valid, and the stack never underflows or grows past max_depth.
+ *
+ * @param expr a stack expression
+ * @param const_count the number of entries in the constant pool
+ *
+ * @return true if the expression is valid, false otherwise
+ */
+bool stack_expr_is_valid(const struct expr *expr, size_t const_count);
 
 void destroy_expr(struct expr *expr);
 
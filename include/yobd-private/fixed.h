@@ -0,0 +1,70 @@
+/**
+ * @file      fixed.h
+ * @brief     Fixed-point evaluation of PIDs for targets without an FPU.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_FIXED_H_
+#define YOBD_PRIVATE_FIXED_H_
+
+#include <stdint.h>
+#include <yobd/yobd.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/parser.h>
+
+/**
+ * The number of extra fraction bits carried by coefficients while summing, so
+ * that rounding them costs far less than the result's last bit.
+ */
+#define FIXED_GUARD_BITS (30)
+
+/**
+ * Results are scaled so that their magnitude stays below 2^FIXED_RANGE_BITS,
+ * leaving headroom in an int32_t for rounding.
+ */
+#define FIXED_RANGE_BITS (30)
+
+typedef enum {
+    /* A linear expression over the data bytes, with the unit conversion. */
+    FIXED_LINEAR,
+    /* An unsigned integer passed through, then unit-converted. */
+    FIXED_NOP,
+    /* An integer stack expression, then unit-converted. */
+    FIXED_STACK_INT,
+    /*
+     * A float passthrough or a float expression that is not linear, which
+     * still needs floating point. The float result is scaled and rounded.
+     */
+    FIXED_FLOAT
+} fixed_kind;
+
+/*
+ * How to evaluate a PID in fixed point. For every kind but FIXED_FLOAT, the
+ * result is:
+ *
+ * (coeffs[0] + coeffs[1]*x1 + ... + coeffs[4]*x4) >> FIXED_GUARD_BITS
+ *
+ * where the xi are the data bytes for FIXED_LINEAR, and x1 is the raw integer
+ * for FIXED_NOP and FIXED_STACK_INT. coeffs[0] includes the rounding bias. The
+ * result is the value in SI units times 2^frac_bits.
+ */
+struct fixed_pid {
+    int64_t coeffs[EXPR_LINEAR_COEFFS];
+    uint8_t kind;
+    int8_t frac_bits;
+    /* For FIXED_FLOAT, 2^frac_bits. */
+    float float_scale;
+};
+
+/**
+ * Compiles every PID in a context to fixed point, if the options ask for it.
+ *
+ * @param ctx a yobd context with all PIDs parsed
+ * @param opts schema options
+ *
+ * @return an error code
+ */
+yobd_err build_fixed(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts);
+
+#endif /* YOBD_PRIVATE_FIXED_H_ */
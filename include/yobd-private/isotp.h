@@ -0,0 +1,150 @@
+/**
+ * @file      isotp.h
+ * @brief     ISO-TP (ISO 15765-2) framing of OBD II messages.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_ISOTP_H_
+#define YOBD_PRIVATE_ISOTP_H_
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/**
+ * The value to use to pad OBD II messages. ISO 15765-2:2016 page 43 suggests
+ * but does not require 0xcc for padding.
+ */
+#define OBD_II_PAD_VALUE (0xcc)
+
+/**
+ * The CAN data length code that should be used for OBD-II frames.
+ */
+#define OBD_II_DLC 8
+
+/** ISO-TP frame types, in the high nibble of the first data byte. */
+typedef enum {
+    ISOTP_SINGLE = 0x0,
+    ISOTP_FIRST = 0x1,
+    ISOTP_CONSECUTIVE = 0x2,
+    ISOTP_FLOW_CONTROL = 0x3
+} isotp_frame_type;
+
+/** The most payload bytes a single frame carries. */
+#define ISOTP_SINGLE_MAX (7)
+
+/** The payload bytes a first frame carries. */
+#define ISOTP_FIRST_DATA (6)
+
+/** The most payload bytes a consecutive frame carries. */
+#define ISOTP_CONSECUTIVE_DATA (7)
+
+/** The largest message ISO-TP can carry over classic CAN. */
+#define ISOTP_MAX_SIZE (4095)
+
+/** Flow control status telling the sender to keep sending. */
+#define ISOTP_FLOW_CONTINUE (0x0)
+
+/** Flow control status telling the sender to wait for more flow control. */
+#define ISOTP_FLOW_WAIT (0x1)
+
+/**
+ * The offset from an ECU's response ID to its physical request ID, to which
+ * flow control frames are sent.
+ */
+#define ISOTP_FLOW_CONTROL_OFFSET (8)
+
+/** The most payload bytes a CAN FD single frame carries. */
+#define ISOTP_FD_SINGLE_MAX (CANFD_MAX_DLEN - 2)
+
+static inline
+isotp_frame_type isotp_get_type(const struct can_frame *frame)
+{
+    return frame->data[0] >> 4;
+}
+
+/**
+ * Returns the number of CAN frames needed to send a message.
+ *
+ * @param size the message size, at most ISOTP_MAX_SIZE
+ *
+ * @return a frame count
+ */
+size_t isotp_frame_count(size_t size);
+
+/**
+ * Splits a message into a single frame, or a first frame followed by
+ * consecutive frames, as the sender would send them.
+ *
+ * @param id the CAN ID to send from
+ * @param payload the message
+ * @param size the message size, at most ISOTP_MAX_SIZE
+ * @param frames isotp_frame_count(size) frames to fill in
+ */
+void isotp_segment(
+    canid_t id,
+    const unsigned char *payload,
+    size_t size,
+    struct can_frame *frames);
+
+/**
+ * Reassembles a complete message from a single frame, or from a first frame
+ * and its consecutive frames in order, all from the same sender.
+ *
+ * @param frames the frames of the message
+ * @param count the number of frames
+ * @param payload filled in with the message
+ * @param max the size of payload
+ * @param size filled in with the message size
+ *
+ * @return an error code
+ */
+yobd_err isotp_reassemble(
+    const struct can_frame *frames,
+    size_t count,
+    unsigned char *payload,
+    size_t max,
+    size_t *size);
+
+/**
+ * Fills in the flow control frame that tells an ECU to send the rest of a
+ * message without pausing.
+ *
+ * @param response_id the CAN ID of the ECU's first frame
+ * @param frame the frame to fill in
+ */
+void isotp_make_flow_control(canid_t response_id, struct can_frame *frame);
+
+/**
+ * Fills in a CAN FD single frame. Messages that fit in a classic single frame
+ * are sent as one, in an 8-byte frame. Longer ones get the 2-byte single frame
+ * header and the shortest CAN FD length that holds them, padded.
+ *
+ * @param id the CAN ID to send from
+ * @param payload the message
+ * @param size the message size, at most ISOTP_FD_SINGLE_MAX
+ * @param frame the frame to fill in
+ */
+void isotp_fd_make_single(
+    canid_t id,
+    const unsigned char *payload,
+    size_t size,
+    struct canfd_frame *frame);
+
+/**
+ * Finds the message in a CAN FD single frame.
+ *
+ * @param frame a CAN FD frame
+ * @param payload filled in with a pointer to the message within frame
+ * @param size filled in with the message size
+ *
+ * @return an error code
+ */
+yobd_err isotp_fd_parse_single(
+    const struct canfd_frame *frame,
+    const unsigned char **payload,
+    size_t *size);
+
+#endif /* YOBD_PRIVATE_ISOTP_H_ */
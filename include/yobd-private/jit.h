@@ -0,0 +1,46 @@
+/**
+ * @file      jit.h
+ * @brief     Native code generation for PID expressions.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_JIT_H_
+#define YOBD_PRIVATE_JIT_H_
+
+#include <stddef.h>
+#include <yobd/yobd.h>
+
+/**
+ * A compiled PID expression. It takes the data bytes of a CAN response and
+ * returns the value in SI units.
+ */
+typedef float (*jit_func)(const unsigned char *data);
+
+/** Executable memory holding all compiled expressions for a context. */
+struct jit_arena {
+    void *mem;
+    size_t size;
+};
+
+/**
+ * Compiles the expressions of the PIDs in a context to native code, if the
+ * options ask for it. This does nothing if yobd was built without JIT support
+ * or the architecture is not supported, in which case the PIDs are
+ * interpreted as usual.
+ *
+ * @param ctx a yobd context with all PIDs parsed
+ * @param opts schema options
+ *
+ * @return an error code
+ */
+yobd_err build_jit(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts);
+
+/**
+ * Frees a JIT arena. It is safe to call this on an arena that was never used.
+ *
+ * @param arena a JIT arena
+ */
+void destroy_jit(struct jit_arena *arena);
+
+#endif /* YOBD_PRIVATE_JIT_H_ */
@@ -0,0 +1,53 @@
+/**
+ * @file      lut.h
+ * @brief     Precomputed per-PID lookup tables.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_PRIVATE_LUT_H_
+#define YOBD_PRIVATE_LUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** The largest PID size, in CAN bytes, that can have a lookup table. */
+#define LUT_MAX_BYTES (2)
+
+/**
+ * Returns the number of entries in a lookup table for a PID of the given size.
+ */
+static inline
+size_t lut_entries(uint_fast8_t can_bytes)
+{
+    return ((size_t) 1) << (8*can_bytes);
+}
+
+/**
+ * Returns the lookup table index for the given data bytes. Tables are indexed
+ * by the data bytes in wire order, regardless of the endianness of the bus.
+ */
+static inline
+size_t lut_index(uint_fast8_t can_bytes, const unsigned char *data)
+{
+    if (can_bytes == 1) {
+        return data[0];
+    }
+    else {
+        return (data[0] << 8) | data[1];
+    }
+}
+
+/**
+ * Precomputes lookup tables for the PIDs in a context, according to the given
+ * options.
+ *
+ * @param ctx a yobd context with all PIDs parsed
+ * @param opts schema options
+ *
+ * @return an error code
+ */
+yobd_err build_luts(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts);
+
+#endif /* YOBD_PRIVATE_LUT_H_ */
@@ -8,29 +8,305 @@
 #ifndef YOBD_PRIVATE_PARSER_H_
 #define YOBD_PRIVATE_PARSER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <xlib/xhash.h>
 #include <yobd/yobd.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/jit.h>
 #include <yobd-private/unit.h>
 
+/** The number of SAE standard modes (0x00 through 0x0a). */
+#define SAE_MODE_COUNT (0x0b)
+
+/** The number of PIDs in an SAE standard mode, which uses one-byte PIDs. */
+#define SAE_PID_COUNT (0x100)
+
+/** The size of a cache line, which each decode record fills exactly. */
+#define PID_CTX_ALIGN (64)
+
+/*
+ * The specialized function that decodes a PID. It is chosen when the schema is
+ * loaded, so decoding never re-examines things that cannot change afterwards,
+ * such as the expression type, the byte count, and the byte order.
+ */
+typedef enum {
+    /* Precomputed tables, indexed by one or two data bytes. */
+    DECODER_LUT_1,
+    DECODER_LUT_2,
+    /* Native code, which includes the unit conversion. */
+    DECODER_JIT,
+    /* Unsigned integers of 1 to 4 bytes, in little- or big-endian order. */
+    DECODER_NOP_1,
+    DECODER_NOP_2_LE,
+    DECODER_NOP_2_BE,
+    DECODER_NOP_3_LE,
+    DECODER_NOP_3_BE,
+    DECODER_NOP_4_LE,
+    DECODER_NOP_4_BE,
+    /* IEEE 754 floats. */
+    DECODER_NOP_FLOAT_LE,
+    DECODER_NOP_FLOAT_BE,
+    /* Linear expressions using 0 to 4 data bytes. */
+    DECODER_LINEAR_0,
+    DECODER_LINEAR_1,
+    DECODER_LINEAR_2,
+    DECODER_LINEAR_3,
+    DECODER_LINEAR_4,
+    /* Bytecode, evaluated in float or int32_t arithmetic. */
+    DECODER_STACK_FLOAT,
+    DECODER_STACK_INT,
+    DECODER_COUNT
+} decoder_id;
+
+/*
+ * Everything needed to decode a response for a PID, and nothing else, packed
+ * into a single cache line. Descriptors live in a separate array, so a decode
+ * touches one line per PID no matter how many PIDs are in use.
+ */
+struct pid_ctx {
+    /* The value of data[0] in a valid response: mode, PID, and data bytes. */
+    uint8_t expected_bytes;
+    /* The index in the CAN frame of the first data byte (A). */
+    uint8_t data_offset;
+    uint8_t can_bytes;
+    /* A pid_data_type. */
+    uint8_t pid_type;
+    /* A decoder_id. */
+    uint8_t decoder;
+    /* Whether or not the CAN bus is big-endian, for decoding nop expressions. */
+    bool big_endian;
+    struct expr expr;
+    union {
+        /* For DECODER_LUT_*, the SI value for every input, by lut_index. */
+        float *lut;
+        /* For DECODER_JIT, the compiled expression. */
+        jit_func jit;
+    };
+    /*
+     * Conversion to SI units. Linear expressions already include this, so it
+     * is used only for other expression types.
+     */
+    struct unit_conv conv;
+} __attribute__ ((aligned (PID_CTX_ALIGN)));
+
+_Static_assert(
+    sizeof(struct pid_ctx) == PID_CTX_ALIGN,
+    "pid_ctx must fit in a single cache line");
+
+/* A PID as it is parsed, before it is split into decode and descriptor parts. */
 struct parse_pid_ctx {
-    convert_func convert_func;
+    struct unit_conv conv;
     pid_data_type pid_type;
     struct expr expr;
     /* Public PID descriptor. */
     struct yobd_pid_desc desc;
 };
 
-struct parse_pid_ctx *get_pid_ctx(
-    const struct yobd_ctx *ctx,
-    yobd_mode mode,
-    yobd_pid pid);
-
 XHASH_MAP_INIT_INT(MODEPID_MAP, struct parse_pid_ctx)
 
 struct yobd_ctx {
     bool big_endian;
+    /* The number of PIDs in the schema. */
+    size_t pid_count;
+    /* The decode record of each PID, sorted by modepid. */
+    struct pid_ctx *pids;
+    /* The descriptor of each entry in pids, which decoding never touches. */
+    struct yobd_pid_desc *descs;
+    /* The modepid of each entry in pids. */
+    uint32_t *modepids;
+    /*
+     * The index of the first manufacturer-mode PID in pids. Because pids is
+     * sorted, all manufacturer-mode PIDs come after all SAE standard PIDs.
+     */
+    size_t mfr_start;
+    /*
+     * A direct index for SAE standard modes. Each entry is an index into pids
+     * plus one, or 0 if the schema does not contain the mode-PID. Since SAE
+     * PIDs sort first, there are at most SAE_MODE_COUNT*SAE_PID_COUNT of them,
+     * so the index always fits in 16 bits.
+     */
+    uint16_t sae_index[SAE_MODE_COUNT][SAE_PID_COUNT];
+    /*
+     * Holds PIDs while the schema is being parsed. It is consumed when building
+     * the index and is NULL afterwards.
+     */
     xhash_t(MODEPID_MAP) *modepid_map;
+    /* Holds the code for all PIDs with a non-NULL jit. */
+    struct jit_arena jit;
+    /*
+     * If non-NULL, how to evaluate each entry in pids in fixed point. This is
+     * built only if the schema options ask for it.
+     */
+    struct fixed_pid *fixed;
+    /*
+     * A single cache-line-aligned allocation holding pids, followed by
+     * everything else other than lookup tables: modepids, bytecode, and
+     * finally descriptors and names, which are not needed for decoding. The
+     * decode path touches only the front of it.
+     */
+    void *arena;
+    size_t arena_size;
+    /*
+     * If non-NULL, the compiled schema this context was loaded from. PID names,
+     * bytecode, and modepids point into it instead of the arena, which then
+     * holds only pids and descs.
+     */
+    void *map;
+    size_t map_size;
 };
 
+static inline
+bool mode_is_sae_standard(yobd_mode mode)
+{
+    return mode <= 0x0a;
+}
+
+static inline
+uint32_t get_modepid(yobd_mode mode, yobd_pid pid)
+{
+    return (mode << 16) | pid;
+}
+
+static inline
+yobd_mode get_mode(uint32_t modepid)
+{
+    return modepid >> 16;
+}
+
+static inline
+yobd_pid get_pid(uint32_t modepid)
+{
+    return modepid & 0xffff;
+}
+
+/*
+ * Returns the number of bytes before the data in a response: one byte for mode,
+ * and one byte (standard modes) or two bytes (manufacturer modes) for PID.
+ */
+static inline
+size_t mode_data_offset(yobd_mode mode)
+{
+    if (mode_is_sae_standard(mode)) {
+        return 2;
+    }
+    else {
+        return 3;
+    }
+}
+
+static inline
+bool pid_has_lut(const struct pid_ctx *pid_ctx)
+{
+    return pid_ctx->decoder == DECODER_LUT_1 ||
+           pid_ctx->decoder == DECODER_LUT_2;
+}
+
+/**
+ * Fills in the decode record for a PID, including its decoder.
+ *
+ * @param pid_ctx the decode record to fill in
+ * @param big_endian whether or not the CAN bus is big-endian
+ * @param mode the PID's mode
+ * @param parse_ctx the parsed PID
+ */
+void init_pid_ctx(
+    struct pid_ctx *pid_ctx,
+    bool big_endian,
+    yobd_mode mode,
+    const struct parse_pid_ctx *parse_ctx);
+
+/**
+ * Allocates a context's arena, aligned so that each decode record at the front
+ * of it occupies exactly one cache line.
+ *
+ * @param ctx a yobd context, which must not yet have an arena
+ * @param size the number of bytes to allocate
+ *
+ * @return an error code
+ */
+yobd_err alloc_arena(struct yobd_ctx *ctx, size_t size);
+
+/**
+ * Allocates an empty context, which is safe to pass to yobd_free_ctx.
+ *
+ * @return a context, or NULL if we are out of memory
+ */
+struct yobd_ctx *create_ctx(void);
+
+/**
+ * Finds a schema file. Absolute paths are used as-is, and anything else is
+ * relative to the yobd schema directory.
+ *
+ * @param schema a schema path, as passed to yobd_parse_schema
+ * @param path filled in with the path to open, which must hold PATH_MAX bytes
+ *
+ * @return an error code
+ */
+yobd_err find_schema_path(const char *schema, char *path);
+
+size_t get_mfr_pid_index(
+    const struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid);
+
+/**
+ * Finds the index in pids and descs for a mode-PID.
+ *
+ * @param ctx a yobd context
+ * @param mode an OBD II mode
+ * @param pid an OBD II PID
+ *
+ * @return an index, or SIZE_MAX if the schema does not contain the mode-PID
+ */
+static inline
+size_t get_pid_index(
+    const struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    uint_fast16_t index;
+
+    if (!mode_is_sae_standard(mode)) {
+        return get_mfr_pid_index(ctx, mode, pid);
+    }
+
+    if (pid >= SAE_PID_COUNT) {
+        return SIZE_MAX;
+    }
+
+    index = ctx->sae_index[mode][pid];
+    if (index == 0) {
+        return SIZE_MAX;
+    }
+
+    return index - 1;
+}
+
+/**
+ * Finds the decode record for a mode-PID.
+ *
+ * @param ctx a yobd context
+ * @param mode an OBD II mode
+ * @param pid an OBD II PID
+ *
+ * @return a decode record, or NULL if the schema does not contain the mode-PID
+ */
+static inline
+const struct pid_ctx *get_pid_ctx(
+    const struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    size_t index;
+
+    index = get_pid_index(ctx, mode, pid);
+    if (index == SIZE_MAX) {
+        return NULL;
+    }
+
+    return &ctx->pids[index];
+}
+
 #endif /* YOBD_PRIVATE_PARSER_H_ */
@@ -10,13 +10,32 @@
 
 #include <yobd/yobd.h>
 
-typedef float (*convert_func)(float val);
+/**
+ * An affine conversion from a raw unit to an SI unit, such that
+ * si = scale*raw + offset.
+ */
+struct unit_conv {
+    double scale;
+    double offset;
+};
+
+/**
+ * Returns the conversion (converting to SI units) for a given raw unit.
+ * @param raw_unit a raw unit string, as found in a schema
+ * @return a conversion, with memory owned by yobd
+ */
+const struct unit_conv *find_unit_conv(const char *raw_unit);
 
 /**
- * Returns the conversion function (converting to SI units) for a given unit.
- * @param unit a unit ID
- * @return conversion function pointer
+ * Converts a raw value to SI units.
+ * @param conv a conversion
+ * @param val a value in raw units
+ * @return the value in SI units
  */
-convert_func find_convert_func(const char *raw_unit);
+static inline
+float unit_convert(const struct unit_conv *conv, float val)
+{
+    return conv->scale*val + conv->offset;
+}
 
 #endif /* YOBD_PRIVATE_UNIT_H_ */
@@ -0,0 +1,107 @@
+/**
+ * @file      canfd.h
+ * @brief     yobd public header for OBD II over CAN FD.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_CANFD_H_
+#define YOBD_CANFD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/*
+ * On CAN FD, a message of up to 62 bytes fits in one ISO-TP single frame.
+ * Messages that would fit in a classic frame are sent in an 8-byte frame with
+ * the classic layout, so these functions interoperate with classic CAN ECUs
+ * as long as the messages are short.
+ */
+
+/**
+ * The most data bytes a CAN FD response for a single PID may carry: a single
+ * frame holds 62 payload bytes, of which the mode and PID take 2 for standard
+ * modes and 3 for manufacturer modes.
+ */
+#define YOBD_CANFD_MAX_DATA (CANFD_MAX_DLEN - 2 - 2)
+
+/**
+ * Creates a CAN FD frame representing a given OBD II query.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[out] frame the CAN FD frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_canfd_query(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    struct canfd_frame *frame);
+
+/**
+ * Creates a CAN FD frame representing a given OBD II response.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[in] data the data payload for the frame
+ * @param[in] data_size the size of the data payload, between 1 and
+ *                      YOBD_CANFD_MAX_DATA for standard modes, or one less for
+ *                      manufacturer modes
+ * @param[out] frame the CAN FD frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_canfd_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *data,
+    uint8_t data_size,
+    struct canfd_frame *frame);
+
+/**
+ * Parses a given CAN FD frame, returning basic header information about the
+ * frame.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] frame a CAN FD frame to be parsed
+ * @param[out] mode filled in with the mode of the given frame
+ * @param[out] pid filled in with the pid of the given frame
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_canfd_headers(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pid);
+
+/**
+ * Interprets a CAN FD response to a single-PID query.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] frame a CAN FD frame to be interpreted
+ * @param[out] val a float value in SI units
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_canfd_response(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    float *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_CANFD_H_ */
@@ -0,0 +1,225 @@
+/**
+ * @file      correlator.h
+ * @brief     yobd public header for matching OBD II responses to the queries
+ *            that caused them, measuring latency and expiring lost queries.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_CORRELATOR_H_
+#define YOBD_CORRELATOR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** Forward declaration for opaque pointer. */
+struct yobd_correlator;
+
+/** What a correlator made of one response. */
+struct yobd_correlation {
+    /**
+     * True if the response answered an outstanding query. False if there was
+     * no such query, as for a response that arrives after its query timed out,
+     * or if the ECU had already answered it. The other fields are valid only
+     * if this is true.
+     */
+    bool matched;
+    /** The index of the ECU that answered, its response ID less 0x7e8. */
+    uint8_t ecu;
+    /** The round-trip latency, from sending the query to the response. */
+    uint64_t latency;
+    /**
+     * True if this response completed the query, which frees its mode-PID to
+     * be queried again.
+     */
+    bool complete;
+};
+
+/** A query that timed out before every ECU it expected answered. */
+struct yobd_correlator_timeout {
+    yobd_mode mode;
+    yobd_pid pid;
+    /** The time the query was sent. */
+    uint64_t sent;
+    /** The ECUs the query was waiting for, or 0 for any one ECU. */
+    uint8_t expected;
+    /** The ECUs that did answer. */
+    uint8_t responded;
+};
+
+/** Counters kept by a correlator since it was created. */
+struct yobd_correlator_stats {
+    /** The queries sent, one per mode-PID. */
+    uint64_t sent;
+    /** The responses that matched a query. */
+    uint64_t matched;
+    /** The responses that matched no outstanding query. */
+    uint64_t unmatched;
+    /** The queries completed by their responses. */
+    uint64_t completed;
+    /** The queries that timed out. */
+    uint64_t timeouts;
+    /** The queries outstanding now. */
+    uint64_t in_flight;
+};
+
+/**
+ * Creates a correlator, which tracks outstanding queries in a table with one
+ * slot per mode-PID in the schema, allocated here. Tracking, matching and
+ * expiring queries never allocate and take constant time, so a caller can
+ * keep queries for every mode-PID in flight at once from a single thread.
+ * Since the query ID is shared by all ECUs, only one query per mode-PID can
+ * be outstanding at a time. Time is whatever monotonic clock the caller
+ * passes in, in nanoseconds.
+ *
+ * @param[in] ctx a yobd context, which must outlive the correlator
+ * @param[in] timeout how long to wait for responses to a query, in
+ *                    nanoseconds, greater than 0
+ * @param[out] corr filled in with a new correlator. Free it with
+ *                  yobd_free_correlator.
+ *
+ * @return an error code
+ */
+yobd_err yobd_new_correlator(
+    struct yobd_ctx *ctx,
+    uint64_t timeout,
+    struct yobd_correlator **corr);
+
+/**
+ * Frees a correlator.
+ *
+ * @param[in] corr a correlator
+ */
+void yobd_free_correlator(struct yobd_correlator *corr);
+
+/**
+ * Records that a query for a mode-PID was sent.
+ *
+ * @param[in] corr a correlator
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID, which must be in the schema
+ * @param[in] expected the ECUs to wait for, with bit i for the ECU at response
+ *                     ID 0x7e8 + i, such as from yobd_caps_get_ecus. The
+ *                     query completes when all of them have answered. If 0,
+ *                     the query completes when any one ECU answers.
+ * @param[in] now the time the query was sent, in nanoseconds, which must not
+ *                go backward from one query to the next
+ *
+ * @return an error code. YOBD_QUERY_IN_FLIGHT is returned if a query for the
+ *         mode-PID is still outstanding.
+ */
+yobd_err yobd_correlator_add(
+    struct yobd_correlator *corr,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint8_t expected,
+    uint64_t now);
+
+/**
+ * Records that a query frame was sent, which may ask for one PID or, in an SAE
+ * standard mode, for several. Either all of its mode-PIDs are recorded or none
+ * are.
+ *
+ * @param[in] corr a correlator
+ * @param[in] frame a query frame, as from yobd_make_can_query or
+ *                  yobd_make_can_multi_query
+ * @param[in] expected the ECUs to wait for, as for yobd_correlator_add
+ * @param[in] now the time the query was sent, in nanoseconds
+ *
+ * @return an error code, as for yobd_correlator_add
+ */
+yobd_err yobd_correlator_add_query(
+    struct yobd_correlator *corr,
+    const struct can_frame *frame,
+    uint8_t expected,
+    uint64_t now);
+
+/**
+ * Matches a response from an ECU to the outstanding query for its mode-PID.
+ * Use this for responses that are not single CAN frames, such as the PIDs of
+ * a reassembled multi-PID response.
+ *
+ * @param[in] corr a correlator
+ * @param[in] id the response ID of the ECU that answered
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[in] now the time the response was received, in nanoseconds
+ * @param[out] match filled in with what the response matched
+ *
+ * @return an error code. An unmatched response is not an error.
+ */
+yobd_err yobd_correlator_match(
+    struct yobd_correlator *corr,
+    canid_t id,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint64_t now,
+    struct yobd_correlation *match);
+
+/**
+ * Matches a single-frame CAN response to the outstanding query for its
+ * mode-PID.
+ *
+ * @param[in] corr a correlator
+ * @param[in] frame a CAN response
+ * @param[in] now the time the response was received, in nanoseconds
+ * @param[out] match filled in with what the response matched
+ *
+ * @return an error code. An unmatched response is not an error, but a frame
+ *         that is not a single-frame response is.
+ */
+yobd_err yobd_correlator_match_response(
+    struct yobd_correlator *corr,
+    const struct can_frame *frame,
+    uint64_t now,
+    struct yobd_correlation *match);
+
+/**
+ * Expires the queries whose timeout has passed, freeing their mode-PIDs to be
+ * queried again. Queries expire in the order they were sent, and each costs
+ * O(1). Call again no later than the time returned in wake.
+ *
+ * @param[in] corr a correlator
+ * @param[in] now the current time in nanoseconds
+ * @param[out] timeouts an array filled in with the expired queries
+ * @param[in] max the size of the timeouts array. If more than max queries
+ *                have expired, the rest are left for the next call, and wake
+ *                is set to now.
+ * @param[out] count filled in with the number of expired queries
+ * @param[out] wake filled in with the time the next query expires, or
+ *                  UINT64_MAX if none are outstanding
+ *
+ * @return an error code
+ */
+yobd_err yobd_correlator_expire(
+    struct yobd_correlator *corr,
+    uint64_t now,
+    struct yobd_correlator_timeout *timeouts,
+    size_t max,
+    size_t *count,
+    uint64_t *wake);
+
+/**
+ * Gets a correlator's counters.
+ *
+ * @param[in] corr a correlator
+ * @param[out] stats filled in with the counters
+ *
+ * @return an error code
+ */
+yobd_err yobd_correlator_get_stats(
+    struct yobd_correlator *corr,
+    struct yobd_correlator_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_CORRELATOR_H_ */
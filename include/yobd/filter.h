@@ -0,0 +1,66 @@
+/**
+ * @file      filter.h
+ * @brief     yobd public header for generating kernel CAN filters, so that
+ *            frames yobd would reject never reach userspace.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_FILTER_H_
+#define YOBD_FILTER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <linux/filter.h>
+#include <stddef.h>
+#include <yobd/yobd.h>
+
+/**
+ * Fills in CAN_RAW filters, for the CAN_RAW_FILTER socket option, that pass
+ * only OBD II responses, which is to say standard frames with IDs
+ * YOBD_OBD_II_RESPONSE_BASE through YOBD_OBD_II_RESPONSE_END.
+ *
+ * @param[in] ctx a yobd context
+ * @param[out] filters an array of filters, or NULL to only get the count
+ * @param[in] max the size of the filters array
+ * @param[out] count filled in with the number of filters needed
+ *
+ * @return an error code. YOBD_INVALID_PARAMETER is returned if max is too
+ *         small.
+ */
+yobd_err yobd_make_can_filters(
+    struct yobd_ctx *ctx,
+    struct can_filter *filters,
+    size_t max,
+    size_t *count);
+
+/**
+ * Generates a classic BPF program, for the SO_ATTACH_FILTER socket option on a
+ * CAN_RAW socket, that passes exactly the frames yobd_parse_can_response would
+ * accept. This goes further than yobd_make_can_filters: it checks the DLC,
+ * the length byte, and that the mode-PID is in the schema. The program matches
+ * the byte order of the machine it is generated on.
+ *
+ * @param[in] ctx a yobd context
+ * @param[out] prog an array of instructions, or NULL to only get the length
+ * @param[in] max the size of the prog array
+ * @param[out] len filled in with the number of instructions needed
+ *
+ * @return an error code. YOBD_INVALID_PARAMETER is returned if max is too
+ *         small, or if the schema has so many PIDs that the program would be
+ *         longer than the kernel's limit of BPF_MAXINSNS.
+ */
+yobd_err yobd_make_can_bpf(
+    struct yobd_ctx *ctx,
+    struct sock_filter *prog,
+    size_t max,
+    size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_FILTER_H_ */
@@ -0,0 +1,177 @@
+/**
+ * @file      handle.h
+ * @brief     yobd public header for decoding with pre-resolved PID handles.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_HANDLE_H_
+#define YOBD_HANDLE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/**
+ * How yobd_decode_with_handle_inline decodes a PID. Only simple PIDs are
+ * decoded inline; everything else calls into the library.
+ */
+typedef enum {
+    YOBD_HANDLE_GENERIC = 0,
+    YOBD_HANDLE_LINEAR,
+    YOBD_HANDLE_NOP_1,
+    YOBD_HANDLE_NOP_2_LE,
+    YOBD_HANDLE_NOP_2_BE
+} yobd_handle_kind;
+
+/**
+ * A mode-PID resolved against a yobd context, so that decoding frames for it
+ * needs neither a PID lookup nor header parsing. Handles are plain values that
+ * may be copied freely, and they remain valid for the lifetime of the context
+ * they were resolved from.
+ *
+ * All fields are private and may change between yobd versions. They are
+ * visible only so that yobd_decode_with_handle_inline can be inlined.
+ */
+typedef struct {
+    const void *pid_ctx;
+    uint8_t expected_bytes;
+    uint8_t data_offset;
+    uint8_t kind;
+    uint8_t linear_bytes;
+    union {
+        float coeffs[5];
+        struct {
+            double scale;
+            double offset;
+        } conv;
+    } u;
+} yobd_pid_handle;
+
+/**
+ * Resolves a mode-PID into a handle.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[out] handle filled in with a handle for the mode-PID
+ *
+ * @return an error code
+ */
+yobd_err yobd_get_pid_handle(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    yobd_pid_handle *handle);
+
+/**
+ * Interprets a CAN response that the caller already knows carries the
+ * handle's mode-PID, such as after filtering on it. The CAN ID, DLC, mode, and
+ * PID are not checked; only the data byte count is.
+ *
+ * @param[in] handle a handle from yobd_get_pid_handle
+ * @param[in] frame a CAN response for the handle's mode-PID
+ * @param[out] val filled in with the value in SI units
+ *
+ * @return an error code
+ */
+yobd_err yobd_decode_with_handle(
+    const yobd_pid_handle *handle,
+    const struct can_frame *frame,
+    float *val);
+
+/**
+ * Interprets a run of CAN responses that all carry the handle's mode-PID, with
+ * the same results as calling yobd_decode_with_handle on each one: each
+ * frame's data byte count is checked, and frames that pass are decoded. Runs
+ * of at least 48 frames whose PID expression can be evaluated exactly in
+ * vector form are decoded several frames at a time with the widest SIMD
+ * instructions the CPU supports. Other runs are decoded one frame at a time
+ * with the handle's decoder.
+ *
+ * @param[in] handle a handle from yobd_get_pid_handle
+ * @param[in] frames an array of CAN responses for the handle's mode-PID
+ * @param[in] count the number of frames in the frames array
+ * @param[out] vals an array of count floats, filled in with the value of each
+ *                  frame in SI units. Entries for frames that failed to parse
+ *                  are left untouched.
+ * @param[out] errs an array of count error codes, filled in with the result of
+ *                  parsing each frame
+ *
+ * @return an error code. Note that YOBD_OK means only that the arguments were
+ *         valid; per-frame results are reported through errs.
+ */
+yobd_err yobd_decode_batch_with_handle(
+    const yobd_pid_handle *handle,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs);
+
+/**
+ * Like yobd_decode_with_handle, but decodes linear and plain integer PIDs
+ * inline, so that decoding a frame in a loop costs only a few instructions.
+ * Other PIDs fall back to yobd_decode_with_handle. No parameters are checked
+ * for NULL.
+ *
+ * Results match yobd_decode_with_handle, provided that the caller is compiled
+ * without floating-point contraction (e.g. -std=c11 or -ffp-contract=off).
+ *
+ * @param[in] handle a handle from yobd_get_pid_handle
+ * @param[in] frame a CAN response for the handle's mode-PID
+ * @param[out] val filled in with the value in SI units
+ *
+ * @return an error code
+ */
+static inline
+yobd_err yobd_decode_with_handle_inline(
+    const yobd_pid_handle *handle,
+    const struct can_frame *frame,
+    float *val)
+{
+    const unsigned char *data;
+    uint_fast8_t i;
+    float linear;
+    float raw;
+
+    if (frame->data[0] != handle->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+    data = &frame->data[handle->data_offset];
+
+    switch (handle->kind) {
+        case YOBD_HANDLE_LINEAR:
+            linear = handle->u.coeffs[0];
+            for (i = 0; i < handle->linear_bytes; ++i) {
+                linear += handle->u.coeffs[i+1] * data[i];
+            }
+            *val = linear;
+            return YOBD_OK;
+        case YOBD_HANDLE_NOP_1:
+            raw = data[0];
+            break;
+        case YOBD_HANDLE_NOP_2_LE:
+            raw = (data[1] << 8) | data[0];
+            break;
+        case YOBD_HANDLE_NOP_2_BE:
+            raw = (data[0] << 8) | data[1];
+            break;
+        default:
+            return yobd_decode_with_handle(handle, frame, val);
+    }
+
+    *val = handle->u.conv.scale*raw + handle->u.conv.offset;
+
+    return YOBD_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_HANDLE_H_ */
@@ -0,0 +1,202 @@
+/**
+ * @file      multi.h
+ * @brief     yobd public header for querying several PIDs with one CAN frame.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_MULTI_H_
+#define YOBD_MULTI_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** The most PIDs that one OBD II query may ask for, per SAE J1979. */
+#define YOBD_MAX_MULTI_PIDS (6)
+
+/**
+ * The largest payload of a response to a multi-PID query: the mode, then a PID
+ * and up to 5 data bytes for each PID.
+ */
+#define YOBD_MAX_MULTI_PAYLOAD (1 + YOBD_MAX_MULTI_PIDS*(1 + 5))
+
+/**
+ * The most CAN frames a response to a multi-PID query takes: an ISO-TP first
+ * frame with 6 payload bytes, then consecutive frames with 7 each.
+ */
+#define YOBD_MAX_MULTI_FRAMES (1 + (YOBD_MAX_MULTI_PAYLOAD - 6 + 7 - 1) / 7)
+
+/**
+ * Creates a CAN frame asking for several PIDs of one SAE standard mode at once.
+ * All PIDs must be in the schema, since parsing the response needs their
+ * sizes.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an SAE standard OBD II mode
+ * @param[in] pids an array of PIDs
+ * @param[in] count the number of PIDs, between 1 and YOBD_MAX_MULTI_PIDS
+ * @param[out] frame the CAN frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_can_multi_query(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    struct can_frame *frame);
+
+/**
+ * Creates the CAN frames an ECU would send in response to a multi-PID query.
+ * If the response does not fit in one frame, it is split into an ISO-TP first
+ * frame and consecutive frames. This is mainly useful for testing and for
+ * simulating ECUs.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an SAE standard OBD II mode
+ * @param[in] pids an array of PIDs
+ * @param[in] count the number of PIDs, between 1 and YOBD_MAX_MULTI_PIDS
+ * @param[in] data the data bytes of each PID in turn, with as many bytes for
+ *                 each PID as the schema says. A "PIDs supported" PID of
+ *                 mode 1 or 9 that the schema does not list takes the 4 bytes
+ *                 of its bitmap.
+ * @param[out] frames an array of CAN frames to be filled in
+ * @param[in] max_frames the size of the frames array. YOBD_MAX_MULTI_FRAMES is
+ *                       always enough.
+ * @param[out] frame_count filled in with the number of frames used
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_can_multi_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    const unsigned char *data,
+    struct can_frame *frames,
+    size_t max_frames,
+    size_t *frame_count);
+
+/**
+ * Creates the CAN FD frame an ECU would send in response to a multi-PID query.
+ * On CAN FD, the response always fits in a single frame.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] mode an SAE standard OBD II mode
+ * @param[in] pids an array of PIDs
+ * @param[in] count the number of PIDs, between 1 and YOBD_MAX_MULTI_PIDS
+ * @param[in] data the data bytes of each PID in turn, with as many bytes for
+ *                 each PID as the schema says. A "PIDs supported" PID of
+ *                 mode 1 or 9 that the schema does not list takes the 4 bytes
+ *                 of its bitmap.
+ * @param[out] frame the CAN FD frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_canfd_multi_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    const unsigned char *data,
+    struct canfd_frame *frame);
+
+/**
+ * Parses the OBD II payload of a response to a multi-PID query, which is the
+ * response mode followed by each PID and its data bytes. The PIDs may come in
+ * any order, and ECUs leave out PIDs they do not support.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] payload the payload, as reassembled from CAN frames
+ * @param[in] size the payload size
+ * @param[out] mode filled in with the query mode
+ * @param[out] pids an array filled in with the PID of each value
+ * @param[out] vals an array filled in with each value in SI units
+ * @param[in] max the size of the pids and vals arrays
+ * @param[out] count filled in with the number of values
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_multi_response(
+    struct yobd_ctx *ctx,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count);
+
+/**
+ * Parses a response to a multi-PID query, carried either in one CAN frame or
+ * in an ISO-TP first frame followed by its consecutive frames, all from the
+ * same ECU and in order.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] frames the CAN frames of the response
+ * @param[in] frame_count the number of frames
+ * @param[out] mode filled in with the query mode
+ * @param[out] pids an array filled in with the PID of each value
+ * @param[out] vals an array filled in with each value in SI units
+ * @param[in] max the size of the pids and vals arrays
+ * @param[out] count filled in with the number of values
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_can_multi_response(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    size_t frame_count,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count);
+
+/**
+ * Parses a response to a multi-PID query carried in one CAN FD frame.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] frame the CAN FD frame of the response
+ * @param[out] mode filled in with the query mode
+ * @param[out] pids an array filled in with the PID of each value
+ * @param[out] vals an array filled in with each value in SI units
+ * @param[in] max the size of the pids and vals arrays
+ * @param[out] count filled in with the number of values
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_canfd_multi_response(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count);
+
+/**
+ * Creates the ISO-TP flow control frame that the tester sends after an ECU's
+ * first frame, telling the ECU to send the rest of the response without
+ * pausing.
+ *
+ * @param[in] first_frame the ECU's first frame
+ * @param[out] frame the CAN frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_can_flow_control(
+    const struct can_frame *first_frame,
+    struct can_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_MULTI_H_ */
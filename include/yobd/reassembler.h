@@ -0,0 +1,99 @@
+/**
+ * @file      reassembler.h
+ * @brief     yobd public header for reassembling ISO-TP responses that span
+ *            several CAN frames.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_REASSEMBLER_H_
+#define YOBD_REASSEMBLER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <yobd/yobd.h>
+
+/** Forward declaration for opaque pointer. */
+struct yobd_reassembler;
+
+/** What came of pushing one frame into a reassembler. */
+struct yobd_reassembly {
+    /** The response ID of the ECU that sent the frame. */
+    canid_t id;
+    /**
+     * True if the frame started a multi-frame message, in which case
+     * flow_control must be sent before the ECU will send the rest.
+     */
+    bool send_flow_control;
+    /** The flow control frame, valid only if send_flow_control is true. */
+    struct can_frame flow_control;
+    /**
+     * The complete message, or NULL if the frame did not complete one. The
+     * message is the OBD II payload, starting with the response mode, and is
+     * valid until the next frame from the same ECU is pushed.
+     */
+    const unsigned char *payload;
+    /** The size of payload. */
+    size_t size;
+};
+
+/**
+ * Creates a reassembler, which turns the frames of responses from up to 8
+ * ECUs (response IDs YOBD_OBD_II_RESPONSE_BASE through
+ * YOBD_OBD_II_RESPONSE_END), interleaved in any way, into complete messages.
+ * Buffers for every ECU are allocated here, so pushing frames never allocates.
+ *
+ * @param[out] reassembler filled in with a new reassembler. Free it with
+ *                         yobd_free_reassembler.
+ *
+ * @return an error code
+ */
+yobd_err yobd_new_reassembler(struct yobd_reassembler **reassembler);
+
+/**
+ * Frees a reassembler.
+ *
+ * @param[in] reassembler a reassembler
+ */
+void yobd_free_reassembler(struct yobd_reassembler *reassembler);
+
+/**
+ * Drops any partly received messages, for instance after an ECU has been
+ * silent for longer than the ISO-TP timeout.
+ *
+ * @param[in] reassembler a reassembler
+ */
+void yobd_reset_reassembler(struct yobd_reassembler *reassembler);
+
+/**
+ * Pushes one frame from an ECU into a reassembler.
+ *
+ * A single frame completes a message at once. A first frame starts a message
+ * and asks for flow control, and the last of its consecutive frames completes
+ * it. A single or first frame arriving while a message from the same ECU is
+ * incomplete abandons that message, as ISO 15765-2 requires.
+ *
+ * @param[in] reassembler a reassembler
+ * @param[in] frame a CAN frame
+ * @param[out] out filled in with what came of the frame
+ *
+ * @return an error code. YOBD_UNKNOWN_ID is returned for frames that are not
+ *         OBD II responses, and YOBD_INVALID_ISOTP for frames that are not
+ *         part of a message, in which case the ECU's partial message, if any,
+ *         is dropped.
+ */
+yobd_err yobd_reassembler_push(
+    struct yobd_reassembler *reassembler,
+    const struct can_frame *frame,
+    struct yobd_reassembly *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_REASSEMBLER_H_ */
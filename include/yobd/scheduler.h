@@ -0,0 +1,259 @@
+/**
+ * @file      scheduler.h
+ * @brief     yobd public header for scheduling periodic OBD II queries within
+ *            a bus budget.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_SCHEDULER_H_
+#define YOBD_SCHEDULER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/**
+ * The bits an 8-byte classic CAN frame with a standard ID takes on the wire,
+ * including worst-case bit stuffing and interframe space. This is what the
+ * scheduler charges per frame when given a bitrate.
+ */
+#define YOBD_CAN_FRAME_BITS (135)
+
+/** Forward declaration for opaque pointer. */
+struct yobd_scheduler;
+
+/**
+ * Options for a scheduler. Always initialize these with
+ * yobd_scheduler_opts_init before setting any fields, so that fields added in
+ * the future get sane defaults.
+ */
+struct yobd_scheduler_opts {
+    /** The most frames per second that queries and responses may use, or 0. */
+    uint32_t max_frames_per_sec;
+    /**
+     * The bus bitrate in bits per second, or 0. If set, queries and responses
+     * may use bus_share percent of it.
+     */
+    uint32_t bitrate;
+    /** The percentage of the bitrate that queries and responses may use. */
+    uint8_t bus_share;
+    /**
+     * The most frames that may be sent back to back after the bus has been
+     * idle. This must be at least 2, the cost of one single-PID query.
+     */
+    uint32_t burst;
+    /**
+     * Whether to pack due PIDs of the same SAE standard mode into multi-PID
+     * queries. Responses to these may span several frames, which must be
+     * reassembled and answered with flow control (see yobd/multi.h and
+     * yobd/reassembler.h).
+     */
+    bool multi_pid;
+};
+
+/**
+ * Initializes scheduler options to their defaults: no bus budget, a burst of
+ * 8 frames, and single-PID queries only.
+ *
+ * @param[out] opts scheduler options to initialize
+ */
+void yobd_scheduler_opts_init(struct yobd_scheduler_opts *opts);
+
+/**
+ * Creates a scheduler, which decides which queries to send and when, so that
+ * each registered PID is polled at its requested period as far as the bus
+ * budget allows. When the budget is short, higher-priority PIDs are polled
+ * first. Time is whatever monotonic clock the caller passes in, in
+ * nanoseconds.
+ *
+ * Each query is charged one frame for itself and one for each frame of the
+ * expected response from one ECU, plus a flow control frame for responses
+ * that span several frames.
+ *
+ * @param[in] ctx a yobd context, which must outlive the scheduler
+ * @param[in] opts scheduler options, initialized with yobd_scheduler_opts_init
+ * @param[out] sched filled in with a new scheduler. Free it with
+ *                   yobd_free_scheduler.
+ *
+ * @return an error code
+ */
+yobd_err yobd_new_scheduler(
+    struct yobd_ctx *ctx,
+    const struct yobd_scheduler_opts *opts,
+    struct yobd_scheduler **sched);
+
+/**
+ * Frees a scheduler.
+ *
+ * @param[in] sched a scheduler
+ */
+void yobd_free_scheduler(struct yobd_scheduler *sched);
+
+/** What a scheduler knows about one of its PIDs. */
+struct yobd_scheduler_pid_stats {
+    /** The period the PID was registered with, in nanoseconds. */
+    uint64_t base_period;
+    /**
+     * The period the PID is polled at now, in nanoseconds. This differs from
+     * base_period only for adaptive PIDs.
+     */
+    uint64_t period;
+    /** The number of queries sent for the PID so far. */
+    uint64_t polls;
+};
+
+/**
+ * Registers a mode-PID to be polled, or changes the period and priority of one
+ * that is already registered. A newly registered PID is due immediately.
+ * Registering a PID again turns off adaptive polling for it.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID, which must be in the schema
+ * @param[in] period the polling period in nanoseconds, greater than 0
+ * @param[in] priority the priority, with higher values polled first
+ *
+ * @return an error code
+ */
+yobd_err yobd_scheduler_add_pid(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint64_t period,
+    uint8_t priority);
+
+/**
+ * Stops polling a mode-PID.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ *
+ * @return an error code. YOBD_PID_DOES_NOT_EXIST is returned if the mode-PID
+ *         is not registered.
+ */
+yobd_err yobd_scheduler_remove_pid(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid);
+
+/**
+ * Turns on adaptive polling for a registered mode-PID. Its period then follows
+ * how fast its value changes, as reported through yobd_scheduler_observe:
+ * after a change larger than the deadband, the period is set so that the
+ * value would change by about one deadband per poll at the rate it has just
+ * been changing; while the value stays within the deadband, the period grows
+ * by a quarter with each value. The period always stays within the bounds.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[in] deadband the change in value, in SI units, that counts as a real
+ *                     change rather than noise, at least 0
+ * @param[in] min_period the shortest period in nanoseconds, greater than 0
+ * @param[in] max_period the longest period in nanoseconds, at least
+ *                       min_period
+ *
+ * @return an error code. YOBD_PID_DOES_NOT_EXIST is returned if the mode-PID
+ *         is not registered.
+ */
+yobd_err yobd_scheduler_set_adaptive(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    float deadband,
+    uint64_t min_period,
+    uint64_t max_period);
+
+/**
+ * Reports a decoded value of a registered mode-PID, such as one from
+ * yobd_parse_can_response, so that an adaptive PID can adjust its period.
+ * Values of PIDs that are not adaptive are ignored.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[in] val the value in SI units
+ * @param[in] now the time the value was received, in nanoseconds
+ *
+ * @return an error code. YOBD_PID_DOES_NOT_EXIST is returned if the mode-PID
+ *         is not registered.
+ */
+yobd_err yobd_scheduler_observe(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    float val,
+    uint64_t now);
+
+/**
+ * Decodes a CAN response with yobd_parse_can_response and reports its value
+ * with yobd_scheduler_observe. Responses for mode-PIDs that are not registered
+ * are decoded but otherwise ignored.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] frame a CAN response
+ * @param[in] now the time the frame was received, in nanoseconds
+ * @param[out] val filled in with the value in SI units
+ *
+ * @return an error code, as from yobd_parse_can_response
+ */
+yobd_err yobd_scheduler_observe_response(
+    struct yobd_scheduler *sched,
+    const struct can_frame *frame,
+    uint64_t now,
+    float *val);
+
+/**
+ * Gets the live polling state of a registered mode-PID, including the period
+ * it is being polled at now.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ * @param[out] stats filled in with the PID's state
+ *
+ * @return an error code. YOBD_PID_DOES_NOT_EXIST is returned if the mode-PID
+ *         is not registered.
+ */
+yobd_err yobd_scheduler_get_pid_stats(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    struct yobd_scheduler_pid_stats *stats);
+
+/**
+ * Gets the query frames to send now. Each call costs O(log n) per query in
+ * the number of registered PIDs. Call again no later than the time returned
+ * in wake, or sooner if PIDs are added.
+ *
+ * @param[in] sched a scheduler
+ * @param[in] now the current time in nanoseconds, which must not go backward
+ * @param[out] frames an array of query frames to be filled in
+ * @param[in] max the size of the frames array
+ * @param[out] count filled in with the number of frames to send
+ * @param[out] wake filled in with the time at which to call again, or
+ *                  UINT64_MAX if no PIDs are registered
+ *
+ * @return an error code
+ */
+yobd_err yobd_scheduler_next(
+    struct yobd_scheduler *sched,
+    uint64_t now,
+    struct can_frame *frames,
+    size_t max,
+    size_t *count,
+    uint64_t *wake);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_SCHEDULER_H_ */
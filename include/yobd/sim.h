@@ -0,0 +1,279 @@
+/**
+ * @file      sim.h
+ * @brief     yobd-sim public header, for simulating the ECUs of a vehicle
+ *            answering OBD II queries. This is a separate library from yobd,
+ *            meant for testing and load testing without a car.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_SIM_H_
+#define YOBD_SIM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** The most ECUs a simulated vehicle can have, one per response ID. */
+#define YOBD_SIM_MAX_ECUS \
+    (YOBD_OBD_II_RESPONSE_END - YOBD_OBD_II_RESPONSE_BASE + 1)
+
+/** Forward declaration for opaque pointer. */
+struct yobd_sim;
+
+/**
+ * How the value of a simulated PID changes over time. Values are raw: the
+ * unsigned big-endian integer in the PID's data bytes, before the schema's
+ * expression turns it into SI units. Values outside the range the data bytes
+ * can hold are clamped to it.
+ */
+typedef enum {
+    /** Always value. */
+    YOBD_SIM_CONSTANT = 0,
+    /**
+     * value + rate per second, starting over every period nanoseconds if
+     * period is not 0.
+     */
+    YOBD_SIM_RAMP,
+    /** value + amplitude * sin(2 pi t / period), with period in nanoseconds. */
+    YOBD_SIM_SINE,
+    /** The data recorded for the PID in a file, see yobd_sim_load_replay. */
+    YOBD_SIM_REPLAY
+} yobd_sim_gen_type;
+
+/** A value generator for a simulated PID. */
+struct yobd_sim_gen {
+    yobd_sim_gen_type type;
+    double value;
+    double rate;
+    double amplitude;
+    uint64_t period;
+};
+
+/**
+ * How a simulated ECU answers. Always initialize these with
+ * yobd_sim_ecu_opts_init before setting any fields, so that fields added in
+ * the future get sane defaults.
+ */
+struct yobd_sim_ecu_opts {
+    /** The shortest time from a query to its response, in nanoseconds. */
+    uint64_t latency;
+    /**
+     * The most random time added to latency, in nanoseconds. Each response
+     * gets a delay spread evenly between latency and latency + jitter.
+     */
+    uint64_t jitter;
+    /** The chance of not answering a query, in parts per million. */
+    uint32_t drop_ppm;
+    /**
+     * Whether the ECU starts out supporting every PID in the schema, rather
+     * than none. Either way, yobd_sim_set_supported changes single PIDs.
+     */
+    bool all_pids;
+};
+
+/** Counters kept by a simulator since it was created. */
+struct yobd_sim_stats {
+    /** The queries received, counting each PID of a multi-PID query. */
+    uint64_t queries;
+    /** The response frames sent, including every frame of long responses. */
+    uint64_t frames;
+    /** The responses dropped on purpose, per ECU and PID. */
+    uint64_t dropped;
+    /** The frames received that were neither queries nor flow control. */
+    uint64_t ignored;
+};
+
+/**
+ * Initializes ECU options to their defaults: 5 ms latency with no jitter or
+ * drops, supporting every PID.
+ *
+ * @param[out] opts ECU options to initialize
+ */
+void yobd_sim_ecu_opts_init(struct yobd_sim_ecu_opts *opts);
+
+/**
+ * Creates a simulated vehicle with no ECUs. Every PID in the schema starts out
+ * with a ramp through its whole raw range every 10 seconds.
+ *
+ * A simulator answers single-PID and multi-PID queries, the latter with
+ * ISO-TP first and consecutive frames when they do not fit in one frame, as
+ * well as the "PIDs supported" queries of modes 1 and 9, which each ECU
+ * answers with the PIDs it supports. Time is whatever monotonic clock the
+ * caller passes in, in nanoseconds.
+ *
+ * @param[in] ctx a yobd context, which must outlive the simulator
+ * @param[in] seed the seed for jitter and drops, so runs can be repeated
+ * @param[out] sim filled in with a new simulator. Free it with yobd_free_sim.
+ *
+ * @return an error code
+ */
+yobd_err yobd_new_sim(
+    struct yobd_ctx *ctx,
+    uint64_t seed,
+    struct yobd_sim **sim);
+
+/**
+ * Frees a simulator.
+ *
+ * @param[in] sim a simulator
+ */
+void yobd_free_sim(struct yobd_sim *sim);
+
+/**
+ * Adds an ECU to a simulated vehicle. ECUs answer from response IDs
+ * YOBD_OBD_II_RESPONSE_BASE upward, in the order they are added.
+ *
+ * @param[in] sim a simulator
+ * @param[in] opts ECU options, initialized with yobd_sim_ecu_opts_init
+ * @param[out] ecu filled in with the index of the new ECU
+ *
+ * @return an error code. YOBD_INVALID_PARAMETER is returned if the vehicle
+ *         already has YOBD_SIM_MAX_ECUS ECUs.
+ */
+yobd_err yobd_sim_add_ecu(
+    struct yobd_sim *sim,
+    const struct yobd_sim_ecu_opts *opts,
+    size_t *ecu);
+
+/**
+ * Sets whether an ECU answers queries for a mode-PID.
+ *
+ * @param[in] sim a simulator
+ * @param[in] ecu the index of an ECU
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID, which must be in the schema
+ * @param[in] supported whether the ECU answers
+ *
+ * @return an error code
+ */
+yobd_err yobd_sim_set_supported(
+    struct yobd_sim *sim,
+    size_t ecu,
+    yobd_mode mode,
+    yobd_pid pid,
+    bool supported);
+
+/**
+ * Sets the value generator of a mode-PID, which all ECUs share.
+ *
+ * @param[in] sim a simulator
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID, which must be in the schema
+ * @param[in] gen a generator. Its type may not be YOBD_SIM_REPLAY.
+ *
+ * @return an error code
+ */
+yobd_err yobd_sim_set_gen(
+    struct yobd_sim *sim,
+    yobd_mode mode,
+    yobd_pid pid,
+    const struct yobd_sim_gen *gen);
+
+/**
+ * Loads recorded responses from a candump log (as written by candump -l) and
+ * replays them: from then on, each mode-PID in the log is answered with the
+ * data of the last response recorded at or before the same offset into the
+ * log, counting from the first frame the simulator receives and looping at
+ * the end of the log. Frames that are not single-frame responses to a
+ * mode-PID in the schema are skipped.
+ *
+ * @param[in] sim a simulator
+ * @param[in] file the path of the log
+ * @param[out] count filled in with the number of responses loaded
+ *
+ * @return an error code. YOBD_PARSE_FAIL is returned if a line is not in
+ *         candump log format.
+ */
+yobd_err yobd_sim_load_replay(
+    struct yobd_sim *sim,
+    const char *file,
+    size_t *count);
+
+/**
+ * Hands a received frame to the simulated ECUs. Queries are answered after
+ * each ECU's latency, and flow control frames release the rest of long
+ * responses. Other frames are counted and ignored.
+ *
+ * @param[in] sim a simulator
+ * @param[in] frame a received CAN frame
+ * @param[in] now the time the frame was received, in nanoseconds
+ *
+ * @return an error code. Frames the simulator does not understand are not an
+ *         error.
+ */
+yobd_err yobd_sim_push(
+    struct yobd_sim *sim,
+    const struct can_frame *frame,
+    uint64_t now);
+
+/**
+ * Gets the response frames due by now, in the order they are due. Each call
+ * costs O(log n) per frame in the number of frames waiting. Call again no
+ * later than the time returned in wake.
+ *
+ * @param[in] sim a simulator
+ * @param[in] now the current time in nanoseconds
+ * @param[out] frames an array of response frames to be filled in
+ * @param[in] max the size of the frames array
+ * @param[out] count filled in with the number of frames to send
+ * @param[out] wake filled in with the time the next frame is due, which is
+ *                  now if more frames are already due, or UINT64_MAX if none
+ *                  are waiting
+ *
+ * @return an error code
+ */
+yobd_err yobd_sim_next(
+    struct yobd_sim *sim,
+    uint64_t now,
+    struct can_frame *frames,
+    size_t max,
+    size_t *count,
+    uint64_t *wake);
+
+/**
+ * Serves a datagram socket that carries one struct can_frame per datagram,
+ * such as a nonblocking CAN_RAW socket on a vcan interface or one end of an
+ * AF_UNIX socketpair. Receives every queued frame and pushes it into the
+ * simulator, then sends the responses that are due, using one recvmmsg or
+ * sendmmsg per batch. It never blocks; frames the socket cannot take yet are
+ * kept for the next call. Wait for the socket to be readable, or for wake,
+ * then call again.
+ *
+ * @param[in] sim a simulator
+ * @param[in] fd a nonblocking socket
+ * @param[in] now the current time in nanoseconds
+ * @param[out] wake filled in as for yobd_sim_next
+ *
+ * @return an error code. System call failures are reported as positive errno
+ *         values.
+ */
+yobd_err yobd_sim_pump(
+    struct yobd_sim *sim,
+    int fd,
+    uint64_t now,
+    uint64_t *wake);
+
+/**
+ * Gets a simulator's counters.
+ *
+ * @param[in] sim a simulator
+ * @param[out] stats filled in with the counters
+ *
+ * @return an error code
+ */
+yobd_err yobd_sim_get_stats(
+    struct yobd_sim *sim,
+    struct yobd_sim_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_SIM_H_ */
@@ -0,0 +1,127 @@
+/**
+ * @file      sink.h
+ * @brief     yobd public header for collecting decoded values into per-PID
+ *            columns.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_SINK_H_
+#define YOBD_SINK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** Forward declaration for opaque pointer. */
+struct yobd_sink;
+
+/**
+ * Called when a column fills up, or when the caller flushes the sink. The
+ * arrays are valid only until the callback returns, after which the column is
+ * emptied and reused.
+ *
+ * @param mode the column's mode
+ * @param pid the column's PID
+ * @param timestamps the timestamp of each value, in the order the frames were
+ *                   pushed
+ * @param vals the values in SI units
+ * @param count the number of entries in timestamps and vals
+ * @param data the data passed to yobd_new_sink
+ */
+typedef void (*yobd_sink_flush_func)(
+    yobd_mode mode,
+    yobd_pid pid,
+    const uint64_t *timestamps,
+    const float *vals,
+    size_t count,
+    void *data);
+
+/**
+ * Creates a sink, which decodes CAN responses for the mode-PIDs registered
+ * with it and appends each value, along with its timestamp, to a column for
+ * its mode-PID. Each column is a pair of contiguous, preallocated arrays, so
+ * aggregating a column is a linear scan.
+ *
+ * @param[in] ctx a yobd context, which must outlive the sink
+ * @param[in] capacity the number of values each column holds before it is
+ *                     flushed
+ * @param[in] flush the function to call when a column is flushed
+ * @param[in] data passed to flush
+ * @param[out] sink filled in with a new sink. Free it with yobd_free_sink.
+ *
+ * @return an error code
+ */
+yobd_err yobd_new_sink(
+    struct yobd_ctx *ctx,
+    size_t capacity,
+    yobd_sink_flush_func flush,
+    void *data,
+    struct yobd_sink **sink);
+
+/**
+ * Frees a sink without flushing it. Call yobd_sink_flush first to avoid
+ * losing values.
+ *
+ * @param[in] sink a sink
+ */
+void yobd_free_sink(struct yobd_sink *sink);
+
+/**
+ * Registers a mode-PID with a sink, allocating its column. Registering a
+ * mode-PID that is already registered does nothing.
+ *
+ * @param[in] sink a sink
+ * @param[in] mode an OBD II mode
+ * @param[in] pid an OBD II PID
+ *
+ * @return an error code
+ */
+yobd_err yobd_sink_add_pid(
+    struct yobd_sink *sink,
+    yobd_mode mode,
+    yobd_pid pid);
+
+/**
+ * Decodes an array of CAN frames into the sink's columns. Frames for
+ * mode-PIDs that are not registered, and frames that fail to parse, are
+ * skipped. Runs of frames for the same mode-PID are decoded together, as with
+ * yobd_decode_batch_with_handle. Whenever a column fills up, it is flushed.
+ *
+ * @param[in] sink a sink
+ * @param[in] frames an array of CAN frames to be interpreted
+ * @param[in] timestamps an array of count timestamps, one per frame, in
+ *                       whatever unit the caller likes
+ * @param[in] count the number of frames in the frames array
+ * @param[out] stored filled in with the number of values appended to columns,
+ *                    or NULL if not needed
+ *
+ * @return an error code
+ */
+yobd_err yobd_sink_push(
+    struct yobd_sink *sink,
+    const struct can_frame *frames,
+    const uint64_t *timestamps,
+    size_t count,
+    size_t *stored);
+
+/**
+ * Flushes every column that holds at least one value, in the order the
+ * mode-PIDs were registered.
+ *
+ * @param[in] sink a sink
+ *
+ * @return an error code
+ */
+yobd_err yobd_sink_flush(struct yobd_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_SINK_H_ */
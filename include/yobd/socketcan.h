@@ -0,0 +1,154 @@
+/**
+ * @file      socketcan.h
+ * @brief     yobd-socketcan public header, for receiving frames from SocketCAN
+ *            in batches. This is a separate library from yobd, which does no
+ *            I/O of its own.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_SOCKETCAN_H_
+#define YOBD_SOCKETCAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/sink.h>
+#include <yobd/yobd.h>
+
+/** Forward declaration for opaque pointer. */
+struct yobd_socketcan;
+
+/**
+ * Opens a CAN_RAW socket bound to a CAN interface, with kernel receive
+ * timestamps turned on.
+ *
+ * @param[in] ifname the interface name, such as "can0" or "vcan0"
+ * @param[in] batch the most frames to receive per system call
+ * @param[out] sock filled in with a new socket. Close it with
+ *                  yobd_socketcan_close.
+ *
+ * @return an error code. System call failures are reported as positive errno
+ *         values, which yobd_strerror understands.
+ */
+yobd_err yobd_socketcan_open(
+    const char *ifname,
+    size_t batch,
+    struct yobd_socketcan **sock);
+
+/**
+ * Wraps an already open datagram socket that delivers one struct can_frame per
+ * datagram, such as a CAN_RAW socket the caller has set up, or one end of an
+ * AF_UNIX socketpair standing in for CAN on machines without it. Receive
+ * timestamps are turned on. The file descriptor is not closed by
+ * yobd_socketcan_close.
+ *
+ * @param[in] fd a socket
+ * @param[in] batch the most frames to receive per system call
+ * @param[out] sock filled in with a new socket. Close it with
+ *                  yobd_socketcan_close.
+ *
+ * @return an error code
+ */
+yobd_err yobd_socketcan_from_fd(
+    int fd,
+    size_t batch,
+    struct yobd_socketcan **sock);
+
+/**
+ * Frees a socket, closing it if it was opened by yobd_socketcan_open.
+ *
+ * @param[in] sock a socket
+ */
+void yobd_socketcan_close(struct yobd_socketcan *sock);
+
+/**
+ * Gets the file descriptor of a socket, for use with poll and friends.
+ *
+ * @param[in] sock a socket
+ *
+ * @return a file descriptor
+ */
+int yobd_socketcan_get_fd(const struct yobd_socketcan *sock);
+
+/**
+ * Receives as many frames as are queued, up to the batch size, with one
+ * system call. Datagrams that are not exactly one struct can_frame, such as
+ * CAN FD frames, are dropped.
+ *
+ * @param[in] sock a socket
+ * @param[in] wait if true, block until at least one frame arrives; if false,
+ *                 return at once with a count of 0 if none are queued
+ * @param[out] frames filled in with the received frames, valid until the next
+ *                    receive on the socket
+ * @param[out] timestamps filled in with the time each frame was received, in
+ *                        nanoseconds since the epoch, as stamped by the
+ *                        kernel. Frames without a kernel timestamp get the
+ *                        time the system call returned.
+ * @param[out] count filled in with the number of frames
+ *
+ * @return an error code. System call failures are reported as positive errno
+ *         values.
+ */
+yobd_err yobd_socketcan_recv(
+    struct yobd_socketcan *sock,
+    bool wait,
+    const struct can_frame **frames,
+    const uint64_t **timestamps,
+    size_t *count);
+
+/**
+ * Receives a batch of frames as yobd_socketcan_recv does, then interprets them
+ * as yobd_parse_can_responses does.
+ *
+ * @param[in] sock a socket
+ * @param[in] ctx a yobd context
+ * @param[in] wait as for yobd_socketcan_recv
+ * @param[out] vals an array of batch floats, as for yobd_parse_can_responses
+ * @param[out] errs an array of batch error codes, as for
+ *                  yobd_parse_can_responses
+ * @param[out] modes an array of batch modes, or NULL if not needed
+ * @param[out] pids an array of batch PIDs, or NULL if not needed
+ * @param[out] count filled in with the number of frames received
+ *
+ * @return an error code
+ */
+yobd_err yobd_socketcan_recv_responses(
+    struct yobd_socketcan *sock,
+    struct yobd_ctx *ctx,
+    bool wait,
+    float *vals,
+    yobd_err *errs,
+    yobd_mode *modes,
+    yobd_pid *pids,
+    size_t *count);
+
+/**
+ * Receives a batch of frames as yobd_socketcan_recv does, then pushes them and
+ * their timestamps into a sink.
+ *
+ * @param[in] sock a socket
+ * @param[in] sink a sink
+ * @param[in] wait as for yobd_socketcan_recv
+ * @param[out] count filled in with the number of frames received
+ * @param[out] stored filled in with the number of values the sink stored
+ *
+ * @return an error code
+ */
+yobd_err yobd_socketcan_recv_sink(
+    struct yobd_socketcan *sock,
+    struct yobd_sink *sink,
+    bool wait,
+    size_t *count,
+    size_t *stored);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_SOCKETCAN_H_ */
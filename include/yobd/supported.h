@@ -0,0 +1,235 @@
+/**
+ * @file      supported.h
+ * @brief     yobd public header for discovering which PIDs a vehicle's ECUs
+ *            support, using the SAE "PIDs supported" bitmaps.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_SUPPORTED_H_
+#define YOBD_SUPPORTED_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <yobd/yobd.h>
+
+/** The most ECUs that answer OBD II queries, one per response ID. */
+#define YOBD_MAX_ECUS (YOBD_OBD_II_RESPONSE_END - YOBD_OBD_II_RESPONSE_BASE + 1)
+
+/**
+ * The distance between "PIDs supported" PIDs. The response to PID p is a
+ * 4-byte bitmap of PIDs p+1 through p+0x20, from the top bit of the first
+ * byte down. If the last of these, itself a "PIDs supported" PID, is set,
+ * there is another bitmap to ask for.
+ */
+#define YOBD_SUPPORTED_PIDS_STRIDE (0x20)
+
+/** The most PIDs a mode can have, and so the bits of a capability bitset. */
+#define YOBD_CAPS_PIDS (0x100)
+
+/**
+ * The most bytes a serialized yobd_caps takes, which is when all ECUs have
+ * answered.
+ */
+#define YOBD_MAX_CAPS_SIZE (10 + YOBD_MAX_ECUS*2*YOBD_CAPS_PIDS/8)
+
+/**
+ * The PIDs one ECU supports in the modes that have "PIDs supported" bitmaps
+ * yobd understands, which are mode 1 (current data) and mode 9 (vehicle
+ * information). In each, bit p % 32 of word p / 32 is set if PID p is
+ * supported.
+ */
+struct yobd_ecu_caps {
+    uint32_t mode1[YOBD_CAPS_PIDS / 32];
+    uint32_t mode9[YOBD_CAPS_PIDS / 32];
+};
+
+/** What the ECUs of a vehicle support, as learned by discovery. */
+struct yobd_caps {
+    /**
+     * Bit i is set if ECU i, with response ID YOBD_OBD_II_RESPONSE_BASE + i,
+     * has answered a discovery query.
+     */
+    uint8_t ecus;
+    /** What each ECU supports, valid only for ECUs that have answered. */
+    struct yobd_ecu_caps ecu[YOBD_MAX_ECUS];
+};
+
+/**
+ * Initializes capabilities to knowing nothing, before discovery.
+ *
+ * @param[out] caps capabilities to initialize
+ */
+void yobd_caps_init(struct yobd_caps *caps);
+
+/**
+ * Creates a CAN frame asking every ECU for one "PIDs supported" bitmap.
+ * Discovery starts with PID 0x00 and continues with
+ * yobd_caps_next_supported_pid.
+ *
+ * @param[in] mode the mode, 1 or 9
+ * @param[in] pid a "PIDs supported" PID: 0x00, 0x20, and so on up to 0xe0
+ * @param[out] frame the CAN frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_supported_query(
+    yobd_mode mode,
+    yobd_pid pid,
+    struct can_frame *frame);
+
+/**
+ * Creates a mode 1 CAN frame asking for the first six "PIDs supported"
+ * bitmaps, PIDs 0x00 through 0xa0, at once. Each ECU answers with only the
+ * bitmaps it has, in a response that spans several frames and so must be
+ * reassembled with flow control (see yobd/reassembler.h) and passed to
+ * yobd_parse_supported_payload. Discovery then continues with
+ * yobd_caps_next_supported_pid from PID 0xa0.
+ *
+ * @param[out] frame the CAN frame to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_make_supported_multi_query(struct can_frame *frame);
+
+/**
+ * Records the "PIDs supported" bitmaps in the OBD II payload of a response,
+ * which starts with the response mode and does not include any ISO-TP header.
+ * The payload may hold one bitmap, as a response to yobd_make_supported_query
+ * does, or several, as a response to yobd_make_supported_multi_query does.
+ *
+ * @param[in,out] caps capabilities to update
+ * @param[in] id the response ID of the ECU that sent the payload
+ * @param[in] payload the payload
+ * @param[in] size the payload size
+ *
+ * @return an error code. YOBD_INVALID_MODE or YOBD_INVALID_PID is returned if
+ *         the payload is not a response to a "PIDs supported" query, in which
+ *         case caps is left unchanged.
+ */
+yobd_err yobd_parse_supported_payload(
+    struct yobd_caps *caps,
+    canid_t id,
+    const unsigned char *payload,
+    size_t size);
+
+/**
+ * Records the "PIDs supported" bitmap in a single-frame CAN response.
+ *
+ * @param[in,out] caps capabilities to update
+ * @param[in] frame a CAN response
+ *
+ * @return an error code. YOBD_UNKNOWN_ID, YOBD_INVALID_MODE or
+ *         YOBD_INVALID_PID is returned if the frame is not a single-frame
+ *         response to a "PIDs supported" query, in which case caps is left
+ *         unchanged.
+ */
+yobd_err yobd_parse_supported_response(
+    struct yobd_caps *caps,
+    const struct can_frame *frame);
+
+/**
+ * Gets the next "PIDs supported" PID to ask for after the one last asked for,
+ * which is the next bitmap that any ECU has said it has. Since this depends
+ * only on which bitmaps have arrived, ECUs that never answer do not stall
+ * discovery.
+ *
+ * @param[in] caps capabilities so far
+ * @param[in] mode the mode, 1 or 9
+ * @param[in] last the "PIDs supported" PID last asked for
+ * @param[out] next filled in with the next PID to ask for
+ * @param[out] done filled in with true if there is nothing more to ask for, in
+ *                  which case next is not filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_caps_next_supported_pid(
+    const struct yobd_caps *caps,
+    yobd_mode mode,
+    yobd_pid last,
+    yobd_pid *next,
+    bool *done);
+
+/**
+ * Gets which ECUs support a mode-PID.
+ *
+ * @param[in] caps capabilities
+ * @param[in] mode the mode, 1 or 9
+ * @param[in] pid an OBD II PID
+ * @param[out] ecus filled in with a mask in which bit i is set if ECU i, with
+ *                  response ID YOBD_OBD_II_RESPONSE_BASE + i, supports the
+ *                  mode-PID
+ *
+ * @return an error code
+ */
+yobd_err yobd_caps_get_ecus(
+    const struct yobd_caps *caps,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint8_t *ecus);
+
+/**
+ * Iterates through the PID descriptors in a yobd context that at least one ECU
+ * supports, which are the ones worth querying. Discovery says nothing about
+ * modes other than 1 and 9, so PIDs of other modes are always included.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] caps capabilities
+ * @param[in] func a function called once per supported PID descriptor
+ * @param[in] data user-specific data context passed into each function call
+ *
+ * @return an error code
+ */
+yobd_err yobd_caps_foreach(
+    struct yobd_ctx *ctx,
+    const struct yobd_caps *caps,
+    pid_process_func func,
+    void *data);
+
+/**
+ * Serializes capabilities into a portable byte buffer, so that they can be
+ * stored, for instance keyed by VIN, and loaded on the next ignition instead
+ * of running discovery again. Only ECUs that have answered take space.
+ *
+ * @param[in] caps capabilities
+ * @param[out] buf a buffer, or NULL to only get the size
+ * @param[in] max the size of buf
+ * @param[out] size filled in with the number of bytes needed, at most
+ *                  YOBD_MAX_CAPS_SIZE
+ *
+ * @return an error code. YOBD_INVALID_PARAMETER is returned if max is too
+ *         small.
+ */
+yobd_err yobd_caps_serialize(
+    const struct yobd_caps *caps,
+    unsigned char *buf,
+    size_t max,
+    size_t *size);
+
+/**
+ * Loads capabilities serialized by yobd_caps_serialize, on this or any other
+ * machine.
+ *
+ * @param[in] buf the serialized capabilities
+ * @param[in] size the size of buf
+ * @param[out] caps filled in with the capabilities
+ *
+ * @return an error code. YOBD_INVALID_CAPS is returned if buf is not valid
+ *         serialized capabilities, in which case caps is left unchanged.
+ */
+yobd_err yobd_caps_deserialize(
+    const unsigned char *buf,
+    size_t size,
+    struct yobd_caps *caps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YOBD_SUPPORTED_H_ */
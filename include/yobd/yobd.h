@@ -48,7 +48,11 @@ typedef enum {
     YOBD_UNKNOWN_MODE_PID = -10,
     YOBD_UNKNOWN_UNIT = -11,
     YOBD_INVALID_DATA_BYTES = -12,
-    YOBD_PARSE_FAIL = -13
+    YOBD_PARSE_FAIL = -13,
+    YOBD_INVALID_COMPILED_SCHEMA = -14,
+    YOBD_INVALID_ISOTP = -15,
+    YOBD_INVALID_CAPS = -16,
+    YOBD_QUERY_IN_FLIGHT = -17
 } yobd_err;
 
 /**
@@ -92,6 +96,49 @@ struct yobd_pid_desc {
     yobd_unit unit;
 };
 
+/**
+ * Options controlling how a schema is compiled when it is parsed. Always
+ * initialize these with yobd_schema_opts_init before setting any fields, so
+ * that fields added in the future get sane defaults.
+ */
+struct yobd_schema_opts {
+    /**
+     * The largest PID size, in CAN bytes, for which to precompute a lookup
+     * table holding the parsed value for every possible input. A 1-byte PID
+     * needs 256 floats (1 KiB) and a 2-byte PID needs 65536 floats (256 KiB).
+     * 0 disables lookup tables, and values above 2 are treated as 2.
+     */
+    uint_fast8_t lut_max_bytes;
+    /**
+     * The total memory, in bytes, that lookup tables may use. Tables are
+     * assigned to smaller PIDs first, in mode-PID order, until the budget is
+     * exhausted.
+     */
+    size_t lut_budget;
+    /**
+     * Whether to compile PID expressions to native code. Only expressions that
+     * are not linear in the data bytes are compiled, as linear ones are already
+     * cheap to evaluate. This is ignored if yobd was built without JIT support
+     * or the architecture is not supported (currently, only x86-64 is), in
+     * which case expressions are interpreted.
+     */
+    bool jit;
+    /**
+     * Whether to compile every PID to fixed point at load time, so that
+     * yobd_parse_can_response_fixed can be used. This costs one small record
+     * per PID.
+     */
+    bool fixed_point;
+};
+
+/**
+ * Initializes schema options to their defaults (no lookup tables, no JIT, and
+ * no fixed point).
+ *
+ * @param[out] opts schema options to initialize
+ */
+void yobd_schema_opts_init(struct yobd_schema_opts *opts);
+
 /**
  * Parses a schema, returning a context.
  *
@@ -103,6 +150,59 @@ struct yobd_pid_desc {
  */
 yobd_err yobd_parse_schema(const char *file, struct yobd_ctx **ctx);
 
+/**
+ * Parses a schema with the given options, returning a context.
+ *
+ * @param[in] file a schema file, as in yobd_parse_schema
+ * @param[in] opts schema options, initialized with yobd_schema_opts_init
+ * @param[out] ctx a yobd context, to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_schema_opts(
+    const char *file,
+    const struct yobd_schema_opts *opts,
+    struct yobd_ctx **ctx);
+
+/**
+ * Writes a context out as a compiled schema, which can later be loaded with
+ * yobd_load_compiled_schema much faster than the original schema can be
+ * parsed. A compiled schema is specific to the version of yobd and to the
+ * byte order of the machine that wrote it.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] file the path of the compiled schema to write
+ *
+ * @return an error code
+ */
+yobd_err yobd_save_compiled_schema(struct yobd_ctx *ctx, const char *file);
+
+/**
+ * Loads a compiled schema, as written by yobd_save_compiled_schema, returning
+ * a context. The file is mapped read-only and used in place, so it must not be
+ * modified while the context is in use.
+ *
+ * @param[in] file a compiled schema file, found as in yobd_parse_schema
+ * @param[out] ctx a yobd context, to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_load_compiled_schema(const char *file, struct yobd_ctx **ctx);
+
+/**
+ * Loads a compiled schema with the given options, returning a context.
+ *
+ * @param[in] file a compiled schema file, as in yobd_load_compiled_schema
+ * @param[in] opts schema options, initialized with yobd_schema_opts_init
+ * @param[out] ctx a yobd context, to be filled in
+ *
+ * @return an error code
+ */
+yobd_err yobd_load_compiled_schema_opts(
+    const char *file,
+    const struct yobd_schema_opts *opts,
+    struct yobd_ctx **ctx);
+
 /**
  * Frees a yobd context.
  *
@@ -110,6 +210,39 @@ yobd_err yobd_parse_schema(const char *file, struct yobd_ctx **ctx);
  */
 void yobd_free_ctx(struct yobd_ctx *ctx);
 
+/** The memory used by a yobd context, in bytes. */
+struct yobd_footprint {
+    /** The context itself, including the index of SAE standard PIDs. */
+    size_t ctx;
+    /** PID descriptors, the mode-PID index, names, and bytecode. */
+    size_t arena;
+    /** Lookup tables, if enabled in the schema options. */
+    size_t luts;
+    /** Native code, if the JIT is enabled in the schema options. */
+    size_t jit;
+    /** Fixed-point records, if enabled in the schema options. */
+    size_t fixed;
+    /**
+     * The compiled schema file, if the context was loaded from one. This is
+     * mapped read-only, so it is shared with the page cache.
+     */
+    size_t mapped;
+    /** The sum of all of the above. */
+    size_t total;
+};
+
+/**
+ * Gets the memory footprint of a context.
+ *
+ * @param[in] ctx a yobd context
+ * @param[out] footprint filled in with the memory used by the context
+ *
+ * @return an error code
+ */
+yobd_err yobd_get_footprint(
+    struct yobd_ctx *ctx,
+    struct yobd_footprint *footprint);
+
 /**
  * Gets the number of PIDs known to this context.
  *
@@ -124,8 +257,8 @@ yobd_err yobd_get_pid_count(struct yobd_ctx *ctx, size_t *count);
  * Gets the descriptor corresponding to the given mode and PID, containing
  * information about how to interpret the bitpacked data for this PID.
  *
- * Note that this call is relatively cheap (it amounts to a hash table lookup),
- * so it is OK for callers to call it for every incoming CAN frame. In other
+ * Note that this call is relatively cheap (it amounts to a table lookup), so
+ * it is OK for callers to call it for every incoming CAN frame. In other
  * words, there is no need to separately cache PID descriptors, and the caller
  * should just look them up on-demand.
  *
@@ -217,9 +350,10 @@ yobd_err yobd_make_can_query_noctx(
  * @param[in] pid an OBD II PID
  * @param[in] data the data payload for the CAN frame
  * @param[in] data_size the size of the data payload (must be between 1 and 5 by
- *                      the OBD II spec). This is specified so that yobd does
- *                      not have to know about the mode-pid in its schema or
- *                      incur the overhead of a schema lookup.
+ *                      the OBD II spec for standard modes, or between 1 and 4
+ *                      for manufacturer modes). This is specified so that yobd
+ *                      does not have to know about the mode-pid in its schema
+ *                      or incur the overhead of a schema lookup.
  * @param[out] frame the CAN frame to be filled in
  *
  * @return an error code
@@ -241,9 +375,10 @@ yobd_err yobd_make_can_response(
  * @param[in] pid an OBD II PID
  * @param[in] data the data payload for the CAN frame
  * @param[in] data_size the size of the data payload (must be between 1 and 5 by
- *                      the OBD II spec). This is specified so that yobd does
- *                      not have to know about the mode-pid in its schema or
- *                      incur the overhead of a schema lookup.
+ *                      the OBD II spec for standard modes, or between 1 and 4
+ *                      for manufacturer modes). This is specified so that yobd
+ *                      does not have to know about the mode-pid in its schema
+ *                      or incur the overhead of a schema lookup.
  * @param[out] frame the CAN frame to be filled in
  *
  * @return an error code
@@ -302,6 +437,89 @@ yobd_err yobd_parse_can_response(
     const struct can_frame *frame,
     float *val);
 
+/**
+ * Interprets the OBD II payload of a response to a single-PID query, as
+ * reassembled from one or more CAN frames. The payload starts with the
+ * response mode and does not include any ISO-TP header.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] payload the payload
+ * @param[in] size the payload size
+ * @param[out] mode filled in with the query mode
+ * @param[out] pid filled in with the PID
+ * @param[out] val a float value in SI units
+ *
+ * @return an error code
+ */
+yobd_err yobd_parse_response_payload(
+    struct yobd_ctx *ctx,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pid,
+    float *val);
+
+/**
+ * Interprets a CAN response in fixed point, without floating-point arithmetic
+ * for most PIDs. The value in SI units is val * 2^-frac_bits. frac_bits is
+ * fixed per PID at load time and chosen so that every possible value fits in
+ * val, so it only needs to be read once per PID. It may be negative for PIDs
+ * with very large ranges.
+ *
+ * PIDs that pass through a float, and float expressions that are not linear
+ * in the data bytes, are still evaluated in floating point and then scaled,
+ * saturating values that do not fit. Where such a PID's range cannot be
+ * bounded at load time, as for float passthroughs and expressions that might
+ * divide by zero, frac_bits is 8: values keep a resolution of 1/256 but
+ * saturate beyond 2^23 in magnitude.
+ *
+ * @param[in] ctx a yobd context created with the fixed_point schema option
+ * @param[in] frame a CAN frame to be interpreted
+ * @param[out] val the value in SI units, scaled by 2^frac_bits
+ * @param[out] frac_bits the number of fraction bits in val
+ *
+ * @return an error code. YOBD_INVALID_PARAMETER is returned if the context
+ *         was created without the fixed_point option.
+ */
+yobd_err yobd_parse_can_response_fixed(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frame,
+    int32_t *val,
+    int8_t *frac_bits);
+
+/**
+ * Interprets an array of CAN frames, as if calling yobd_parse_can_response on
+ * each one. This is cheaper than calling yobd_parse_can_response in a loop, as
+ * argument checking happens once per call, and runs of frames for the same
+ * mode-PID share a single PID lookup.
+ *
+ * @param[in] ctx a yobd context
+ * @param[in] frames an array of CAN frames to be interpreted
+ * @param[in] count the number of frames in the frames array
+ * @param[out] vals an array of count floats, filled in with the value of each
+ *                  frame in SI units. Entries for frames that failed to parse
+ *                  are left untouched.
+ * @param[out] errs an array of count error codes, filled in with the result of
+ *                  parsing each frame
+ * @param[out] modes an array of count modes, filled in with the mode of each
+ *                   frame, or NULL if not needed. Entries are valid only if the
+ *                   corresponding error code is YOBD_OK.
+ * @param[out] pids an array of count PIDs, filled in with the PID of each
+ *                  frame, or NULL if not needed. Entries are valid only if the
+ *                  corresponding error code is YOBD_OK.
+ *
+ * @return an error code. Note that YOBD_OK means only that the arguments were
+ *         valid; per-frame results are reported through errs.
+ */
+yobd_err yobd_parse_can_responses(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs,
+    yobd_mode *modes,
+    yobd_pid *pids);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1235 @@
+/**
+ * @file      sim.c
+ * @brief     Simulated ECUs answering OBD II queries, for testing and load
+ *            testing.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/can.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <yobd/multi.h>
+#include <yobd/sim.h>
+#include <yobd/supported.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+#define NS_PER_S (1000000000ULL)
+#define NS_PER_US (1000ULL)
+#define NS_PER_MS (1000000ULL)
+
+/* The period of the ramp every PID starts out with. */
+#define DEFAULT_RAMP_PERIOD (10*NS_PER_S)
+
+/* The most data bytes a PID has, in an SAE standard mode. */
+#define MAX_DATA_BYTES (5)
+
+/* The size of a "PIDs supported" bitmap. */
+#define BITMAP_BYTES (4)
+
+/* Flow control comes to an ECU's request ID, below its response ID. */
+#define FLOW_CONTROL_BASE \
+    (YOBD_OBD_II_RESPONSE_BASE - ISOTP_FLOW_CONTROL_OFFSET)
+
+/* The frames yobd_sim_pump moves per system call. */
+#define PUMP_BATCH (64)
+
+/* How long yobd_sim_pump waits before retrying a socket that is full. */
+#define PUMP_RETRY (100*NS_PER_US)
+
+/* A response recorded in a log, at a time relative to the log's start. */
+struct replay_sample {
+    uint64_t time;
+    unsigned char data[MAX_DATA_BYTES];
+};
+
+struct sim_pid {
+    /* The mode in the high 16 bits and the PID in the low, for sorting. */
+    uint32_t key;
+    yobd_mode mode;
+    yobd_pid pid;
+    uint8_t can_bytes;
+    /* The ECUs that answer for the PID, one bit each. */
+    uint8_t ecus;
+    struct yobd_sim_gen gen;
+    struct replay_sample *samples;
+    size_t sample_count;
+    size_t sample_capacity;
+};
+
+/* A frame waiting to be sent. seq keeps frames due together in order. */
+struct sim_out {
+    uint64_t due;
+    uint64_t seq;
+    struct can_frame frame;
+};
+
+struct sim_ecu {
+    struct yobd_sim_ecu_opts opts;
+    /* The consecutive frames of a long response, waiting for flow control. */
+    struct can_frame rest[YOBD_MAX_MULTI_FRAMES];
+    size_t rest_count;
+};
+
+struct yobd_sim {
+    struct yobd_ctx *ctx;
+    uint64_t rand_state;
+    /* Every PID in the schema, sorted by key. */
+    struct sim_pid *pids;
+    size_t pid_count;
+    struct sim_ecu ecus[YOBD_SIM_MAX_ECUS];
+    size_t ecu_count;
+    /* A min-heap of frames waiting to be sent, by due time then seq. */
+    struct sim_out *out;
+    size_t out_count;
+    size_t out_capacity;
+    uint64_t seq;
+    /* Generators run on time since the first frame received. */
+    bool started;
+    uint64_t start;
+    /* The length of the longest loaded log, over which replays repeat. */
+    uint64_t replay_length;
+    struct yobd_sim_stats stats;
+    /* Buffers for yobd_sim_pump, set up once. */
+    struct mmsghdr msgs[PUMP_BATCH];
+    struct iovec iovs[PUMP_BATCH];
+    struct can_frame frames[PUMP_BATCH];
+    struct sim_out sending[PUMP_BATCH];
+};
+
+static inline
+uint32_t get_key(yobd_mode mode, yobd_pid pid)
+{
+    return ((uint32_t) mode << 16) | pid;
+}
+
+/* xorshift64, which is plenty for jitter and drops. */
+static
+uint64_t next_rand(struct yobd_sim *sim)
+{
+    sim->rand_state ^= sim->rand_state << 13;
+    sim->rand_state ^= sim->rand_state >> 7;
+    sim->rand_state ^= sim->rand_state << 17;
+
+    return sim->rand_state;
+}
+
+static
+int compare_pids(const void *a, const void *b)
+{
+    const struct sim_pid *pa;
+    const struct sim_pid *pb;
+
+    pa = a;
+    pb = b;
+    if (pa->key != pb->key) {
+        return pa->key < pb->key ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static
+struct sim_pid *find_pid(struct yobd_sim *sim, yobd_mode mode, yobd_pid pid)
+{
+    struct sim_pid key;
+
+    key.key = get_key(mode, pid);
+
+    return bsearch(
+        &key,
+        sim->pids,
+        sim->pid_count,
+        sizeof(*sim->pids),
+        compare_pids);
+}
+
+/* Returns the largest raw value a PID's data bytes hold. */
+static inline
+double raw_max(const struct sim_pid *pid)
+{
+    return ldexp(1.0, 8*pid->can_bytes) - 1;
+}
+
+static
+bool add_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct sim_pid *sim_pid;
+    struct yobd_sim *sim;
+
+    sim = data;
+    sim_pid = &sim->pids[sim->pid_count];
+    memset(sim_pid, 0, sizeof(*sim_pid));
+    sim_pid->key = get_key(mode, pid);
+    sim_pid->mode = mode;
+    sim_pid->pid = pid;
+    sim_pid->can_bytes = desc->can_bytes;
+    sim_pid->gen.type = YOBD_SIM_RAMP;
+    sim_pid->gen.value = 0;
+    sim_pid->gen.rate = raw_max(sim_pid) * NS_PER_S / DEFAULT_RAMP_PERIOD;
+    sim_pid->gen.period = DEFAULT_RAMP_PERIOD;
+    ++sim->pid_count;
+
+    return false;
+}
+
+PUBLIC_API
+void yobd_sim_ecu_opts_init(struct yobd_sim_ecu_opts *opts)
+{
+    opts->latency = 5*NS_PER_MS;
+    opts->jitter = 0;
+    opts->drop_ppm = 0;
+    opts->all_pids = true;
+}
+
+PUBLIC_API
+yobd_err yobd_new_sim(
+    struct yobd_ctx *ctx,
+    uint64_t seed,
+    struct yobd_sim **out_sim)
+{
+    size_t count;
+    yobd_err err;
+    size_t i;
+    struct msghdr *hdr;
+    struct yobd_sim *sim;
+
+    if (ctx == NULL || out_sim == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = yobd_get_pid_count(ctx, &count);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    sim = calloc(1, sizeof(*sim));
+    if (sim == NULL) {
+        goto error_sim_calloc;
+    }
+    sim->ctx = ctx;
+    /* xorshift never leaves 0, so avoid it. */
+    sim->rand_state = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+
+    sim->pids = malloc(count * sizeof(*sim->pids));
+    if (sim->pids == NULL && count > 0) {
+        goto error_pids_malloc;
+    }
+    err = yobd_pid_foreach(ctx, add_pid, sim);
+    if (err != YOBD_OK) {
+        goto error_foreach;
+    }
+    qsort(sim->pids, sim->pid_count, sizeof(*sim->pids), compare_pids);
+
+    for (i = 0; i < PUMP_BATCH; ++i) {
+        sim->iovs[i].iov_base = &sim->frames[i];
+        sim->iovs[i].iov_len = sizeof(sim->frames[i]);
+        hdr = &sim->msgs[i].msg_hdr;
+        hdr->msg_iov = &sim->iovs[i];
+        hdr->msg_iovlen = 1;
+    }
+
+    *out_sim = sim;
+
+    return YOBD_OK;
+
+error_foreach:
+    free(sim->pids);
+    free(sim);
+    return err;
+error_pids_malloc:
+    free(sim);
+error_sim_calloc:
+    return YOBD_OOM;
+}
+
+PUBLIC_API
+void yobd_free_sim(struct yobd_sim *sim)
+{
+    size_t i;
+
+    if (sim == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sim->pid_count; ++i) {
+        free(sim->pids[i].samples);
+    }
+    free(sim->pids);
+    free(sim->out);
+    free(sim);
+}
+
+PUBLIC_API
+yobd_err yobd_sim_add_ecu(
+    struct yobd_sim *sim,
+    const struct yobd_sim_ecu_opts *opts,
+    size_t *ecu)
+{
+    size_t i;
+
+    if (sim == NULL || opts == NULL || ecu == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (sim->ecu_count == YOBD_SIM_MAX_ECUS) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *ecu = sim->ecu_count;
+    sim->ecus[*ecu].opts = *opts;
+    sim->ecus[*ecu].rest_count = 0;
+    if (opts->all_pids) {
+        for (i = 0; i < sim->pid_count; ++i) {
+            sim->pids[i].ecus |= 1 << *ecu;
+        }
+    }
+    ++sim->ecu_count;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_set_supported(
+    struct yobd_sim *sim,
+    size_t ecu,
+    yobd_mode mode,
+    yobd_pid pid,
+    bool supported)
+{
+    struct sim_pid *sim_pid;
+
+    if (sim == NULL || ecu >= sim->ecu_count) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    sim_pid = find_pid(sim, mode, pid);
+    if (sim_pid == NULL) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+
+    if (supported) {
+        sim_pid->ecus |= 1 << ecu;
+    }
+    else {
+        sim_pid->ecus &= ~(1 << ecu);
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_set_gen(
+    struct yobd_sim *sim,
+    yobd_mode mode,
+    yobd_pid pid,
+    const struct yobd_sim_gen *gen)
+{
+    struct sim_pid *sim_pid;
+
+    if (sim == NULL || gen == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (gen->type != YOBD_SIM_CONSTANT && gen->type != YOBD_SIM_RAMP &&
+        gen->type != YOBD_SIM_SINE) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (gen->type == YOBD_SIM_SINE && gen->period == 0) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    sim_pid = find_pid(sim, mode, pid);
+    if (sim_pid == NULL) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+    sim_pid->gen = *gen;
+
+    return YOBD_OK;
+}
+
+static
+yobd_err add_sample(
+    struct sim_pid *sim_pid,
+    uint64_t time,
+    const unsigned char *data)
+{
+    size_t capacity;
+    struct replay_sample *samples;
+
+    if (sim_pid->sample_count == sim_pid->sample_capacity) {
+        capacity = sim_pid->sample_capacity == 0 ?
+            64 :
+            2*sim_pid->sample_capacity;
+        samples = realloc(sim_pid->samples, capacity * sizeof(*samples));
+        if (samples == NULL) {
+            return YOBD_OOM;
+        }
+        sim_pid->samples = samples;
+        sim_pid->sample_capacity = capacity;
+    }
+
+    samples = &sim_pid->samples[sim_pid->sample_count];
+    samples->time = time;
+    memset(samples->data, 0, sizeof(samples->data));
+    memcpy(samples->data, data, sim_pid->can_bytes);
+    ++sim_pid->sample_count;
+
+    return YOBD_OK;
+}
+
+/*
+ * Parses one candump log line, such as "(1436509052.249713) vcan0
+ * 7E8#04410C1AF8". Returns false if the line is not in that format.
+ */
+static
+bool parse_log_line(const char *line, uint64_t *time, struct can_frame *frame)
+{
+    unsigned int byte;
+    char data[2*CAN_MAX_DLEN + 1];
+    unsigned int id;
+    size_t len;
+    size_t i;
+    unsigned long nsec;
+    char nsec_str[10];
+    unsigned long sec;
+
+    if (sscanf(line, " (%lu.%9[0-9]) %*s %x#%16[0-9a-fA-F]",
+               &sec, nsec_str, &id, data) != 4) {
+        return false;
+    }
+
+    /* Scale the fraction to nanoseconds, whatever its number of digits. */
+    nsec = strtoul(nsec_str, NULL, 10);
+    for (len = strlen(nsec_str); len < 9; ++len) {
+        nsec *= 10;
+    }
+    *time = (uint64_t) sec * NS_PER_S + nsec;
+
+    len = strlen(data);
+    if (len % 2 != 0) {
+        return false;
+    }
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = id;
+    frame->can_dlc = len / 2;
+    for (i = 0; i < frame->can_dlc; ++i) {
+        if (sscanf(&data[2*i], "%2x", &byte) != 1) {
+            return false;
+        }
+        frame->data[i] = byte;
+    }
+
+    return true;
+}
+
+static
+int compare_samples(const void *a, const void *b)
+{
+    const struct replay_sample *sa;
+    const struct replay_sample *sb;
+
+    sa = a;
+    sb = b;
+    if (sa->time != sb->time) {
+        return sa->time < sb->time ? -1 : 1;
+    }
+
+    return 0;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_load_replay(
+    struct yobd_sim *sim,
+    const char *file,
+    size_t *count)
+{
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    FILE *f;
+    bool first;
+    uint64_t first_time;
+    struct can_frame frame;
+    size_t i;
+    uint64_t last_time;
+    char line[256];
+    yobd_mode mode;
+    yobd_pid pid;
+    struct sim_pid *sim_pid;
+    uint64_t time;
+
+    if (sim == NULL || file == NULL || count == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    f = fopen(file, "r");
+    if (f == NULL) {
+        return YOBD_CANNOT_OPEN_FILE;
+    }
+
+    *count = 0;
+    first = true;
+    first_time = 0;
+    last_time = 0;
+    err = YOBD_OK;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (!parse_log_line(line, &time, &frame)) {
+            err = YOBD_PARSE_FAIL;
+            goto out;
+        }
+        if (first) {
+            first_time = time;
+            first = false;
+        }
+        if (time > last_time) {
+            last_time = time;
+        }
+
+        /* Keep single-frame responses to mode-PIDs the schema has. */
+        if (frame.can_dlc != OBD_II_DLC || frame.data[0] > ISOTP_SINGLE_MAX) {
+            continue;
+        }
+        if (yobd_parse_can_headers(sim->ctx, &frame, &mode, &pid) != YOBD_OK ||
+            frame.can_id == YOBD_OBD_II_QUERY_ADDRESS) {
+            continue;
+        }
+        sim_pid = find_pid(sim, mode, pid);
+        if (sim_pid == NULL ||
+            yobd_get_pid_descriptor(sim->ctx, mode, pid, &desc) != YOBD_OK ||
+            frame.data[0] != mode_data_offset(mode) + desc->can_bytes) {
+            continue;
+        }
+
+        err = add_sample(
+            sim_pid,
+            time - first_time,
+            &frame.data[1 + mode_data_offset(mode)]);
+        if (err != YOBD_OK) {
+            goto out;
+        }
+        sim_pid->gen.type = YOBD_SIM_REPLAY;
+        ++*count;
+    }
+
+    if (last_time - first_time > sim->replay_length) {
+        sim->replay_length = last_time - first_time;
+    }
+    for (i = 0; i < sim->pid_count; ++i) {
+        if (sim->pids[i].sample_count == 0) {
+            continue;
+        }
+        qsort(
+            sim->pids[i].samples,
+            sim->pids[i].sample_count,
+            sizeof(*sim->pids[i].samples),
+            compare_samples);
+    }
+
+out:
+    fclose(f);
+
+    return err;
+}
+
+/* Returns the replayed sample for a time since the simulation started. */
+static
+const struct replay_sample *find_sample(
+    const struct yobd_sim *sim,
+    const struct sim_pid *sim_pid,
+    uint64_t elapsed)
+{
+    size_t hi;
+    size_t lo;
+    size_t mid;
+    uint64_t t;
+
+    t = sim->replay_length > 0 ? elapsed % sim->replay_length : 0;
+
+    /* Find the last sample at or before t, or the first if there is none. */
+    lo = 0;
+    hi = sim_pid->sample_count;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (sim_pid->samples[mid].time <= t) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return &sim_pid->samples[lo];
+}
+
+/* Fills in a PID's data bytes as its generator has them at a given time. */
+static
+void generate(
+    const struct yobd_sim *sim,
+    const struct sim_pid *sim_pid,
+    uint64_t now,
+    unsigned char *data)
+{
+    uint64_t elapsed;
+    const struct yobd_sim_gen *gen;
+    size_t i;
+    double max;
+    uint64_t raw;
+    double t;
+    double val;
+
+    elapsed = now - sim->start;
+    gen = &sim_pid->gen;
+    switch (gen->type) {
+        case YOBD_SIM_REPLAY:
+            memcpy(
+                data,
+                find_sample(sim, sim_pid, elapsed)->data,
+                sim_pid->can_bytes);
+            return;
+        case YOBD_SIM_RAMP:
+            if (gen->period > 0) {
+                elapsed %= gen->period;
+            }
+            val = gen->value + gen->rate * ((double) elapsed / NS_PER_S);
+            break;
+        case YOBD_SIM_SINE:
+            t = (double) (elapsed % gen->period) / gen->period;
+            val = gen->value + gen->amplitude * sin(2 * M_PI * t);
+            break;
+        case YOBD_SIM_CONSTANT:
+        default:
+            val = gen->value;
+            break;
+    }
+
+    max = raw_max(sim_pid);
+    if (!(val > 0)) {
+        val = 0;
+    }
+    else if (val > max) {
+        val = max;
+    }
+    raw = (uint64_t) (val + 0.5);
+
+    for (i = 0; i < sim_pid->can_bytes; ++i) {
+        data[i] = raw >> (8 * (sim_pid->can_bytes - 1 - i));
+    }
+}
+
+/* Adds a frame to the heap of frames waiting to be sent. */
+static
+yobd_err push_out(
+    struct yobd_sim *sim,
+    uint64_t due,
+    uint64_t seq,
+    const struct can_frame *frame)
+{
+    size_t capacity;
+    size_t i;
+    struct sim_out *out;
+    size_t parent;
+
+    if (sim->out_count == sim->out_capacity) {
+        capacity = sim->out_capacity == 0 ? 64 : 2*sim->out_capacity;
+        out = realloc(sim->out, capacity * sizeof(*out));
+        if (out == NULL) {
+            return YOBD_OOM;
+        }
+        sim->out = out;
+        sim->out_capacity = capacity;
+    }
+
+    out = sim->out;
+    i = sim->out_count;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (out[parent].due < due ||
+            (out[parent].due == due && out[parent].seq < seq)) {
+            break;
+        }
+        out[i] = out[parent];
+        i = parent;
+    }
+    out[i].due = due;
+    out[i].seq = seq;
+    out[i].frame = *frame;
+    ++sim->out_count;
+
+    return YOBD_OK;
+}
+
+static inline
+bool out_before(const struct sim_out *a, const struct sim_out *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+/* Removes the earliest frame from the heap. */
+static
+void pop_out(struct yobd_sim *sim, struct sim_out *first)
+{
+    size_t child;
+    size_t i;
+    struct sim_out *out;
+    struct sim_out last;
+
+    out = sim->out;
+    *first = out[0];
+    --sim->out_count;
+    last = out[sim->out_count];
+
+    i = 0;
+    for (;;) {
+        child = 2*i + 1;
+        if (child >= sim->out_count) {
+            break;
+        }
+        if (child + 1 < sim->out_count &&
+            out_before(&out[child+1], &out[child])) {
+            ++child;
+        }
+        if (!out_before(&out[child], &last)) {
+            break;
+        }
+        out[i] = out[child];
+        i = child;
+    }
+    out[i] = last;
+}
+
+/* Returns an ECU's delay for its next response, or false to drop it. */
+static
+bool roll_delay(struct yobd_sim *sim, size_t ecu, uint64_t *delay)
+{
+    const struct yobd_sim_ecu_opts *opts;
+
+    opts = &sim->ecus[ecu].opts;
+    if (opts->drop_ppm > 0 && next_rand(sim) % 1000000 < opts->drop_ppm) {
+        ++sim->stats.dropped;
+        return false;
+    }
+
+    *delay = opts->latency;
+    if (opts->jitter > 0) {
+        *delay += next_rand(sim) % (opts->jitter + 1);
+    }
+
+    return true;
+}
+
+/*
+ * Appends an ECU's "PIDs supported" bitmap for PIDs base+1 through base+0x20
+ * of a mode. Returns false if the ECU would not answer for the bitmap, which
+ * is when it supports nothing from base on. Mode 1 PID 0x00 is always
+ * answered, as J1979 requires.
+ */
+static
+bool make_bitmap(
+    const struct yobd_sim *sim,
+    size_t ecu,
+    yobd_mode mode,
+    yobd_pid base,
+    unsigned char *data)
+{
+    bool any;
+    size_t i;
+    yobd_pid pid;
+    const struct sim_pid *sim_pid;
+
+    memset(data, 0, BITMAP_BYTES);
+    any = mode == 0x1 && base == 0;
+    for (i = 0; i < sim->pid_count; ++i) {
+        sim_pid = &sim->pids[i];
+        if (sim_pid->mode != mode || sim_pid->pid < base ||
+            !(sim_pid->ecus & (1 << ecu))) {
+            continue;
+        }
+        any = true;
+
+        /* Anything past the bitmap sets its last bit. */
+        pid = sim_pid->pid;
+        if (pid > base + YOBD_SUPPORTED_PIDS_STRIDE) {
+            pid = base + YOBD_SUPPORTED_PIDS_STRIDE;
+        }
+        if (pid > base) {
+            data[(pid - base - 1) / 8] |= 0x80 >> ((pid - base - 1) % 8);
+        }
+    }
+
+    return any;
+}
+
+/*
+ * Builds the frames of one ECU's response to an SAE standard query for some
+ * PIDs, setting count to 0 if the ECU has nothing to say.
+ */
+static
+yobd_err make_response(
+    struct yobd_sim *sim,
+    size_t ecu,
+    yobd_mode mode,
+    const unsigned char *query_pids,
+    size_t query_count,
+    uint64_t now,
+    struct can_frame *frames,
+    size_t *count)
+{
+    unsigned char data[YOBD_MAX_MULTI_PIDS * MAX_DATA_BYTES];
+    yobd_err err;
+    size_t i;
+    size_t pid_count;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    size_t size;
+    struct sim_pid *sim_pid;
+
+    pid_count = 0;
+    size = 0;
+    for (i = 0; i < query_count; ++i) {
+        /* "PIDs supported" answers follow the ECU, whatever the schema says. */
+        if ((mode == 0x1 || mode == 0x9) &&
+            query_pids[i] % YOBD_SUPPORTED_PIDS_STRIDE == 0) {
+            if (make_bitmap(sim, ecu, mode, query_pids[i], &data[size])) {
+                pids[pid_count] = query_pids[i];
+                ++pid_count;
+                size += BITMAP_BYTES;
+            }
+            continue;
+        }
+
+        sim_pid = find_pid(sim, mode, query_pids[i]);
+        if (sim_pid == NULL || !(sim_pid->ecus & (1 << ecu))) {
+            continue;
+        }
+        pids[pid_count] = query_pids[i];
+        ++pid_count;
+        generate(sim, sim_pid, now, &data[size]);
+        size += sim_pid->can_bytes;
+    }
+
+    *count = 0;
+    if (pid_count == 0) {
+        return YOBD_OK;
+    }
+
+    memset(frames, 0, YOBD_MAX_MULTI_FRAMES * sizeof(*frames));
+    if (pid_count == 1) {
+        err = yobd_make_can_response(
+            sim->ctx,
+            mode,
+            pids[0],
+            data,
+            size,
+            &frames[0]);
+        *count = 1;
+    }
+    else {
+        err = yobd_make_can_multi_response(
+            sim->ctx,
+            mode,
+            pids,
+            pid_count,
+            data,
+            frames,
+            YOBD_MAX_MULTI_FRAMES,
+            count);
+    }
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    for (i = 0; i < *count; ++i) {
+        frames[i].can_id = YOBD_OBD_II_RESPONSE_BASE + ecu;
+    }
+
+    return YOBD_OK;
+}
+
+/* Schedules one ECU's answer to a query, holding back long responses. */
+static
+yobd_err answer(
+    struct yobd_sim *sim,
+    size_t ecu,
+    const struct can_frame *frames,
+    size_t count,
+    uint64_t now)
+{
+    uint64_t delay;
+    yobd_err err;
+    struct sim_ecu *sim_ecu;
+
+    if (!roll_delay(sim, ecu, &delay)) {
+        return YOBD_OK;
+    }
+
+    err = push_out(sim, now + delay, sim->seq++, &frames[0]);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    /* A new long response replaces any that was still waiting. */
+    sim_ecu = &sim->ecus[ecu];
+    sim_ecu->rest_count = count - 1;
+    memcpy(sim_ecu->rest, &frames[1], (count - 1) * sizeof(*frames));
+
+    return YOBD_OK;
+}
+
+static
+yobd_err handle_query(
+    struct yobd_sim *sim,
+    const struct can_frame *frame,
+    uint64_t now)
+{
+    size_t count;
+    size_t ecu;
+    yobd_err err;
+    struct can_frame frames[YOBD_MAX_MULTI_FRAMES];
+    unsigned char data[MAX_DATA_BYTES];
+    yobd_mode mode;
+    yobd_pid pid;
+    size_t size;
+    struct sim_pid *sim_pid;
+
+    size = frame->data[0];
+    mode = frame->data[1];
+    if (frame->can_dlc != OBD_II_DLC || size < 2 || size > ISOTP_SINGLE_MAX) {
+        ++sim->stats.ignored;
+        return YOBD_OK;
+    }
+
+    if (mode_is_sae_standard(mode)) {
+        /* SAE standard modes may ask for up to 6 PIDs at once. */
+        sim->stats.queries += size - 1;
+        for (ecu = 0; ecu < sim->ecu_count; ++ecu) {
+            err = make_response(
+                sim,
+                ecu,
+                mode,
+                &frame->data[2],
+                size - 1,
+                now,
+                frames,
+                &count);
+            if (err != YOBD_OK) {
+                return err;
+            }
+            if (count == 0) {
+                continue;
+            }
+            err = answer(sim, ecu, frames, count, now);
+            if (err != YOBD_OK) {
+                return err;
+            }
+        }
+        return YOBD_OK;
+    }
+
+    /* Manufacturer modes ask for one PID, in the schema's byte order. */
+    err = yobd_parse_can_headers(sim->ctx, frame, &mode, &pid);
+    sim_pid = err == YOBD_OK ? find_pid(sim, mode, pid) : NULL;
+    if (sim_pid == NULL) {
+        ++sim->stats.ignored;
+        return YOBD_OK;
+    }
+    ++sim->stats.queries;
+    for (ecu = 0; ecu < sim->ecu_count; ++ecu) {
+        if (!(sim_pid->ecus & (1 << ecu))) {
+            continue;
+        }
+        generate(sim, sim_pid, now, data);
+        memset(&frames[0], 0, sizeof(frames[0]));
+        err = yobd_make_can_response(
+            sim->ctx,
+            mode,
+            pid,
+            data,
+            sim_pid->can_bytes,
+            &frames[0]);
+        if (err != YOBD_OK) {
+            return err;
+        }
+        frames[0].can_id = YOBD_OBD_II_RESPONSE_BASE + ecu;
+        err = answer(sim, ecu, frames, 1, now);
+        if (err != YOBD_OK) {
+            return err;
+        }
+    }
+
+    return YOBD_OK;
+}
+
+/* Returns the separation a flow control frame asks for between frames. */
+static
+uint64_t get_separation(uint8_t st_min)
+{
+    if (st_min <= 0x7f) {
+        return st_min * NS_PER_MS;
+    }
+    if (st_min >= 0xf1 && st_min <= 0xf9) {
+        return (st_min - 0xf0) * 100 * NS_PER_US;
+    }
+
+    /* Reserved values mean the longest separation. */
+    return 0x7f * NS_PER_MS;
+}
+
+static
+yobd_err handle_flow_control(
+    struct yobd_sim *sim,
+    const struct can_frame *frame,
+    uint64_t now)
+{
+    size_t ecu;
+    yobd_err err;
+    size_t i;
+    uint64_t separation;
+    struct sim_ecu *sim_ecu;
+
+    ecu = frame->can_id - FLOW_CONTROL_BASE;
+    if (ecu >= sim->ecu_count || frame->can_dlc < 3 ||
+        isotp_get_type(frame) != ISOTP_FLOW_CONTROL) {
+        ++sim->stats.ignored;
+        return YOBD_OK;
+    }
+
+    /* Wait means more flow control is coming, and overflow ends the message. */
+    sim_ecu = &sim->ecus[ecu];
+    switch (frame->data[0] & 0xf) {
+        case ISOTP_FLOW_CONTINUE:
+            break;
+        case ISOTP_FLOW_WAIT:
+            return YOBD_OK;
+        default:
+            sim_ecu->rest_count = 0;
+            return YOBD_OK;
+    }
+
+    /* Blocks are not simulated: one flow control releases everything. */
+    separation = get_separation(frame->data[2]);
+    for (i = 0; i < sim_ecu->rest_count; ++i) {
+        err = push_out(
+            sim,
+            now + (i + 1) * separation,
+            sim->seq++,
+            &sim_ecu->rest[i]);
+        if (err != YOBD_OK) {
+            return err;
+        }
+    }
+    sim_ecu->rest_count = 0;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_push(
+    struct yobd_sim *sim,
+    const struct can_frame *frame,
+    uint64_t now)
+{
+    if (sim == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (!sim->started) {
+        sim->start = now;
+        sim->started = true;
+    }
+    if (now < sim->start) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (frame->can_id == YOBD_OBD_II_QUERY_ADDRESS) {
+        return handle_query(sim, frame, now);
+    }
+    if (frame->can_id >= FLOW_CONTROL_BASE &&
+        frame->can_id < YOBD_OBD_II_RESPONSE_BASE) {
+        return handle_flow_control(sim, frame, now);
+    }
+
+    ++sim->stats.ignored;
+
+    return YOBD_OK;
+}
+
+/* Returns when to call again, given the frames still waiting. */
+static
+uint64_t get_wake(const struct yobd_sim *sim, uint64_t now)
+{
+    if (sim->out_count == 0) {
+        return UINT64_MAX;
+    }
+    if (sim->out[0].due < now) {
+        return now;
+    }
+
+    return sim->out[0].due;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_next(
+    struct yobd_sim *sim,
+    uint64_t now,
+    struct can_frame *frames,
+    size_t max,
+    size_t *count,
+    uint64_t *wake)
+{
+    struct sim_out out;
+
+    if (sim == NULL || (frames == NULL && max > 0) || count == NULL ||
+        wake == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *count = 0;
+    while (*count < max && sim->out_count > 0 && sim->out[0].due <= now) {
+        pop_out(sim, &out);
+        frames[*count] = out.frame;
+        ++*count;
+    }
+    sim->stats.frames += *count;
+    *wake = get_wake(sim, now);
+
+    return YOBD_OK;
+}
+
+/* Receives and pushes every frame queued on a socket. */
+static
+yobd_err pump_recv(struct yobd_sim *sim, int fd, uint64_t now)
+{
+    yobd_err err;
+    int i;
+    int ret;
+
+    do {
+        ret = recvmmsg(fd, sim->msgs, PUMP_BATCH, MSG_DONTWAIT, NULL);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return YOBD_OK;
+            }
+            return errno;
+        }
+
+        for (i = 0; i < ret; ++i) {
+            if (sim->msgs[i].msg_len != sizeof(struct can_frame)) {
+                ++sim->stats.ignored;
+                continue;
+            }
+            err = yobd_sim_push(sim, &sim->frames[i], now);
+            if (err != YOBD_OK) {
+                return err;
+            }
+        }
+    } while (ret == PUMP_BATCH);
+
+    return YOBD_OK;
+}
+
+/*
+ * Sends the frames that are due, returning through full whether the socket
+ * filled up before they were all sent.
+ */
+static
+yobd_err pump_send(struct yobd_sim *sim, int fd, uint64_t now, bool *full)
+{
+    size_t count;
+    size_t i;
+    int ret;
+    int saved;
+
+    *full = false;
+    for (;;) {
+        count = 0;
+        while (count < PUMP_BATCH && sim->out_count > 0 &&
+               sim->out[0].due <= now) {
+            pop_out(sim, &sim->sending[count]);
+            sim->frames[count] = sim->sending[count].frame;
+            ++count;
+        }
+        if (count == 0) {
+            return YOBD_OK;
+        }
+
+        ret = sendmmsg(fd, sim->msgs, count, MSG_DONTWAIT);
+        saved = errno;
+        if (ret == -1) {
+            ret = 0;
+        }
+        sim->stats.frames += ret;
+
+        /* Keep what did not go out, in order, for next time. */
+        for (i = ret; i < count; ++i) {
+            push_out(
+                sim,
+                sim->sending[i].due,
+                sim->sending[i].seq,
+                &sim->sending[i].frame);
+        }
+        if ((size_t) ret < count) {
+            if (ret > 0 || saved == EAGAIN || saved == EWOULDBLOCK ||
+                saved == ENOBUFS) {
+                *full = true;
+                return YOBD_OK;
+            }
+            return saved;
+        }
+    }
+}
+
+PUBLIC_API
+yobd_err yobd_sim_pump(
+    struct yobd_sim *sim,
+    int fd,
+    uint64_t now,
+    uint64_t *wake)
+{
+    yobd_err err;
+    bool full;
+
+    if (sim == NULL || wake == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = pump_recv(sim, fd, now);
+    if (err != YOBD_OK) {
+        return err;
+    }
+    err = pump_send(sim, fd, now, &full);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    *wake = full ? now + PUMP_RETRY : get_wake(sim, now);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_sim_get_stats(
+    struct yobd_sim *sim,
+    struct yobd_sim_stats *stats)
+{
+    if (sim == NULL || stats == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *stats = sim->stats;
+
+    return YOBD_OK;
+}
@@ -0,0 +1,413 @@
+/**
+ * @file      socketcan.c
+ * @brief     Batched SocketCAN receive with kernel timestamps.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <yobd/sink.h>
+#include <yobd/socketcan.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+
+/*
+ * The control buffer space each frame needs: a software timestamp from
+ * SO_TIMESTAMPING, or from SO_TIMESTAMPNS on sockets that lack it.
+ */
+#define CONTROL_SIZE \
+    (CMSG_SPACE(3*sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct timespec)))
+
+struct yobd_socketcan {
+    int fd;
+    /* True if we opened fd and must close it. */
+    bool owned;
+    size_t batch;
+    /*
+     * Receive buffers for a whole batch, set up once so that each receive is
+     * a single recvmmsg with no allocation.
+     */
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    unsigned char *control;
+    struct can_frame *frames;
+    uint64_t *timestamps;
+};
+
+static inline
+uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return ((uint64_t) ts->tv_sec) * 1000000000 + ts->tv_nsec;
+}
+
+/* Turns on receive timestamps, returning an errno value. */
+static
+int enable_timestamps(int fd)
+{
+    int domain;
+    socklen_t len;
+    int on;
+    int ret;
+
+    on = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    ret = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &on, sizeof(on));
+    if (ret == -1) {
+        return errno;
+    }
+
+    /*
+     * Only some protocols, CAN among them, deliver SO_TIMESTAMPING receive
+     * timestamps. Stand-ins such as AF_UNIX sockets deliver only the older
+     * SO_TIMESTAMPNS ones, so ask for those too.
+     */
+    len = sizeof(domain);
+    ret = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    if (ret == -1) {
+        return errno;
+    }
+    if (domain != AF_CAN) {
+        on = 1;
+        ret = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+        if (ret == -1) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+static
+yobd_err new_socketcan(
+    int fd,
+    bool owned,
+    size_t batch,
+    struct yobd_socketcan **out_sock)
+{
+    int err;
+    size_t i;
+    struct msghdr *hdr;
+    struct yobd_socketcan *sock;
+
+    err = enable_timestamps(fd);
+    if (err != 0) {
+        return err;
+    }
+
+    sock = malloc(sizeof(*sock));
+    if (sock == NULL) {
+        goto error_sock_malloc;
+    }
+    sock->fd = fd;
+    sock->owned = owned;
+    sock->batch = batch;
+
+    sock->msgs = malloc(batch * sizeof(*sock->msgs));
+    if (sock->msgs == NULL) {
+        goto error_msgs_malloc;
+    }
+    sock->iovs = malloc(batch * sizeof(*sock->iovs));
+    if (sock->iovs == NULL) {
+        goto error_iovs_malloc;
+    }
+    sock->control = malloc(batch * CONTROL_SIZE);
+    if (sock->control == NULL) {
+        goto error_control_malloc;
+    }
+    sock->frames = malloc(batch * sizeof(*sock->frames));
+    if (sock->frames == NULL) {
+        goto error_frames_malloc;
+    }
+    sock->timestamps = malloc(batch * sizeof(*sock->timestamps));
+    if (sock->timestamps == NULL) {
+        goto error_timestamps_malloc;
+    }
+
+    memset(sock->msgs, 0, batch * sizeof(*sock->msgs));
+    for (i = 0; i < batch; ++i) {
+        sock->iovs[i].iov_base = &sock->frames[i];
+        sock->iovs[i].iov_len = sizeof(sock->frames[i]);
+        hdr = &sock->msgs[i].msg_hdr;
+        hdr->msg_iov = &sock->iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = &sock->control[i * CONTROL_SIZE];
+    }
+
+    *out_sock = sock;
+
+    return YOBD_OK;
+
+error_timestamps_malloc:
+    free(sock->frames);
+error_frames_malloc:
+    free(sock->control);
+error_control_malloc:
+    free(sock->iovs);
+error_iovs_malloc:
+    free(sock->msgs);
+error_msgs_malloc:
+    free(sock);
+error_sock_malloc:
+    return YOBD_OOM;
+}
+
+PUBLIC_API
+yobd_err yobd_socketcan_open(
+    const char *ifname,
+    size_t batch,
+    struct yobd_socketcan **sock)
+{
+    struct sockaddr_can addr;
+    yobd_err err;
+    int fd;
+    unsigned int index;
+    int ret;
+
+    if (ifname == NULL || batch == 0 || sock == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = if_nametoindex(ifname);
+    if (index == 0) {
+        return errno;
+    }
+
+    fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd == -1) {
+        return errno;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = index;
+    ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1) {
+        err = errno;
+        goto error_bind;
+    }
+
+    err = new_socketcan(fd, true, batch, sock);
+    if (err != YOBD_OK) {
+        goto error_new_socketcan;
+    }
+
+    return YOBD_OK;
+
+error_new_socketcan:
+error_bind:
+    close(fd);
+    return err;
+}
+
+PUBLIC_API
+yobd_err yobd_socketcan_from_fd(
+    int fd,
+    size_t batch,
+    struct yobd_socketcan **sock)
+{
+    if (fd < 0 || batch == 0 || sock == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    return new_socketcan(fd, false, batch, sock);
+}
+
+PUBLIC_API
+void yobd_socketcan_close(struct yobd_socketcan *sock)
+{
+    if (sock == NULL) {
+        return;
+    }
+
+    if (sock->owned) {
+        close(sock->fd);
+    }
+    free(sock->timestamps);
+    free(sock->frames);
+    free(sock->control);
+    free(sock->iovs);
+    free(sock->msgs);
+    free(sock);
+}
+
+PUBLIC_API
+int yobd_socketcan_get_fd(const struct yobd_socketcan *sock)
+{
+    if (sock == NULL) {
+        return -1;
+    }
+
+    return sock->fd;
+}
+
+/*
+ * Finds the kernel receive timestamp of a message, returning fallback if it
+ * has none.
+ */
+static
+uint64_t get_timestamp(struct msghdr *hdr, uint64_t fallback)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts[3];
+
+    for (cmsg = CMSG_FIRSTHDR(hdr);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+
+        /* The software timestamp is the first of three. */
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+            if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+                return timespec_to_ns(&ts[0]);
+            }
+        }
+        else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(ts[0]));
+            return timespec_to_ns(&ts[0]);
+        }
+    }
+
+    return fallback;
+}
+
+PUBLIC_API
+yobd_err yobd_socketcan_recv(
+    struct yobd_socketcan *sock,
+    bool wait,
+    const struct can_frame **frames,
+    const uint64_t **timestamps,
+    size_t *count)
+{
+    uint64_t fallback;
+    struct msghdr *hdr;
+    size_t i;
+    size_t n;
+    struct timespec now;
+    int ret;
+
+    if (sock == NULL || frames == NULL || timestamps == NULL ||
+        count == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    /* The kernel shrinks these on every receive, so restore them. */
+    for (i = 0; i < sock->batch; ++i) {
+        sock->msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    }
+
+    /*
+     * MSG_WAITFORONE blocks for the first frame only, then takes whatever
+     * else is already queued.
+     */
+    ret = recvmmsg(
+        sock->fd,
+        sock->msgs,
+        sock->batch,
+        wait ? MSG_WAITFORONE : MSG_DONTWAIT,
+        NULL);
+    if (ret == -1) {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *count = 0;
+            *frames = sock->frames;
+            *timestamps = sock->timestamps;
+            return YOBD_OK;
+        }
+        return errno;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fallback = timespec_to_ns(&now);
+
+    /* Compact the batch, dropping anything that is not a classic frame. */
+    n = 0;
+    for (i = 0; i < (size_t) ret; ++i) {
+        hdr = &sock->msgs[i].msg_hdr;
+        if (sock->msgs[i].msg_len != sizeof(struct can_frame) ||
+            (hdr->msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+        if (n != i) {
+            sock->frames[n] = sock->frames[i];
+        }
+        sock->timestamps[n] = get_timestamp(hdr, fallback);
+        ++n;
+    }
+
+    *frames = sock->frames;
+    *timestamps = sock->timestamps;
+    *count = n;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_socketcan_recv_responses(
+    struct yobd_socketcan *sock,
+    struct yobd_ctx *ctx,
+    bool wait,
+    float *vals,
+    yobd_err *errs,
+    yobd_mode *modes,
+    yobd_pid *pids,
+    size_t *count)
+{
+    yobd_err err;
+    const struct can_frame *frames;
+    const uint64_t *timestamps;
+
+    if (ctx == NULL || vals == NULL || errs == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = yobd_socketcan_recv(sock, wait, &frames, &timestamps, count);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_parse_can_responses(
+        ctx,
+        frames,
+        *count,
+        vals,
+        errs,
+        modes,
+        pids);
+}
+
+PUBLIC_API
+yobd_err yobd_socketcan_recv_sink(
+    struct yobd_socketcan *sock,
+    struct yobd_sink *sink,
+    bool wait,
+    size_t *count,
+    size_t *stored)
+{
+    yobd_err err;
+    const struct can_frame *frames;
+    const uint64_t *timestamps;
+
+    if (sink == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = yobd_socketcan_recv(sock, wait, &frames, &timestamps, count);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_sink_push(sink, frames, timestamps, *count, stored);
+}
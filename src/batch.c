@@ -0,0 +1,245 @@
+/**
+ * @file      batch.c
+ * @brief     Vectorized decoding of runs of frames for the same PID.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <yobd/handle.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/batch.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/parser.h>
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+/* The portable fallback, which uses one lane and so needs no SIMD at all. */
+#define BATCH_SUFFIX scalar
+#define BATCH_WIDTH 4
+#define BATCH_ATTR
+#include <yobd-private/batch-kernel.h>
+#undef BATCH_SUFFIX
+#undef BATCH_WIDTH
+#undef BATCH_ATTR
+
+static
+bool scalar_supported(void)
+{
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define BATCH_SUFFIX sse2
+#define BATCH_WIDTH 16
+#define BATCH_ATTR __attribute__ ((target ("sse2")))
+#include <yobd-private/batch-kernel.h>
+#undef BATCH_SUFFIX
+#undef BATCH_WIDTH
+#undef BATCH_ATTR
+
+#define BATCH_SUFFIX avx2
+#define BATCH_WIDTH 32
+#define BATCH_ATTR __attribute__ ((target ("avx2")))
+#include <yobd-private/batch-kernel.h>
+#undef BATCH_SUFFIX
+#undef BATCH_WIDTH
+#undef BATCH_ATTR
+
+static
+bool sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static
+bool avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#elif defined(__ARM_NEON)
+
+/* NEON is either part of the target or not, so there is nothing to detect. */
+#define BATCH_SUFFIX neon
+#define BATCH_WIDTH 16
+#define BATCH_ATTR
+#include <yobd-private/batch-kernel.h>
+#undef BATCH_SUFFIX
+#undef BATCH_WIDTH
+#undef BATCH_ATTR
+
+static
+bool neon_supported(void)
+{
+    return true;
+}
+
+#endif
+
+const struct batch_impl batch_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", batch_eval_avx2, avx2_supported },
+    { "sse2", batch_eval_sse2, sse2_supported },
+#elif defined(__ARM_NEON)
+    { "neon", batch_eval_neon, neon_supported },
+#endif
+    { "scalar", batch_eval_scalar, scalar_supported },
+};
+
+const size_t batch_impl_count = ARRAYLEN(batch_impls);
+
+/* The fastest evaluator this CPU supports, picked when the library loads. */
+static batch_func best_batch_func = batch_eval_scalar;
+
+__attribute__ ((constructor))
+static
+void select_batch_func(void)
+{
+    size_t i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+
+    for (i = 0; i < batch_impl_count; ++i) {
+        if (batch_impls[i].supported()) {
+            best_batch_func = batch_impls[i].func;
+            return;
+        }
+    }
+}
+
+batch_func get_best_batch_func(void)
+{
+    return best_batch_func;
+}
+
+bool batch_can_vectorize(const struct pid_ctx *pid_ctx)
+{
+    const struct expr *expr;
+
+    /*
+     * Only the PID's own data bytes are transposed, so expressions reading
+     * past them are left to the scalar path.
+     */
+    expr = &pid_ctx->expr;
+    if (expr_data_bytes(expr) > pid_ctx->can_bytes) {
+        return false;
+    }
+
+    switch (expr->type) {
+        case EXPR_NOP:
+        case EXPR_LINEAR:
+            return true;
+        case EXPR_STACK:
+            /* The evaluators keep a fixed-size stack. */
+            if (expr->max_depth > EXPR_MAX_TOKENS) {
+                return false;
+            }
+            /* Dividing by zero must fail the same way decode_pid does. */
+            if (!expr_is_total(expr, pid_ctx->pid_type)) {
+                return false;
+            }
+            /*
+             * Integer expressions are evaluated in 32 bits, which matches the
+             * scalar path for everything but division.
+             */
+            return pid_ctx->pid_type == PID_DATA_TYPE_FLOAT ||
+                   !stack_expr_divides(expr);
+    }
+
+    return false;
+}
+
+static inline
+yobd_err check_frame(const struct pid_ctx *pid_ctx, const struct can_frame *frame)
+{
+    if (frame->data[0] != pid_ctx->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+
+    return YOBD_OK;
+}
+
+void decode_batch(
+    const struct pid_ctx *pid_ctx,
+    batch_func func,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs)
+{
+    size_t i;
+    struct batch_input in;
+    size_t j;
+    size_t k;
+    size_t n;
+    float out[BATCH_CHUNK];
+    size_t padded;
+
+    if (count < BATCH_MIN_FRAMES || !batch_can_vectorize(pid_ctx)) {
+        for (i = 0; i < count; ++i) {
+            errs[i] = check_frame(pid_ctx, &frames[i]);
+            if (errs[i] == YOBD_OK) {
+                vals[i] = decode_pid(
+                    pid_ctx,
+                    &frames[i].data[pid_ctx->data_offset]);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i += n) {
+        n = count - i;
+        if (n > BATCH_CHUNK) {
+            n = BATCH_CHUNK;
+        }
+        padded = (n + BATCH_LANE_MULTIPLE - 1) / BATCH_LANE_MULTIPLE *
+            BATCH_LANE_MULTIPLE;
+
+        /*
+         * Transpose the data bytes into struct-of-arrays form, padding the
+         * last vector with zeros rather than leaving it uninitialized.
+         */
+        for (k = 0; k < pid_ctx->can_bytes; ++k) {
+            for (j = 0; j < n; ++j) {
+                in.bytes[k][j] = frames[i+j].data[pid_ctx->data_offset + k];
+            }
+            for (; j < padded; ++j) {
+                in.bytes[k][j] = 0;
+            }
+        }
+
+        func(pid_ctx, &in, n, out);
+
+        for (j = 0; j < n; ++j) {
+            errs[i+j] = check_frame(pid_ctx, &frames[i+j]);
+            if (errs[i+j] == YOBD_OK) {
+                vals[i+j] = out[j];
+            }
+        }
+    }
+}
+
+PUBLIC_API
+yobd_err yobd_decode_batch_with_handle(
+    const yobd_pid_handle *handle,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs)
+{
+    if (handle == NULL || frames == NULL || vals == NULL || errs == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    decode_batch(handle->pid_ctx, best_batch_func, frames, count, vals, errs);
+
+    return YOBD_OK;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file      canfd.c
+ * @brief     OBD II queries and responses over CAN FD.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <yobd/canfd.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+/*
+ * Writes the mode and PID at the start of a query or response payload,
+ * returning the number of bytes written, or 0 if the PID does not fit the
+ * mode.
+ */
+static
+size_t put_mode_pid(
+    bool big_endian,
+    bool response,
+    yobd_mode mode,
+    yobd_pid pid,
+    unsigned char *payload)
+{
+    /* The response mode is query mode + 0x40. */
+    payload[0] = response ? 0x40 + mode : mode;
+    if (mode_is_sae_standard(mode)) {
+        /* Standard-mode PIDs must use only one byte. */
+        if (pid > 0xff) {
+            return 0;
+        }
+        payload[1] = pid;
+    }
+    else if (big_endian) {
+        payload[1] = (pid & 0xff00) >> 8;
+        payload[2] = pid & 0x00ff;
+    }
+    else {
+        payload[1] = pid & 0x00ff;
+        payload[2] = (pid & 0xff00) >> 8;
+    }
+
+    return mode_data_offset(mode);
+}
+
+static
+bool is_query(const struct canfd_frame *frame)
+{
+    return frame->can_id == YOBD_OBD_II_QUERY_ADDRESS;
+}
+
+static
+bool is_response(const struct canfd_frame *frame)
+{
+    return (frame->can_id >= YOBD_OBD_II_RESPONSE_BASE &&
+            frame->can_id <= YOBD_OBD_II_RESPONSE_END);
+}
+
+PUBLIC_API
+yobd_err yobd_make_canfd_query(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    struct canfd_frame *frame)
+{
+    unsigned char payload[3];
+    size_t size;
+
+    if (ctx == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    size = put_mode_pid(ctx->big_endian, false, mode, pid, payload);
+    if (size == 0) {
+        return YOBD_INVALID_PID;
+    }
+
+    isotp_fd_make_single(YOBD_OBD_II_QUERY_ADDRESS, payload, size, frame);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_make_canfd_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *data,
+    uint8_t data_size,
+    struct canfd_frame *frame)
+{
+    unsigned char payload[ISOTP_FD_SINGLE_MAX];
+    size_t size;
+
+    if (ctx == NULL || data == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (data_size < 1 ||
+        data_size > ISOTP_FD_SINGLE_MAX - mode_data_offset(mode)) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    size = put_mode_pid(ctx->big_endian, true, mode, pid, payload);
+    if (size == 0) {
+        return YOBD_INVALID_PID;
+    }
+    memcpy(&payload[size], data, data_size);
+    size += data_size;
+
+    isotp_fd_make_single(YOBD_OBD_II_RESPONSE_BASE, payload, size, frame);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_canfd_headers(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pid)
+{
+    yobd_err err;
+    const unsigned char *payload;
+    size_t size;
+
+    if (ctx == NULL || frame == NULL || mode == NULL || pid == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (!is_query(frame) && !is_response(frame)) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    err = isotp_fd_parse_single(frame, &payload, &size);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return parse_payload_headers(
+        ctx->big_endian,
+        is_response(frame),
+        payload,
+        size,
+        mode,
+        pid);
+}
+
+PUBLIC_API
+yobd_err yobd_parse_canfd_response(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    float *val)
+{
+    yobd_err err;
+    yobd_mode mode;
+    const unsigned char *payload;
+    yobd_pid pid;
+    size_t size;
+
+    if (ctx == NULL || frame == NULL || val == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (!is_response(frame)) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    err = isotp_fd_parse_single(frame, &payload, &size);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_parse_response_payload(ctx, payload, size, &mode, &pid, val);
+}
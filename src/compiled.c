@@ -0,0 +1,491 @@
+/**
+ * @file      compiled.c
+ * @brief     Saving and loading precompiled binary schemas.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/compiled.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/fixed.h>
+#include <yobd-private/jit.h>
+#include <yobd-private/lut.h>
+#include <yobd-private/parser.h>
+
+static
+size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+/* Returns the number of code section bytes that a stack expression needs. */
+static
+size_t get_code_bytes(const struct expr *expr)
+{
+    return align_up(stack_expr_bytes(expr), sizeof(*expr->consts));
+}
+
+static
+void write_pid(
+    const struct pid_ctx *pid_ctx,
+    const struct yobd_pid_desc *desc,
+    struct compiled_pid *out,
+    char *strings,
+    size_t *strings_pos,
+    uint8_t *code,
+    size_t *code_pos)
+{
+    size_t len;
+
+    out->scale = pid_ctx->conv.scale;
+    out->offset = pid_ctx->conv.offset;
+    out->size = pid_ctx->expr.size;
+    out->expr_type = pid_ctx->expr.type;
+    out->pid_type = pid_ctx->pid_type;
+    out->can_bytes = desc->can_bytes;
+    out->unit = desc->unit;
+
+    len = strlen(desc->name) + 1;
+    memcpy(&strings[*strings_pos], desc->name, len);
+    out->name = *strings_pos;
+    *strings_pos += len;
+
+    switch (pid_ctx->expr.type) {
+        case EXPR_NOP:
+            break;
+        case EXPR_LINEAR:
+            memcpy(out->coeffs, pid_ctx->expr.coeffs, sizeof(out->coeffs));
+            break;
+        case EXPR_STACK:
+            out->code = *code_pos;
+            out->const_count = stack_expr_const_count(&pid_ctx->expr);
+            out->max_depth = pid_ctx->expr.max_depth;
+            /* The bytecode immediately follows the constants. */
+            memcpy(
+                &code[*code_pos],
+                pid_ctx->expr.consts,
+                stack_expr_bytes(&pid_ctx->expr));
+            *code_pos += get_code_bytes(&pid_ctx->expr);
+            break;
+    }
+}
+
+PUBLIC_API
+yobd_err yobd_save_compiled_schema(struct yobd_ctx *ctx, const char *file)
+{
+    uint8_t *buf;
+    size_t code_pos;
+    size_t code_size;
+    yobd_err err;
+    FILE *f;
+    struct compiled_header *header;
+    size_t i;
+    struct compiled_header layout;
+    const struct pid_ctx *pid_ctx;
+    struct compiled_pid *pids;
+    size_t size;
+    size_t strings_pos;
+    size_t strings_size;
+    size_t written;
+
+    if (ctx == NULL || file == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    strings_size = 0;
+    code_size = 0;
+    for (i = 0; i < ctx->pid_count; ++i) {
+        pid_ctx = &ctx->pids[i];
+        strings_size += strlen(ctx->descs[i].name) + 1;
+        if (pid_ctx->expr.type == EXPR_STACK) {
+            code_size += get_code_bytes(&pid_ctx->expr);
+        }
+    }
+
+    /* Lay out the sections. */
+    memset(&layout, 0, sizeof(layout));
+    layout.pids_offset = sizeof(layout);
+    layout.modepids_offset = align_up(
+        layout.pids_offset + ctx->pid_count*sizeof(*pids),
+        COMPILED_ALIGN);
+    layout.sae_index_offset = align_up(
+        layout.modepids_offset + ctx->pid_count*sizeof(*ctx->modepids),
+        COMPILED_ALIGN);
+    layout.strings_offset = align_up(
+        layout.sae_index_offset + sizeof(ctx->sae_index),
+        COMPILED_ALIGN);
+    layout.strings_size = strings_size;
+    layout.code_offset = align_up(
+        layout.strings_offset + strings_size,
+        COMPILED_ALIGN);
+    layout.code_size = code_size;
+    size = (size_t) layout.code_offset + code_size;
+    if (size > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    memcpy(layout.magic, COMPILED_MAGIC, sizeof(layout.magic));
+    layout.version = COMPILED_VERSION;
+    layout.byte_order = COMPILED_BYTE_ORDER;
+    layout.flags = ctx->big_endian ? COMPILED_FLAG_BIG_ENDIAN : 0;
+    layout.size = size;
+    layout.pid_count = ctx->pid_count;
+    layout.mfr_start = ctx->mfr_start;
+
+    buf = calloc(1, size);
+    if (buf == NULL) {
+        return YOBD_OOM;
+    }
+    header = (struct compiled_header *) buf;
+    *header = layout;
+
+    pids = (struct compiled_pid *) &buf[header->pids_offset];
+    strings_pos = 0;
+    code_pos = 0;
+    for (i = 0; i < ctx->pid_count; ++i) {
+        write_pid(
+            &ctx->pids[i],
+            &ctx->descs[i],
+            &pids[i],
+            (char *) &buf[header->strings_offset],
+            &strings_pos,
+            &buf[header->code_offset],
+            &code_pos);
+    }
+    memcpy(
+        &buf[header->modepids_offset],
+        ctx->modepids,
+        ctx->pid_count*sizeof(*ctx->modepids));
+    memcpy(
+        &buf[header->sae_index_offset],
+        ctx->sae_index,
+        sizeof(ctx->sae_index));
+
+    f = fopen(file, "wb");
+    if (f == NULL) {
+        err = YOBD_CANNOT_OPEN_FILE;
+        goto out;
+    }
+    written = fwrite(buf, 1, size, f);
+    err = (written == size) ? YOBD_OK : errno;
+    if (fclose(f) != 0 && err == YOBD_OK) {
+        err = errno;
+    }
+
+out:
+    free(buf);
+    return err;
+}
+
+/* Returns true if a section lies within the file and is aligned. */
+static
+bool section_is_valid(uint32_t offset, uint64_t size, size_t file_size)
+{
+    return offset % COMPILED_ALIGN == 0 &&
+           offset <= file_size &&
+           size <= file_size - offset;
+}
+
+static
+yobd_err load_pid(
+    const struct compiled_header *header,
+    const struct compiled_pid *in,
+    bool big_endian,
+    yobd_mode mode,
+    struct pid_ctx *pid_ctx,
+    struct yobd_pid_desc *desc)
+{
+    uint8_t *code;
+    struct parse_pid_ctx parse_ctx;
+    const char *strings;
+
+    code = (uint8_t *) header + header->code_offset;
+    strings = (const char *) header + header->strings_offset;
+
+    if (in->name >= header->strings_size ||
+        in->pid_type > PID_DATA_TYPE_UINT8 ||
+        in->unit > YOBD_UNIT_RAD_PER_S ||
+        in->can_bytes < 1 ||
+        in->can_bytes > 4) {
+        return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    parse_ctx.conv.scale = in->scale;
+    parse_ctx.conv.offset = in->offset;
+    parse_ctx.pid_type = in->pid_type;
+    parse_ctx.desc.name = &strings[in->name];
+    parse_ctx.desc.can_bytes = in->can_bytes;
+    parse_ctx.desc.unit = in->unit;
+
+    parse_ctx.expr.type = in->expr_type;
+    parse_ctx.expr.size = in->size;
+    switch (in->expr_type) {
+        case EXPR_NOP:
+            break;
+        case EXPR_LINEAR:
+            if (in->size >= EXPR_LINEAR_COEFFS) {
+                return YOBD_INVALID_COMPILED_SCHEMA;
+            }
+            memcpy(parse_ctx.expr.coeffs, in->coeffs, sizeof(in->coeffs));
+            break;
+        case EXPR_STACK:
+            if (in->code % sizeof(*parse_ctx.expr.consts) != 0 ||
+                in->code > header->code_size ||
+                (uint64_t) in->const_count*sizeof(*parse_ctx.expr.consts) +
+                    in->size > header->code_size - in->code) {
+                return YOBD_INVALID_COMPILED_SCHEMA;
+            }
+            /* The expression is never written, so it can live in the map. */
+            parse_ctx.expr.consts = (union expr_const *) &code[in->code];
+            parse_ctx.expr.code = (const uint8_t *) (
+                parse_ctx.expr.consts + in->const_count);
+            parse_ctx.expr.max_depth = in->max_depth;
+            if (!stack_expr_is_valid(&parse_ctx.expr, in->const_count)) {
+                return YOBD_INVALID_COMPILED_SCHEMA;
+            }
+            break;
+        default:
+            return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    init_pid_ctx(pid_ctx, big_endian, mode, &parse_ctx);
+    *desc = parse_ctx.desc;
+
+    return YOBD_OK;
+}
+
+/* Checks that the index is consistent, so lookups can trust it. */
+static
+bool index_is_valid(const struct yobd_ctx *ctx)
+{
+    size_t i;
+    uint_fast16_t index;
+    yobd_mode mode;
+    yobd_pid pid;
+
+    for (i = 0; i < ctx->pid_count; ++i) {
+        if (i > 0 && ctx->modepids[i] <= ctx->modepids[i-1]) {
+            return false;
+        }
+        mode = get_mode(ctx->modepids[i]);
+        if (mode_is_sae_standard(mode) != (i < ctx->mfr_start)) {
+            return false;
+        }
+    }
+
+    for (mode = 0; mode < SAE_MODE_COUNT; ++mode) {
+        for (pid = 0; pid < SAE_PID_COUNT; ++pid) {
+            index = ctx->sae_index[mode][pid];
+            if (index == 0) {
+                continue;
+            }
+            if (index > ctx->pid_count ||
+                ctx->modepids[index-1] != get_modepid(mode, pid)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Sets up a context to use the compiled schema it has mapped. */
+static
+yobd_err load_map(struct yobd_ctx *ctx)
+{
+    yobd_err err;
+    const struct compiled_header *header;
+    size_t i;
+    const struct compiled_pid *pids;
+    const char *strings;
+
+    header = ctx->map;
+    if (memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != COMPILED_VERSION ||
+        header->byte_order != COMPILED_BYTE_ORDER ||
+        header->size != ctx->map_size ||
+        header->mfr_start > header->pid_count) {
+        return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    if (!section_is_valid(
+            header->pids_offset,
+            (uint64_t) header->pid_count*sizeof(*pids),
+            ctx->map_size) ||
+        !section_is_valid(
+            header->modepids_offset,
+            (uint64_t) header->pid_count*sizeof(*ctx->modepids),
+            ctx->map_size) ||
+        !section_is_valid(
+            header->sae_index_offset,
+            sizeof(ctx->sae_index),
+            ctx->map_size) ||
+        !section_is_valid(
+            header->strings_offset,
+            header->strings_size,
+            ctx->map_size) ||
+        !section_is_valid(
+            header->code_offset,
+            header->code_size,
+            ctx->map_size)) {
+        return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    /* If the table ends with a NUL, every name in it is terminated. */
+    strings = (const char *) ctx->map + header->strings_offset;
+    if (header->strings_size > 0 &&
+        strings[header->strings_size - 1] != '\0') {
+        return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    ctx->big_endian = header->flags & COMPILED_FLAG_BIG_ENDIAN;
+    ctx->mfr_start = header->mfr_start;
+    ctx->modepids = (uint32_t *) ((uint8_t *) ctx->map + header->modepids_offset);
+    memcpy(
+        ctx->sae_index,
+        (const uint8_t *) ctx->map + header->sae_index_offset,
+        sizeof(ctx->sae_index));
+
+    /*
+     * The arena holds only the decode records and descriptors, as everything
+     * they point to is in the map.
+     */
+    err = alloc_arena(
+        ctx,
+        header->pid_count*(sizeof(*ctx->pids) + sizeof(*ctx->descs)));
+    if (err != YOBD_OK) {
+        return err;
+    }
+    ctx->pids = ctx->arena;
+    ctx->descs = (struct yobd_pid_desc *) &ctx->pids[header->pid_count];
+    pids = (const struct compiled_pid *) (
+        (const uint8_t *) ctx->map + header->pids_offset);
+    for (i = 0; i < header->pid_count; ++i) {
+        err = load_pid(
+            header,
+            &pids[i],
+            ctx->big_endian,
+            get_mode(ctx->modepids[i]),
+            &ctx->pids[i],
+            &ctx->descs[i]);
+        if (err != YOBD_OK) {
+            return err;
+        }
+    }
+    ctx->pid_count = header->pid_count;
+
+    if (!index_is_valid(ctx)) {
+        return YOBD_INVALID_COMPILED_SCHEMA;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_load_compiled_schema(const char *schema, struct yobd_ctx **ctx)
+{
+    struct yobd_schema_opts opts;
+
+    yobd_schema_opts_init(&opts);
+
+    return yobd_load_compiled_schema_opts(schema, &opts, ctx);
+}
+
+PUBLIC_API
+yobd_err yobd_load_compiled_schema_opts(
+    const char *schema,
+    const struct yobd_schema_opts *opts,
+    struct yobd_ctx **out_ctx)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    int fd;
+    void *map;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (schema == NULL || opts == NULL || out_ctx == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = find_schema_path(schema, path);
+    if (err != YOBD_OK) {
+        return err;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return YOBD_CANNOT_OPEN_FILE;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        err = errno;
+        goto out;
+    }
+    if (st.st_size < (off_t) sizeof(struct compiled_header) ||
+        (uint64_t) st.st_size > UINT32_MAX) {
+        err = YOBD_INVALID_COMPILED_SCHEMA;
+        goto out;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        err = errno;
+        goto out;
+    }
+
+    ctx = create_ctx();
+    if (ctx == NULL) {
+        munmap(map, st.st_size);
+        err = YOBD_OOM;
+        goto out;
+    }
+    /* From here on, freeing the context unmaps the file. */
+    ctx->map = map;
+    ctx->map_size = st.st_size;
+
+    err = load_map(ctx);
+    if (err != YOBD_OK) {
+        goto error_load_map;
+    }
+
+    err = build_luts(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_luts;
+    }
+
+    err = build_jit(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_jit;
+    }
+
+    err = build_fixed(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_fixed;
+    }
+
+    *out_ctx = ctx;
+
+    goto out;
+
+error_build_fixed:
+error_build_jit:
+error_build_luts:
+error_load_map:
+    yobd_free_ctx(ctx);
+out:
+    close(fd);
+    return err;
+}
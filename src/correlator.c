@@ -0,0 +1,406 @@
+/**
+ * @file      correlator.c
+ * @brief     Matching of OBD II responses to their queries, with timeouts.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <yobd/correlator.h>
+#include <yobd/multi.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+/* Marks the end of the in-flight list. */
+#define NO_SLOT (UINT32_MAX)
+
+/* An outstanding query, or an idle slot, for one mode-PID of the schema. */
+struct corr_slot {
+    uint64_t sent;
+    /* Neighbors in the in-flight list, valid only while in flight. */
+    uint32_t prev;
+    uint32_t next;
+    uint8_t expected;
+    uint8_t responded;
+    bool in_flight;
+};
+
+/*
+ * Since every query has the same timeout and queries are sent in time order,
+ * they also expire in the order they were sent. Keeping in-flight slots in a
+ * list in that order makes expiring a query a matter of popping the head, and
+ * completing one a matter of unlinking it, both in O(1).
+ */
+struct yobd_correlator {
+    struct yobd_ctx *ctx;
+    uint64_t timeout;
+    uint64_t last_sent;
+    /* One slot per PID in the context, indexed as the context indexes PIDs. */
+    struct corr_slot *slots;
+    /* The in-flight list, oldest first. */
+    uint32_t head;
+    uint32_t tail;
+    struct yobd_correlator_stats stats;
+};
+
+PUBLIC_API
+yobd_err yobd_new_correlator(
+    struct yobd_ctx *ctx,
+    uint64_t timeout,
+    struct yobd_correlator **out_corr)
+{
+    struct yobd_correlator *corr;
+
+    if (ctx == NULL || timeout == 0 || out_corr == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    corr = calloc(1, sizeof(*corr));
+    if (corr == NULL) {
+        goto error_corr_calloc;
+    }
+    corr->ctx = ctx;
+    corr->timeout = timeout;
+    corr->head = NO_SLOT;
+    corr->tail = NO_SLOT;
+
+    corr->slots = calloc(ctx->pid_count, sizeof(*corr->slots));
+    if (corr->slots == NULL && ctx->pid_count > 0) {
+        goto error_slots_calloc;
+    }
+
+    *out_corr = corr;
+
+    return YOBD_OK;
+
+error_slots_calloc:
+    free(corr);
+error_corr_calloc:
+    return YOBD_OOM;
+}
+
+PUBLIC_API
+void yobd_free_correlator(struct yobd_correlator *corr)
+{
+    if (corr == NULL) {
+        return;
+    }
+
+    free(corr->slots);
+    free(corr);
+}
+
+/* Removes a slot from the in-flight list. */
+static
+void unlink_slot(struct yobd_correlator *corr, uint32_t index)
+{
+    struct corr_slot *slot;
+
+    slot = &corr->slots[index];
+    if (slot->prev == NO_SLOT) {
+        corr->head = slot->next;
+    }
+    else {
+        corr->slots[slot->prev].next = slot->next;
+    }
+    if (slot->next == NO_SLOT) {
+        corr->tail = slot->prev;
+    }
+    else {
+        corr->slots[slot->next].prev = slot->prev;
+    }
+
+    slot->in_flight = false;
+    --corr->stats.in_flight;
+}
+
+/* Looks up the slot of a mode-PID that can take a new query. */
+static
+yobd_err get_free_slot(
+    struct yobd_correlator *corr,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint32_t *index)
+{
+    size_t pid_index;
+
+    pid_index = get_pid_index(corr->ctx, mode, pid);
+    if (pid_index == SIZE_MAX) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+    if (corr->slots[pid_index].in_flight) {
+        return YOBD_QUERY_IN_FLIGHT;
+    }
+
+    *index = pid_index;
+
+    return YOBD_OK;
+}
+
+/* Puts a free slot at the tail of the in-flight list. */
+static
+void start_query(
+    struct yobd_correlator *corr,
+    uint32_t index,
+    uint8_t expected,
+    uint64_t now)
+{
+    struct corr_slot *slot;
+
+    slot = &corr->slots[index];
+    slot->sent = now;
+    slot->expected = expected;
+    slot->responded = 0;
+    slot->in_flight = true;
+    slot->prev = corr->tail;
+    slot->next = NO_SLOT;
+    if (corr->tail == NO_SLOT) {
+        corr->head = index;
+    }
+    else {
+        corr->slots[corr->tail].next = index;
+    }
+    corr->tail = index;
+
+    corr->last_sent = now;
+    ++corr->stats.sent;
+    ++corr->stats.in_flight;
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_add(
+    struct yobd_correlator *corr,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint8_t expected,
+    uint64_t now)
+{
+    yobd_err err;
+    uint32_t index;
+
+    if (corr == NULL || now < corr->last_sent) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = get_free_slot(corr, mode, pid, &index);
+    if (err != YOBD_OK) {
+        return err;
+    }
+    start_query(corr, index, expected, now);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_add_query(
+    struct yobd_correlator *corr,
+    const struct can_frame *frame,
+    uint8_t expected,
+    uint64_t now)
+{
+    size_t count;
+    yobd_err err;
+    size_t i;
+    uint32_t indices[YOBD_MAX_MULTI_PIDS];
+    yobd_mode mode;
+    yobd_pid pid;
+    size_t size;
+
+    if (corr == NULL || frame == NULL || now < corr->last_sent) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (frame->can_id != YOBD_OBD_II_QUERY_ADDRESS) {
+        return YOBD_UNKNOWN_ID;
+    }
+    size = frame->data[0];
+    if (frame->can_dlc != OBD_II_DLC || size < 2 || size > ISOTP_SINGLE_MAX) {
+        return YOBD_INVALID_DLC;
+    }
+
+    /* Check every mode-PID before recording any. */
+    mode = frame->data[1];
+    if (mode_is_sae_standard(mode)) {
+        count = size - 1;
+        for (i = 0; i < count; ++i) {
+            err = get_free_slot(corr, mode, frame->data[2+i], &indices[i]);
+            if (err != YOBD_OK) {
+                return err;
+            }
+        }
+    }
+    else {
+        err = parse_payload_headers(
+            corr->ctx->big_endian,
+            false,
+            &frame->data[1],
+            size,
+            &mode,
+            &pid);
+        if (err != YOBD_OK) {
+            return err;
+        }
+        count = 1;
+        err = get_free_slot(corr, mode, pid, &indices[0]);
+        if (err != YOBD_OK) {
+            return err;
+        }
+    }
+
+    /* A multi-PID query may name a PID twice; record it once. */
+    for (i = 0; i < count; ++i) {
+        if (!corr->slots[indices[i]].in_flight) {
+            start_query(corr, indices[i], expected, now);
+        }
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_match(
+    struct yobd_correlator *corr,
+    canid_t id,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint64_t now,
+    struct yobd_correlation *match)
+{
+    uint8_t bit;
+    size_t pid_index;
+    struct corr_slot *slot;
+
+    if (corr == NULL || match == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (id < YOBD_OBD_II_RESPONSE_BASE || id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    match->matched = false;
+    pid_index = get_pid_index(corr->ctx, mode, pid);
+    if (pid_index == SIZE_MAX) {
+        ++corr->stats.unmatched;
+        return YOBD_OK;
+    }
+    slot = &corr->slots[pid_index];
+    bit = 1 << (id - YOBD_OBD_II_RESPONSE_BASE);
+    if (!slot->in_flight || (slot->responded & bit)) {
+        ++corr->stats.unmatched;
+        return YOBD_OK;
+    }
+
+    slot->responded |= bit;
+    match->matched = true;
+    match->ecu = id - YOBD_OBD_II_RESPONSE_BASE;
+    match->latency = now >= slot->sent ? now - slot->sent : 0;
+    ++corr->stats.matched;
+
+    /* With no ECUs given, any one answer will do. */
+    match->complete = (slot->responded & slot->expected) == slot->expected;
+    if (slot->expected == 0) {
+        match->complete = true;
+    }
+    if (match->complete) {
+        unlink_slot(corr, pid_index);
+        ++corr->stats.completed;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_match_response(
+    struct yobd_correlator *corr,
+    const struct can_frame *frame,
+    uint64_t now,
+    struct yobd_correlation *match)
+{
+    yobd_err err;
+    yobd_mode mode;
+    yobd_pid pid;
+
+    if (corr == NULL || frame == NULL || match == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    /* Only a single frame has the mode and PID where the headers expect. */
+    if (frame->data[0] > ISOTP_SINGLE_MAX) {
+        return YOBD_INVALID_ISOTP;
+    }
+    err = parse_response_headers(corr->ctx->big_endian, frame, &mode, &pid);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_correlator_match(corr, frame->can_id, mode, pid, now, match);
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_expire(
+    struct yobd_correlator *corr,
+    uint64_t now,
+    struct yobd_correlator_timeout *timeouts,
+    size_t max,
+    size_t *count,
+    uint64_t *wake)
+{
+    uint32_t index;
+    struct corr_slot *slot;
+
+    if (corr == NULL || (timeouts == NULL && max > 0) || count == NULL ||
+        wake == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *count = 0;
+    while (corr->head != NO_SLOT) {
+        index = corr->head;
+        slot = &corr->slots[index];
+        if (slot->sent + corr->timeout > now) {
+            break;
+        }
+        if (*count == max) {
+            *wake = now;
+            return YOBD_OK;
+        }
+
+        timeouts[*count].mode = get_mode(corr->ctx->modepids[index]);
+        timeouts[*count].pid = get_pid(corr->ctx->modepids[index]);
+        timeouts[*count].sent = slot->sent;
+        timeouts[*count].expected = slot->expected;
+        timeouts[*count].responded = slot->responded;
+        ++*count;
+
+        unlink_slot(corr, index);
+        ++corr->stats.timeouts;
+    }
+
+    if (corr->head == NO_SLOT) {
+        *wake = UINT64_MAX;
+    }
+    else {
+        *wake = corr->slots[corr->head].sent + corr->timeout;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_correlator_get_stats(
+    struct yobd_correlator *corr,
+    struct yobd_correlator_stats *stats)
+{
+    if (corr == NULL || stats == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *stats = corr->stats;
+
+    return YOBD_OK;
+}
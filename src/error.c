@@ -49,6 +49,14 @@ const char *yobd_strerror(yobd_err err)
             return "bytes specified is different than expected";
         case YOBD_PARSE_FAIL:
             return "failed to parse YOBD schema";
+        case YOBD_INVALID_COMPILED_SCHEMA:
+            return "invalid or incompatible compiled schema";
+        case YOBD_INVALID_ISOTP:
+            return "malformed or out-of-sequence ISO-TP message";
+        case YOBD_INVALID_CAPS:
+            return "invalid or incompatible serialized capabilities";
+        case YOBD_QUERY_IN_FLIGHT:
+            return "a query for the mode-PID is already in flight";
     }
 
     /*
@@ -9,127 +9,89 @@
 #include <endian.h>
 #include <float.h>
 #include <stdbool.h>
+#include <string.h>
 #include <yobd-private/api.h>
+#include <yobd-private/eval.h>
 #include <yobd-private/expr.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/lut.h>
 #include <yobd-private/parser.h>
+#include <yobd/handle.h>
 #include <yobd/yobd.h>
 
 #include <stdio.h>
 
 /**
- * The value to use to pad OBD II messages. ISO 15765-2:2016 page 43 suggests
- * but does not require 0xcc for padding.
- */
-#define OBD_II_PAD_VALUE (0xcc)
-
-/**
- * The CAN data length code that should be used for OBD-II frames.
- */
-#define OBD_II_DLC 8
-
-/**
- * Macro to define stack evaluation functions.
+ * Macro to define bytecode evaluation functions. The stack is sized by the
+ * depth computed at parse time, and every value on it has the same type, so
+ * the loop needs no bounds or type checks.
  *
+ * @param type the type in which the expression is evaluated
  * @param stack_type the type of values the stack can handle
- * @param enum_type the enum type corresponding to the given stack_type
  */
-#define DEFINE_EVAL_FUNC(stack_type, enum_type) \
+#define DEFINE_EVAL_FUNC(type, stack_type) \
 static \
-float eval_expr_##stack_type( \
-    const struct expr *expr, \
-    struct EXPR_STACK *stack, \
-    const unsigned char *data) \
+type eval_expr_##type(const struct expr *expr, const unsigned char *data) \
 { \
-    size_t i; \
-    struct expr_token tok1; \
-    struct expr_token tok2; \
-    struct expr_token result; \
+    const uint8_t *code; \
+    const uint8_t *end; \
+    stack_type stack[expr->max_depth]; \
+    stack_type *top; \
     stack_type val; \
     \
-    for (i = 0; i < expr->size; ++i) { \
-        switch (expr->data[i].type) { \
-            case EXPR_A: \
-                result.type = enum_type; \
-                result.as_##stack_type = data[0]; \
-                PUSH_STACK(EXPR_STACK, stack, &result); \
+    /*
+     * The top of the stack lives in val rather than in memory, so operators
+     * load only their left operand. The first push spills a meaningless value
+     * into stack[0], which is why the stack needs max_depth slots rather than
+     * max_depth - 1.
+     */ \
+    top = stack; \
+    val = 0; \
+    end = expr->code + expr->size; \
+    for (code = expr->code; code < end; ++code) { \
+        switch ((bytecode_op) *code) { \
+            case BC_PUSH_A: \
+                *top++ = val; \
+                val = data[0]; \
+                break; \
+            case BC_PUSH_B: \
+                *top++ = val; \
+                val = data[1]; \
+                break; \
+            case BC_PUSH_C: \
+                *top++ = val; \
+                val = data[2]; \
+                break; \
+            case BC_PUSH_D: \
+                *top++ = val; \
+                val = data[3]; \
                 break; \
-            case EXPR_B: \
-                result.type = enum_type; \
-                result.as_##stack_type = data[1]; \
-                PUSH_STACK(EXPR_STACK, stack, &result); \
+            case BC_PUSH_CONST: \
+                ++code; \
+                *top++ = val; \
+                val = expr->consts[*code].as_##type; \
                 break; \
-            case EXPR_C: \
-                result.type = enum_type; \
-                result.as_##stack_type = data[2]; \
-                PUSH_STACK(EXPR_STACK, stack, &result); \
+            case BC_ADD: \
+                val = *--top + val; \
                 break; \
-            case EXPR_D: \
-                result.type = enum_type; \
-                result.as_##stack_type = data[3]; \
-                PUSH_STACK(EXPR_STACK, stack, &result); \
+            case BC_SUB: \
+                val = *--top - val; \
                 break; \
-            case EXPR_OP: \
-                tok1 = POP_STACK(EXPR_STACK, stack); \
-                tok2 = POP_STACK(EXPR_STACK, stack); \
-                XASSERT_EQ(tok1.type, enum_type); \
-                XASSERT_EQ(tok2.type, enum_type); \
-                result.type = enum_type; \
-                switch (expr->data[i].as_op) { \
-                    case EXPR_OP_ADD: \
-                        result.as_##stack_type = tok2.as_##stack_type + tok1.as_##stack_type; \
-                        break; \
-                    case EXPR_OP_SUB: \
-                        result.as_##stack_type = tok2.as_##stack_type - tok1.as_##stack_type; \
-                        break; \
-                    case EXPR_OP_MUL: \
-                        result.as_##stack_type = tok2.as_##stack_type * tok1.as_##stack_type; \
-                        break; \
-                    case EXPR_OP_DIV: \
-                        XASSERT_NEQ(tok1.as_##stack_type, 0); \
-                        result.as_##stack_type = tok2.as_##stack_type / tok1.as_##stack_type; \
-                        break; \
-                } \
-                PUSH_STACK(EXPR_STACK, stack, &result); \
+            case BC_MUL: \
+                val = *--top * val; \
                 break; \
-            case enum_type: \
-                PUSH_STACK(EXPR_STACK, stack, &expr->data[i]); \
+            case BC_DIV: \
+                XASSERT_NEQ(val, 0); \
+                val = *--top / val; \
                 break; \
-            default: \
-                /*
-                 * All tokens should be of the same numeric type (float or int),
-                 * to avoid issues converting between types.
-                 */ \
-                XASSERT_ERROR; \
         } \
     } \
     \
-    XASSERT_EQ(STACK_SIZE(EXPR_STACK, stack), 1); \
-    result = POP_STACK(EXPR_STACK, stack); \
-    XASSERT_EQ(result.type, enum_type); \
-    \
-    val = result.as_##stack_type; \
-    return (float) val; \
+    return (type) val; \
 }
 
-DEFINE_EVAL_FUNC(int32_t, EXPR_INT32)
-DEFINE_EVAL_FUNC(float, EXPR_FLOAT)
-
-static inline
-bool mode_is_sae_standard(yobd_mode mode)
-{
-    return mode <= 0x0a;
-}
-
-static inline
-size_t mode_data_offset(yobd_mode mode)
-{
-    if (mode_is_sae_standard(mode)) {
-        return 2;
-    }
-    else {
-        return 3;
-    }
-}
+DEFINE_EVAL_FUNC(int32_t, int_fast32_t)
+DEFINE_EVAL_FUNC(float, float)
 
 PUBLIC_API
 yobd_err yobd_make_can_query_noctx(
@@ -163,13 +125,13 @@ yobd_err yobd_make_can_query_noctx(
         frame->data[0] = 3;
         if (big_endian) {
             frame->data[1] = mode;
-            frame->data[2] = pid & 0xff00;
+            frame->data[2] = (pid & 0xff00) >> 8;
             frame->data[3] = pid & 0x00ff;
         }
         else {
             frame->data[1] = mode;
             frame->data[2] = pid & 0x00ff;
-            frame->data[3] = pid & 0xff00;
+            frame->data[3] = (pid & 0xff00) >> 8;
         }
         data_start = &frame->data[4];
     }
@@ -212,7 +174,12 @@ yobd_err yobd_make_can_response_noctx(
         return YOBD_INVALID_PARAMETER;
     }
 
-    if (data_size < 1 || data_size > 5) {
+    /*
+     * The payload has to fit after the length byte, the mode, and the PID, so
+     * it can be up to 5 bytes for standard modes and 4 for manufacturer modes.
+     */
+    if (data_size < 1 ||
+        data_size > sizeof(frame->data) - 1 - mode_data_offset(mode)) {
         return YOBD_INVALID_PARAMETER;
     }
 
@@ -233,12 +200,12 @@ yobd_err yobd_make_can_response_noctx(
     }
     else {
         if (big_endian) {
-            frame->data[2] = pid & 0xff00;
+            frame->data[2] = (pid & 0xff00) >> 8;
             frame->data[3] = pid & 0x00ff;
         }
         else {
             frame->data[2] = pid & 0x00ff;
-            frame->data[3] = pid & 0xff00;
+            frame->data[3] = (pid & 0xff00) >> 8;
         }
         data_start = &frame->data[4];
     }
@@ -289,82 +256,21 @@ bool is_response(const struct can_frame *frame)
             frame->can_id <= YOBD_OBD_II_RESPONSE_END);
 }
 
-float nop_eval(
-    bool big_endian,
-    uint_fast8_t can_bytes,
-    pid_data_type pid_type,
-    const unsigned char *data)
+int32_t stack_eval_int(const struct expr *expr, const unsigned char *data)
 {
-    union {
-        float float_val;
-        uint32_t uint_val;
-    } nop;
-    uint32_t num;
-    float val;
-
-    switch (can_bytes) {
-        case 1:
-            val = (float) *data;
-            break;
-        case 2:
-            if (big_endian) {
-                val = (float) be16toh(*((uint16_t *) data));
-            }
-            else {
-                val = (float) le16toh(*((uint16_t *) data));
-            }
-            break;
-        case 3:
-            if (big_endian) {
-                num = (data[0] << 16) | (data[1] << 8) | data[2];
-            }
-            else {
-                num = (data[2] << 16) | (data[0] << 8) | data[0];
-            }
-            val = (float) num;
-            break;
-        case 4:
-            if (pid_type != PID_DATA_TYPE_FLOAT) {
-                if (big_endian) {
-                    val = (float) be32toh(*((uint32_t *) data));
-                }
-                else {
-                    val = (float) le32toh(*((uint32_t *) data));
-                }
-            }
-            else {
-                /* Reinterpret the bits as an IEEE 754 float. */
-                if (big_endian) {
-                    nop.uint_val = be32toh(*((uint32_t *) data));
-                }
-                else {
-                    /* Little endian. */
-                    nop.uint_val = le32toh(*((uint32_t *) data));
-                }
-                val = nop.float_val;
-            }
-            break;
-        default:
-            /* We should not have passed the parsing step. */
-            XASSERT_ERROR;
-    }
-
-    return val;
+    return eval_expr_int32_t(expr, data);
 }
 
-static
-float stack_eval(pid_data_type pid_type, const struct expr *expr, const unsigned char *data)
+float stack_eval(
+    pid_data_type pid_type,
+    const struct expr *expr,
+    const unsigned char *data)
 {
-    struct EXPR_STACK eval_stack;
-    struct expr_token stack_data[expr->size * sizeof(*expr->data)];
     float val;
 
-    /* Put the data for the evaluation stack on the stack. Haha. */
-    INIT_STACK(EXPR_STACK, &eval_stack, stack_data, expr->size);
-
     switch (pid_type) {
         case PID_DATA_TYPE_FLOAT:
-            val = eval_expr_float(expr, &eval_stack, data);
+            val = eval_expr_float(expr, data);
             break;
         case PID_DATA_TYPE_INT8:
         case PID_DATA_TYPE_UINT8:
@@ -372,34 +278,241 @@ float stack_eval(pid_data_type pid_type, const struct expr *expr, const unsigned
         case PID_DATA_TYPE_INT16:
         case PID_DATA_TYPE_UINT32:
         case PID_DATA_TYPE_INT32:
-            val = eval_expr_int32_t(expr, &eval_stack, data);
+            val = eval_expr_int32_t(expr, data);
             break;
     }
 
     return val;
 }
 
+/*
+ * The decoders. Each handles exactly one combination of expression type, byte
+ * count, byte order, and data type, so none of them branch on the PID.
+ */
+
 static
-float eval_expr(
-    bool big_endian,
-    uint_fast8_t can_bytes,
-    pid_data_type pid_type,
+float decode_lut_1(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return pid_ctx->lut[lut_index(1, data)];
+}
+
+static
+float decode_lut_2(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return pid_ctx->lut[lut_index(2, data)];
+}
+
+static
+float decode_jit(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return pid_ctx->jit(data);
+}
+
+static
+float decode_nop_1(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(&pid_ctx->conv, (float) data[0]);
+}
+
+static
+float decode_nop_2_le(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        (float) le16toh(*((uint16_t *) data)));
+}
+
+static
+float decode_nop_2_be(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        (float) be16toh(*((uint16_t *) data)));
+}
+
+static
+float decode_nop_3_le(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    uint32_t num;
+
+    num = (data[2] << 16) | (data[1] << 8) | data[0];
+
+    return unit_convert(&pid_ctx->conv, (float) num);
+}
+
+static
+float decode_nop_3_be(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    uint32_t num;
+
+    num = (data[0] << 16) | (data[1] << 8) | data[2];
+
+    return unit_convert(&pid_ctx->conv, (float) num);
+}
+
+static
+float decode_nop_4_le(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        (float) le32toh(*((uint32_t *) data)));
+}
+
+static
+float decode_nop_4_be(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        (float) be32toh(*((uint32_t *) data)));
+}
+
+/* Reinterprets the bits as an IEEE 754 float. */
+static inline
+float uint_to_float(uint32_t num)
+{
+    union {
+        float float_val;
+        uint32_t uint_val;
+    } nop;
+
+    nop.uint_val = num;
+
+    return nop.float_val;
+}
+
+static
+float decode_nop_float_le(
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        uint_to_float(le32toh(*((uint32_t *) data))));
+}
+
+static
+float decode_nop_float_be(
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        uint_to_float(be32toh(*((uint32_t *) data))));
+}
+
+/*
+ * Evaluates a linear expression, which already includes the unit conversion.
+ * Called with a constant size, so the compiler can unroll it.
+ */
+static inline
+float linear_eval(
     const struct expr *expr,
     const unsigned char *data,
-    convert_func convert)
+    size_t size)
 {
+    size_t i;
     float val;
 
-    switch (expr->type) {
+    val = expr->coeffs[0];
+    for (i = 0; i < size; ++i) {
+        val += expr->coeffs[i+1] * data[i];
+    }
+
+    return val;
+}
+
+#define DEFINE_LINEAR_DECODER(size) \
+static \
+float decode_linear_##size( \
+    const struct pid_ctx *pid_ctx, \
+    const unsigned char *data) \
+{ \
+    return linear_eval(&pid_ctx->expr, data, size); \
+}
+
+DEFINE_LINEAR_DECODER(0)
+DEFINE_LINEAR_DECODER(1)
+DEFINE_LINEAR_DECODER(2)
+DEFINE_LINEAR_DECODER(3)
+DEFINE_LINEAR_DECODER(4)
+
+static
+float decode_stack_float(
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        eval_expr_float(&pid_ctx->expr, data));
+}
+
+static
+float decode_stack_int(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    return unit_convert(
+        &pid_ctx->conv,
+        eval_expr_int32_t(&pid_ctx->expr, data));
+}
+
+const decode_func decoders[DECODER_COUNT] = {
+    [DECODER_LUT_1] = decode_lut_1,
+    [DECODER_LUT_2] = decode_lut_2,
+    [DECODER_JIT] = decode_jit,
+    [DECODER_NOP_1] = decode_nop_1,
+    [DECODER_NOP_2_LE] = decode_nop_2_le,
+    [DECODER_NOP_2_BE] = decode_nop_2_be,
+    [DECODER_NOP_3_LE] = decode_nop_3_le,
+    [DECODER_NOP_3_BE] = decode_nop_3_be,
+    [DECODER_NOP_4_LE] = decode_nop_4_le,
+    [DECODER_NOP_4_BE] = decode_nop_4_be,
+    [DECODER_NOP_FLOAT_LE] = decode_nop_float_le,
+    [DECODER_NOP_FLOAT_BE] = decode_nop_float_be,
+    [DECODER_LINEAR_0] = decode_linear_0,
+    [DECODER_LINEAR_1] = decode_linear_1,
+    [DECODER_LINEAR_2] = decode_linear_2,
+    [DECODER_LINEAR_3] = decode_linear_3,
+    [DECODER_LINEAR_4] = decode_linear_4,
+    [DECODER_STACK_FLOAT] = decode_stack_float,
+    [DECODER_STACK_INT] = decode_stack_int,
+};
+
+decoder_id select_decoder(bool big_endian, const struct pid_ctx *pid_ctx)
+{
+    switch (pid_ctx->expr.type) {
         case EXPR_NOP:
-            val = nop_eval(big_endian, can_bytes, pid_type, data);
             break;
         case EXPR_STACK:
-            val = stack_eval(pid_type, expr, data);
-            break;
+            if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                return DECODER_STACK_FLOAT;
+            }
+            else {
+                return DECODER_STACK_INT;
+            }
+        case EXPR_LINEAR:
+            XASSERT_LT(pid_ctx->expr.size, EXPR_LINEAR_COEFFS);
+            return DECODER_LINEAR_0 + pid_ctx->expr.size;
+    }
+
+    switch (pid_ctx->can_bytes) {
+        case 1:
+            return DECODER_NOP_1;
+        case 2:
+            return big_endian ? DECODER_NOP_2_BE : DECODER_NOP_2_LE;
+        case 3:
+            return big_endian ? DECODER_NOP_3_BE : DECODER_NOP_3_LE;
+        case 4:
+            if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                return big_endian ? DECODER_NOP_FLOAT_BE : DECODER_NOP_FLOAT_LE;
+            }
+            else {
+                return big_endian ? DECODER_NOP_4_BE : DECODER_NOP_4_LE;
+            }
     }
 
-    return convert(val);
+    /* We should not have passed the parsing step. */
+    XASSERT_ERROR;
+
+    return DECODER_NOP_1;
 }
 
 static
@@ -483,64 +596,220 @@ yobd_err yobd_parse_can_headers(
     return yobd_parse_can_headers_noctx(ctx->big_endian, frame, mode, pid);
 }
 
+yobd_err parse_response_headers(
+    bool big_endian,
+    const struct can_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pid)
+{
+    const unsigned char *data_start;
+
+    if (!is_response(frame)) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    if (frame->can_dlc != OBD_II_DLC) {
+        return YOBD_INVALID_DLC;
+    }
+
+    return parse_mode_pid(big_endian, frame, mode, pid, &data_start);
+}
+
+yobd_err parse_payload_headers(
+    bool big_endian,
+    bool response,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pid)
+{
+    /* With no mode byte, there is no valid mode. */
+    if (size < 1) {
+        return YOBD_INVALID_MODE;
+    }
+
+    /* As in parse_mode_pid, a response mode below 0x41 is invalid. */
+    *mode = payload[0];
+    if (response) {
+        if (*mode < 0x41) {
+            return YOBD_INVALID_MODE;
+        }
+        *mode -= 0x40;
+    }
+    if (size < mode_data_offset(*mode)) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+
+    if (mode_is_sae_standard(*mode)) {
+        *pid = payload[1];
+    }
+    else if (big_endian) {
+        *pid = (payload[1] << 8) | payload[2];
+    }
+    else {
+        *pid = (payload[2] << 8) | payload[1];
+    }
+
+    return YOBD_OK;
+}
+
+/**
+ * The most recently decoded mode-PID, kept so that consecutive frames for the
+ * same mode-PID can skip the PID lookup.
+ */
+struct decode_cache {
+    yobd_mode mode;
+    yobd_pid pid;
+    const struct pid_ctx *pid_ctx;
+};
+
+static inline
+void init_decode_cache(struct decode_cache *cache)
+{
+    cache->pid_ctx = NULL;
+}
+
+static inline
+yobd_err decode_response(
+    const struct yobd_ctx *ctx,
+    const struct can_frame *frame,
+    struct decode_cache *cache,
+    yobd_mode *mode,
+    yobd_pid *pid,
+    float *val)
+{
+    const unsigned char *data_start;
+    yobd_err err;
+    const struct pid_ctx *pid_ctx;
+
+    err = parse_response_headers(ctx->big_endian, frame, mode, pid);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    if (cache->pid_ctx == NULL || cache->mode != *mode || cache->pid != *pid) {
+        pid_ctx = get_pid_ctx(ctx, *mode, *pid);
+        if (pid_ctx == NULL) {
+            /* We don't know about this mode-PID combination! */
+            return YOBD_UNKNOWN_MODE_PID;
+        }
+
+        cache->mode = *mode;
+        cache->pid = *pid;
+        cache->pid_ctx = pid_ctx;
+    }
+    pid_ctx = cache->pid_ctx;
+
+    /* From here on, everything we need is in the PID's cache line. */
+    if (frame->data[0] != pid_ctx->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+    data_start = &frame->data[pid_ctx->data_offset];
+
+    *val = decode_pid(pid_ctx, data_start);
+
+    return YOBD_OK;
+}
+
 PUBLIC_API
 yobd_err yobd_parse_can_response(
     struct yobd_ctx *ctx,
     const struct can_frame *frame,
     float *val)
 {
-    const unsigned char *data_start;
-    yobd_err err;
-    size_t expected_bytes;
+    struct decode_cache cache;
     yobd_mode mode;
     yobd_pid pid;
-    size_t offset;
-    const struct parse_pid_ctx *pid_ctx;
 
     if (ctx == NULL || frame == NULL || val == NULL) {
         return YOBD_INVALID_PARAMETER;
     }
 
-    if (!is_response(frame)) {
-        return YOBD_UNKNOWN_ID;
-    }
+    init_decode_cache(&cache);
 
-    if (frame->can_dlc != 8) {
-        return YOBD_INVALID_DLC;
+    return decode_response(ctx, frame, &cache, &mode, &pid, val);
+}
+
+PUBLIC_API
+yobd_err yobd_parse_response_payload(
+    struct yobd_ctx *ctx,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pid,
+    float *val)
+{
+    yobd_err err;
+    const struct pid_ctx *pid_ctx;
+
+    if (ctx == NULL || payload == NULL || mode == NULL || pid == NULL ||
+        val == NULL) {
+        return YOBD_INVALID_PARAMETER;
     }
 
-    err = parse_mode_pid(ctx->big_endian, frame, &mode, &pid, &data_start);
+    err = parse_payload_headers(
+        ctx->big_endian,
+        true,
+        payload,
+        size,
+        mode,
+        pid);
     if (err != YOBD_OK) {
         return err;
     }
 
-    pid_ctx = get_pid_ctx(ctx, mode, pid);
+    pid_ctx = get_pid_ctx(ctx, *mode, *pid);
     if (pid_ctx == NULL) {
-        /* We don't know about this mode-PID combination! */
         return YOBD_UNKNOWN_MODE_PID;
     }
 
-    if (mode_is_sae_standard(mode)) {
-        /* One byte for mode, one byte for PID. */
-        offset = 2;
-    }
-    else {
-        /* One byte for mode, two bytes for PID. */
-        offset = 3;
+    /* The payload is a frame without its length byte. */
+    if (size != pid_ctx->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
     }
-    expected_bytes = offset + pid_ctx->desc.can_bytes;
+    *val = decode_pid_bounded(
+        pid_ctx,
+        &payload[pid_ctx->data_offset - 1],
+        size - (pid_ctx->data_offset - 1));
 
-    if (frame->data[0] != expected_bytes) {
-        return YOBD_INVALID_DATA_BYTES;
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_can_responses(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    size_t count,
+    float *vals,
+    yobd_err *errs,
+    yobd_mode *modes,
+    yobd_pid *pids)
+{
+    struct decode_cache cache;
+    size_t i;
+    yobd_mode mode;
+    yobd_pid pid;
+
+    if (ctx == NULL || frames == NULL || vals == NULL || errs == NULL) {
+        return YOBD_INVALID_PARAMETER;
     }
 
-    *val = eval_expr(
-        ctx->big_endian,
-        pid_ctx->desc.can_bytes,
-        pid_ctx->pid_type,
-        &pid_ctx->expr,
-        data_start,
-        pid_ctx->convert_func);
+    /*
+     * The cache persists across frames, so runs of frames for the same mode-PID
+     * (the common case when draining a socket) pay for the lookup only once.
+     */
+    init_decode_cache(&cache);
+    for (i = 0; i < count; ++i) {
+        mode = 0;
+        pid = 0;
+        errs[i] = decode_response(ctx, &frames[i], &cache, &mode, &pid, &vals[i]);
+        if (modes != NULL) {
+            modes[i] = mode;
+        }
+        if (pids != NULL) {
+            pids[i] = pid;
+        }
+    }
 
     return YOBD_OK;
 }
@@ -552,18 +821,98 @@ yobd_err yobd_get_pid_descriptor(
     yobd_pid pid,
     const struct yobd_pid_desc **pid_desc)
 {
-    const struct parse_pid_ctx *pid_ctx;
+    size_t index;
 
     if (ctx == NULL || pid_desc == NULL) {
         return YOBD_INVALID_PARAMETER;
     }
 
+    index = get_pid_index(ctx, mode, pid);
+    if (index == SIZE_MAX) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+
+    *pid_desc = &ctx->descs[index];
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_get_pid_handle(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid,
+    yobd_pid_handle *handle)
+{
+    const struct pid_ctx *pid_ctx;
+
+    if (ctx == NULL || handle == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
     pid_ctx = get_pid_ctx(ctx, mode, pid);
     if (pid_ctx == NULL) {
         return YOBD_UNKNOWN_MODE_PID;
     }
 
-    *pid_desc = &pid_ctx->desc;
+    memset(handle, 0, sizeof(*handle));
+    handle->pid_ctx = pid_ctx;
+    handle->expected_bytes = pid_ctx->expected_bytes;
+    handle->data_offset = pid_ctx->data_offset;
+
+    /*
+     * Pick the inline case from the expression rather than the decoder, as
+     * inline arithmetic beats a call even if the PID has a lookup table, and
+     * gives the same result.
+     */
+    handle->kind = YOBD_HANDLE_GENERIC;
+    switch (pid_ctx->expr.type) {
+        case EXPR_LINEAR:
+            handle->kind = YOBD_HANDLE_LINEAR;
+            handle->linear_bytes = pid_ctx->expr.size;
+            memcpy(
+                handle->u.coeffs,
+                pid_ctx->expr.coeffs,
+                sizeof(handle->u.coeffs));
+            break;
+        case EXPR_NOP:
+            if (pid_ctx->can_bytes == 1) {
+                handle->kind = YOBD_HANDLE_NOP_1;
+            }
+            else if (pid_ctx->can_bytes == 2 && ctx->big_endian) {
+                handle->kind = YOBD_HANDLE_NOP_2_BE;
+            }
+            else if (pid_ctx->can_bytes == 2) {
+                handle->kind = YOBD_HANDLE_NOP_2_LE;
+            }
+            handle->u.conv.scale = pid_ctx->conv.scale;
+            handle->u.conv.offset = pid_ctx->conv.offset;
+            break;
+        case EXPR_STACK:
+            break;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_decode_with_handle(
+    const yobd_pid_handle *handle,
+    const struct can_frame *frame,
+    float *val)
+{
+    const struct pid_ctx *pid_ctx;
+
+    if (handle == NULL || frame == NULL || val == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    pid_ctx = handle->pid_ctx;
+    if (frame->data[0] != pid_ctx->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+
+    *val = decode_pid(pid_ctx, &frame->data[pid_ctx->data_offset]);
 
     return YOBD_OK;
 }
@@ -17,7 +17,6 @@
 
 #define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
 #define OP_STACK_SIZE (20)
-#define OUT_STACK_SIZE (50)
 
 typedef enum {
     TOK_A,
@@ -35,6 +34,16 @@ typedef enum {
 
 DEFINE_STACK(OP_STACK, parse_token)
 
+/*
+ * A value that is linear in the data bytes:
+ * coeffs[0] + coeffs[1]*A + coeffs[2]*B + coeffs[3]*C + coeffs[4]*D
+ */
+struct linear_val {
+    double coeffs[EXPR_LINEAR_COEFFS];
+};
+
+DEFINE_STACK(LINEAR_STACK, struct linear_val)
+
 static
 void next_token(
     const char *str,
@@ -185,6 +194,7 @@ void handle_op(
     PUSH_STACK(OP_STACK, op_stack, &tok);
 }
 
+static
 void shunting_yard(
     const char *str,
     pid_data_type type,
@@ -292,14 +302,284 @@ void shunting_yard(
     XASSERT_GT(STACK_SIZE(EXPR_STACK, out_stack), 0);
 }
 
-yobd_err parse_expr_val(const char *str, struct expr *expr, pid_data_type type)
+static
+bool linear_is_constant(const struct linear_val *val)
+{
+    size_t i;
+
+    for (i = 1; i < ARRAYLEN(val->coeffs); ++i) {
+        if (val->coeffs[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static
+void linear_scale(struct linear_val *val, double factor)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAYLEN(val->coeffs); ++i) {
+        val->coeffs[i] *= factor;
+    }
+}
+
+/*
+ * Symbolically evaluates an RPN expression, tracking each stack value as a
+ * linear combination of the data bytes. Returns false as soon as we see an
+ * operation that would make the result non-linear.
+ */
+static
+bool make_linear(
+    const struct expr_token *toks,
+    size_t size,
+    pid_data_type type,
+    struct linear_val *result)
+{
+    size_t i;
+    size_t j;
+    struct linear_val lhs;
+    struct linear_val rhs;
+    struct LINEAR_STACK stack;
+    struct linear_val stack_data[size];
+    struct linear_val val;
+
+    INIT_STACK(LINEAR_STACK, &stack, stack_data, size);
+
+    for (i = 0; i < size; ++i) {
+        memset(&val, 0, sizeof(val));
+        switch (toks[i].type) {
+            case EXPR_A:
+            case EXPR_B:
+            case EXPR_C:
+            case EXPR_D:
+                val.coeffs[1 + toks[i].type - EXPR_A] = 1;
+                break;
+            case EXPR_FLOAT:
+                val.coeffs[0] = toks[i].as_float;
+                break;
+            case EXPR_INT32:
+                val.coeffs[0] = toks[i].as_int32_t;
+                break;
+            case EXPR_OP:
+                rhs = POP_STACK(LINEAR_STACK, &stack);
+                lhs = POP_STACK(LINEAR_STACK, &stack);
+                switch (toks[i].as_op) {
+                    case EXPR_OP_ADD:
+                        for (j = 0; j < ARRAYLEN(val.coeffs); ++j) {
+                            val.coeffs[j] = lhs.coeffs[j] + rhs.coeffs[j];
+                        }
+                        break;
+                    case EXPR_OP_SUB:
+                        for (j = 0; j < ARRAYLEN(val.coeffs); ++j) {
+                            val.coeffs[j] = lhs.coeffs[j] - rhs.coeffs[j];
+                        }
+                        break;
+                    case EXPR_OP_MUL:
+                        if (linear_is_constant(&lhs)) {
+                            val = rhs;
+                            linear_scale(&val, lhs.coeffs[0]);
+                        }
+                        else if (linear_is_constant(&rhs)) {
+                            val = lhs;
+                            linear_scale(&val, rhs.coeffs[0]);
+                        }
+                        else {
+                            /* Data byte times data byte. */
+                            return false;
+                        }
+                        break;
+                    case EXPR_OP_DIV:
+                        /*
+                         * Integer division truncates, so it is linear only over
+                         * floats.
+                         */
+                        if (type != PID_DATA_TYPE_FLOAT) {
+                            return false;
+                        }
+                        if (!linear_is_constant(&rhs) || rhs.coeffs[0] == 0) {
+                            return false;
+                        }
+                        val = lhs;
+                        linear_scale(&val, 1 / rhs.coeffs[0]);
+                        break;
+                }
+                break;
+        }
+        PUSH_STACK(LINEAR_STACK, &stack, &val);
+    }
+
+    XASSERT_EQ(STACK_SIZE(LINEAR_STACK, &stack), 1);
+    *result = POP_STACK(LINEAR_STACK, &stack);
+
+    return true;
+}
+
+/*
+ * Folds a unit conversion into a linear value and stores it in an expression.
+ */
+static
+void fold_linear(
+    const struct linear_val *val,
+    const struct unit_conv *conv,
+    struct expr *expr)
+{
+    size_t i;
+
+    expr->type = EXPR_LINEAR;
+    expr->coeffs[0] = conv->scale*val->coeffs[0] + conv->offset;
+    expr->size = 0;
+    for (i = 1; i < ARRAYLEN(expr->coeffs); ++i) {
+        expr->coeffs[i] = conv->scale*val->coeffs[i];
+        if (val->coeffs[i] != 0) {
+            expr->size = i;
+        }
+    }
+}
+
+size_t parse_expr_tokens(
+    const char *str,
+    pid_data_type type,
+    struct expr_token *toks)
 {
-    size_t expr_bytes;
     parse_token op_data[OP_STACK_SIZE];
     struct OP_STACK op_stack;
-    struct expr_token out_data[OUT_STACK_SIZE];
     struct EXPR_STACK out_stack;
 
+    INIT_STACK(OP_STACK, &op_stack, op_data, ARRAYLEN(op_data));
+    INIT_STACK(EXPR_STACK, &out_stack, toks, EXPR_MAX_TOKENS);
+
+    /*
+     * Note that in the original Shunting Yard algorithm, we use an output queue
+     * instead of an output stack. Reading the stack from bottom to top
+     * effectively turns it into a queue, so the tokens come out in RPN order.
+     */
+    shunting_yard(str, type, &op_stack, &out_stack);
+
+    return STACK_SIZE(EXPR_STACK, &out_stack);
+}
+
+yobd_err compile_expr(
+    const struct expr_token *toks,
+    size_t count,
+    struct expr *expr)
+{
+    uint8_t *code;
+    size_t code_size;
+    size_t const_count;
+    union expr_const *consts;
+    size_t depth;
+    size_t i;
+    size_t max_depth;
+
+    /*
+     * Size the constant pool and the code, and find the maximum stack depth,
+     * so that evaluation needs neither bounds checks nor type checks.
+     */
+    const_count = 0;
+    code_size = 0;
+    depth = 0;
+    max_depth = 0;
+    for (i = 0; i < count; ++i) {
+        switch (toks[i].type) {
+            case EXPR_FLOAT:
+            case EXPR_INT32:
+                ++const_count;
+                code_size += 2;
+                ++depth;
+                break;
+            case EXPR_A:
+            case EXPR_B:
+            case EXPR_C:
+            case EXPR_D:
+                ++code_size;
+                ++depth;
+                break;
+            case EXPR_OP:
+                XASSERT_GTE(depth, 2);
+                ++code_size;
+                --depth;
+                break;
+        }
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+    }
+    XASSERT_EQ(depth, 1);
+    /* Constant indices must fit in the one-byte operand. */
+    XASSERT_LTE(const_count, UINT8_MAX + 1);
+
+    consts = malloc(const_count*sizeof(*consts) + code_size);
+    if (consts == NULL) {
+        return YOBD_OOM;
+    }
+    code = (uint8_t *) (consts + const_count);
+
+    expr->type = EXPR_STACK;
+    expr->size = code_size;
+    expr->consts = consts;
+    expr->code = code;
+    expr->max_depth = max_depth;
+
+    const_count = 0;
+    for (i = 0; i < count; ++i) {
+        switch (toks[i].type) {
+            case EXPR_A:
+                *code++ = BC_PUSH_A;
+                break;
+            case EXPR_B:
+                *code++ = BC_PUSH_B;
+                break;
+            case EXPR_C:
+                *code++ = BC_PUSH_C;
+                break;
+            case EXPR_D:
+                *code++ = BC_PUSH_D;
+                break;
+            case EXPR_FLOAT:
+                consts[const_count].as_float = toks[i].as_float;
+                *code++ = BC_PUSH_CONST;
+                *code++ = const_count++;
+                break;
+            case EXPR_INT32:
+                consts[const_count].as_int32_t = toks[i].as_int32_t;
+                *code++ = BC_PUSH_CONST;
+                *code++ = const_count++;
+                break;
+            case EXPR_OP:
+                switch (toks[i].as_op) {
+                    case EXPR_OP_ADD:
+                        *code++ = BC_ADD;
+                        break;
+                    case EXPR_OP_SUB:
+                        *code++ = BC_SUB;
+                        break;
+                    case EXPR_OP_MUL:
+                        *code++ = BC_MUL;
+                        break;
+                    case EXPR_OP_DIV:
+                        *code++ = BC_DIV;
+                        break;
+                }
+                break;
+        }
+    }
+
+    return YOBD_OK;
+}
+
+yobd_err parse_expr_val(
+    const char *str,
+    struct expr *expr,
+    pid_data_type type,
+    const struct unit_conv *conv)
+{
+    size_t count;
+    struct linear_val linear;
+    struct expr_token toks[EXPR_MAX_TOKENS];
+
     if (strcmp(str, "nop") == 0) {
         /*
          * no-op means we don't have to evaluate anything; just pass the data
@@ -307,36 +587,190 @@ yobd_err parse_expr_val(const char *str, struct expr *expr, pid_data_type type)
          */
         expr->type = EXPR_NOP;
         expr->size = 0;
-        expr->data = NULL;
         return YOBD_OK;
     }
 
-    INIT_STACK(OP_STACK, &op_stack, op_data, ARRAYLEN(op_data));
-    INIT_STACK(EXPR_STACK, &out_stack, out_data, ARRAYLEN(out_data));
+    count = parse_expr_tokens(str, type, toks);
 
-    shunting_yard(str, type, &op_stack, &out_stack);
+    /*
+     * Most expressions are linear in the data bytes, as are all unit
+     * conversions. In that case, skip the stack machine entirely and just
+     * compute a few products at runtime.
+     */
+    if (make_linear(toks, count, type, &linear)) {
+        fold_linear(&linear, conv, expr);
+        return YOBD_OK;
+    }
 
-    /* Make our expression data the right size. */
-    expr->type = EXPR_STACK;
-    expr->size = STACK_SIZE(EXPR_STACK, &out_stack);
-    expr_bytes = expr->size * sizeof(*expr->data);
-    expr->data = malloc(expr_bytes);
-    if (expr->data == NULL) {
-        return YOBD_OOM;
+    return compile_expr(toks, count, expr);
+}
+
+bool expr_is_total(const struct expr *expr, pid_data_type type)
+{
+    const uint8_t *code;
+    const uint8_t *end;
+    const union expr_const *prev_const;
+
+    if (expr->type != EXPR_STACK) {
+        /* Linear and nop expressions never divide at runtime. */
+        return true;
     }
 
     /*
-     * Note that in the original Shunting Yard algorithm, we use an output queue
-     * instead of an output stack. By copying from the stack bottom to the stack
-     * top, we effectively reverse the stack order and turn it into a queue so
-     * that it will be correctly evaluated.
+     * In RPN, a divisor that is a single constant is pushed right before the
+     * division. Anything else might be zero for some input.
      */
-    memcpy(expr->data, STACK_DATA(EXPR_STACK, &out_stack), expr_bytes);
+    prev_const = NULL;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch (*code) {
+            case BC_PUSH_CONST:
+                ++code;
+                prev_const = &expr->consts[*code];
+                continue;
+            case BC_DIV:
+                if (prev_const == NULL) {
+                    return false;
+                }
+                if (type == PID_DATA_TYPE_FLOAT && prev_const->as_float == 0) {
+                    return false;
+                }
+                if (type != PID_DATA_TYPE_FLOAT && prev_const->as_int32_t == 0) {
+                    return false;
+                }
+                break;
+        }
+        prev_const = NULL;
+    }
 
-    return YOBD_OK;
+    return true;
+}
+
+size_t expr_data_bytes(const struct expr *expr)
+{
+    size_t bytes;
+    const uint8_t *code;
+    const uint8_t *end;
+
+    switch (expr->type) {
+        case EXPR_NOP:
+            return 0;
+        case EXPR_LINEAR:
+            return expr->size;
+        case EXPR_STACK:
+            break;
+    }
+
+    bytes = 0;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch (*code) {
+            case BC_PUSH_CONST:
+                /* Skip the constant index, which might look like a push. */
+                ++code;
+                break;
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                if ((size_t) (*code - BC_PUSH_A) + 1 > bytes) {
+                    bytes = *code - BC_PUSH_A + 1;
+                }
+                break;
+        }
+    }
+
+    return bytes;
+}
+
+bool stack_expr_divides(const struct expr *expr)
+{
+    const uint8_t *code;
+    const uint8_t *end;
+
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch (*code) {
+            case BC_PUSH_CONST:
+                /* Skip the constant index, which might look like BC_DIV. */
+                ++code;
+                break;
+            case BC_DIV:
+                return true;
+        }
+    }
+
+    return false;
+}
+
+size_t stack_expr_const_count(const struct expr *expr)
+{
+    return (expr->code - (const uint8_t *) expr->consts) /
+        sizeof(*expr->consts);
+}
+
+size_t stack_expr_bytes(const struct expr *expr)
+{
+    return stack_expr_const_count(expr)*sizeof(*expr->consts) + expr->size;
+}
+
+void relocate_stack_expr(struct expr *expr, void *dest)
+{
+    size_t const_count;
+
+    const_count = stack_expr_const_count(expr);
+    memcpy(dest, expr->consts, stack_expr_bytes(expr));
+    expr->consts = dest;
+    expr->code = (const uint8_t *) (expr->consts + const_count);
+}
+
+bool stack_expr_is_valid(const struct expr *expr, size_t const_count)
+{
+    const uint8_t *code;
+    size_t depth;
+    const uint8_t *end;
+
+    depth = 0;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch (*code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                ++depth;
+                break;
+            case BC_PUSH_CONST:
+                ++code;
+                if (code == end || *code >= const_count) {
+                    return false;
+                }
+                ++depth;
+                break;
+            case BC_ADD:
+            case BC_SUB:
+            case BC_MUL:
+            case BC_DIV:
+                if (depth < 2) {
+                    return false;
+                }
+                --depth;
+                break;
+            default:
+                return false;
+        }
+        if (depth > expr->max_depth) {
+            return false;
+        }
+    }
+
+    return depth == 1;
 }
 
 void destroy_expr(struct expr *expr)
 {
-    free(expr->data);
+    if (expr->type == EXPR_STACK) {
+        /* The code lives in the same allocation as the constants. */
+        free(expr->consts);
+    }
 }
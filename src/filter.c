@@ -0,0 +1,235 @@
+/**
+ * @file      filter.c
+ * @brief     Generation of kernel CAN filters and BPF programs from a schema.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <yobd/filter.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+/* The mask that makes one filter match all 8 response IDs. */
+#define RESPONSE_ID_MASK \
+    (~((canid_t) (YOBD_OBD_II_RESPONSE_END - YOBD_OBD_II_RESPONSE_BASE)))
+
+/* What a BPF program returns to keep a whole frame, or to drop it. */
+#define BPF_ACCEPT (UINT32_MAX)
+#define BPF_REJECT (0)
+
+/* The instructions each PID takes in a BPF program. */
+#define BPF_PID_INSNS (5)
+
+/* Offsets of CAN frame fields, as BPF loads see them. */
+#define OFFSET_ID (offsetof(struct can_frame, can_id))
+#define OFFSET_DLC (offsetof(struct can_frame, can_dlc))
+#define OFFSET_DATA (offsetof(struct can_frame, data))
+
+PUBLIC_API
+yobd_err yobd_make_can_filters(
+    struct yobd_ctx *ctx,
+    struct can_filter *filters,
+    size_t max,
+    size_t *count)
+{
+    if (ctx == NULL || count == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *count = 1;
+    if (filters == NULL) {
+        return YOBD_OK;
+    }
+    if (max < *count) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    /*
+     * The response IDs are 8-aligned, so one filter covers them all. Keeping
+     * the EFF and RTR flags in the mask rejects extended and remote frames.
+     */
+    filters[0].can_id = YOBD_OBD_II_RESPONSE_BASE;
+    filters[0].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+        (CAN_SFF_MASK & RESPONSE_ID_MASK);
+
+    return YOBD_OK;
+}
+
+/* Appends BPF instructions, or just counts them if there is no program. */
+struct emitter {
+    struct sock_filter *prog;
+    size_t max;
+    size_t len;
+};
+
+static
+void emit(
+    struct emitter *e,
+    uint16_t code,
+    uint8_t jt,
+    uint8_t jf,
+    uint32_t k)
+{
+    if (e->prog != NULL && e->len < e->max) {
+        e->prog[e->len].code = code;
+        e->prog[e->len].jt = jt;
+        e->prog[e->len].jf = jf;
+        e->prog[e->len].k = k;
+    }
+    ++e->len;
+}
+
+/*
+ * BPF word loads read memory as big-endian, but can_id is in host byte order.
+ * Returns the value a word load of the given can_id yields.
+ */
+static
+uint32_t id_as_loaded(canid_t id)
+{
+    unsigned char bytes[sizeof(id)];
+
+    memcpy(bytes, &id, sizeof(bytes));
+
+    return ((uint32_t) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) |
+           bytes[3];
+}
+
+/* Returns the value a halfword load of a manufacturer-mode PID yields. */
+static
+uint32_t pid_as_loaded(bool big_endian, yobd_pid pid)
+{
+    if (big_endian) {
+        return pid;
+    }
+    else {
+        return ((pid & 0xff) << 8) | (pid >> 8);
+    }
+}
+
+/*
+ * Emits the checks for every PID of one mode, which start with the mode byte
+ * in A and end by either returning or jumping past the mode's block.
+ */
+static
+void emit_mode(
+    struct emitter *e,
+    const struct yobd_ctx *ctx,
+    size_t start,
+    size_t end)
+{
+    size_t i;
+    yobd_mode mode;
+    const struct pid_ctx *pid_ctx;
+    yobd_pid pid;
+
+    mode = get_mode(ctx->modepids[start]);
+
+    /* Skip this block, including its final return, if the mode differs. */
+    emit(e, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0x40 + mode);
+    emit(e, BPF_JMP | BPF_JA, 0, 0, (end - start) * BPF_PID_INSNS + 2);
+
+    if (mode_is_sae_standard(mode)) {
+        emit(e, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFFSET_DATA + 2);
+    }
+    else {
+        emit(e, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFFSET_DATA + 2);
+    }
+
+    for (i = start; i < end; ++i) {
+        pid_ctx = &ctx->pids[i];
+        pid = get_pid(ctx->modepids[i]);
+        if (mode_is_sae_standard(mode)) {
+            emit(e, BPF_JMP | BPF_JEQ | BPF_K, 0, 4, pid);
+        }
+        else {
+            emit(
+                e,
+                BPF_JMP | BPF_JEQ | BPF_K,
+                0,
+                4,
+                pid_as_loaded(ctx->big_endian, pid));
+        }
+        emit(e, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFFSET_DATA);
+        emit(e, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, pid_ctx->expected_bytes);
+        emit(e, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+        emit(e, BPF_RET | BPF_K, 0, 0, BPF_REJECT);
+    }
+
+    emit(e, BPF_RET | BPF_K, 0, 0, BPF_REJECT);
+}
+
+PUBLIC_API
+yobd_err yobd_make_can_bpf(
+    struct yobd_ctx *ctx,
+    struct sock_filter *prog,
+    size_t max,
+    size_t *len)
+{
+    struct emitter e;
+    size_t end;
+    yobd_mode mode;
+    size_t start;
+
+    if (ctx == NULL || len == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    e.prog = prog;
+    e.max = max;
+    e.len = 0;
+
+    /* Only OBD II response IDs. */
+    emit(&e, BPF_LD | BPF_W | BPF_ABS, 0, 0, OFFSET_ID);
+    emit(
+        &e,
+        BPF_ALU | BPF_AND | BPF_K,
+        0,
+        0,
+        id_as_loaded(RESPONSE_ID_MASK));
+    emit(
+        &e,
+        BPF_JMP | BPF_JEQ | BPF_K,
+        1,
+        0,
+        id_as_loaded(YOBD_OBD_II_RESPONSE_BASE));
+    emit(&e, BPF_RET | BPF_K, 0, 0, BPF_REJECT);
+
+    emit(&e, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFFSET_DLC);
+    emit(&e, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, OBD_II_DLC);
+    emit(&e, BPF_RET | BPF_K, 0, 0, BPF_REJECT);
+
+    /*
+     * One block per mode. modepids is sorted, so each mode's PIDs are
+     * contiguous. Response modes below 0x41 or above 0xff cannot be parsed, so
+     * such modes are left out.
+     */
+    emit(&e, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFFSET_DATA + 1);
+    for (start = 0; start < ctx->pid_count; start = end) {
+        mode = get_mode(ctx->modepids[start]);
+        for (end = start; end < ctx->pid_count; ++end) {
+            if (get_mode(ctx->modepids[end]) != mode) {
+                break;
+            }
+        }
+        if (mode >= 0x01 && mode <= 0xff - 0x40) {
+            emit_mode(&e, ctx, start, end);
+        }
+    }
+    emit(&e, BPF_RET | BPF_K, 0, 0, BPF_REJECT);
+
+    *len = e.len;
+    if (e.len > BPF_MAXINSNS) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (prog != NULL && max < e.len) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    return YOBD_OK;
+}
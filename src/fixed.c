@@ -0,0 +1,515 @@
+/**
+ * @file      fixed.c
+ * @brief     Fixed-point evaluation of PIDs for targets without an FPU.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/fixed.h>
+#include <yobd-private/parser.h>
+
+/*
+ * The range of frac_bits. PIDs whose range is too large for this are evaluated
+ * in floating point and saturated.
+ */
+#define FIXED_MIN_FRAC_BITS (-60)
+#define FIXED_MAX_FRAC_BITS (60)
+
+/*
+ * The frac_bits of float PIDs whose range cannot be bounded: float
+ * passthroughs, and float expressions that might divide by zero. Values
+ * saturate beyond 2^23 in magnitude, which is where a float runs out of
+ * fraction bits anyway.
+ */
+#define FIXED_FLOAT_FRAC_BITS (8)
+
+/* A closed interval, bounding the values an expression can take. */
+struct range {
+    double lo;
+    double hi;
+};
+
+static
+double abs_double(double x)
+{
+    return (x < 0) ? -x : x;
+}
+
+/* Returns 2^exp, without needing libm. */
+static
+double pow2(int exp)
+{
+    double val;
+
+    val = 1;
+    for (; exp > 0; --exp) {
+        val *= 2;
+    }
+    for (; exp < 0; ++exp) {
+        val /= 2;
+    }
+
+    return val;
+}
+
+/* Rounds to the nearest integer, with ties away from zero. */
+static
+int64_t round_int64(double x)
+{
+    return (x >= 0) ? (int64_t) (x + 0.5) : (int64_t) (x - 0.5);
+}
+
+static
+double range_max_abs(const struct range *range)
+{
+    double hi;
+    double lo;
+
+    lo = abs_double(range->lo);
+    hi = abs_double(range->hi);
+
+    return (lo > hi) ? lo : hi;
+}
+
+/* Returns the smallest range holding all of the given values. */
+static
+struct range range_of(const double *vals, size_t count)
+{
+    size_t i;
+    struct range range;
+
+    range.lo = vals[0];
+    range.hi = vals[0];
+    for (i = 1; i < count; ++i) {
+        if (vals[i] < range.lo) {
+            range.lo = vals[i];
+        }
+        if (vals[i] > range.hi) {
+            range.hi = vals[i];
+        }
+    }
+
+    return range;
+}
+
+/* Truncates toward zero, like integer division. */
+static
+double trunc_double(double x)
+{
+    return (double) (int64_t) x;
+}
+
+/*
+ * Bounds the value of a stack expression over every possible input, by
+ * interval arithmetic over its bytecode. Integer expressions that might
+ * overflow 32 bits get the whole int32_t range, since they wrap. Returns false
+ * if the expression is unbounded, which happens only when a float expression
+ * might divide by zero.
+ */
+static
+bool stack_expr_range(
+    const struct expr *expr,
+    pid_data_type type,
+    struct range *out)
+{
+    const uint8_t *code;
+    const uint8_t *end;
+    struct range lhs;
+    double max;
+    struct range rhs;
+    struct range stack[expr->max_depth];
+    struct range *top;
+    double val;
+    double vals[4];
+    bool wraps;
+
+    wraps = false;
+    top = stack;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch ((bytecode_op) *code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                top->lo = 0;
+                top->hi = UINT8_MAX;
+                ++top;
+                continue;
+            case BC_PUSH_CONST:
+                ++code;
+                if (type == PID_DATA_TYPE_FLOAT) {
+                    val = expr->consts[*code].as_float;
+                }
+                else {
+                    val = expr->consts[*code].as_int32_t;
+                }
+                top->lo = val;
+                top->hi = val;
+                ++top;
+                continue;
+            case BC_ADD:
+            case BC_SUB:
+            case BC_MUL:
+            case BC_DIV:
+                break;
+        }
+
+        rhs = *--top;
+        lhs = top[-1];
+        switch ((bytecode_op) *code) {
+            case BC_ADD:
+                top[-1].lo = lhs.lo + rhs.lo;
+                top[-1].hi = lhs.hi + rhs.hi;
+                break;
+            case BC_SUB:
+                top[-1].lo = lhs.lo - rhs.hi;
+                top[-1].hi = lhs.hi - rhs.lo;
+                break;
+            case BC_MUL:
+                vals[0] = lhs.lo*rhs.lo;
+                vals[1] = lhs.lo*rhs.hi;
+                vals[2] = lhs.hi*rhs.lo;
+                vals[3] = lhs.hi*rhs.hi;
+                top[-1] = range_of(vals, 4);
+                break;
+            case BC_DIV:
+                if (type != PID_DATA_TYPE_FLOAT && rhs.lo == rhs.hi) {
+                    /* Truncation is monotonic, so the ends stay the ends. */
+                    vals[0] = trunc_double(lhs.lo / rhs.lo);
+                    vals[1] = trunc_double(lhs.hi / rhs.lo);
+                    top[-1] = range_of(vals, 2);
+                }
+                else if (type != PID_DATA_TYPE_FLOAT) {
+                    /* A nonzero integer divisor can only shrink the value. */
+                    max = range_max_abs(&lhs);
+                    top[-1].lo = -max;
+                    top[-1].hi = max;
+                }
+                else if (rhs.lo <= 0 && rhs.hi >= 0) {
+                    return false;
+                }
+                else {
+                    vals[0] = lhs.lo / rhs.lo;
+                    vals[1] = lhs.lo / rhs.hi;
+                    vals[2] = lhs.hi / rhs.lo;
+                    vals[3] = lhs.hi / rhs.hi;
+                    top[-1] = range_of(vals, 4);
+                }
+                break;
+            default:
+                XASSERT_ERROR;
+                break;
+        }
+
+        if (top[-1].lo < INT32_MIN || top[-1].hi > INT32_MAX) {
+            wraps = true;
+        }
+    }
+
+    *out = stack[0];
+    if (type != PID_DATA_TYPE_FLOAT && wraps) {
+        out->lo = INT32_MIN;
+        out->hi = INT32_MAX;
+    }
+
+    return true;
+}
+
+/*
+ * Picks the largest frac_bits for which values up to bound in magnitude stay
+ * below 2^FIXED_RANGE_BITS. Returns false if there is no such frac_bits in
+ * range.
+ */
+static
+bool pick_frac_bits(double bound, int8_t *frac_bits)
+{
+    int bits;
+    double limit;
+
+    if (bound == 0) {
+        *frac_bits = 0;
+        return true;
+    }
+
+    /* Find the smallest bits with bound < 2^bits. */
+    bits = 0;
+    for (limit = 1; limit <= bound; limit *= 2) {
+        ++bits;
+    }
+    for (; limit / 2 > bound; limit /= 2) {
+        --bits;
+    }
+
+    bits = FIXED_RANGE_BITS - bits;
+    if (bits < FIXED_MIN_FRAC_BITS) {
+        return false;
+    }
+    if (bits > FIXED_MAX_FRAC_BITS) {
+        bits = FIXED_MAX_FRAC_BITS;
+    }
+    *frac_bits = bits;
+
+    return true;
+}
+
+/*
+ * Fills in coefficients for value = c[0] + c[1]*x1 + ..., where each xi is at
+ * most max_x[i-1] in magnitude. Returns false if the result cannot be scaled
+ * into range.
+ */
+static
+bool set_coeffs(
+    struct fixed_pid *fixed,
+    const double *c,
+    const double *max_x,
+    size_t count)
+{
+    double bound;
+    size_t i;
+    double scale;
+
+    bound = abs_double(c[0]);
+    for (i = 1; i < count; ++i) {
+        bound += abs_double(c[i]) * max_x[i-1];
+    }
+    if (!pick_frac_bits(bound, &fixed->frac_bits)) {
+        return false;
+    }
+
+    /*
+     * Every term is now below 2^(FIXED_RANGE_BITS + FIXED_GUARD_BITS) in
+     * magnitude, so the sum fits comfortably in an int64_t.
+     */
+    scale = pow2(fixed->frac_bits + FIXED_GUARD_BITS);
+    for (i = 0; i < EXPR_LINEAR_COEFFS; ++i) {
+        fixed->coeffs[i] = (i < count) ? round_int64(c[i] * scale) : 0;
+    }
+    /* Round to nearest when shifting out the guard bits. */
+    fixed->coeffs[0] += ((int64_t) 1) << (FIXED_GUARD_BITS - 1);
+
+    return true;
+}
+
+static
+void set_float(struct fixed_pid *fixed, int8_t frac_bits)
+{
+    fixed->kind = FIXED_FLOAT;
+    fixed->frac_bits = frac_bits;
+    fixed->float_scale = pow2(frac_bits);
+}
+
+static
+void compile_fixed(const struct pid_ctx *pid_ctx, struct fixed_pid *fixed)
+{
+    double c[EXPR_LINEAR_COEFFS];
+    const struct unit_conv *conv;
+    const struct expr *expr;
+    int8_t frac_bits;
+    size_t i;
+    double max_x[EXPR_LINEAR_COEFFS - 1];
+    struct range range;
+
+    conv = &pid_ctx->conv;
+    expr = &pid_ctx->expr;
+    c[0] = conv->offset;
+    c[1] = conv->scale;
+    switch (expr->type) {
+        case EXPR_LINEAR:
+            fixed->kind = FIXED_LINEAR;
+            for (i = 0; i < EXPR_LINEAR_COEFFS; ++i) {
+                c[i] = expr->coeffs[i];
+            }
+            for (i = 0; i < EXPR_LINEAR_COEFFS - 1; ++i) {
+                max_x[i] = UINT8_MAX;
+            }
+            if (set_coeffs(fixed, c, max_x, EXPR_LINEAR_COEFFS)) {
+                return;
+            }
+            break;
+        case EXPR_NOP:
+            if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                set_float(fixed, FIXED_FLOAT_FRAC_BITS);
+                return;
+            }
+            fixed->kind = FIXED_NOP;
+            max_x[0] = pow2(8*pid_ctx->can_bytes) - 1;
+            if (set_coeffs(fixed, c, max_x, 2)) {
+                return;
+            }
+            break;
+        case EXPR_STACK:
+            if (!stack_expr_range(expr, pid_ctx->pid_type, &range)) {
+                set_float(fixed, FIXED_FLOAT_FRAC_BITS);
+                return;
+            }
+            if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                if (!pick_frac_bits(
+                        abs_double(c[0]) +
+                        abs_double(c[1])*range_max_abs(&range),
+                        &frac_bits)) {
+                    frac_bits = FIXED_MIN_FRAC_BITS;
+                }
+                set_float(fixed, frac_bits);
+                return;
+            }
+            fixed->kind = FIXED_STACK_INT;
+            max_x[0] = range_max_abs(&range);
+            if (set_coeffs(fixed, c, max_x, 2)) {
+                return;
+            }
+            break;
+    }
+
+    /*
+     * The range is too large for integer arithmetic at any frac_bits we allow,
+     * so evaluate in float at the coarsest scale.
+     */
+    set_float(fixed, FIXED_MIN_FRAC_BITS);
+}
+
+yobd_err build_fixed(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts)
+{
+    size_t i;
+
+    if (!opts->fixed_point) {
+        return YOBD_OK;
+    }
+
+    ctx->fixed = malloc(ctx->pid_count * sizeof(*ctx->fixed));
+    if (ctx->fixed == NULL && ctx->pid_count > 0) {
+        return YOBD_OOM;
+    }
+
+    for (i = 0; i < ctx->pid_count; ++i) {
+        compile_fixed(&ctx->pids[i], &ctx->fixed[i]);
+    }
+
+    return YOBD_OK;
+}
+
+/* Assembles the data bytes of a passthrough PID into an unsigned integer. */
+static inline
+uint32_t nop_raw(const struct pid_ctx *pid_ctx, const unsigned char *data)
+{
+    uint_fast8_t i;
+    uint32_t raw;
+
+    raw = 0;
+    if (pid_ctx->big_endian) {
+        for (i = 0; i < pid_ctx->can_bytes; ++i) {
+            raw = (raw << 8) | data[i];
+        }
+    }
+    else {
+        for (i = pid_ctx->can_bytes; i > 0; --i) {
+            raw = (raw << 8) | data[i-1];
+        }
+    }
+
+    return raw;
+}
+
+/* Rounds a float to an int32_t, saturating and mapping NaN to 0. */
+static inline
+int32_t saturate_float(float val)
+{
+    if (val != val) {
+        return 0;
+    }
+    if (val >= 2147483648.0f) {
+        return INT32_MAX;
+    }
+    if (val <= -2147483648.0f) {
+        return INT32_MIN;
+    }
+
+    return (int32_t) round_int64(val);
+}
+
+static inline
+int32_t fixed_eval(
+    const struct fixed_pid *fixed,
+    const struct pid_ctx *pid_ctx,
+    const unsigned char *data)
+{
+    int64_t acc;
+    size_t i;
+    int64_t raw;
+
+    acc = fixed->coeffs[0];
+    switch (fixed->kind) {
+        case FIXED_LINEAR:
+            for (i = 0; i < pid_ctx->expr.size; ++i) {
+                acc += fixed->coeffs[i+1] * data[i];
+            }
+            break;
+        case FIXED_NOP:
+            raw = nop_raw(pid_ctx, data);
+            acc += fixed->coeffs[1] * raw;
+            break;
+        case FIXED_STACK_INT:
+            raw = stack_eval_int(&pid_ctx->expr, data);
+            acc += fixed->coeffs[1] * raw;
+            break;
+        default:
+            return saturate_float(decode_pid(pid_ctx, data) * fixed->float_scale);
+    }
+
+    /*
+     * The shift is arithmetic, so it rounds toward negative infinity, which
+     * the bias in coeffs[0] turns into rounding to nearest.
+     */
+    return acc >> FIXED_GUARD_BITS;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_can_response_fixed(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frame,
+    int32_t *val,
+    int8_t *frac_bits)
+{
+    yobd_err err;
+    const struct fixed_pid *fixed;
+    size_t index;
+    yobd_mode mode;
+    yobd_pid pid;
+    const struct pid_ctx *pid_ctx;
+
+    if (ctx == NULL || frame == NULL || val == NULL || frac_bits == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (ctx->fixed == NULL) {
+        /* The context was not built for fixed point. */
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    err = parse_response_headers(ctx->big_endian, frame, &mode, &pid);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    index = get_pid_index(ctx, mode, pid);
+    if (index == SIZE_MAX) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+    pid_ctx = &ctx->pids[index];
+    if (frame->data[0] != pid_ctx->expected_bytes) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+
+    fixed = &ctx->fixed[index];
+    *val = fixed_eval(fixed, pid_ctx, &frame->data[pid_ctx->data_offset]);
+    *frac_bits = fixed->frac_bits;
+
+    return YOBD_OK;
+}
@@ -0,0 +1,240 @@
+/**
+ * @file      isotp.c
+ * @brief     ISO-TP (ISO 15765-2) framing of OBD II messages.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/isotp.h>
+
+size_t isotp_frame_count(size_t size)
+{
+    if (size <= ISOTP_SINGLE_MAX) {
+        return 1;
+    }
+
+    size -= ISOTP_FIRST_DATA;
+
+    return 1 + (size + ISOTP_CONSECUTIVE_DATA - 1) / ISOTP_CONSECUTIVE_DATA;
+}
+
+/* Copies part of a message into a frame after its header, padding the rest. */
+static
+void fill_frame(
+    struct can_frame *frame,
+    size_t header,
+    const unsigned char *data,
+    size_t size)
+{
+    memcpy(&frame->data[header], data, size);
+    memset(
+        &frame->data[header + size],
+        OBD_II_PAD_VALUE,
+        sizeof(frame->data) - header - size);
+}
+
+void isotp_segment(
+    canid_t id,
+    const unsigned char *payload,
+    size_t size,
+    struct can_frame *frames)
+{
+    size_t chunk;
+    size_t i;
+    size_t offset;
+
+    XASSERT_LTE(size, ISOTP_MAX_SIZE);
+
+    frames[0].can_id = id;
+    frames[0].can_dlc = OBD_II_DLC;
+    if (size <= ISOTP_SINGLE_MAX) {
+        frames[0].data[0] = (ISOTP_SINGLE << 4) | size;
+        fill_frame(&frames[0], 1, payload, size);
+        return;
+    }
+
+    frames[0].data[0] = (ISOTP_FIRST << 4) | (size >> 8);
+    frames[0].data[1] = size & 0xff;
+    fill_frame(&frames[0], 2, payload, ISOTP_FIRST_DATA);
+
+    /* Sequence numbers start at 1 and wrap around after 15. */
+    offset = ISOTP_FIRST_DATA;
+    for (i = 1; offset < size; ++i) {
+        chunk = size - offset;
+        if (chunk > ISOTP_CONSECUTIVE_DATA) {
+            chunk = ISOTP_CONSECUTIVE_DATA;
+        }
+        frames[i].can_id = id;
+        frames[i].can_dlc = OBD_II_DLC;
+        frames[i].data[0] = (ISOTP_CONSECUTIVE << 4) | (i & 0xf);
+        fill_frame(&frames[i], 1, &payload[offset], chunk);
+        offset += chunk;
+    }
+}
+
+yobd_err isotp_reassemble(
+    const struct can_frame *frames,
+    size_t count,
+    unsigned char *payload,
+    size_t max,
+    size_t *size)
+{
+    size_t chunk;
+    size_t i;
+    size_t len;
+    size_t offset;
+
+    if (count == 0) {
+        return YOBD_INVALID_ISOTP;
+    }
+    for (i = 0; i < count; ++i) {
+        if (frames[i].can_dlc != OBD_II_DLC) {
+            return YOBD_INVALID_DLC;
+        }
+    }
+
+    switch (isotp_get_type(&frames[0])) {
+        case ISOTP_SINGLE:
+            len = frames[0].data[0] & 0xf;
+            if (count != 1 || len == 0 || len > ISOTP_SINGLE_MAX) {
+                return YOBD_INVALID_ISOTP;
+            }
+            if (len > max) {
+                return YOBD_INVALID_PARAMETER;
+            }
+            memcpy(payload, &frames[0].data[1], len);
+            *size = len;
+            return YOBD_OK;
+        case ISOTP_FIRST:
+            break;
+        default:
+            return YOBD_INVALID_ISOTP;
+    }
+
+    /* Anything that fits in a single frame must be sent as one. */
+    len = ((frames[0].data[0] & 0xf) << 8) | frames[0].data[1];
+    if (len <= ISOTP_SINGLE_MAX || count != isotp_frame_count(len)) {
+        return YOBD_INVALID_ISOTP;
+    }
+    if (len > max) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    memcpy(payload, &frames[0].data[2], ISOTP_FIRST_DATA);
+    offset = ISOTP_FIRST_DATA;
+    for (i = 1; i < count; ++i) {
+        if (frames[i].can_id != frames[0].can_id ||
+            isotp_get_type(&frames[i]) != ISOTP_CONSECUTIVE ||
+            (frames[i].data[0] & 0xf) != (i & 0xf)) {
+            return YOBD_INVALID_ISOTP;
+        }
+
+        chunk = len - offset;
+        if (chunk > ISOTP_CONSECUTIVE_DATA) {
+            chunk = ISOTP_CONSECUTIVE_DATA;
+        }
+        memcpy(&payload[offset], &frames[i].data[1], chunk);
+        offset += chunk;
+    }
+    *size = len;
+
+    return YOBD_OK;
+}
+
+void isotp_make_flow_control(canid_t response_id, struct can_frame *frame)
+{
+    frame->can_id = response_id - ISOTP_FLOW_CONTROL_OFFSET;
+    frame->can_dlc = OBD_II_DLC;
+    frame->data[0] = (ISOTP_FLOW_CONTROL << 4) | ISOTP_FLOW_CONTINUE;
+    /* A block size of 0 means the ECU need not wait for more flow control. */
+    frame->data[1] = 0;
+    /* No minimum separation time between consecutive frames. */
+    frame->data[2] = 0;
+    memset(&frame->data[3], OBD_II_PAD_VALUE, sizeof(frame->data) - 3);
+}
+
+/* Returns the shortest CAN FD data length that holds size bytes. */
+static
+uint8_t fd_len(size_t size)
+{
+    static const uint8_t lens[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    size_t i;
+
+    i = 0;
+    while (lens[i] < size) {
+        ++i;
+    }
+
+    return lens[i];
+}
+
+void isotp_fd_make_single(
+    canid_t id,
+    const unsigned char *payload,
+    size_t size,
+    struct canfd_frame *frame)
+{
+    size_t header;
+
+    XASSERT_LTE(size, ISOTP_FD_SINGLE_MAX);
+
+    frame->can_id = id;
+    frame->flags = 0;
+    frame->__res0 = 0;
+    frame->__res1 = 0;
+    if (size <= ISOTP_SINGLE_MAX) {
+        frame->data[0] = (ISOTP_SINGLE << 4) | size;
+        header = 1;
+    }
+    else {
+        /* A zero length in the first byte means the length is in the next. */
+        frame->data[0] = ISOTP_SINGLE << 4;
+        frame->data[1] = size;
+        header = 2;
+    }
+    frame->len = fd_len(header + size);
+
+    memcpy(&frame->data[header], payload, size);
+    memset(
+        &frame->data[header + size],
+        OBD_II_PAD_VALUE,
+        frame->len - header - size);
+}
+
+yobd_err isotp_fd_parse_single(
+    const struct canfd_frame *frame,
+    const unsigned char **payload,
+    size_t *size)
+{
+    size_t len;
+
+    if (frame->len < OBD_II_DLC || frame->len > CANFD_MAX_DLEN ||
+        fd_len(frame->len) != frame->len) {
+        return YOBD_INVALID_DLC;
+    }
+    if (frame->data[0] >> 4 != ISOTP_SINGLE) {
+        return YOBD_INVALID_ISOTP;
+    }
+
+    len = frame->data[0] & 0xf;
+    if (frame->len == OBD_II_DLC) {
+        if (len == 0 || len > ISOTP_SINGLE_MAX) {
+            return YOBD_INVALID_ISOTP;
+        }
+        *payload = &frame->data[1];
+    }
+    else {
+        len = frame->data[1];
+        if (frame->data[0] != 0 || len <= ISOTP_SINGLE_MAX ||
+            len > frame->len - 2u) {
+            return YOBD_INVALID_ISOTP;
+        }
+        *payload = &frame->data[2];
+    }
+    *size = len;
+
+    return YOBD_OK;
+}
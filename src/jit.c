@@ -0,0 +1,548 @@
+/**
+ * @file      jit.c
+ * @brief     Native code generation for PID expressions.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <yobd/yobd.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/expr.h>
+#include <yobd-private/jit.h>
+#include <yobd-private/parser.h>
+
+#include "config.h"
+
+#if defined(CONFIG_YOBD_JIT) && defined(__x86_64__)
+#define JIT_SUPPORTED
+#endif
+
+#ifdef JIT_SUPPORTED
+
+/* Start each function on a 16-byte boundary, as compilers do. */
+#define JIT_FUNC_ALIGN (16)
+
+/*
+ * Float stack slot i lives in xmm<i>. xmm15 is reserved for comparing divisors
+ * against zero, leaving 15 slots.
+ */
+#define JIT_FLOAT_SLOTS (15)
+#define XMM_ZERO (15)
+
+/* x86-64 general-purpose register numbers. */
+#define RAX (0)
+#define RCX (1)
+#define RDX (2)
+#define RSI (6)
+#define RDI (7)
+#define R8 (8)
+#define R9 (9)
+#define R10 (10)
+#define R11 (11)
+
+/*
+ * Integer stack slots, which avoid rax and rdx (clobbered by idiv) and rdi
+ * (which holds the data pointer). All are caller-saved, so the generated code
+ * needs no prologue.
+ */
+static const uint8_t INT_SLOTS[] = { R8, R9, R10, R11, RSI, RCX };
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+/*
+ * A buffer to emit code into. If data is NULL, nothing is written, but size is
+ * still updated; this lets us measure the code before allocating memory for it.
+ */
+struct code_buf {
+    unsigned char *data;
+    size_t size;
+};
+
+static
+void emit_byte(struct code_buf *buf, uint8_t byte)
+{
+    if (buf->data != NULL) {
+        buf->data[buf->size] = byte;
+    }
+    ++buf->size;
+}
+
+static
+void emit_u32(struct code_buf *buf, uint32_t val)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(val); ++i) {
+        emit_byte(buf, (val >> (8*i)) & 0xff);
+    }
+}
+
+static
+void emit_u64(struct code_buf *buf, uint64_t val)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(val); ++i) {
+        emit_byte(buf, (val >> (8*i)) & 0xff);
+    }
+}
+
+static
+uint8_t modrm_reg(uint8_t reg, uint8_t rm)
+{
+    return 0xc0 | ((reg & 7) << 3) | (rm & 7);
+}
+
+/*
+ * Emits a REX prefix if one is needed: for 64-bit operands, or to reach
+ * registers 8-15 in the reg or rm fields.
+ */
+static
+void emit_rex(struct code_buf *buf, bool wide, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex;
+
+    rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40) {
+        emit_byte(buf, rex);
+    }
+}
+
+/*
+ * Emits a two-byte-opcode (0x0f) instruction with register operands, as used
+ * by SSE. prefix is the mandatory prefix (0x66, 0xf2, 0xf3) or 0 for none.
+ */
+static
+void emit_0f(
+    struct code_buf *buf,
+    uint8_t prefix,
+    bool wide,
+    uint8_t op,
+    uint8_t reg,
+    uint8_t rm)
+{
+    if (prefix != 0) {
+        emit_byte(buf, prefix);
+    }
+    emit_rex(buf, wide, reg, rm);
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, op);
+    emit_byte(buf, modrm_reg(reg, rm));
+}
+
+/* Emits a one-byte-opcode instruction on 64-bit register operands. */
+static
+void emit_alu64(struct code_buf *buf, uint8_t op, uint8_t reg, uint8_t rm)
+{
+    emit_rex(buf, true, reg, rm);
+    emit_byte(buf, op);
+    emit_byte(buf, modrm_reg(reg, rm));
+}
+
+/* movzx reg32, byte [rdi + offset] */
+static
+void emit_load_data(struct code_buf *buf, uint8_t reg, uint8_t offset)
+{
+    emit_rex(buf, false, reg, RDI);
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, 0xb6);
+    /* mod 01: [rm + disp8] */
+    emit_byte(buf, 0x40 | ((reg & 7) << 3) | RDI);
+    emit_byte(buf, offset);
+}
+
+/* Loads the bits of a float constant into an xmm register, via eax. */
+static
+void emit_load_float(struct code_buf *buf, uint8_t xmm, float val)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &val, sizeof(bits));
+    /* mov eax, imm32 */
+    emit_byte(buf, 0xb8 + RAX);
+    emit_u32(buf, bits);
+    /* movd xmm, eax */
+    emit_0f(buf, 0x66, false, 0x6e, xmm, RAX);
+}
+
+/* Loads the bits of a double constant into an xmm register, via rax. */
+static
+void emit_load_double(struct code_buf *buf, uint8_t xmm, double val)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &val, sizeof(bits));
+    /* mov rax, imm64 */
+    emit_rex(buf, true, 0, RAX);
+    emit_byte(buf, 0xb8 + RAX);
+    emit_u64(buf, bits);
+    /* movq xmm, rax */
+    emit_0f(buf, 0x66, true, 0x6e, xmm, RAX);
+}
+
+/* ud2, which raises SIGILL. */
+static
+void emit_trap(struct code_buf *buf)
+{
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, 0x0b);
+}
+
+/*
+ * Emits a float stack expression, leaving the result in xmm0. Like the
+ * interpreter, all arithmetic is in single precision, and dividing by zero is
+ * fatal.
+ */
+static
+void emit_float_stack(struct code_buf *buf, const struct expr *expr)
+{
+    const uint8_t *code;
+    const union expr_const *divisor;
+    size_t depth;
+    const uint8_t *end;
+    uint8_t op;
+
+    divisor = NULL;
+    depth = 0;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch ((bytecode_op) *code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                emit_load_data(buf, RAX, *code - BC_PUSH_A);
+                /* cvtsi2ss xmm, eax */
+                emit_0f(buf, 0xf3, false, 0x2a, depth, RAX);
+                ++depth;
+                divisor = NULL;
+                continue;
+            case BC_PUSH_CONST:
+                ++code;
+                emit_load_float(buf, depth, expr->consts[*code].as_float);
+                ++depth;
+                /* If the next op divides, this is the divisor. */
+                divisor = &expr->consts[*code];
+                continue;
+            case BC_ADD:
+                op = 0x58;
+                break;
+            case BC_SUB:
+                op = 0x5c;
+                break;
+            case BC_MUL:
+                op = 0x59;
+                break;
+            case BC_DIV:
+                if (divisor == NULL || divisor->as_float == 0) {
+                    /*
+                     * xorps xmm15, xmm15; ucomiss divisor, xmm15. Trap if
+                     * equal (ZF) but not unordered (PF), as NaN is not zero.
+                     */
+                    emit_0f(buf, 0, false, 0x57, XMM_ZERO, XMM_ZERO);
+                    emit_0f(buf, 0, false, 0x2e, depth - 1, XMM_ZERO);
+                    /* jne +4; jp +2 */
+                    emit_byte(buf, 0x75);
+                    emit_byte(buf, 0x04);
+                    emit_byte(buf, 0x7a);
+                    emit_byte(buf, 0x02);
+                    emit_trap(buf);
+                }
+                op = 0x5e;
+                break;
+        }
+
+        /* addss/subss/mulss/divss lhs, rhs */
+        emit_0f(buf, 0xf3, false, op, depth - 2, depth - 1);
+        --depth;
+        divisor = NULL;
+    }
+    XASSERT_EQ(depth, 1);
+}
+
+/*
+ * Emits an integer stack expression, leaving the result in xmm0. Like the
+ * interpreter, the stack holds 64-bit values (int_fast32_t), and the result is
+ * truncated to 32 bits before converting to float.
+ */
+static
+void emit_int_stack(struct code_buf *buf, const struct expr *expr)
+{
+    const uint8_t *code;
+    size_t depth;
+    const union expr_const *divisor;
+    const uint8_t *end;
+    uint8_t lhs;
+    uint8_t rhs;
+
+    depth = 0;
+    divisor = NULL;
+    end = expr->code + expr->size;
+    for (code = expr->code; code < end; ++code) {
+        switch ((bytecode_op) *code) {
+            case BC_PUSH_A:
+            case BC_PUSH_B:
+            case BC_PUSH_C:
+            case BC_PUSH_D:
+                /* Loading into the 32-bit register zeroes the upper half. */
+                emit_load_data(buf, INT_SLOTS[depth], *code - BC_PUSH_A);
+                ++depth;
+                divisor = NULL;
+                continue;
+            case BC_PUSH_CONST:
+                ++code;
+                /* mov reg64, imm32 (sign-extended) */
+                emit_rex(buf, true, 0, INT_SLOTS[depth]);
+                emit_byte(buf, 0xc7);
+                emit_byte(buf, modrm_reg(0, INT_SLOTS[depth]));
+                emit_u32(buf, expr->consts[*code].as_int32_t);
+                ++depth;
+                /* If the next op divides, this is the divisor. */
+                divisor = &expr->consts[*code];
+                continue;
+            default:
+                break;
+        }
+
+        lhs = INT_SLOTS[depth - 2];
+        rhs = INT_SLOTS[depth - 1];
+        switch ((bytecode_op) *code) {
+            case BC_ADD:
+                emit_alu64(buf, 0x01, rhs, lhs);
+                break;
+            case BC_SUB:
+                emit_alu64(buf, 0x29, rhs, lhs);
+                break;
+            case BC_MUL:
+                /* imul lhs, rhs */
+                emit_0f(buf, 0, true, 0xaf, lhs, rhs);
+                break;
+            case BC_DIV:
+                if (divisor == NULL || divisor->as_int32_t == 0) {
+                    /* test rhs, rhs; jne +2; ud2 */
+                    emit_alu64(buf, 0x85, rhs, rhs);
+                    emit_byte(buf, 0x75);
+                    emit_byte(buf, 0x02);
+                    emit_trap(buf);
+                }
+                /* mov rax, lhs; cqo; idiv rhs; mov lhs, rax */
+                emit_alu64(buf, 0x8b, RAX, lhs);
+                emit_byte(buf, 0x48);
+                emit_byte(buf, 0x99);
+                emit_rex(buf, true, 0, rhs);
+                emit_byte(buf, 0xf7);
+                emit_byte(buf, modrm_reg(7, rhs));
+                emit_alu64(buf, 0x89, RAX, lhs);
+                break;
+            default:
+                XASSERT_ERROR;
+        }
+        --depth;
+        divisor = NULL;
+    }
+    XASSERT_EQ(depth, 1);
+
+    /* cvtsi2ss xmm0, r8d */
+    emit_0f(buf, 0xf3, false, 0x2a, 0, INT_SLOTS[0]);
+}
+
+/*
+ * Emits the unit conversion for xmm0, computing (float) (scale*val + offset) in
+ * double precision, as unit_convert does.
+ */
+static
+void emit_unit_convert(struct code_buf *buf, const struct unit_conv *conv)
+{
+    /* cvtss2sd xmm0, xmm0 */
+    emit_0f(buf, 0xf3, false, 0x5a, 0, 0);
+    emit_load_double(buf, 1, conv->scale);
+    /* mulsd xmm0, xmm1 */
+    emit_0f(buf, 0xf2, false, 0x59, 0, 1);
+    emit_load_double(buf, 1, conv->offset);
+    /* addsd xmm0, xmm1 */
+    emit_0f(buf, 0xf2, false, 0x58, 0, 1);
+    /* cvtsd2ss xmm0, xmm0 */
+    emit_0f(buf, 0xf2, false, 0x5a, 0, 0);
+}
+
+/* Returns true if we can compile the given PID. */
+static
+bool can_compile(const struct pid_ctx *pid_ctx)
+{
+    const struct expr *expr;
+
+    if (pid_has_lut(pid_ctx)) {
+        /* A lookup table is faster still. */
+        return false;
+    }
+
+    expr = &pid_ctx->expr;
+    switch (expr->type) {
+        case EXPR_NOP:
+        case EXPR_LINEAR:
+            /*
+             * These are already a handful of instructions, and calling through
+             * a pointer that changes with every PID costs more than it saves.
+             */
+            return false;
+        case EXPR_STACK:
+            if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+                return expr->max_depth <= JIT_FLOAT_SLOTS;
+            }
+            else {
+                return expr->max_depth <= ARRAYLEN(INT_SLOTS);
+            }
+    }
+
+    return false;
+}
+
+static
+void compile_pid(struct code_buf *buf, const struct pid_ctx *pid_ctx)
+{
+    const struct expr *expr;
+
+    expr = &pid_ctx->expr;
+    XASSERT_EQ(expr->type, EXPR_STACK);
+    if (pid_ctx->pid_type == PID_DATA_TYPE_FLOAT) {
+        emit_float_stack(buf, expr);
+    }
+    else {
+        emit_int_stack(buf, expr);
+    }
+    emit_unit_convert(buf, &pid_ctx->conv);
+
+    /* ret */
+    emit_byte(buf, 0xc3);
+}
+
+/*
+ * Compiles every PID we can into buf, returning the offset of each PID's code
+ * in offsets (or SIZE_MAX if it was not compiled). If buf->data is NULL, this
+ * just measures the code.
+ */
+static
+void compile_all(
+    const struct yobd_ctx *ctx,
+    struct code_buf *buf,
+    size_t *offsets)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->pid_count; ++i) {
+        if (!can_compile(&ctx->pids[i])) {
+            if (offsets != NULL) {
+                offsets[i] = SIZE_MAX;
+            }
+            continue;
+        }
+
+        /* Pad with int3, which traps if ever executed. */
+        while (buf->size % JIT_FUNC_ALIGN != 0) {
+            emit_byte(buf, 0xcc);
+        }
+        if (offsets != NULL) {
+            offsets[i] = buf->size;
+        }
+        compile_pid(buf, &ctx->pids[i]);
+    }
+}
+
+yobd_err build_jit(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts)
+{
+    union {
+        void *addr;
+        jit_func func;
+    } entry;
+    struct code_buf buf;
+    int err;
+    size_t i;
+    void *mem;
+    size_t *offsets;
+
+    if (!opts->jit) {
+        return YOBD_OK;
+    }
+
+    /* Measure first, so the arena can be allocated in one shot. */
+    buf.data = NULL;
+    buf.size = 0;
+    compile_all(ctx, &buf, NULL);
+    if (buf.size == 0) {
+        return YOBD_OK;
+    }
+
+    offsets = malloc(ctx->pid_count * sizeof(*offsets));
+    if (offsets == NULL) {
+        return YOBD_OOM;
+    }
+
+    /*
+     * Never map memory both writable and executable: write the code, then flip
+     * it to read-execute.
+     */
+    mem = mmap(
+        NULL,
+        buf.size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0);
+    if (mem == MAP_FAILED) {
+        free(offsets);
+        return YOBD_OOM;
+    }
+    ctx->jit.mem = mem;
+    ctx->jit.size = buf.size;
+
+    buf.data = mem;
+    buf.size = 0;
+    compile_all(ctx, &buf, offsets);
+    XASSERT_EQ(buf.size, ctx->jit.size);
+
+    err = mprotect(mem, buf.size, PROT_READ | PROT_EXEC);
+    if (err == -1) {
+        err = errno;
+        free(offsets);
+        return err;
+    }
+
+    for (i = 0; i < ctx->pid_count; ++i) {
+        if (offsets[i] == SIZE_MAX) {
+            continue;
+        }
+        entry.addr = buf.data + offsets[i];
+        ctx->pids[i].jit = entry.func;
+        ctx->pids[i].decoder = DECODER_JIT;
+    }
+    free(offsets);
+
+    return YOBD_OK;
+}
+
+#else
+
+yobd_err build_jit(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts)
+{
+    (void) ctx;
+    (void) opts;
+
+    /* Everything gets interpreted. */
+    return YOBD_OK;
+}
+
+#endif /* JIT_SUPPORTED */
+
+void destroy_jit(struct jit_arena *arena)
+{
+    if (arena->mem != NULL) {
+        munmap(arena->mem, arena->size);
+    }
+}
@@ -0,0 +1,99 @@
+/**
+ * @file      lut.c
+ * @brief     Precomputed per-PID lookup tables.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdlib.h>
+#include <yobd/yobd.h>
+#include <yobd-private/assert.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/lut.h>
+#include <yobd-private/parser.h>
+
+static
+float *make_lut(const struct pid_ctx *pid_ctx)
+{
+    unsigned char data[LUT_MAX_BYTES];
+    size_t entries;
+    size_t i;
+    float *lut;
+    uint_fast8_t can_bytes;
+
+    can_bytes = pid_ctx->can_bytes;
+    entries = lut_entries(can_bytes);
+    lut = malloc(entries * sizeof(*lut));
+    if (lut == NULL) {
+        return NULL;
+    }
+
+    /*
+     * Run every possible input through the PID's decoder, so that the table
+     * matches evaluation exactly.
+     */
+    for (i = 0; i < entries; ++i) {
+        if (can_bytes == 1) {
+            data[0] = i;
+        }
+        else {
+            data[0] = i >> 8;
+            data[1] = i & 0xff;
+        }
+        XASSERT_EQ(lut_index(can_bytes, data), i);
+
+        lut[i] = decode_pid(pid_ctx, data);
+    }
+
+    return lut;
+}
+
+yobd_err build_luts(struct yobd_ctx *ctx, const struct yobd_schema_opts *opts)
+{
+    size_t bytes;
+    uint_fast8_t can_bytes;
+    size_t i;
+    uint_fast8_t max_bytes;
+    float *lut;
+    struct pid_ctx *pid_ctx;
+    size_t remaining;
+
+    max_bytes = opts->lut_max_bytes;
+    if (max_bytes > LUT_MAX_BYTES) {
+        max_bytes = LUT_MAX_BYTES;
+    }
+
+    /* Smaller tables give the most PIDs per byte, so assign those first. */
+    remaining = opts->lut_budget;
+    for (can_bytes = 1; can_bytes <= max_bytes; ++can_bytes) {
+        bytes = lut_entries(can_bytes) * sizeof(*lut);
+        for (i = 0; i < ctx->pid_count && bytes <= remaining; ++i) {
+            pid_ctx = &ctx->pids[i];
+            if (pid_ctx->can_bytes != can_bytes) {
+                continue;
+            }
+            if (!expr_is_total(&pid_ctx->expr, pid_ctx->pid_type)) {
+                /* Evaluating every input might divide by zero. */
+                continue;
+            }
+            if (expr_data_bytes(&pid_ctx->expr) > can_bytes) {
+                /*
+                 * The expression reads bytes past the PID's own, which a table
+                 * indexed by the PID's bytes cannot account for.
+                 */
+                continue;
+            }
+
+            lut = make_lut(pid_ctx);
+            if (lut == NULL) {
+                return YOBD_OOM;
+            }
+            pid_ctx->lut = lut;
+            pid_ctx->decoder =
+                (can_bytes == 1) ? DECODER_LUT_1 : DECODER_LUT_2;
+            remaining -= bytes;
+        }
+    }
+
+    return YOBD_OK;
+}
@@ -0,0 +1,377 @@
+/**
+ * @file      multi.c
+ * @brief     Queries and responses carrying several PIDs at once.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <yobd/multi.h>
+#include <yobd/supported.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+/* The response mode is the query mode plus this. */
+#define RESPONSE_MODE_OFFSET (0x40)
+
+/* The size of a "PIDs supported" bitmap. */
+#define BITMAP_BYTES (4)
+
+/*
+ * Returns how many data bytes a PID has in a response, or 0 if it is unknown.
+ * ECUs answer the "PIDs supported" PIDs of modes 1 and 9 with bitmaps whether
+ * or not the schema lists them, so responses may carry those too.
+ */
+static
+uint_fast8_t get_response_bytes(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    const struct pid_ctx *pid_ctx;
+
+    pid_ctx = get_pid_ctx(ctx, mode, pid);
+    if (pid_ctx != NULL) {
+        return pid_ctx->can_bytes;
+    }
+    if ((mode == 0x1 || mode == 0x9) &&
+        pid % YOBD_SUPPORTED_PIDS_STRIDE == 0) {
+        return BITMAP_BYTES;
+    }
+
+    return 0;
+}
+
+/*
+ * Checks the arguments shared by multi-PID queries and responses, and that we
+ * know the size of every PID. For a query, the schema must have each PID, as
+ * parsing the response needs it.
+ */
+static
+yobd_err check_multi_pids(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    bool response)
+{
+    size_t i;
+    bool known;
+
+    if (ctx == NULL || pids == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (count == 0 || count > YOBD_MAX_MULTI_PIDS) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    /* Manufacturer modes have 2-byte PIDs and no multi-PID queries. */
+    if (!mode_is_sae_standard(mode)) {
+        return YOBD_INVALID_MODE;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (pids[i] > 0xff) {
+            return YOBD_INVALID_PID;
+        }
+        if (response) {
+            known = get_response_bytes(ctx, mode, pids[i]) > 0;
+        }
+        else {
+            known = get_pid_index(ctx, mode, pids[i]) != SIZE_MAX;
+        }
+        if (!known) {
+            return YOBD_UNKNOWN_MODE_PID;
+        }
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_make_can_multi_query(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    struct can_frame *frame)
+{
+    yobd_err err;
+    size_t i;
+
+    if (frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    err = check_multi_pids(ctx, mode, pids, count, false);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    /* A query is always a single frame: length, mode, and up to 6 PIDs. */
+    frame->can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    frame->can_dlc = OBD_II_DLC;
+    frame->data[0] = 1 + count;
+    frame->data[1] = mode;
+    for (i = 0; i < count; ++i) {
+        frame->data[2+i] = pids[i];
+    }
+    memset(
+        &frame->data[2+count],
+        OBD_II_PAD_VALUE,
+        sizeof(frame->data) - 2 - count);
+
+    return YOBD_OK;
+}
+
+/*
+ * Builds the payload of a response to a multi-PID query, returning its size.
+ * The PIDs must already have been checked.
+ */
+static
+size_t build_multi_payload(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    const unsigned char *data,
+    unsigned char *payload)
+{
+    uint_fast8_t can_bytes;
+    size_t i;
+    size_t size;
+
+    payload[0] = RESPONSE_MODE_OFFSET + mode;
+    size = 1;
+    for (i = 0; i < count; ++i) {
+        can_bytes = get_response_bytes(ctx, mode, pids[i]);
+        payload[size] = pids[i];
+        memcpy(&payload[size + 1], data, can_bytes);
+        data += can_bytes;
+        size += 1 + can_bytes;
+    }
+
+    return size;
+}
+
+PUBLIC_API
+yobd_err yobd_make_can_multi_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    const unsigned char *data,
+    struct can_frame *frames,
+    size_t max_frames,
+    size_t *frame_count)
+{
+    yobd_err err;
+    unsigned char payload[YOBD_MAX_MULTI_PAYLOAD];
+    size_t size;
+
+    if (data == NULL || frames == NULL || frame_count == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    err = check_multi_pids(ctx, mode, pids, count, true);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    size = build_multi_payload(ctx, mode, pids, count, data, payload);
+    if (isotp_frame_count(size) > max_frames) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    isotp_segment(YOBD_OBD_II_RESPONSE_BASE, payload, size, frames);
+    *frame_count = isotp_frame_count(size);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_make_canfd_multi_response(
+    struct yobd_ctx *ctx,
+    yobd_mode mode,
+    const yobd_pid *pids,
+    size_t count,
+    const unsigned char *data,
+    struct canfd_frame *frame)
+{
+    yobd_err err;
+    unsigned char payload[YOBD_MAX_MULTI_PAYLOAD];
+    size_t size;
+
+    if (data == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    err = check_multi_pids(ctx, mode, pids, count, true);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    size = build_multi_payload(ctx, mode, pids, count, data, payload);
+    isotp_fd_make_single(YOBD_OBD_II_RESPONSE_BASE, payload, size, frame);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_multi_response(
+    struct yobd_ctx *ctx,
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count)
+{
+    size_t n;
+    size_t offset;
+    const struct pid_ctx *pid_ctx;
+
+    if (ctx == NULL || payload == NULL || mode == NULL || pids == NULL ||
+        vals == NULL || count == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (size < 1 || payload[0] <= RESPONSE_MODE_OFFSET) {
+        return YOBD_INVALID_MODE;
+    }
+    *mode = payload[0] - RESPONSE_MODE_OFFSET;
+    if (!mode_is_sae_standard(*mode)) {
+        return YOBD_INVALID_MODE;
+    }
+
+    /*
+     * Each PID is followed by its data bytes, so we need the schema to find
+     * where the next PID starts.
+     */
+    n = 0;
+    for (offset = 1; offset < size; offset += 1 + pid_ctx->can_bytes) {
+        pid_ctx = get_pid_ctx(ctx, *mode, payload[offset]);
+        if (pid_ctx == NULL) {
+            return YOBD_UNKNOWN_MODE_PID;
+        }
+        if (offset + 1 + pid_ctx->can_bytes > size) {
+            return YOBD_INVALID_DATA_BYTES;
+        }
+        if (n == max) {
+            return YOBD_INVALID_PARAMETER;
+        }
+
+        pids[n] = payload[offset];
+        vals[n] = decode_pid_bounded(
+            pid_ctx,
+            &payload[offset + 1],
+            size - offset - 1);
+        ++n;
+    }
+    *count = n;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_can_multi_response(
+    struct yobd_ctx *ctx,
+    const struct can_frame *frames,
+    size_t frame_count,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count)
+{
+    yobd_err err;
+    size_t i;
+    unsigned char payload[ISOTP_MAX_SIZE];
+    size_t size;
+
+    if (ctx == NULL || frames == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < frame_count; ++i) {
+        if (frames[i].can_id < YOBD_OBD_II_RESPONSE_BASE ||
+            frames[i].can_id > YOBD_OBD_II_RESPONSE_END) {
+            return YOBD_UNKNOWN_ID;
+        }
+    }
+
+    err = isotp_reassemble(frames, frame_count, payload, sizeof(payload), &size);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_parse_multi_response(
+        ctx,
+        payload,
+        size,
+        mode,
+        pids,
+        vals,
+        max,
+        count);
+}
+
+PUBLIC_API
+yobd_err yobd_parse_canfd_multi_response(
+    struct yobd_ctx *ctx,
+    const struct canfd_frame *frame,
+    yobd_mode *mode,
+    yobd_pid *pids,
+    float *vals,
+    size_t max,
+    size_t *count)
+{
+    yobd_err err;
+    const unsigned char *payload;
+    size_t size;
+
+    if (ctx == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (frame->can_id < YOBD_OBD_II_RESPONSE_BASE ||
+        frame->can_id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    err = isotp_fd_parse_single(frame, &payload, &size);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    return yobd_parse_multi_response(
+        ctx,
+        payload,
+        size,
+        mode,
+        pids,
+        vals,
+        max,
+        count);
+}
+
+PUBLIC_API
+yobd_err yobd_make_can_flow_control(
+    const struct can_frame *first_frame,
+    struct can_frame *frame)
+{
+    if (first_frame == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (first_frame->can_id < YOBD_OBD_II_RESPONSE_BASE ||
+        first_frame->can_id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+    if (isotp_get_type(first_frame) != ISOTP_FIRST) {
+        return YOBD_INVALID_ISOTP;
+    }
+
+    isotp_make_flow_control(first_frame->can_id, frame);
+
+    return YOBD_OK;
+}
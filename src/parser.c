@@ -9,11 +9,17 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <yaml.h>
 #include <yobd-private/api.h>
 #include <yobd-private/assert.h>
+#include <yobd-private/eval.h>
 #include <yobd-private/expr.h>
+#include <yobd-private/fixed.h>
+#include <yobd-private/jit.h>
+#include <yobd-private/lut.h>
 #include <yobd-private/parser.h>
 #include <yobd-private/unit.h>
 
@@ -21,34 +27,39 @@
 
 #define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
 
-static uint32_t get_modepid(yobd_mode mode, yobd_pid pid)
-{
-    return (mode << 16) | pid;
-}
-
-static yobd_mode get_mode(uint32_t modepid)
-{
-    return modepid >> 16;
-}
-
-static yobd_pid get_pid(uint32_t modepid)
-{
-    return modepid & 0xffff;
-}
-
-struct parse_pid_ctx *get_pid_ctx(
+size_t get_mfr_pid_index(
     const struct yobd_ctx *ctx,
     yobd_mode mode,
     yobd_pid pid)
 {
-    xhiter_t iter;
+    const uint32_t *base;
+    size_t half;
+    uint32_t modepid;
+    size_t n;
 
-    iter = xh_get(MODEPID_MAP, ctx->modepid_map, get_modepid(mode, pid));
-    if (iter == xh_end(ctx->modepid_map)) {
-        return NULL;
+    n = ctx->pid_count - ctx->mfr_start;
+    if (n == 0) {
+        return SIZE_MAX;
     }
 
-    return &xh_val(ctx->modepid_map, iter);
+    /*
+     * Binary search the manufacturer-mode tail of the sorted modepid array.
+     * This is written so that the compiler can use conditional moves instead
+     * of branches, as the branches would be unpredictable.
+     */
+    modepid = get_modepid(mode, pid);
+    base = &ctx->modepids[ctx->mfr_start];
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half] <= modepid) ? &base[half] : base;
+        n -= half;
+    }
+
+    if (*base != modepid) {
+        return SIZE_MAX;
+    }
+
+    return base - ctx->modepids;
 }
 
 PUBLIC_API
@@ -58,7 +69,44 @@ yobd_err yobd_get_pid_count(struct yobd_ctx *ctx, size_t *count)
         return YOBD_INVALID_PARAMETER;
     }
 
-    *count = xh_size(ctx->modepid_map);
+    *count = ctx->pid_count;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_get_footprint(
+    struct yobd_ctx *ctx,
+    struct yobd_footprint *footprint)
+{
+    size_t i;
+    const struct pid_ctx *pid_ctx;
+
+    if (ctx == NULL || footprint == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    footprint->ctx = sizeof(*ctx);
+    footprint->arena = ctx->arena_size;
+    footprint->luts = 0;
+    for (i = 0; i < ctx->pid_count; ++i) {
+        pid_ctx = &ctx->pids[i];
+        if (pid_has_lut(pid_ctx)) {
+            footprint->luts +=
+                lut_entries(pid_ctx->can_bytes) * sizeof(*pid_ctx->lut);
+        }
+    }
+    footprint->jit = (ctx->jit.mem != NULL) ? ctx->jit.size : 0;
+    footprint->fixed =
+        (ctx->fixed != NULL) ? ctx->pid_count * sizeof(*ctx->fixed) : 0;
+    footprint->mapped = (ctx->map != NULL) ? ctx->map_size : 0;
+    footprint->total =
+        footprint->ctx +
+        footprint->arena +
+        footprint->luts +
+        footprint->jit +
+        footprint->fixed +
+        footprint->mapped;
 
     return YOBD_OK;
 }
@@ -69,28 +117,23 @@ yobd_err yobd_pid_foreach(
     pid_process_func func,
     void *data)
 {
-    const struct yobd_pid_desc *desc;
     bool done;
-    xhiter_t iter;
-    yobd_mode mode;
-    uint32_t modepid;
-    yobd_pid pid;
+    size_t i;
 
     if (ctx == NULL) {
         return YOBD_INVALID_PARAMETER;
     }
 
-    /* Find the first valid iter entry. */
-    xh_iter(ctx->modepid_map, iter,
-        modepid = xh_key(ctx->modepid_map, iter);
-        mode = get_mode(modepid);
-        pid = get_pid(modepid);
-        desc = &xh_val(ctx->modepid_map, iter).desc;
-        done = func(desc, mode, pid, data);
+    for (i = 0; i < ctx->pid_count; ++i) {
+        done = func(
+            &ctx->descs[i],
+            get_mode(ctx->modepids[i]),
+            get_pid(ctx->modepids[i]),
+            data);
         if (done) {
             break;
         }
-    );
+    }
 
     return YOBD_OK;
 }
@@ -102,39 +145,124 @@ struct parse_pid_ctx *put_mode_pid(
     yobd_pid pid)
 {
     xhiter_t iter;
+    struct parse_pid_ctx *pid_ctx;
     int ret;
 
-    iter = xh_put(MODEPID_MAP, ctx->modepid_map, (mode << 16) | pid, &ret);
+    iter = xh_put(MODEPID_MAP, ctx->modepid_map, get_modepid(mode, pid), &ret);
     if (ret == -1) {
         return NULL;
     }
 
-    return &xh_val(ctx->modepid_map, iter);
+    /*
+     * Zero the entry so that it is safe to free even if we fail partway
+     * through parsing it.
+     */
+    pid_ctx = &xh_val(ctx->modepid_map, iter);
+    memset(pid_ctx, 0, sizeof(*pid_ctx));
+
+    return pid_ctx;
+}
+
+/* Frees a PID that has not yet been moved into the arena. */
+static
+void destroy_pid_ctx(struct parse_pid_ctx *pid_ctx)
+{
+    free((char *) pid_ctx->desc.name);
+    destroy_expr(&pid_ctx->expr);
+}
+
+void init_pid_ctx(
+    struct pid_ctx *pid_ctx,
+    bool big_endian,
+    yobd_mode mode,
+    const struct parse_pid_ctx *parse_ctx)
+{
+    memset(pid_ctx, 0, sizeof(*pid_ctx));
+    pid_ctx->can_bytes = parse_ctx->desc.can_bytes;
+    pid_ctx->expected_bytes = mode_data_offset(mode) + pid_ctx->can_bytes;
+    /* Data follows data[0], which holds the number of bytes. */
+    pid_ctx->data_offset = 1 + mode_data_offset(mode);
+    pid_ctx->pid_type = parse_ctx->pid_type;
+    pid_ctx->big_endian = big_endian;
+    pid_ctx->expr = parse_ctx->expr;
+    pid_ctx->conv = parse_ctx->conv;
+    pid_ctx->decoder = select_decoder(big_endian, pid_ctx);
+}
+
+yobd_err alloc_arena(struct yobd_ctx *ctx, size_t size)
+{
+    int ret;
+
+    ctx->arena_size = size;
+    if (size == 0) {
+        return YOBD_OK;
+    }
+
+    ret = posix_memalign(&ctx->arena, PID_CTX_ALIGN, size);
+    if (ret != 0) {
+        ctx->arena = NULL;
+        return YOBD_OOM;
+    }
+
+    return YOBD_OK;
+}
+
+struct yobd_ctx *create_ctx(void)
+{
+    struct yobd_ctx *ctx;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->big_endian = false;
+    ctx->pid_count = 0;
+    ctx->pids = NULL;
+    ctx->descs = NULL;
+    ctx->modepids = NULL;
+    ctx->mfr_start = 0;
+    ctx->modepid_map = NULL;
+    ctx->jit.mem = NULL;
+    ctx->jit.size = 0;
+    ctx->fixed = NULL;
+    ctx->arena = NULL;
+    ctx->arena_size = 0;
+    ctx->map = NULL;
+    ctx->map_size = 0;
+
+    return ctx;
 }
 
 PUBLIC_API
 void yobd_free_ctx(struct yobd_ctx *ctx)
 {
+    size_t i;
     xhiter_t iter;
-    struct parse_pid_ctx *pid_ctx;
 
     if (ctx == NULL) {
         return;
     }
 
-    XASSERT_NOT_NULL(ctx->modepid_map);
-
+    /* The map is non-NULL only if we failed while parsing. */
     if (ctx->modepid_map != NULL) {
         xh_iter(ctx->modepid_map, iter,
-            pid_ctx = &xh_val(ctx->modepid_map, iter);
-
-            free((char *) pid_ctx->desc.name);
-            if (pid_ctx->expr.type == EXPR_STACK) {
-                destroy_expr(&pid_ctx->expr);
-            }
+            destroy_pid_ctx(&xh_val(ctx->modepid_map, iter));
         );
+        xh_destroy(MODEPID_MAP, ctx->modepid_map);
+    }
+
+    /* Everything else the PIDs point to is in the arena or the map. */
+    for (i = 0; i < ctx->pid_count; ++i) {
+        if (pid_has_lut(&ctx->pids[i])) {
+            free(ctx->pids[i].lut);
+        }
+    }
+    free(ctx->arena);
+    free(ctx->fixed);
+    destroy_jit(&ctx->jit);
+    if (ctx->map != NULL) {
+        munmap(ctx->map, ctx->map_size);
     }
-    xh_destroy(MODEPID_MAP, ctx->modepid_map);
 
     free(ctx);
 }
@@ -216,6 +344,7 @@ static
 yobd_err parse_expr(
     yaml_node_t *node,
     yaml_document_t *doc,
+    const struct unit_conv *conv,
     pid_data_type *pid_type,
     struct expr *expr)
 {
@@ -263,7 +392,7 @@ yobd_err parse_expr(
     XASSERT_NOT_NULL(pid_type_str);
 
     *pid_type = find_type(pid_type_str);
-    return parse_expr_val(expr_str, expr, *pid_type);
+    return parse_expr_val(expr_str, expr, *pid_type, conv);
 }
 
 static
@@ -272,12 +401,19 @@ yobd_err parse_desc(
     yaml_document_t *doc,
     struct parse_pid_ctx *pid_ctx)
 {
+    yobd_err err;
+    yaml_node_t *expr_node;
     yaml_node_t *key;
     const char *key_str;
     yaml_node_pair_t *pair;
     yaml_node_t *val;
     const char *val_str;
 
+    /*
+     * The expression is compiled together with the unit conversion, so we
+     * parse it only after we have seen the raw unit.
+     */
+    expr_node = NULL;
     XASSERT_EQ(node->type, YAML_MAPPING_NODE);
     for (pair = node->data.mapping.pairs.start;
          pair < node->data.mapping.pairs.top;
@@ -308,7 +444,7 @@ yobd_err parse_desc(
         else if (strcmp(key_str, "raw-unit") == 0) {
             XASSERT_EQ(val->type, YAML_SCALAR_NODE);
             val_str = (const char *) val->data.scalar.value;
-            pid_ctx->convert_func = find_convert_func(val_str);
+            pid_ctx->conv = *find_unit_conv(val_str);
         }
         else if (strcmp(key_str, "si-unit") == 0) {
             XASSERT_EQ(val->type, YAML_SCALAR_NODE);
@@ -316,7 +452,7 @@ yobd_err parse_desc(
             pid_ctx->desc.unit = find_unit(val_str);
         }
         else if (strcmp(key_str, "expr") == 0) {
-            parse_expr(val, doc, &pid_ctx->pid_type, &pid_ctx->expr);
+            expr_node = val;
         }
         else {
             /* Unrecognized key. */
@@ -324,6 +460,17 @@ yobd_err parse_desc(
             XASSERT_ERROR;
         }
     }
+    XASSERT_NOT_NULL(expr_node);
+
+    err = parse_expr(
+        expr_node,
+        doc,
+        &pid_ctx->conv,
+        &pid_ctx->pid_type,
+        &pid_ctx->expr);
+    if (err != YOBD_OK) {
+        return err;
+    }
 
     switch (pid_ctx->pid_type) {
         case PID_DATA_TYPE_FLOAT:
@@ -519,44 +666,227 @@ yobd_err parse(FILE *file, struct yobd_ctx *ctx)
     return err;
 }
 
-PUBLIC_API
-yobd_err yobd_parse_schema(const char *schema, struct yobd_ctx **out_ctx)
+struct sort_entry {
+    uint32_t modepid;
+    struct parse_pid_ctx *pid_ctx;
+};
+
+static
+int compare_sort_entry(const void *a, const void *b)
 {
-    char abspath[PATH_MAX];
-    int count;
-    struct yobd_ctx *ctx;
+    uint32_t modepid_a;
+    uint32_t modepid_b;
+
+    modepid_a = ((const struct sort_entry *) a)->modepid;
+    modepid_b = ((const struct sort_entry *) b)->modepid;
+    if (modepid_a < modepid_b) {
+        return -1;
+    }
+    else if (modepid_a > modepid_b) {
+        return 1;
+    }
+    else {
+        return 0;
+    }
+}
+
+static
+size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+/*
+ * Moves the PIDs from the parsing hash map into sorted decode record and
+ * descriptor arrays in the arena, along with their names and bytecode, and
+ * builds the lookup indices on top of them. On success, the hash map is
+ * destroyed.
+ */
+static
+yobd_err build_index(struct yobd_ctx *ctx)
+{
+    uint8_t *arena;
+    size_t code_offset;
+    size_t descs_offset;
+    struct yobd_pid_desc *desc;
+    struct sort_entry *entries;
     yobd_err err;
-    FILE *file;
-    int ret;
+    size_t i;
+    xhiter_t iter;
+    size_t len;
+    yobd_mode mode;
+    size_t modepids_offset;
+    size_t names_offset;
+    struct parse_pid_ctx *parse_ctx;
+    struct pid_ctx *pid_ctx;
+    yobd_pid pid;
+    size_t pid_count;
+    size_t size;
 
-    if (schema == NULL) {
-        err = YOBD_INVALID_PARAMETER;
-        goto out;
+    pid_count = xh_size(ctx->modepid_map);
+    entries = malloc(pid_count * sizeof(*entries));
+    if (entries == NULL && pid_count > 0) {
+        return YOBD_OOM;
+    }
+
+    i = 0;
+    xh_iter(ctx->modepid_map, iter,
+        entries[i].modepid = xh_key(ctx->modepid_map, iter);
+        entries[i].pid_ctx = &xh_val(ctx->modepid_map, iter);
+        ++i;
+    );
+    qsort(entries, pid_count, sizeof(*entries), compare_sort_entry);
+
+    /* Size the arena, keeping what decoding needs at the front. */
+    modepids_offset = pid_count * sizeof(*ctx->pids);
+    code_offset = align_up(
+        modepids_offset + pid_count * sizeof(*ctx->modepids),
+        sizeof(union expr_const));
+    descs_offset = code_offset;
+    for (i = 0; i < pid_count; ++i) {
+        parse_ctx = entries[i].pid_ctx;
+        if (parse_ctx->expr.type == EXPR_STACK) {
+            descs_offset += align_up(
+                stack_expr_bytes(&parse_ctx->expr),
+                sizeof(union expr_const));
+        }
+    }
+    descs_offset = align_up(descs_offset, _Alignof(struct yobd_pid_desc));
+    names_offset = descs_offset + pid_count * sizeof(*ctx->descs);
+    size = names_offset;
+    for (i = 0; i < pid_count; ++i) {
+        size += strlen(entries[i].pid_ctx->desc.name) + 1;
+    }
+
+    err = alloc_arena(ctx, size);
+    if (err != YOBD_OK) {
+        free(entries);
+        return err;
+    }
+    arena = ctx->arena;
+    ctx->pids = (struct pid_ctx *) arena;
+    ctx->modepids = (uint32_t *) &arena[modepids_offset];
+    ctx->descs = (struct yobd_pid_desc *) &arena[descs_offset];
+
+    memset(ctx->sae_index, 0, sizeof(ctx->sae_index));
+    ctx->mfr_start = pid_count;
+    for (i = 0; i < pid_count; ++i) {
+        mode = get_mode(entries[i].modepid);
+        pid = get_pid(entries[i].modepid);
+        parse_ctx = entries[i].pid_ctx;
+
+        ctx->modepids[i] = entries[i].modepid;
+        pid_ctx = &ctx->pids[i];
+        init_pid_ctx(pid_ctx, ctx->big_endian, mode, parse_ctx);
+        desc = &ctx->descs[i];
+        *desc = parse_ctx->desc;
+
+        /* Move the name and bytecode, freeing the parsing copies. */
+        len = strlen(desc->name) + 1;
+        memcpy(&arena[names_offset], desc->name, len);
+        free((char *) desc->name);
+        desc->name = (const char *) &arena[names_offset];
+        names_offset += len;
+        if (pid_ctx->expr.type == EXPR_STACK) {
+            relocate_stack_expr(&pid_ctx->expr, &arena[code_offset]);
+            destroy_expr(&parse_ctx->expr);
+            code_offset += align_up(
+                stack_expr_bytes(&pid_ctx->expr),
+                sizeof(union expr_const));
+        }
+
+        if (mode_is_sae_standard(mode)) {
+            /* Standard-mode PIDs must use only one byte. */
+            XASSERT_LT(pid, SAE_PID_COUNT);
+            ctx->sae_index[mode][pid] = i + 1;
+        }
+        else if (ctx->mfr_start == pid_count) {
+            ctx->mfr_start = i;
+        }
+    }
+    ctx->pid_count = pid_count;
+    free(entries);
+
+    /* The PIDs are now owned by the arena. */
+    xh_destroy(MODEPID_MAP, ctx->modepid_map);
+    ctx->modepid_map = NULL;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+void yobd_schema_opts_init(struct yobd_schema_opts *opts)
+{
+    if (opts == NULL) {
+        return;
     }
 
+    opts->lut_max_bytes = 0;
+    opts->lut_budget = 0;
+    opts->jit = false;
+    opts->fixed_point = false;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_schema(const char *schema, struct yobd_ctx **out_ctx)
+{
+    struct yobd_schema_opts opts;
+
+    yobd_schema_opts_init(&opts);
+
+    return yobd_parse_schema_opts(schema, &opts, out_ctx);
+}
+
+yobd_err find_schema_path(const char *schema, char *path)
+{
+    int count;
+
     /* Determine if path is absolute or relative. */
     if (schema[0] == '/') {
-        file = fopen(schema, "r");
+        count = snprintf(path, PATH_MAX, "%s", schema);
     }
     else {
         count = snprintf(
-            abspath,
-            ARRAYLEN(abspath),
+            path,
+            PATH_MAX,
             "%s/%s",
             CONFIG_YOBD_PID_DIR,
             schema);
-        if (count == PATH_MAX) {
-            err = YOBD_CANNOT_OPEN_FILE;
-            goto out;
-        }
-        file = fopen(abspath, "r");
     }
+    if (count >= PATH_MAX) {
+        return YOBD_CANNOT_OPEN_FILE;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_schema_opts(
+    const char *schema,
+    const struct yobd_schema_opts *opts,
+    struct yobd_ctx **out_ctx)
+{
+    char path[PATH_MAX];
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    FILE *file;
+
+    if (schema == NULL || opts == NULL || out_ctx == NULL) {
+        err = YOBD_INVALID_PARAMETER;
+        goto out;
+    }
+
+    err = find_schema_path(schema, path);
+    if (err != YOBD_OK) {
+        goto out;
+    }
+    file = fopen(path, "r");
     if (file == NULL) {
         err = YOBD_CANNOT_OPEN_FILE;
         goto out;
     }
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = create_ctx();
     if (ctx == NULL) {
         err = YOBD_OOM;
         goto error_malloc;
@@ -573,21 +903,37 @@ yobd_err yobd_parse_schema(const char *schema, struct yobd_ctx **out_ctx)
         goto error_parse;
     }
 
-    fclose(file);
+    err = build_index(ctx);
+    if (err != YOBD_OK) {
+        goto error_build_index;
+    }
 
-    ret = xh_trim(MODEPID_MAP, ctx->modepid_map);
-    if (ret == -1) {
-        err = YOBD_OOM;
-        goto error_trim;
+    err = build_luts(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_luts;
+    }
+
+    err = build_jit(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_jit;
     }
 
+    err = build_fixed(ctx, opts);
+    if (err != YOBD_OK) {
+        goto error_build_fixed;
+    }
+
+    fclose(file);
+
     *out_ctx = ctx;
 
     goto out;
 
-error_trim:
+error_build_fixed:
+error_build_jit:
+error_build_luts:
+error_build_index:
 error_parse:
-    xh_destroy(MODEPID_MAP, ctx->modepid_map);
 error_modepid_map_init:
     yobd_free_ctx(ctx);
 error_malloc:
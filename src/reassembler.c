@@ -0,0 +1,201 @@
+/**
+ * @file      reassembler.c
+ * @brief     Streaming reassembly of ISO-TP responses from several ECUs.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/reassembler.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/isotp.h>
+
+/* The number of ECUs that may respond to OBD II queries. */
+#define ECU_COUNT (YOBD_OBD_II_RESPONSE_END - YOBD_OBD_II_RESPONSE_BASE + 1)
+
+struct ecu_message {
+    /* True while a multi-frame message is partly received. */
+    bool active;
+    /* The sequence number the next consecutive frame must have. */
+    uint_fast8_t next_seq;
+    /* The message size, as announced by the first frame. */
+    size_t size;
+    /* The number of bytes received so far. */
+    size_t received;
+    unsigned char payload[ISOTP_MAX_SIZE];
+};
+
+struct yobd_reassembler {
+    struct ecu_message ecus[ECU_COUNT];
+};
+
+PUBLIC_API
+yobd_err yobd_new_reassembler(struct yobd_reassembler **out_reassembler)
+{
+    struct yobd_reassembler *reassembler;
+
+    if (out_reassembler == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    reassembler = malloc(sizeof(*reassembler));
+    if (reassembler == NULL) {
+        return YOBD_OOM;
+    }
+    yobd_reset_reassembler(reassembler);
+
+    *out_reassembler = reassembler;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+void yobd_free_reassembler(struct yobd_reassembler *reassembler)
+{
+    free(reassembler);
+}
+
+PUBLIC_API
+void yobd_reset_reassembler(struct yobd_reassembler *reassembler)
+{
+    size_t i;
+
+    if (reassembler == NULL) {
+        return;
+    }
+
+    for (i = 0; i < ECU_COUNT; ++i) {
+        reassembler->ecus[i].active = false;
+    }
+}
+
+static
+yobd_err push_single(
+    struct ecu_message *ecu,
+    const struct can_frame *frame,
+    struct yobd_reassembly *out)
+{
+    size_t len;
+
+    len = frame->data[0] & 0xf;
+    if (len == 0 || len > ISOTP_SINGLE_MAX) {
+        return YOBD_INVALID_ISOTP;
+    }
+
+    memcpy(ecu->payload, &frame->data[1], len);
+    out->payload = ecu->payload;
+    out->size = len;
+
+    return YOBD_OK;
+}
+
+static
+yobd_err push_first(
+    struct ecu_message *ecu,
+    const struct can_frame *frame,
+    struct yobd_reassembly *out)
+{
+    size_t len;
+
+    /* Anything that fits in a single frame must be sent as one. */
+    len = ((frame->data[0] & 0xf) << 8) | frame->data[1];
+    if (len <= ISOTP_SINGLE_MAX) {
+        return YOBD_INVALID_ISOTP;
+    }
+
+    memcpy(ecu->payload, &frame->data[2], ISOTP_FIRST_DATA);
+    ecu->active = true;
+    ecu->next_seq = 1;
+    ecu->size = len;
+    ecu->received = ISOTP_FIRST_DATA;
+
+    out->send_flow_control = true;
+    isotp_make_flow_control(frame->can_id, &out->flow_control);
+
+    return YOBD_OK;
+}
+
+static
+yobd_err push_consecutive(
+    struct ecu_message *ecu,
+    const struct can_frame *frame,
+    struct yobd_reassembly *out)
+{
+    size_t chunk;
+
+    if (!ecu->active || (frame->data[0] & 0xf) != ecu->next_seq) {
+        return YOBD_INVALID_ISOTP;
+    }
+
+    chunk = ecu->size - ecu->received;
+    if (chunk > ISOTP_CONSECUTIVE_DATA) {
+        chunk = ISOTP_CONSECUTIVE_DATA;
+    }
+    memcpy(&ecu->payload[ecu->received], &frame->data[1], chunk);
+    ecu->received += chunk;
+    /* Sequence numbers wrap around after 15. */
+    ecu->next_seq = (ecu->next_seq + 1) & 0xf;
+
+    if (ecu->received == ecu->size) {
+        ecu->active = false;
+        out->payload = ecu->payload;
+        out->size = ecu->size;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_reassembler_push(
+    struct yobd_reassembler *reassembler,
+    const struct can_frame *frame,
+    struct yobd_reassembly *out)
+{
+    struct ecu_message *ecu;
+    yobd_err err;
+
+    if (reassembler == NULL || frame == NULL || out == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (frame->can_id < YOBD_OBD_II_RESPONSE_BASE ||
+        frame->can_id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+    if (frame->can_dlc != OBD_II_DLC) {
+        return YOBD_INVALID_DLC;
+    }
+
+    out->id = frame->can_id;
+    out->send_flow_control = false;
+    out->payload = NULL;
+    out->size = 0;
+
+    ecu = &reassembler->ecus[frame->can_id - YOBD_OBD_II_RESPONSE_BASE];
+    switch (isotp_get_type(frame)) {
+        case ISOTP_SINGLE:
+            ecu->active = false;
+            err = push_single(ecu, frame, out);
+            break;
+        case ISOTP_FIRST:
+            ecu->active = false;
+            err = push_first(ecu, frame, out);
+            break;
+        case ISOTP_CONSECUTIVE:
+            err = push_consecutive(ecu, frame, out);
+            break;
+        default:
+            /* ECUs never send us flow control. */
+            err = YOBD_INVALID_ISOTP;
+            break;
+    }
+
+    if (err != YOBD_OK) {
+        ecu->active = false;
+    }
+
+    return err;
+}
@@ -0,0 +1,944 @@
+/**
+ * @file      scheduler.c
+ * @brief     Scheduling of periodic OBD II queries within a bus budget.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <yobd/multi.h>
+#include <yobd/scheduler.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+#define NS_PER_S (1000000000ULL)
+
+/* Marks a PID that is not registered. */
+#define NO_ENTRY UINT32_MAX
+
+/* The cost of a single-PID query: the query and a single-frame response. */
+#define SINGLE_COST (2)
+
+/* How many ready entries to look through for PIDs to pack with the first. */
+#define PACK_LOOKAHEAD (16)
+
+struct sched_entry;
+
+/* Returns true if a should come out of a heap before b. */
+typedef bool (*heap_before_func)(
+    const struct sched_entry *a,
+    const struct sched_entry *b);
+
+/* A binary heap of indices into the scheduler's entries. */
+struct sched_heap {
+    uint32_t *items;
+    size_t count;
+    heap_before_func before;
+};
+
+struct sched_entry {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint8_t priority;
+    uint8_t can_bytes;
+    /* The index of the PID in the context. */
+    size_t pid_index;
+    /* The period the PID was registered with, and the one in use now. */
+    uint64_t base_period;
+    uint64_t period;
+    /* When the PID is next due to be polled. */
+    uint64_t due;
+    uint64_t polls;
+    /* Adaptive polling settings. */
+    bool adaptive;
+    float deadband;
+    uint64_t min_period;
+    uint64_t max_period;
+    /* The value and time of the last change beyond the deadband, if any. */
+    bool has_ref;
+    float ref_val;
+    uint64_t ref_time;
+    /* The heap holding the entry, and the entry's position in it. */
+    struct sched_heap *heap;
+    size_t pos;
+};
+
+struct yobd_scheduler {
+    struct yobd_ctx *ctx;
+    bool multi_pid;
+    /*
+     * The bus budget is a token bucket. credit is measured in frames times
+     * NS_PER_S, so that it refills by rate every nanosecond without division.
+     * A rate of 0 means there is no budget.
+     */
+    uint64_t rate;
+    uint64_t credit;
+    uint64_t credit_max;
+    uint64_t last_refill;
+    bool refilled;
+    /*
+     * For each PID in the context, an index into entries, or NO_ENTRY if the
+     * PID is not registered.
+     */
+    uint32_t *entry_index;
+    struct sched_entry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    /* Entries that are not yet due, earliest first. */
+    struct sched_heap timers;
+    /* Entries that are due, highest priority first. */
+    struct sched_heap ready;
+};
+
+static
+bool timer_before(const struct sched_entry *a, const struct sched_entry *b)
+{
+    if (a->due != b->due) {
+        return a->due < b->due;
+    }
+
+    return a->priority > b->priority;
+}
+
+static
+bool ready_before(const struct sched_entry *a, const struct sched_entry *b)
+{
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+
+    return a->due < b->due;
+}
+
+static inline
+struct sched_entry *heap_entry(
+    struct yobd_scheduler *sched,
+    const struct sched_heap *heap,
+    size_t pos)
+{
+    return &sched->entries[heap->items[pos]];
+}
+
+static
+void heap_swap(
+    struct yobd_scheduler *sched,
+    struct sched_heap *heap,
+    size_t a,
+    size_t b)
+{
+    uint32_t tmp;
+
+    tmp = heap->items[a];
+    heap->items[a] = heap->items[b];
+    heap->items[b] = tmp;
+    heap_entry(sched, heap, a)->pos = a;
+    heap_entry(sched, heap, b)->pos = b;
+}
+
+static
+void sift_up(struct yobd_scheduler *sched, struct sched_heap *heap, size_t pos)
+{
+    size_t parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (!heap->before(
+                heap_entry(sched, heap, pos),
+                heap_entry(sched, heap, parent))) {
+            break;
+        }
+        heap_swap(sched, heap, pos, parent);
+        pos = parent;
+    }
+}
+
+static
+void sift_down(
+    struct yobd_scheduler *sched,
+    struct sched_heap *heap,
+    size_t pos)
+{
+    size_t best;
+    size_t child;
+
+    for (;;) {
+        best = pos;
+        child = 2*pos + 1;
+        if (child < heap->count &&
+            heap->before(
+                heap_entry(sched, heap, child),
+                heap_entry(sched, heap, best))) {
+            best = child;
+        }
+        ++child;
+        if (child < heap->count &&
+            heap->before(
+                heap_entry(sched, heap, child),
+                heap_entry(sched, heap, best))) {
+            best = child;
+        }
+        if (best == pos) {
+            break;
+        }
+        heap_swap(sched, heap, pos, best);
+        pos = best;
+    }
+}
+
+static
+void heap_push(
+    struct yobd_scheduler *sched,
+    struct sched_heap *heap,
+    uint32_t index)
+{
+    struct sched_entry *entry;
+
+    entry = &sched->entries[index];
+    entry->heap = heap;
+    entry->pos = heap->count;
+    heap->items[heap->count] = index;
+    ++heap->count;
+    sift_up(sched, heap, entry->pos);
+}
+
+static
+void heap_remove(
+    struct yobd_scheduler *sched,
+    struct sched_heap *heap,
+    size_t pos)
+{
+    --heap->count;
+    if (pos == heap->count) {
+        return;
+    }
+
+    heap->items[pos] = heap->items[heap->count];
+    heap_entry(sched, heap, pos)->pos = pos;
+    sift_up(sched, heap, pos);
+    sift_down(sched, heap, pos);
+}
+
+static
+uint32_t heap_pop(struct yobd_scheduler *sched, struct sched_heap *heap)
+{
+    uint32_t index;
+
+    index = heap->items[0];
+    heap_remove(sched, heap, 0);
+
+    return index;
+}
+
+/*
+ * Returns the frames a query costs, given the payload size of the response:
+ * the query itself, the response, and flow control if the response spans
+ * several frames.
+ */
+static
+uint64_t query_cost(size_t payload_size)
+{
+    size_t frames;
+
+    frames = isotp_frame_count(payload_size);
+
+    return 1 + frames + (frames > 1 ? 1 : 0);
+}
+
+static
+void refill(struct yobd_scheduler *sched, uint64_t now)
+{
+    uint64_t elapsed;
+    uint64_t room;
+
+    if (sched->rate == 0) {
+        return;
+    }
+
+    /* The bus starts out idle. */
+    if (!sched->refilled) {
+        sched->credit = sched->credit_max;
+        sched->last_refill = now;
+        sched->refilled = true;
+        return;
+    }
+
+    elapsed = now > sched->last_refill ? now - sched->last_refill : 0;
+    sched->last_refill = now;
+
+    /* Checking for a full bucket first keeps elapsed * rate from overflow. */
+    room = sched->credit_max - sched->credit;
+    if (elapsed >= room / sched->rate + 1) {
+        sched->credit = sched->credit_max;
+    }
+    else {
+        sched->credit += elapsed * sched->rate;
+        if (sched->credit > sched->credit_max) {
+            sched->credit = sched->credit_max;
+        }
+    }
+}
+
+static inline
+bool has_credit(const struct yobd_scheduler *sched, uint64_t cost)
+{
+    return sched->rate == 0 || sched->credit >= cost * NS_PER_S;
+}
+
+/* Returns true if the budget can ever cover the given cost. */
+static inline
+bool within_burst(const struct yobd_scheduler *sched, uint64_t cost)
+{
+    return sched->rate == 0 || cost * NS_PER_S <= sched->credit_max;
+}
+
+/* Returns how long until there is credit for the given cost. */
+static
+uint64_t credit_wait(const struct yobd_scheduler *sched, uint64_t cost)
+{
+    uint64_t need;
+
+    if (has_credit(sched, cost)) {
+        return 0;
+    }
+
+    need = cost * NS_PER_S - sched->credit;
+
+    return (need + sched->rate - 1) / sched->rate;
+}
+
+PUBLIC_API
+void yobd_scheduler_opts_init(struct yobd_scheduler_opts *opts)
+{
+    if (opts == NULL) {
+        return;
+    }
+
+    opts->max_frames_per_sec = 0;
+    opts->bitrate = 0;
+    opts->bus_share = 100;
+    opts->burst = 8;
+    opts->multi_pid = false;
+}
+
+PUBLIC_API
+yobd_err yobd_new_scheduler(
+    struct yobd_ctx *ctx,
+    const struct yobd_scheduler_opts *opts,
+    struct yobd_scheduler **out_sched)
+{
+    uint64_t bus_rate;
+    size_t i;
+    uint64_t rate;
+    struct yobd_scheduler *sched;
+
+    if (ctx == NULL || opts == NULL || out_sched == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (opts->burst < SINGLE_COST) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    rate = opts->max_frames_per_sec;
+    if (opts->bitrate > 0) {
+        if (opts->bus_share == 0 || opts->bus_share > 100) {
+            return YOBD_INVALID_PARAMETER;
+        }
+        bus_rate = (uint64_t) opts->bitrate * opts->bus_share / 100 /
+                   YOBD_CAN_FRAME_BITS;
+        if (bus_rate == 0) {
+            return YOBD_INVALID_PARAMETER;
+        }
+        if (rate == 0 || bus_rate < rate) {
+            rate = bus_rate;
+        }
+    }
+
+    sched = malloc(sizeof(*sched));
+    if (sched == NULL) {
+        goto error_sched_malloc;
+    }
+    sched->ctx = ctx;
+    sched->multi_pid = opts->multi_pid;
+    sched->rate = rate;
+    sched->credit = 0;
+    sched->credit_max = (uint64_t) opts->burst * NS_PER_S;
+    sched->last_refill = 0;
+    sched->refilled = false;
+    sched->entries = NULL;
+    sched->entry_count = 0;
+    sched->entry_capacity = 0;
+    sched->timers.items = NULL;
+    sched->timers.count = 0;
+    sched->timers.before = timer_before;
+    sched->ready.items = NULL;
+    sched->ready.count = 0;
+    sched->ready.before = ready_before;
+
+    sched->entry_index = malloc(ctx->pid_count * sizeof(*sched->entry_index));
+    if (sched->entry_index == NULL && ctx->pid_count > 0) {
+        goto error_entry_index_malloc;
+    }
+    for (i = 0; i < ctx->pid_count; ++i) {
+        sched->entry_index[i] = NO_ENTRY;
+    }
+
+    *out_sched = sched;
+
+    return YOBD_OK;
+
+error_entry_index_malloc:
+    free(sched);
+error_sched_malloc:
+    return YOBD_OOM;
+}
+
+PUBLIC_API
+void yobd_free_scheduler(struct yobd_scheduler *sched)
+{
+    if (sched == NULL) {
+        return;
+    }
+
+    free(sched->ready.items);
+    free(sched->timers.items);
+    free(sched->entries);
+    free(sched->entry_index);
+    free(sched);
+}
+
+/* Makes room for one more entry, in the entries array and in both heaps. */
+static
+yobd_err grow_entries(struct yobd_scheduler *sched)
+{
+    size_t capacity;
+    struct sched_entry *entries;
+    uint32_t *items;
+
+    if (sched->entry_count < sched->entry_capacity) {
+        return YOBD_OK;
+    }
+
+    capacity = sched->entry_capacity == 0 ? 16 : 2*sched->entry_capacity;
+
+    entries = realloc(sched->entries, capacity * sizeof(*entries));
+    if (entries == NULL) {
+        return YOBD_OOM;
+    }
+    sched->entries = entries;
+
+    items = realloc(sched->timers.items, capacity * sizeof(*items));
+    if (items == NULL) {
+        return YOBD_OOM;
+    }
+    sched->timers.items = items;
+
+    items = realloc(sched->ready.items, capacity * sizeof(*items));
+    if (items == NULL) {
+        return YOBD_OOM;
+    }
+    sched->ready.items = items;
+
+    sched->entry_capacity = capacity;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_add_pid(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint64_t period,
+    uint8_t priority)
+{
+    struct sched_entry *entry;
+    yobd_err err;
+    uint32_t index;
+    size_t pid_index;
+
+    if (sched == NULL || period == 0) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    pid_index = get_pid_index(sched->ctx, mode, pid);
+    if (pid_index == SIZE_MAX) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+
+    /* Re-registering keeps the due time and re-sorts the entry's heap. */
+    index = sched->entry_index[pid_index];
+    if (index != NO_ENTRY) {
+        entry = &sched->entries[index];
+        heap_remove(sched, entry->heap, entry->pos);
+        entry->base_period = period;
+        entry->period = period;
+        entry->priority = priority;
+        entry->adaptive = false;
+        heap_push(sched, entry->heap, index);
+        return YOBD_OK;
+    }
+
+    err = grow_entries(sched);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    index = sched->entry_count;
+    entry = &sched->entries[index];
+    entry->mode = mode;
+    entry->pid = pid;
+    entry->priority = priority;
+    entry->can_bytes = sched->ctx->pids[pid_index].can_bytes;
+    entry->pid_index = pid_index;
+    entry->base_period = period;
+    entry->period = period;
+    entry->due = 0;
+    entry->polls = 0;
+    entry->adaptive = false;
+    ++sched->entry_count;
+    sched->entry_index[pid_index] = index;
+
+    heap_push(sched, &sched->timers, index);
+
+    return YOBD_OK;
+}
+
+/* Returns the index of a registered mode-PID's entry, or NO_ENTRY. */
+static
+uint32_t find_entry(
+    const struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    size_t pid_index;
+
+    pid_index = get_pid_index(sched->ctx, mode, pid);
+    if (pid_index == SIZE_MAX) {
+        return NO_ENTRY;
+    }
+
+    return sched->entry_index[pid_index];
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_remove_pid(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    struct sched_entry *entry;
+    uint32_t index;
+    uint32_t last;
+
+    if (sched == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = find_entry(sched, mode, pid);
+    if (index == NO_ENTRY) {
+        return YOBD_PID_DOES_NOT_EXIST;
+    }
+    entry = &sched->entries[index];
+
+    heap_remove(sched, entry->heap, entry->pos);
+    sched->entry_index[entry->pid_index] = NO_ENTRY;
+
+    /* Move the last entry into the hole, and point its heap at its new home. */
+    last = sched->entry_count - 1;
+    if (index != last) {
+        *entry = sched->entries[last];
+        entry->heap->items[entry->pos] = index;
+        sched->entry_index[entry->pid_index] = index;
+    }
+    --sched->entry_count;
+
+    return YOBD_OK;
+}
+
+/*
+ * Changes an entry's period. If the entry is waiting for its next poll, that
+ * poll moves to one new period after the last one.
+ */
+static
+void set_period(struct yobd_scheduler *sched, uint32_t index, uint64_t period)
+{
+    struct sched_entry *entry;
+
+    entry = &sched->entries[index];
+    if (entry->period == period) {
+        return;
+    }
+
+    if (entry->heap == &sched->timers) {
+        heap_remove(sched, &sched->timers, entry->pos);
+        if (entry->due > entry->period) {
+            entry->due = entry->due - entry->period + period;
+        }
+        else {
+            entry->due = period;
+        }
+        heap_push(sched, &sched->timers, index);
+    }
+    entry->period = period;
+}
+
+static inline
+uint64_t clamp_period(const struct sched_entry *entry, uint64_t period)
+{
+    if (period < entry->min_period) {
+        return entry->min_period;
+    }
+    if (period > entry->max_period) {
+        return entry->max_period;
+    }
+
+    return period;
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_set_adaptive(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    float deadband,
+    uint64_t min_period,
+    uint64_t max_period)
+{
+    struct sched_entry *entry;
+    uint32_t index;
+
+    /* The deadband check is written to reject NaN too. */
+    if (sched == NULL || !(deadband >= 0) || min_period == 0 ||
+        max_period < min_period) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = find_entry(sched, mode, pid);
+    if (index == NO_ENTRY) {
+        return YOBD_PID_DOES_NOT_EXIST;
+    }
+    entry = &sched->entries[index];
+
+    entry->adaptive = true;
+    entry->deadband = deadband;
+    entry->min_period = min_period;
+    entry->max_period = max_period;
+    entry->has_ref = false;
+    set_period(sched, index, clamp_period(entry, entry->period));
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_observe(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    float val,
+    uint64_t now)
+{
+    float delta;
+    uint64_t elapsed;
+    struct sched_entry *entry;
+    uint32_t index;
+    uint64_t period;
+
+    if (sched == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = find_entry(sched, mode, pid);
+    if (index == NO_ENTRY) {
+        return YOBD_PID_DOES_NOT_EXIST;
+    }
+    entry = &sched->entries[index];
+    if (!entry->adaptive) {
+        return YOBD_OK;
+    }
+
+    if (!entry->has_ref) {
+        entry->has_ref = true;
+        entry->ref_val = val;
+        entry->ref_time = now;
+        return YOBD_OK;
+    }
+
+    delta = val > entry->ref_val ? val - entry->ref_val : entry->ref_val - val;
+    if (delta > entry->deadband) {
+        /*
+         * Poll often enough that, at the rate the value has been changing
+         * since the last real change, it moves about one deadband per poll.
+         */
+        elapsed = now > entry->ref_time ? now - entry->ref_time : 0;
+        period = (double) elapsed * entry->deadband / delta;
+        entry->ref_val = val;
+        entry->ref_time = now;
+    }
+    else {
+        period = entry->period + entry->period / 4;
+    }
+    set_period(sched, index, clamp_period(entry, period));
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_observe_response(
+    struct yobd_scheduler *sched,
+    const struct can_frame *frame,
+    uint64_t now,
+    float *val)
+{
+    yobd_err err;
+    yobd_err frame_err;
+    yobd_mode mode;
+    yobd_pid pid;
+
+    if (sched == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    /* This parses the headers once, giving us the mode-PID with the value. */
+    err = yobd_parse_can_responses(
+        sched->ctx,
+        frame,
+        1,
+        val,
+        &frame_err,
+        &mode,
+        &pid);
+    if (err != YOBD_OK) {
+        return err;
+    }
+    if (frame_err != YOBD_OK) {
+        return frame_err;
+    }
+
+    err = yobd_scheduler_observe(sched, mode, pid, *val, now);
+    if (err == YOBD_PID_DOES_NOT_EXIST) {
+        return YOBD_OK;
+    }
+
+    return err;
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_get_pid_stats(
+    struct yobd_scheduler *sched,
+    yobd_mode mode,
+    yobd_pid pid,
+    struct yobd_scheduler_pid_stats *stats)
+{
+    const struct sched_entry *entry;
+    uint32_t index;
+
+    if (sched == NULL || stats == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = find_entry(sched, mode, pid);
+    if (index == NO_ENTRY) {
+        return YOBD_PID_DOES_NOT_EXIST;
+    }
+    entry = &sched->entries[index];
+
+    stats->base_period = entry->base_period;
+    stats->period = entry->period;
+    stats->polls = entry->polls;
+
+    return YOBD_OK;
+}
+
+/*
+ * Looks through the next few ready entries for PIDs of the same mode as the
+ * first one in group, adding them to the group while there is room in a query
+ * and the burst size allows. Entries that are passed over go back in the ready
+ * heap.
+ */
+static
+void pack_group(
+    struct yobd_scheduler *sched,
+    uint32_t *group,
+    size_t *group_count,
+    size_t *payload_size)
+{
+    struct sched_entry *entry;
+    size_t i;
+    uint32_t index;
+    yobd_mode mode;
+    size_t size;
+    uint32_t skipped[PACK_LOOKAHEAD];
+    size_t skipped_count;
+
+    mode = sched->entries[group[0]].mode;
+    skipped_count = 0;
+    for (i = 0; i < PACK_LOOKAHEAD; ++i) {
+        if (*group_count == YOBD_MAX_MULTI_PIDS || sched->ready.count == 0) {
+            break;
+        }
+
+        index = heap_pop(sched, &sched->ready);
+        entry = &sched->entries[index];
+        size = *payload_size + 1 + entry->can_bytes;
+        if (entry->mode == mode && within_burst(sched, query_cost(size))) {
+            group[*group_count] = index;
+            ++*group_count;
+            *payload_size = size;
+        }
+        else {
+            skipped[skipped_count] = index;
+            ++skipped_count;
+        }
+    }
+
+    for (i = 0; i < skipped_count; ++i) {
+        heap_push(sched, &sched->ready, skipped[i]);
+    }
+}
+
+/* Makes the query frame for a group of entries of the same mode. */
+static
+yobd_err make_group_query(
+    struct yobd_scheduler *sched,
+    const uint32_t *group,
+    size_t group_count,
+    struct can_frame *frame)
+{
+    const struct sched_entry *entry;
+    size_t i;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+
+    entry = &sched->entries[group[0]];
+    if (group_count == 1) {
+        return yobd_make_can_query(sched->ctx, entry->mode, entry->pid, frame);
+    }
+
+    for (i = 0; i < group_count; ++i) {
+        pids[i] = sched->entries[group[i]].pid;
+    }
+
+    return yobd_make_can_multi_query(
+        sched->ctx,
+        entry->mode,
+        pids,
+        group_count,
+        frame);
+}
+
+/*
+ * Sets an entry's next due time one period on. If it has fallen behind by a
+ * whole period or more, the missed polls are dropped rather than sent in a
+ * burst.
+ */
+static
+void reschedule(struct yobd_scheduler *sched, uint32_t index, uint64_t now)
+{
+    struct sched_entry *entry;
+
+    entry = &sched->entries[index];
+    entry->due += entry->period;
+    if (entry->due <= now) {
+        entry->due = now + entry->period;
+    }
+    heap_push(sched, &sched->timers, index);
+}
+
+PUBLIC_API
+yobd_err yobd_scheduler_next(
+    struct yobd_scheduler *sched,
+    uint64_t now,
+    struct can_frame *frames,
+    size_t max,
+    size_t *count,
+    uint64_t *wake)
+{
+    uint64_t cost;
+    const struct sched_entry *entry;
+    yobd_err err;
+    uint32_t group[YOBD_MAX_MULTI_PIDS];
+    size_t group_count;
+    size_t i;
+    uint32_t index;
+    size_t n;
+    uint64_t needed;
+    size_t payload_size;
+    uint64_t when;
+
+    if (sched == NULL || frames == NULL || count == NULL || wake == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    refill(sched, now);
+
+    while (sched->timers.count > 0 &&
+           heap_entry(sched, &sched->timers, 0)->due <= now) {
+        index = heap_pop(sched, &sched->timers);
+        heap_push(sched, &sched->ready, index);
+    }
+
+    /*
+     * Serve ready entries strictly by priority: if the budget cannot cover the
+     * highest-priority one, lower-priority ones wait too.
+     */
+    n = 0;
+    needed = SINGLE_COST;
+    while (n < max &&
+           sched->ready.count > 0 &&
+           has_credit(sched, SINGLE_COST)) {
+        group[0] = heap_pop(sched, &sched->ready);
+        group_count = 1;
+        entry = &sched->entries[group[0]];
+        payload_size = mode_data_offset(entry->mode) + entry->can_bytes;
+        if (sched->multi_pid && mode_is_sae_standard(entry->mode)) {
+            pack_group(sched, group, &group_count, &payload_size);
+        }
+
+        /*
+         * If the budget covers only part of a packed query, wait for all of
+         * it rather than sending fewer PIDs now, as a packed query polls more
+         * PIDs per frame.
+         */
+        cost = query_cost(payload_size);
+        if (!has_credit(sched, cost)) {
+            for (i = 0; i < group_count; ++i) {
+                heap_push(sched, &sched->ready, group[i]);
+            }
+            needed = cost;
+            break;
+        }
+
+        err = make_group_query(sched, group, group_count, &frames[n]);
+        if (err != YOBD_OK) {
+            for (i = 0; i < group_count; ++i) {
+                heap_push(sched, &sched->ready, group[i]);
+            }
+            return err;
+        }
+        ++n;
+
+        if (sched->rate != 0) {
+            sched->credit -= cost * NS_PER_S;
+        }
+        for (i = 0; i < group_count; ++i) {
+            ++sched->entries[group[i]].polls;
+            reschedule(sched, group[i], now);
+        }
+    }
+    *count = n;
+
+    when = UINT64_MAX;
+    if (sched->ready.count > 0) {
+        when = now + credit_wait(sched, needed);
+    }
+    if (sched->timers.count > 0 &&
+        heap_entry(sched, &sched->timers, 0)->due < when) {
+        when = heap_entry(sched, &sched->timers, 0)->due;
+    }
+    *wake = when;
+
+    return YOBD_OK;
+}
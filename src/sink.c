@@ -0,0 +1,350 @@
+/**
+ * @file      sink.c
+ * @brief     Columnar collection of decoded values, one column per PID.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <yobd/sink.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/batch.h>
+#include <yobd-private/eval.h>
+#include <yobd-private/parser.h>
+
+/* Marks a PID that has no column. */
+#define NO_COLUMN UINT32_MAX
+
+struct sink_column {
+    yobd_mode mode;
+    yobd_pid pid;
+    const struct pid_ctx *pid_ctx;
+    /* The number of values currently in the column. */
+    size_t count;
+    /*
+     * A single allocation of capacity timestamps followed by capacity values.
+     */
+    uint64_t *timestamps;
+    float *vals;
+};
+
+struct yobd_sink {
+    const struct yobd_ctx *ctx;
+    size_t capacity;
+    yobd_sink_flush_func flush;
+    void *data;
+    /* The batch evaluator to decode runs of frames with. */
+    batch_func func;
+    /*
+     * For each PID in the context, an index into columns, or NO_COLUMN if the
+     * PID is not registered. This lets routing a frame reuse the PID lookup
+     * that decoding needs anyway.
+     */
+    uint32_t *column_index;
+    /* Columns in the order they were registered. */
+    struct sink_column *columns;
+    size_t column_count;
+    /* Per-frame results of the run being decoded, with room for capacity. */
+    yobd_err *errs;
+};
+
+PUBLIC_API
+yobd_err yobd_new_sink(
+    struct yobd_ctx *ctx,
+    size_t capacity,
+    yobd_sink_flush_func flush,
+    void *data,
+    struct yobd_sink **out_sink)
+{
+    size_t i;
+    struct yobd_sink *sink;
+
+    if (ctx == NULL || capacity == 0 || flush == NULL || out_sink == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (capacity > SIZE_MAX / (sizeof(uint64_t) + sizeof(float))) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    sink = malloc(sizeof(*sink));
+    if (sink == NULL) {
+        goto error_sink_malloc;
+    }
+    sink->ctx = ctx;
+    sink->capacity = capacity;
+    sink->flush = flush;
+    sink->data = data;
+    sink->func = get_best_batch_func();
+    sink->columns = NULL;
+    sink->column_count = 0;
+
+    sink->column_index = malloc(ctx->pid_count * sizeof(*sink->column_index));
+    if (sink->column_index == NULL && ctx->pid_count > 0) {
+        goto error_column_index_malloc;
+    }
+    for (i = 0; i < ctx->pid_count; ++i) {
+        sink->column_index[i] = NO_COLUMN;
+    }
+
+    sink->errs = malloc(capacity * sizeof(*sink->errs));
+    if (sink->errs == NULL) {
+        goto error_errs_malloc;
+    }
+
+    *out_sink = sink;
+
+    return YOBD_OK;
+
+error_errs_malloc:
+    free(sink->column_index);
+error_column_index_malloc:
+    free(sink);
+error_sink_malloc:
+    return YOBD_OOM;
+}
+
+PUBLIC_API
+void yobd_free_sink(struct yobd_sink *sink)
+{
+    size_t i;
+
+    if (sink == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sink->column_count; ++i) {
+        free(sink->columns[i].timestamps);
+    }
+    free(sink->columns);
+    free(sink->column_index);
+    free(sink->errs);
+    free(sink);
+}
+
+PUBLIC_API
+yobd_err yobd_sink_add_pid(
+    struct yobd_sink *sink,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    struct sink_column *column;
+    struct sink_column *columns;
+    size_t index;
+
+    if (sink == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    index = get_pid_index(sink->ctx, mode, pid);
+    if (index == SIZE_MAX) {
+        return YOBD_UNKNOWN_MODE_PID;
+    }
+    if (sink->column_index[index] != NO_COLUMN) {
+        return YOBD_OK;
+    }
+
+    columns = realloc(
+        sink->columns,
+        (sink->column_count + 1) * sizeof(*sink->columns));
+    if (columns == NULL) {
+        return YOBD_OOM;
+    }
+    sink->columns = columns;
+
+    column = &sink->columns[sink->column_count];
+    column->timestamps = malloc(
+        sink->capacity *
+        (sizeof(*column->timestamps) + sizeof(*column->vals)));
+    if (column->timestamps == NULL) {
+        return YOBD_OOM;
+    }
+    column->vals = (float *) (column->timestamps + sink->capacity);
+    column->mode = mode;
+    column->pid = pid;
+    column->pid_ctx = &sink->ctx->pids[index];
+    column->count = 0;
+
+    sink->column_index[index] = sink->column_count;
+    ++sink->column_count;
+
+    return YOBD_OK;
+}
+
+static
+void flush_column(struct yobd_sink *sink, struct sink_column *column)
+{
+    sink->flush(
+        column->mode,
+        column->pid,
+        column->timestamps,
+        column->vals,
+        column->count,
+        sink->data);
+    column->count = 0;
+}
+
+/*
+ * Appends a run of frames that all carry a column's mode-PID, flushing the
+ * column whenever it fills up. Returns the number of values appended.
+ */
+static
+size_t store_run(
+    struct yobd_sink *sink,
+    struct sink_column *column,
+    const struct can_frame *frames,
+    const uint64_t *timestamps,
+    size_t count)
+{
+    size_t i;
+    size_t n;
+    size_t stored;
+    size_t total;
+    float *vals;
+
+    total = 0;
+    while (count > 0) {
+        n = sink->capacity - column->count;
+        if (n > count) {
+            n = count;
+        }
+
+        /*
+         * Decode straight into the column, then squeeze out the frames that
+         * failed to parse.
+         */
+        vals = &column->vals[column->count];
+        decode_batch(
+            column->pid_ctx,
+            sink->func,
+            frames,
+            n,
+            vals,
+            sink->errs);
+        stored = 0;
+        for (i = 0; i < n; ++i) {
+            if (sink->errs[i] != YOBD_OK) {
+                continue;
+            }
+            vals[stored] = vals[i];
+            column->timestamps[column->count + stored] = timestamps[i];
+            ++stored;
+        }
+        column->count += stored;
+        total += stored;
+
+        if (column->count == sink->capacity) {
+            flush_column(sink, column);
+        }
+
+        frames += n;
+        timestamps += n;
+        count -= n;
+    }
+
+    return total;
+}
+
+PUBLIC_API
+yobd_err yobd_sink_push(
+    struct yobd_sink *sink,
+    const struct can_frame *frames,
+    const uint64_t *timestamps,
+    size_t count,
+    size_t *stored)
+{
+    bool big_endian;
+    uint32_t column;
+    size_t end;
+    yobd_err err;
+    bool have_headers;
+    size_t i;
+    size_t index;
+    yobd_mode mode;
+    yobd_mode next_mode;
+    yobd_pid next_pid;
+    yobd_pid pid;
+    size_t total;
+
+    if (sink == NULL || frames == NULL || timestamps == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    big_endian = sink->ctx->big_endian;
+    total = 0;
+    have_headers = false;
+    i = 0;
+    while (i < count) {
+        /* The frame that ended the last run has already been parsed. */
+        if (!have_headers) {
+            err = parse_response_headers(big_endian, &frames[i], &mode, &pid);
+            if (err != YOBD_OK) {
+                ++i;
+                continue;
+            }
+        }
+        have_headers = false;
+
+        /* Frames for the same mode-PID tend to arrive together. */
+        for (end = i + 1; end < count; ++end) {
+            err = parse_response_headers(
+                big_endian,
+                &frames[end],
+                &next_mode,
+                &next_pid);
+            if (err != YOBD_OK || next_mode != mode || next_pid != pid) {
+                break;
+            }
+        }
+
+        index = get_pid_index(sink->ctx, mode, pid);
+        column = (index == SIZE_MAX) ? NO_COLUMN : sink->column_index[index];
+        if (column != NO_COLUMN) {
+            total += store_run(
+                sink,
+                &sink->columns[column],
+                &frames[i],
+                &timestamps[i],
+                end - i);
+        }
+
+        /* Start the next run with the frame that ended this one. */
+        i = end;
+        if (end < count) {
+            if (err == YOBD_OK) {
+                mode = next_mode;
+                pid = next_pid;
+                have_headers = true;
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+
+    if (stored != NULL) {
+        *stored = total;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_sink_flush(struct yobd_sink *sink)
+{
+    size_t i;
+
+    if (sink == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < sink->column_count; ++i) {
+        if (sink->columns[i].count > 0) {
+            flush_column(sink, &sink->columns[i]);
+        }
+    }
+
+    return YOBD_OK;
+}
@@ -0,0 +1,458 @@
+/**
+ * @file      supported.c
+ * @brief     Discovery of supported PIDs with the SAE "PIDs supported"
+ *            bitmaps.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <yobd/supported.h>
+#include <yobd/yobd.h>
+#include <yobd-private/api.h>
+#include <yobd-private/isotp.h>
+#include <yobd-private/parser.h>
+
+/* The bytes of data in a response to a "PIDs supported" query. */
+#define BITMAP_BYTES (4)
+
+/* The "PIDs supported" PIDs that one multi-PID query asks for. */
+#define MULTI_BITMAPS (6)
+
+/*
+ * The serialized form: a magic string, a version, and the mask of ECUs that
+ * have answered, followed by the mode 1 and mode 9 bitsets of each of those
+ * ECUs in turn. Bit j of byte k of a bitset is set if PID 8k + j is supported,
+ * so the form does not depend on byte order.
+ */
+#define CAPS_MAGIC "YOBDCAP"
+#define CAPS_VERSION (1)
+#define CAPS_HEADER_SIZE (sizeof(CAPS_MAGIC) + 2)
+#define CAPS_ECU_SIZE (2*YOBD_CAPS_PIDS/8)
+
+static inline
+bool mode_has_bitmaps(yobd_mode mode)
+{
+    return mode == 0x1 || mode == 0x9;
+}
+
+/* Returns an ECU's bitset for a mode that has bitmaps. */
+static inline
+uint32_t *get_bits(struct yobd_ecu_caps *ecu, yobd_mode mode)
+{
+    return mode == 0x1 ? ecu->mode1 : ecu->mode9;
+}
+
+static inline
+bool test_bit(const uint32_t *bits, yobd_pid pid)
+{
+    return (bits[pid / 32] >> (pid % 32)) & 1;
+}
+
+static inline
+void assign_bit(uint32_t *bits, yobd_pid pid, bool set)
+{
+    if (set) {
+        bits[pid / 32] |= (uint32_t) 1 << (pid % 32);
+    }
+    else {
+        bits[pid / 32] &= ~((uint32_t) 1 << (pid % 32));
+    }
+}
+
+static inline
+bool ecu_supports(
+    const struct yobd_ecu_caps *ecu,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    return test_bit(mode == 0x1 ? ecu->mode1 : ecu->mode9, pid);
+}
+
+static inline
+bool is_supported_pid(yobd_pid pid)
+{
+    return pid < YOBD_CAPS_PIDS && pid % YOBD_SUPPORTED_PIDS_STRIDE == 0;
+}
+
+PUBLIC_API
+void yobd_caps_init(struct yobd_caps *caps)
+{
+    memset(caps, 0, sizeof(*caps));
+}
+
+PUBLIC_API
+yobd_err yobd_make_supported_query(
+    yobd_mode mode,
+    yobd_pid pid,
+    struct can_frame *frame)
+{
+    if (!mode_has_bitmaps(mode)) {
+        return YOBD_INVALID_MODE;
+    }
+    if (!is_supported_pid(pid)) {
+        return YOBD_INVALID_PID;
+    }
+
+    /* Standard-mode queries do not depend on byte order. */
+    return yobd_make_can_query_noctx(true, mode, pid, frame);
+}
+
+PUBLIC_API
+yobd_err yobd_make_supported_multi_query(struct can_frame *frame)
+{
+    size_t i;
+
+    if (frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    frame->can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    frame->can_dlc = OBD_II_DLC;
+    frame->data[0] = 1 + MULTI_BITMAPS;
+    frame->data[1] = 0x1;
+    for (i = 0; i < MULTI_BITMAPS; ++i) {
+        frame->data[2+i] = i * YOBD_SUPPORTED_PIDS_STRIDE;
+    }
+
+    return YOBD_OK;
+}
+
+/* Checks that a payload holds only "PIDs supported" bitmaps. */
+static
+yobd_err check_payload(
+    const unsigned char *payload,
+    size_t size,
+    yobd_mode *mode)
+{
+    size_t pos;
+
+    if (size < 1 || payload[0] < 0x40 || !mode_has_bitmaps(payload[0] - 0x40)) {
+        return YOBD_INVALID_MODE;
+    }
+    *mode = payload[0] - 0x40;
+    if (size == 1) {
+        return YOBD_INVALID_DATA_BYTES;
+    }
+
+    for (pos = 1; pos < size; pos += 1 + BITMAP_BYTES) {
+        if (!is_supported_pid(payload[pos])) {
+            return YOBD_INVALID_PID;
+        }
+        if (size - pos < 1 + BITMAP_BYTES) {
+            return YOBD_INVALID_DATA_BYTES;
+        }
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_supported_payload(
+    struct yobd_caps *caps,
+    canid_t id,
+    const unsigned char *payload,
+    size_t size)
+{
+    uint32_t *bits;
+    const unsigned char *data;
+    size_t ecu;
+    yobd_err err;
+    size_t i;
+    yobd_mode mode;
+    yobd_pid pid;
+    size_t pos;
+
+    if (caps == NULL || payload == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (id < YOBD_OBD_II_RESPONSE_BASE || id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    err = check_payload(payload, size, &mode);
+    if (err != YOBD_OK) {
+        return err;
+    }
+
+    ecu = id - YOBD_OBD_II_RESPONSE_BASE;
+    caps->ecus |= 1 << ecu;
+    bits = get_bits(&caps->ecu[ecu], mode);
+    for (pos = 1; pos < size; pos += 1 + BITMAP_BYTES) {
+        pid = payload[pos];
+        data = &payload[pos+1];
+
+        /* Having answered, the ECU supports the bitmap PID itself. */
+        assign_bit(bits, pid, true);
+        for (i = 0; i < 8*BITMAP_BYTES; ++i) {
+            if (pid + 1 + i >= YOBD_CAPS_PIDS) {
+                break;
+            }
+            assign_bit(
+                bits,
+                pid + 1 + i,
+                (data[i / 8] >> (7 - i % 8)) & 1);
+        }
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_parse_supported_response(
+    struct yobd_caps *caps,
+    const struct can_frame *frame)
+{
+    size_t size;
+
+    if (caps == NULL || frame == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (frame->can_id < YOBD_OBD_II_RESPONSE_BASE ||
+        frame->can_id > YOBD_OBD_II_RESPONSE_END) {
+        return YOBD_UNKNOWN_ID;
+    }
+
+    /* The first byte of a single frame is its size, at most 7. */
+    size = frame->data[0];
+    if (frame->can_dlc < 1 || size > ISOTP_SINGLE_MAX ||
+        size + 1 > frame->can_dlc) {
+        return YOBD_INVALID_DLC;
+    }
+
+    return yobd_parse_supported_payload(
+        caps,
+        frame->can_id,
+        &frame->data[1],
+        size);
+}
+
+/* Returns the mask of ECUs that support a mode-PID of a mode with bitmaps. */
+static
+uint8_t get_ecus(const struct yobd_caps *caps, yobd_mode mode, yobd_pid pid)
+{
+    size_t ecu;
+    uint8_t ecus;
+
+    ecus = 0;
+    for (ecu = 0; ecu < YOBD_MAX_ECUS; ++ecu) {
+        if ((caps->ecus & (1 << ecu)) &&
+            ecu_supports(&caps->ecu[ecu], mode, pid)) {
+            ecus |= 1 << ecu;
+        }
+    }
+
+    return ecus;
+}
+
+PUBLIC_API
+yobd_err yobd_caps_next_supported_pid(
+    const struct yobd_caps *caps,
+    yobd_mode mode,
+    yobd_pid last,
+    yobd_pid *next,
+    bool *done)
+{
+    yobd_pid pid;
+
+    if (caps == NULL || next == NULL || done == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (!mode_has_bitmaps(mode)) {
+        return YOBD_INVALID_MODE;
+    }
+    if (!is_supported_pid(last)) {
+        return YOBD_INVALID_PID;
+    }
+
+    /*
+     * An ECU says it has bitmap p by setting bit p in bitmap p - 0x20. Even if
+     * one ECU skips a bitmap, another may not, so look past gaps.
+     */
+    for (pid = last + YOBD_SUPPORTED_PIDS_STRIDE;
+         pid < YOBD_CAPS_PIDS;
+         pid += YOBD_SUPPORTED_PIDS_STRIDE) {
+        if (get_ecus(caps, mode, pid) != 0) {
+            *next = pid;
+            *done = false;
+            return YOBD_OK;
+        }
+    }
+
+    *done = true;
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_caps_get_ecus(
+    const struct yobd_caps *caps,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint8_t *ecus)
+{
+    if (caps == NULL || ecus == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+    if (!mode_has_bitmaps(mode)) {
+        return YOBD_INVALID_MODE;
+    }
+    if (pid >= YOBD_CAPS_PIDS) {
+        return YOBD_INVALID_PID;
+    }
+
+    *ecus = get_ecus(caps, mode, pid);
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_caps_foreach(
+    struct yobd_ctx *ctx,
+    const struct yobd_caps *caps,
+    pid_process_func func,
+    void *data)
+{
+    bool done;
+    size_t i;
+    yobd_mode mode;
+    yobd_pid pid;
+
+    if (ctx == NULL || caps == NULL || func == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < ctx->pid_count; ++i) {
+        mode = get_mode(ctx->modepids[i]);
+        pid = get_pid(ctx->modepids[i]);
+        if (mode_has_bitmaps(mode) &&
+            get_ecus(caps, mode, pid) == 0) {
+            continue;
+        }
+
+        done = func(&ctx->descs[i], mode, pid, data);
+        if (done) {
+            break;
+        }
+    }
+
+    return YOBD_OK;
+}
+
+/* Writes a bitset a byte at a time, lowest PIDs first. */
+static
+void write_bits(const uint32_t *bits, unsigned char *buf)
+{
+    size_t k;
+
+    for (k = 0; k < YOBD_CAPS_PIDS / 8; ++k) {
+        buf[k] = (bits[k / 4] >> (8 * (k % 4))) & 0xff;
+    }
+}
+
+static
+void read_bits(const unsigned char *buf, uint32_t *bits)
+{
+    size_t k;
+
+    for (k = 0; k < YOBD_CAPS_PIDS / 8; ++k) {
+        bits[k / 4] |= (uint32_t) buf[k] << (8 * (k % 4));
+    }
+}
+
+/* Returns the number of bits set in an ECU mask. */
+static
+size_t ecu_count(uint8_t ecus)
+{
+    size_t count;
+
+    count = 0;
+    while (ecus != 0) {
+        ecus &= ecus - 1;
+        ++count;
+    }
+
+    return count;
+}
+
+PUBLIC_API
+yobd_err yobd_caps_serialize(
+    const struct yobd_caps *caps,
+    unsigned char *buf,
+    size_t max,
+    size_t *size)
+{
+    size_t ecu;
+    unsigned char *pos;
+
+    if (caps == NULL || size == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    *size = CAPS_HEADER_SIZE + ecu_count(caps->ecus)*CAPS_ECU_SIZE;
+    if (buf == NULL) {
+        return YOBD_OK;
+    }
+    if (max < *size) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    memcpy(buf, CAPS_MAGIC, sizeof(CAPS_MAGIC));
+    pos = &buf[sizeof(CAPS_MAGIC)];
+    *pos++ = CAPS_VERSION;
+    *pos++ = caps->ecus;
+    for (ecu = 0; ecu < YOBD_MAX_ECUS; ++ecu) {
+        if (!(caps->ecus & (1 << ecu))) {
+            continue;
+        }
+        write_bits(caps->ecu[ecu].mode1, pos);
+        pos += YOBD_CAPS_PIDS / 8;
+        write_bits(caps->ecu[ecu].mode9, pos);
+        pos += YOBD_CAPS_PIDS / 8;
+    }
+
+    return YOBD_OK;
+}
+
+PUBLIC_API
+yobd_err yobd_caps_deserialize(
+    const unsigned char *buf,
+    size_t size,
+    struct yobd_caps *caps)
+{
+    size_t ecu;
+    uint8_t ecus;
+    const unsigned char *pos;
+
+    if (buf == NULL || caps == NULL) {
+        return YOBD_INVALID_PARAMETER;
+    }
+
+    if (size < CAPS_HEADER_SIZE ||
+        memcmp(buf, CAPS_MAGIC, sizeof(CAPS_MAGIC)) != 0 ||
+        buf[sizeof(CAPS_MAGIC)] != CAPS_VERSION) {
+        return YOBD_INVALID_CAPS;
+    }
+    ecus = buf[sizeof(CAPS_MAGIC) + 1];
+    if (size != CAPS_HEADER_SIZE + ecu_count(ecus)*CAPS_ECU_SIZE) {
+        return YOBD_INVALID_CAPS;
+    }
+
+    yobd_caps_init(caps);
+    caps->ecus = ecus;
+    pos = &buf[CAPS_HEADER_SIZE];
+    for (ecu = 0; ecu < YOBD_MAX_ECUS; ++ecu) {
+        if (!(ecus & (1 << ecu))) {
+            continue;
+        }
+        read_bits(pos, caps->ecu[ecu].mode1);
+        pos += YOBD_CAPS_PIDS / 8;
+        read_bits(pos, caps->ecu[ecu].mode9);
+        pos += YOBD_CAPS_PIDS / 8;
+    }
+
+    return YOBD_OK;
+}
@@ -0,0 +1,440 @@
+/**
+ * @file      adaptive.c
+ * @brief     Replay test for adaptive polling, comparing the queries sent and
+ *            the tracking error against fixed-rate polling over a drive.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/scheduler.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* The length of the drive. */
+#define DRIVE_TIME (150*S)
+
+/* How often to check the scheduler and the tracking error. */
+#define STEP (10*MS)
+
+/* The fixed polling period, which is also the adaptive minimum. */
+#define BASE_PERIOD (100*MS)
+
+/* The longest adaptive periods, for signals that can jump and that can't. */
+#define FAST_MAX_PERIOD (1*S)
+#define SLOW_MAX_PERIOD (5*S)
+
+#define MAX_FRAMES (8)
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+/* A PID in the drive trace. */
+struct trace_pid {
+    yobd_pid pid;
+    const char *name;
+    /* The deadband, in SI units. */
+    float deadband;
+    uint64_t max_period;
+    /* Fills in the raw response bytes at a time in the drive. */
+    void (*sample)(double t, unsigned char *bytes);
+};
+
+/* Vehicle speed in km/h: idle, accelerate, cruise, slow down, cruise, stop. */
+static
+double speed_kmh(double t)
+{
+    if (t < 10) {
+        return 0;
+    }
+    if (t < 30) {
+        return 5 * (t - 10);
+    }
+    if (t < 70) {
+        return 100;
+    }
+    if (t < 80) {
+        return 100 - 5 * (t - 70);
+    }
+    if (t < 110) {
+        return 50;
+    }
+    if (t < 120) {
+        return 50 - 5 * (t - 110);
+    }
+
+    return 0;
+}
+
+static
+void sample_rpm(double t, unsigned char *bytes)
+{
+    unsigned int raw;
+
+    raw = 4 * (800 + 30 * speed_kmh(t));
+    bytes[0] = raw >> 8;
+    bytes[1] = raw & 0xff;
+}
+
+static
+void sample_speed(double t, unsigned char *bytes)
+{
+    bytes[0] = speed_kmh(t);
+}
+
+/* Coolant warms from 20 to 90 C over the first minute, then holds. */
+static
+void sample_coolant(double t, unsigned char *bytes)
+{
+    bytes[0] = 40 + (t < 60 ? 20 + 70 * t / 60 : 90);
+}
+
+static
+void sample_intake(double t, unsigned char *bytes)
+{
+    (void) t;
+
+    bytes[0] = 40 + 25;
+}
+
+/* Engine load is high while accelerating and low otherwise. */
+static
+void sample_load(double t, unsigned char *bytes)
+{
+    double load;
+
+    if (t >= 10 && t < 30) {
+        load = 80;
+    }
+    else if (speed_kmh(t) > 0) {
+        load = 30;
+    }
+    else {
+        load = 15;
+    }
+    bytes[0] = load * 2.55;
+}
+
+static const struct trace_pid TRACE_PIDS[] = {
+    /* 50 rpm, in rad/s. */
+    { 0x0c, "engine RPM", 5.2f, FAST_MAX_PERIOD, sample_rpm },
+    { 0x0d, "vehicle speed", 0.5f, FAST_MAX_PERIOD, sample_speed },
+    { 0x05, "coolant temperature", 1.0f, SLOW_MAX_PERIOD, sample_coolant },
+    { 0x0f, "intake air temperature", 1.0f, SLOW_MAX_PERIOD, sample_intake },
+    { 0x04, "engine load", 2.0f, FAST_MAX_PERIOD, sample_load },
+};
+
+/* What a replay of the drive cost, and how well it tracked each PID. */
+struct replay_result {
+    size_t queries;
+    size_t pid_queries[ARRAYLEN(TRACE_PIDS)];
+    float max_error[ARRAYLEN(TRACE_PIDS)];
+    /* The mean tracking error over the drive. */
+    double mean_error[ARRAYLEN(TRACE_PIDS)];
+    /* The RPM polling period while accelerating. */
+    uint64_t accel_rpm_period;
+};
+
+static
+size_t find_trace_pid(yobd_pid pid)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+        if (TRACE_PIDS[i].pid == pid) {
+            return i;
+        }
+    }
+
+    XASSERT_ERROR;
+    return 0;
+}
+
+/* Decodes the value a PID has at a time in the drive. */
+static
+float true_value(struct yobd_ctx *ctx, size_t i, double t)
+{
+    unsigned char bytes[2];
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    struct can_frame frame;
+    float val;
+
+    err = yobd_get_pid_descriptor(ctx, 0x1, TRACE_PIDS[i].pid, &desc);
+    XASSERT_OK(err);
+    TRACE_PIDS[i].sample(t, bytes);
+    err = yobd_make_can_response(
+        ctx,
+        0x1,
+        TRACE_PIDS[i].pid,
+        bytes,
+        desc->can_bytes,
+        &frame);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response(ctx, &frame, &val);
+    XASSERT_OK(err);
+
+    return val;
+}
+
+/*
+ * Replays the drive, answering each query from the trace and feeding each
+ * answer back to the scheduler. Between answers, the caller knows only the
+ * last value it got, so the tracking error is how far that is from the truth.
+ */
+static
+void replay(struct yobd_ctx *ctx, bool adaptive, struct replay_result *result)
+{
+    unsigned char bytes[2];
+    size_t count;
+    const struct yobd_pid_desc *desc;
+    float error;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    size_t j;
+    float known[ARRAYLEN(TRACE_PIDS)];
+    uint64_t now;
+    struct can_frame response;
+    struct yobd_scheduler *sched;
+    struct yobd_scheduler_opts opts;
+    struct yobd_scheduler_pid_stats stats;
+    float val;
+    uint64_t wake;
+
+    memset(result, 0, sizeof(*result));
+
+    yobd_scheduler_opts_init(&opts);
+    err = yobd_new_scheduler(ctx, &opts, &sched);
+    XASSERT_OK(err);
+    for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+        err = yobd_scheduler_add_pid(
+            sched,
+            0x1,
+            TRACE_PIDS[i].pid,
+            BASE_PERIOD,
+            0);
+        XASSERT_OK(err);
+        if (adaptive) {
+            err = yobd_scheduler_set_adaptive(
+                sched,
+                0x1,
+                TRACE_PIDS[i].pid,
+                TRACE_PIDS[i].deadband,
+                BASE_PERIOD,
+                TRACE_PIDS[i].max_period);
+            XASSERT_OK(err);
+        }
+        known[i] = true_value(ctx, i, 0);
+    }
+
+    wake = 0;
+    for (now = 0; now <= DRIVE_TIME; now += STEP) {
+        if (now >= wake) {
+            err = yobd_scheduler_next(
+                sched,
+                now,
+                frames,
+                MAX_FRAMES,
+                &count,
+                &wake);
+            XASSERT_OK(err);
+            for (j = 0; j < count; ++j) {
+                XASSERT_EQ(frames[j].data[0], 2);
+                i = find_trace_pid(frames[j].data[2]);
+                err = yobd_get_pid_descriptor(
+                    ctx,
+                    0x1,
+                    TRACE_PIDS[i].pid,
+                    &desc);
+                XASSERT_OK(err);
+                TRACE_PIDS[i].sample((double) now / S, bytes);
+                err = yobd_make_can_response(
+                    ctx,
+                    0x1,
+                    TRACE_PIDS[i].pid,
+                    bytes,
+                    desc->can_bytes,
+                    &response);
+                XASSERT_OK(err);
+                err = yobd_scheduler_observe_response(
+                    sched,
+                    &response,
+                    now,
+                    &val);
+                XASSERT_OK(err);
+                known[i] = val;
+                ++result->pid_queries[i];
+            }
+            result->queries += count;
+        }
+
+        for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+            val = true_value(ctx, i, (double) now / S);
+            error = val > known[i] ? val - known[i] : known[i] - val;
+            if (error > result->max_error[i]) {
+                result->max_error[i] = error;
+            }
+            result->mean_error[i] += error / (DRIVE_TIME / STEP + 1);
+        }
+
+        if (now == 20*S) {
+            err = yobd_scheduler_get_pid_stats(sched, 0x1, 0x0c, &stats);
+            XASSERT_OK(err);
+            result->accel_rpm_period = stats.period;
+        }
+    }
+
+    /* The introspected poll counts agree with what was sent. */
+    for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+        err = yobd_scheduler_get_pid_stats(
+            sched,
+            0x1,
+            TRACE_PIDS[i].pid,
+            &stats);
+        XASSERT_OK(err);
+        XASSERT_EQ(stats.polls, result->pid_queries[i]);
+        XASSERT_EQ(stats.base_period, BASE_PERIOD);
+        if (!adaptive) {
+            XASSERT_EQ(stats.period, BASE_PERIOD);
+        }
+    }
+
+    /* At the end, the car has been parked long enough to back off fully. */
+    if (adaptive) {
+        for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+            err = yobd_scheduler_get_pid_stats(
+                sched,
+                0x1,
+                TRACE_PIDS[i].pid,
+                &stats);
+            XASSERT_OK(err);
+            XASSERT_EQ(stats.period, TRACE_PIDS[i].max_period);
+        }
+    }
+
+    yobd_free_scheduler(sched);
+}
+
+static
+void check_params(struct yobd_ctx *ctx)
+{
+    yobd_err err;
+    struct yobd_scheduler_opts opts;
+    struct yobd_scheduler *sched;
+    struct yobd_scheduler_pid_stats stats;
+
+    yobd_scheduler_opts_init(&opts);
+    err = yobd_new_scheduler(ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    err = yobd_scheduler_set_adaptive(sched, 0x1, 0x0c, 1, MS, S);
+    XASSERT_ERRCODE(err, YOBD_PID_DOES_NOT_EXIST);
+    err = yobd_scheduler_observe(sched, 0x1, 0x0c, 1, 0);
+    XASSERT_ERRCODE(err, YOBD_PID_DOES_NOT_EXIST);
+    err = yobd_scheduler_get_pid_stats(sched, 0x1, 0x0c, &stats);
+    XASSERT_ERRCODE(err, YOBD_PID_DOES_NOT_EXIST);
+
+    err = yobd_scheduler_add_pid(sched, 0x1, 0x0c, 10*S, 0);
+    XASSERT_OK(err);
+    err = yobd_scheduler_set_adaptive(sched, 0x1, 0x0c, -1, MS, S);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_scheduler_set_adaptive(sched, 0x1, 0x0c, 1, 0, S);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_scheduler_set_adaptive(sched, 0x1, 0x0c, 1, S, MS);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    /* Turning adaptive polling on clamps the period into the bounds. */
+    err = yobd_scheduler_set_adaptive(sched, 0x1, 0x0c, 1, MS, S);
+    XASSERT_OK(err);
+    err = yobd_scheduler_get_pid_stats(sched, 0x1, 0x0c, &stats);
+    XASSERT_OK(err);
+    XASSERT_EQ(stats.period, S);
+    XASSERT_EQ(stats.base_period, 10*S);
+
+    /* Registering again turns it off. */
+    err = yobd_scheduler_add_pid(sched, 0x1, 0x0c, 10*S, 0);
+    XASSERT_OK(err);
+    err = yobd_scheduler_observe(sched, 0x1, 0x0c, 1, 0);
+    XASSERT_OK(err);
+    err = yobd_scheduler_observe(sched, 0x1, 0x0c, 100, S);
+    XASSERT_OK(err);
+    err = yobd_scheduler_get_pid_stats(sched, 0x1, 0x0c, &stats);
+    XASSERT_OK(err);
+    XASSERT_EQ(stats.period, 10*S);
+
+    yobd_free_scheduler(sched);
+}
+
+int main(int argc, const char **argv)
+{
+    struct replay_result adaptive;
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    struct replay_result fixed;
+    size_t i;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+
+    check_params(ctx);
+
+    replay(ctx, false, &fixed);
+    replay(ctx, true, &adaptive);
+
+    printf(
+        "%-24s %8s %8s %21s %21s\n",
+        "",
+        "fixed",
+        "adaptive",
+        "mean error (SI)",
+        "max error (SI)");
+    for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+        printf(
+            "%-24s %8zu %8zu %10.3f %10.3f %10.3f %10.3f\n",
+            TRACE_PIDS[i].name,
+            fixed.pid_queries[i],
+            adaptive.pid_queries[i],
+            fixed.mean_error[i],
+            adaptive.mean_error[i],
+            fixed.max_error[i],
+            adaptive.max_error[i]);
+    }
+    printf(
+        "queries: %zu fixed, %zu adaptive (%.1f%% of the bus time saved)\n",
+        fixed.queries,
+        adaptive.queries,
+        100.0 * (fixed.queries - adaptive.queries) / fixed.queries);
+
+    /*
+     * Adaptive polling takes under a quarter of the queries, keeps the mean
+     * error of every PID within its deadband, and while RPM climbs at 150 rpm/s
+     * it is polled about every 50 rpm, the deadband.
+     */
+    XASSERT_LT(4*adaptive.queries, fixed.queries);
+    for (i = 0; i < ARRAYLEN(TRACE_PIDS); ++i) {
+        XASSERT_LTE(adaptive.mean_error[i], TRACE_PIDS[i].deadband);
+    }
+    XASSERT_LTE(adaptive.accel_rpm_period, FAST_MAX_PERIOD / 2);
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -18,6 +18,7 @@
 #include <yobd/yobd.h>
 #include <yobd-test/assert.h>
 
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
 #define FLOAT_THRESH 0.001
 
 bool process_pid(
@@ -42,6 +43,11 @@ bool process_pid(
 int main(int argc, const char **argv)
 {
     size_t api_pid_count;
+    yobd_err batch_errs[5];
+    struct can_frame batch_frames[5];
+    yobd_mode batch_modes[5];
+    yobd_pid batch_pids[5];
+    float batch_vals[5];
     struct yobd_ctx *ctx;
     union {
         uint16_t as_uint16_t;
@@ -50,6 +56,7 @@ int main(int argc, const char **argv)
     yobd_err err;
     struct can_frame frame;
     struct can_frame frame2;
+    size_t i;
     size_t iter_pid_count;
     yobd_mode mode;
     yobd_mode mode2;
@@ -206,6 +213,76 @@ int main(int argc, const char **argv)
     XASSERT_OK(err);
     XASSERT_FLTEQ(val, 16.666666f);
 
+    /*
+     * Batch parsing: a run of two frames for the same PID, a frame for a
+     * different PID, a query (which is not a response), and a PID the schema
+     * doesn't know about.
+     */
+    memset(batch_frames, 0, sizeof(batch_frames));
+    batch_frames[0] = frame;
+    batch_frames[1] = frame;
+    batch_frames[1].data[3] = 90;
+    maf_rate.as_uint16_t = 0xabcd;
+    err = yobd_make_can_response(
+        ctx,
+        0x1,
+        0x10,
+        &maf_rate.as_uint8_t,
+        sizeof(maf_rate),
+        &batch_frames[2]);
+    XASSERT_OK(err);
+    err = yobd_make_can_query(ctx, 0x1, 0x10, &batch_frames[3]);
+    XASSERT_OK(err);
+    batch_frames[4] = frame;
+    batch_frames[4].data[2] = 0xfe;
+    err = yobd_parse_can_responses(
+        ctx,
+        batch_frames,
+        ARRAYLEN(batch_frames),
+        batch_vals,
+        batch_errs,
+        batch_modes,
+        batch_pids);
+    XASSERT_OK(err);
+    for (i = 0; i < ARRAYLEN(batch_frames); ++i) {
+        err = yobd_parse_can_response(ctx, &batch_frames[i], &val);
+        XASSERT_EQ(batch_errs[i], err);
+        if (err == YOBD_OK) {
+            XASSERT_FLTEQ(batch_vals[i], val);
+            err = yobd_parse_can_headers(ctx, &batch_frames[i], &mode, &pid);
+            XASSERT_OK(err);
+            XASSERT_EQ(batch_modes[i], mode);
+            XASSERT_EQ(batch_pids[i], pid);
+        }
+    }
+    XASSERT_OK(batch_errs[0]);
+    XASSERT_FLTEQ(batch_vals[0], 16.666666f);
+    XASSERT_OK(batch_errs[1]);
+    XASSERT_FLTEQ(batch_vals[1], 25.0f);
+    XASSERT_OK(batch_errs[2]);
+    XASSERT_FLTEQ_THRESH(batch_vals[2], 0.526500000f, FLOAT_THRESH);
+    XASSERT_ERRCODE(batch_errs[3], YOBD_UNKNOWN_ID);
+    XASSERT_ERRCODE(batch_errs[4], YOBD_UNKNOWN_MODE_PID);
+
+    err = yobd_parse_can_responses(
+        ctx,
+        batch_frames,
+        ARRAYLEN(batch_frames),
+        batch_vals,
+        batch_errs,
+        NULL,
+        NULL);
+    XASSERT_OK(err);
+    err = yobd_parse_can_responses(
+        ctx,
+        batch_frames,
+        ARRAYLEN(batch_frames),
+        batch_vals,
+        NULL,
+        NULL,
+        NULL);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
     yobd_free_ctx(ctx);
 
     return EXIT_SUCCESS;
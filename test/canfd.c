@@ -0,0 +1,329 @@
+/**
+ * @file      canfd.c
+ * @brief     Unit test checking that CAN FD queries and responses round-trip
+ *            and decode to the same values as classic CAN ones.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/canfd.h>
+#include <yobd/multi.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* The number of random inputs to try for each PID. */
+#define ROUNDS (1000)
+
+/* The most PIDs the schema may have. */
+#define MAX_PIDS (256)
+
+struct pid_entry {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint_fast8_t can_bytes;
+};
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct pid_entry pids[MAX_PIDS];
+    size_t count;
+};
+
+static
+bool check_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct can_frame classic;
+    yobd_err err;
+    float expected;
+    struct canfd_frame frame;
+    size_t i;
+    uint_fast8_t j;
+    yobd_mode parsed_mode;
+    yobd_pid parsed_pid;
+    struct test_ctx *test;
+    float val;
+
+    test = data;
+    XASSERT_LT(test->count, MAX_PIDS);
+    test->pids[test->count].mode = mode;
+    test->pids[test->count].pid = pid;
+    test->pids[test->count].can_bytes = desc->can_bytes;
+    ++test->count;
+
+    /* Queries always fit in 8 bytes, laid out as on classic CAN. */
+    err = yobd_make_canfd_query(test->ctx, mode, pid, &frame);
+    XASSERT_OK(err);
+    err = yobd_make_can_query(test->ctx, mode, pid, &classic);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame.can_id, classic.can_id);
+    XASSERT_EQ(frame.len, 8);
+    XASSERT_EQ(memcmp(frame.data, classic.data, 8), 0);
+    err = yobd_parse_canfd_headers(test->ctx, &frame, &parsed_mode, &parsed_pid);
+    XASSERT_OK(err);
+    XASSERT_EQ(parsed_mode, mode);
+    XASSERT_EQ(parsed_pid, pid);
+
+    for (i = 0; i < ROUNDS; ++i) {
+        for (j = 0; j < desc->can_bytes; ++j) {
+            bytes[j] = rand() & 0xff;
+        }
+
+        err = yobd_make_canfd_response(
+            test->ctx,
+            mode,
+            pid,
+            bytes,
+            desc->can_bytes,
+            &frame);
+        XASSERT_OK(err);
+        err = yobd_make_can_response(
+            test->ctx,
+            mode,
+            pid,
+            bytes,
+            desc->can_bytes,
+            &classic);
+        XASSERT_OK(err);
+        XASSERT_EQ(frame.len, 8);
+        XASSERT_EQ(memcmp(frame.data, classic.data, 8), 0);
+
+        err = yobd_parse_canfd_headers(
+            test->ctx,
+            &frame,
+            &parsed_mode,
+            &parsed_pid);
+        XASSERT_OK(err);
+        XASSERT_EQ(parsed_mode, mode);
+        XASSERT_EQ(parsed_pid, pid);
+
+        err = yobd_parse_canfd_response(test->ctx, &frame, &val);
+        XASSERT_OK(err);
+        err = yobd_parse_can_response(test->ctx, &classic, &expected);
+        XASSERT_OK(err);
+        XASSERT_EQ(memcmp(&val, &expected, sizeof(val)), 0);
+    }
+
+    return false;
+}
+
+/* Checks responses too long for classic CAN. */
+static
+void check_long(struct test_ctx *test)
+{
+    unsigned char data[YOBD_CANFD_MAX_DATA + 1];
+    const struct pid_entry *entry;
+    yobd_err err;
+    struct canfd_frame frame;
+    size_t header;
+    size_t i;
+    size_t max_data;
+    yobd_mode mode;
+    yobd_pid pid;
+    float val;
+
+    for (i = 0; i < sizeof(data); ++i) {
+        data[i] = i;
+    }
+
+    /* The mode and PID take 2 bytes in standard modes and 3 otherwise. */
+    entry = &test->pids[0];
+    header = entry->mode <= 0x0a ? 2 : 3;
+    max_data = YOBD_CANFD_MAX_DATA + 2 - header;
+
+    /* Each size lands in the shortest CAN FD length that holds it. */
+    for (i = 8 - header; i <= max_data; ++i) {
+        err = yobd_make_canfd_response(
+            test->ctx,
+            entry->mode,
+            entry->pid,
+            data,
+            i,
+            &frame);
+        XASSERT_OK(err);
+        XASSERT_GTE(frame.len, 2 + header + i);
+        XASSERT_EQ(frame.data[0], 0);
+        XASSERT_EQ(frame.data[1], header + i);
+        XASSERT_EQ(memcmp(&frame.data[2 + header], data, i), 0);
+
+        err = yobd_parse_canfd_headers(test->ctx, &frame, &mode, &pid);
+        XASSERT_OK(err);
+        XASSERT_EQ(mode, entry->mode);
+        XASSERT_EQ(pid, entry->pid);
+
+        /* The schema says how many bytes the PID has, so this is invalid. */
+        err = yobd_parse_canfd_response(test->ctx, &frame, &val);
+        XASSERT_ERRCODE(err, YOBD_INVALID_DATA_BYTES);
+    }
+    XASSERT_EQ(frame.len, CANFD_MAX_DLEN);
+
+    err = yobd_make_canfd_response(
+        test->ctx,
+        entry->mode,
+        entry->pid,
+        data,
+        max_data + 1,
+        &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    /* Malformed frames. */
+    err = yobd_make_canfd_response(
+        test->ctx,
+        entry->mode,
+        entry->pid,
+        data,
+        20,
+        &frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame.len, 24);
+    frame.len = 23;
+    err = yobd_parse_canfd_headers(test->ctx, &frame, &mode, &pid);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DLC);
+    frame.len = 24;
+    frame.data[1] = 23;
+    err = yobd_parse_canfd_headers(test->ctx, &frame, &mode, &pid);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frame.data[1] = 7;
+    err = yobd_parse_canfd_headers(test->ctx, &frame, &mode, &pid);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frame.data[1] = header + 20;
+    frame.can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    err = yobd_parse_canfd_response(test->ctx, &frame, &val);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+}
+
+/* Checks that multi-PID responses fit in one frame and match classic CAN. */
+static
+void check_multi(struct test_ctx *test)
+{
+    unsigned char data[YOBD_MAX_MULTI_PAYLOAD];
+    yobd_err err;
+    size_t fd_count;
+    yobd_pid fd_pids[YOBD_MAX_MULTI_PIDS];
+    float fd_vals[YOBD_MAX_MULTI_PIDS];
+    struct canfd_frame frame;
+    struct can_frame frames[YOBD_MAX_MULTI_FRAMES];
+    size_t frame_count;
+    size_t i;
+    size_t j;
+    yobd_mode mode;
+    size_t n;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    size_t size;
+    size_t val_count;
+    yobd_pid val_pids[YOBD_MAX_MULTI_PIDS];
+    float vals[YOBD_MAX_MULTI_PIDS];
+
+    for (i = 0; i < test->count; i += n) {
+        if (test->pids[i].mode > 0x0a) {
+            n = 1;
+            continue;
+        }
+
+        n = 0;
+        size = 0;
+        while (n < YOBD_MAX_MULTI_PIDS && i + n < test->count &&
+               test->pids[i + n].mode == test->pids[i].mode) {
+            pids[n] = test->pids[i + n].pid;
+            size += test->pids[i + n].can_bytes;
+            ++n;
+        }
+        for (j = 0; j < size; ++j) {
+            data[j] = rand() & 0xff;
+        }
+
+        err = yobd_make_canfd_multi_response(
+            test->ctx,
+            test->pids[i].mode,
+            pids,
+            n,
+            data,
+            &frame);
+        XASSERT_OK(err);
+        err = yobd_parse_canfd_multi_response(
+            test->ctx,
+            &frame,
+            &mode,
+            fd_pids,
+            fd_vals,
+            YOBD_MAX_MULTI_PIDS,
+            &fd_count);
+        XASSERT_OK(err);
+        XASSERT_EQ(mode, test->pids[i].mode);
+
+        err = yobd_make_can_multi_response(
+            test->ctx,
+            test->pids[i].mode,
+            pids,
+            n,
+            data,
+            frames,
+            YOBD_MAX_MULTI_FRAMES,
+            &frame_count);
+        XASSERT_OK(err);
+        err = yobd_parse_can_multi_response(
+            test->ctx,
+            frames,
+            frame_count,
+            &mode,
+            val_pids,
+            vals,
+            YOBD_MAX_MULTI_PIDS,
+            &val_count);
+        XASSERT_OK(err);
+
+        XASSERT_EQ(fd_count, val_count);
+        XASSERT_EQ(memcmp(fd_pids, val_pids, n*sizeof(*fd_pids)), 0);
+        XASSERT_EQ(memcmp(fd_vals, vals, n*sizeof(*fd_vals)), 0);
+
+        printf(
+            "mode 0x%02x, %zu PIDs: 1 CAN FD frame of %u bytes, %zu classic "
+            "frames\n",
+            (unsigned) mode,
+            n,
+            (unsigned) frame.len,
+            frame_count);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    static struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+
+    test.count = 0;
+    err = yobd_pid_foreach(test.ctx, check_pid, &test);
+    XASSERT_OK(err);
+    XASSERT_GT(test.count, 0);
+
+    check_long(&test);
+    check_multi(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,277 @@
+/**
+ * @file      compiled.c
+ * @brief     Unit test checking that compiled schemas behave like the schemas
+ *            they were compiled from.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _DEFAULT_SOURCE
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* PIDs too large to check exhaustively get this many random inputs. */
+#define SAMPLES (1 << 16)
+
+struct compare_ctx {
+    struct yobd_ctx *ref_ctx;
+    struct yobd_ctx *compiled_ctx;
+    size_t compared;
+};
+
+static
+void compare_input(
+    struct compare_ctx *compare,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *bytes,
+    uint_fast8_t can_bytes)
+{
+    yobd_err err;
+    struct can_frame frame;
+    float compiled_val;
+    float ref_val;
+
+    err = yobd_make_can_response(
+        compare->ref_ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+
+    err = yobd_parse_can_response(compare->ref_ctx, &frame, &ref_val);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response(compare->compiled_ctx, &frame, &compiled_val);
+    XASSERT_OK(err);
+
+    XASSERT_EQ(memcmp(&ref_val, &compiled_val, sizeof(ref_val)), 0);
+    ++compare->compared;
+}
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct compare_ctx *compare;
+    const struct yobd_pid_desc *compiled_desc;
+    yobd_err err;
+    size_t i;
+    uint_fast8_t j;
+
+    compare = data;
+
+    err = yobd_get_pid_descriptor(
+        compare->compiled_ctx,
+        mode,
+        pid,
+        &compiled_desc);
+    XASSERT_OK(err);
+    XASSERT_STREQ(compiled_desc->name, desc->name);
+    XASSERT_EQ(compiled_desc->can_bytes, desc->can_bytes);
+    XASSERT_EQ(compiled_desc->unit, desc->unit);
+
+    if (desc->can_bytes <= 2) {
+        for (i = 0; i < ((size_t) 1) << (8*desc->can_bytes); ++i) {
+            bytes[0] = i & 0xff;
+            bytes[1] = i >> 8;
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+    else {
+        for (i = 0; i < SAMPLES; ++i) {
+            for (j = 0; j < desc->can_bytes; ++j) {
+                bytes[j] = rand() & 0xff;
+            }
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+
+    return false;
+}
+
+static
+void get_footprint(struct yobd_ctx *ctx, struct yobd_footprint *footprint)
+{
+    yobd_err err;
+
+    err = yobd_get_footprint(ctx, footprint);
+    XASSERT_OK(err);
+    XASSERT_EQ(
+        footprint->total,
+        footprint->ctx +
+            footprint->arena +
+            footprint->luts +
+            footprint->jit +
+            footprint->mapped);
+}
+
+static
+void make_temp_path(char *path)
+{
+    int fd;
+
+    strcpy(path, "/tmp/yobd-test-XXXXXX");
+    fd = mkstemp(path);
+    XASSERT_NEQ(fd, -1);
+    close(fd);
+}
+
+static
+void read_file(const char *path, unsigned char **buf, size_t *size)
+{
+    FILE *file;
+    long len;
+    size_t count;
+
+    file = fopen(path, "rb");
+    XASSERT_NOT_NULL(file);
+    XASSERT_EQ(fseek(file, 0, SEEK_END), 0);
+    len = ftell(file);
+    XASSERT_GT(len, 0);
+    rewind(file);
+
+    *buf = malloc(len);
+    XASSERT_NOT_NULL(*buf);
+    count = fread(*buf, 1, len, file);
+    XASSERT_EQ(count, (size_t) len);
+    fclose(file);
+    *size = len;
+}
+
+/* Checks that a damaged copy of a compiled schema fails to load. */
+static
+void check_rejected(const unsigned char *buf, size_t size)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    FILE *file;
+    char path[PATH_MAX];
+
+    make_temp_path(path);
+    file = fopen(path, "wb");
+    XASSERT_NOT_NULL(file);
+    XASSERT_EQ(fwrite(buf, 1, size, file), size);
+    fclose(file);
+
+    err = yobd_load_compiled_schema(path, &ctx);
+    XASSERT_ERRCODE(err, YOBD_INVALID_COMPILED_SCHEMA);
+
+    unlink(path);
+}
+
+static
+void test_corruption(const char *path)
+{
+    unsigned char *buf;
+    size_t size;
+
+    read_file(path, &buf, &size);
+
+    /* Truncated. */
+    check_rejected(buf, size / 2);
+    check_rejected(buf, 1);
+
+    /* Not a compiled schema. */
+    buf[0] ^= 0xff;
+    check_rejected(buf, size);
+    buf[0] ^= 0xff;
+
+    /* Written with the opposite byte order. */
+    buf[12] ^= 0x05;
+    buf[15] ^= 0x05;
+    check_rejected(buf, size);
+
+    free(buf);
+}
+
+int main(int argc, const char **argv)
+{
+    struct compare_ctx compare;
+    size_t compiled_count;
+    struct yobd_footprint compiled_footprint;
+    char compiled_path[PATH_MAX];
+    yobd_err err;
+    struct yobd_schema_opts opts;
+    size_t ref_count;
+    struct yobd_footprint ref_footprint;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &compare.ref_ctx);
+    XASSERT_OK(err);
+
+    make_temp_path(compiled_path);
+    err = yobd_save_compiled_schema(compare.ref_ctx, compiled_path);
+    XASSERT_OK(err);
+
+    err = yobd_load_compiled_schema(compiled_path, &compare.compiled_ctx);
+    XASSERT_OK(err);
+
+    err = yobd_get_pid_count(compare.ref_ctx, &ref_count);
+    XASSERT_OK(err);
+    err = yobd_get_pid_count(compare.compiled_ctx, &compiled_count);
+    XASSERT_OK(err);
+    XASSERT_EQ(compiled_count, ref_count);
+
+    srand(0);
+    compare.compared = 0;
+    err = yobd_pid_foreach(compare.ref_ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+    XASSERT_GT(compare.compared, 0);
+
+    /* Compiled contexts keep names and bytecode in the map, not the arena. */
+    get_footprint(compare.ref_ctx, &ref_footprint);
+    XASSERT_GT(ref_footprint.arena, 0);
+    XASSERT_EQ(ref_footprint.luts, 0);
+    XASSERT_EQ(ref_footprint.jit, 0);
+    XASSERT_EQ(ref_footprint.mapped, 0);
+    get_footprint(compare.compiled_ctx, &compiled_footprint);
+    XASSERT_LT(compiled_footprint.arena, ref_footprint.arena);
+    XASSERT_GT(compiled_footprint.mapped, 0);
+    yobd_free_ctx(compare.compiled_ctx);
+
+    /* Options apply to compiled schemas too. */
+    yobd_schema_opts_init(&opts);
+    opts.lut_max_bytes = 2;
+    opts.lut_budget = SIZE_MAX;
+    opts.jit = true;
+    err = yobd_load_compiled_schema_opts(
+        compiled_path,
+        &opts,
+        &compare.compiled_ctx);
+    XASSERT_OK(err);
+    err = yobd_pid_foreach(compare.ref_ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+    get_footprint(compare.compiled_ctx, &compiled_footprint);
+    XASSERT_GT(compiled_footprint.luts, 0);
+    yobd_free_ctx(compare.compiled_ctx);
+
+    test_corruption(compiled_path);
+
+    err = yobd_load_compiled_schema(argv[1], &compare.compiled_ctx);
+    XASSERT_ERRCODE(err, YOBD_INVALID_COMPILED_SCHEMA);
+
+    unlink(compiled_path);
+    yobd_free_ctx(compare.ref_ctx);
+
+    return EXIT_SUCCESS;
+}
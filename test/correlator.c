@@ -0,0 +1,613 @@
+/**
+ * @file      correlator.c
+ * @brief     Unit test for the request/response correlator against a
+ *            simulated multi-ECU responder.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/correlator.h>
+#include <yobd/multi.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* The most mode 1 PIDs the tests use. */
+#define MAX_PIDS (64)
+
+/* The simulated ECUs, which answer at the first response IDs. */
+#define TEST_ECUS (3)
+
+/* How long the correlator waits for responses. */
+#define TIMEOUT (50*MS)
+
+/* The simulated run time, and how often the tester sends a round of queries. */
+#define RUN_TIME (20*S)
+#define SEND_PERIOD (2*MS)
+
+/*
+ * How long the tester waits after a timeout before asking for the PID again,
+ * so that a late response cannot be taken for an answer to the next query.
+ */
+#define HOLDOFF (TIMEOUT)
+
+/* The most responses in flight on the simulated bus. */
+#define MAX_PENDING (MAX_PIDS*TEST_ECUS)
+
+/* How a simulated ECU answers. */
+struct ecu_model {
+    /* The shortest latency, and the most random latency added to it. */
+    uint64_t latency;
+    uint64_t jitter;
+    /* The chance of dropping a response, in percent. */
+    unsigned drop_percent;
+    /* Supports PID i of the test if i % modulus == 0. */
+    size_t modulus;
+};
+
+static const struct ecu_model ECUS[TEST_ECUS] = {
+    /* An engine ECU: fast and supports everything. */
+    { 2*MS, 8*MS, 1, 1 },
+    /* A transmission ECU: slower, and supports every other PID. */
+    { 10*MS, 20*MS, 2, 2 },
+    /* A body ECU: slow, and sometimes slower than the timeout. */
+    { 30*MS, 40*MS, 0, 3 },
+};
+
+/* A response on its way from an ECU. */
+struct pending {
+    uint64_t time;
+    uint64_t latency;
+    size_t ecu;
+    size_t pid_index;
+};
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[MAX_PIDS];
+    size_t pid_count;
+    uint64_t rand_state;
+};
+
+/* Queries and responses of a simulated run. */
+struct run_stats {
+    size_t sent;
+    size_t responses;
+    size_t matched;
+    size_t unmatched;
+    size_t completed;
+    size_t timeouts;
+    size_t predicted_timeouts;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+};
+
+/* xorshift64, so runs are repeatable. */
+static
+uint64_t next_rand(struct test_ctx *test)
+{
+    test->rand_state ^= test->rand_state << 13;
+    test->rand_state ^= test->rand_state >> 7;
+    test->rand_state ^= test->rand_state << 17;
+
+    return test->rand_state;
+}
+
+static
+size_t find_pid(const struct test_ctx *test, yobd_pid pid)
+{
+    size_t i;
+
+    for (i = 0; i < test->pid_count; ++i) {
+        if (test->pids[i].pid == pid) {
+            break;
+        }
+    }
+    XASSERT_LT(i, test->pid_count);
+
+    return i;
+}
+
+static
+uint8_t supported_ecus(size_t pid_index)
+{
+    size_t ecu;
+    uint8_t ecus;
+
+    ecus = 0;
+    for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+        if (pid_index % ECUS[ecu].modulus == 0) {
+            ecus |= 1 << ecu;
+        }
+    }
+
+    return ecus;
+}
+
+/* Inserts a response, keeping pending sorted latest first. */
+static
+void push_pending(
+    struct pending *pending,
+    size_t *count,
+    const struct pending *p)
+{
+    size_t i;
+
+    XASSERT_LT(*count, MAX_PENDING);
+    i = *count;
+    while (i > 0 && pending[i-1].time < p->time) {
+        pending[i] = pending[i-1];
+        --i;
+    }
+    pending[i] = *p;
+    ++*count;
+}
+
+/*
+ * Sends a query for a PID and has the simulated ECUs that support it schedule
+ * their responses. Returns whether the query is bound to time out.
+ */
+static
+bool send_query(
+    struct test_ctx *test,
+    struct yobd_correlator *corr,
+    size_t pid_index,
+    uint64_t now,
+    struct pending *pending,
+    size_t *pending_count)
+{
+    size_t ecu;
+    uint8_t ecus;
+    yobd_err err;
+    struct can_frame frame;
+    struct pending p;
+    bool times_out;
+
+    ecus = supported_ecus(pid_index);
+    err = yobd_make_can_query(
+        test->ctx,
+        0x1,
+        test->pids[pid_index].pid,
+        &frame);
+    XASSERT_OK(err);
+    err = yobd_correlator_add_query(corr, &frame, ecus, now);
+    XASSERT_OK(err);
+
+    times_out = false;
+    for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+        if (!(ecus & (1 << ecu))) {
+            continue;
+        }
+        if (next_rand(test) % 100 < ECUS[ecu].drop_percent) {
+            times_out = true;
+            continue;
+        }
+        p.latency = ECUS[ecu].latency + next_rand(test) % ECUS[ecu].jitter;
+        p.time = now + p.latency;
+        p.ecu = ecu;
+        p.pid_index = pid_index;
+        push_pending(pending, pending_count, &p);
+        if (p.latency > TIMEOUT) {
+            times_out = true;
+        }
+    }
+
+    return times_out;
+}
+
+/* Delivers a response from a simulated ECU to the correlator. */
+static
+void deliver(
+    struct test_ctx *test,
+    struct yobd_correlator *corr,
+    const struct pending *p,
+    bool *in_flight,
+    struct run_stats *stats)
+{
+    unsigned char data[8];
+    yobd_err err;
+    struct can_frame frame;
+    struct yobd_correlation match;
+    const struct yobd_pid_desc *desc;
+
+    err = yobd_get_pid_descriptor(
+        test->ctx,
+        0x1,
+        test->pids[p->pid_index].pid,
+        &desc);
+    XASSERT_OK(err);
+    memset(data, 0, sizeof(data));
+    err = yobd_make_can_response(
+        test->ctx,
+        0x1,
+        test->pids[p->pid_index].pid,
+        data,
+        desc->can_bytes,
+        &frame);
+    XASSERT_OK(err);
+    frame.can_id = YOBD_OBD_II_RESPONSE_BASE + p->ecu;
+
+    err = yobd_correlator_match_response(corr, &frame, p->time, &match);
+    XASSERT_OK(err);
+    ++stats->responses;
+
+    /* Responses later than the timeout find their query gone. */
+    if (p->latency > TIMEOUT) {
+        XASSERT_EQ(match.matched, false);
+        ++stats->unmatched;
+        return;
+    }
+
+    XASSERT_EQ(match.matched, true);
+    XASSERT_EQ(match.ecu, p->ecu);
+    XASSERT_EQ(match.latency, p->latency);
+    ++stats->matched;
+    stats->latency_sum += match.latency;
+    if (match.latency > stats->latency_max) {
+        stats->latency_max = match.latency;
+    }
+    if (match.complete) {
+        in_flight[p->pid_index] = false;
+        ++stats->completed;
+    }
+}
+
+/*
+ * Runs the tester and the simulated ECUs as discrete events: every
+ * SEND_PERIOD, the tester queries each PID that has no query outstanding, and
+ * it handles responses and timeouts as they come, never blocking.
+ */
+static
+void check_simulation(struct test_ctx *test)
+{
+    struct yobd_correlator *corr;
+    size_t count;
+    yobd_err err;
+    uint64_t holdoff[MAX_PIDS];
+    size_t i;
+    bool in_flight[MAX_PIDS];
+    size_t index;
+    size_t max_in_flight;
+    uint64_t next_send;
+    uint64_t now;
+    size_t outstanding;
+    struct pending pending[MAX_PENDING];
+    size_t pending_count;
+    struct yobd_correlator_stats cstats;
+    struct run_stats stats;
+    struct yobd_correlator_timeout timeouts[MAX_PIDS];
+    uint64_t wake;
+
+    err = yobd_new_correlator(test->ctx, TIMEOUT, &corr);
+    XASSERT_OK(err);
+
+    memset(&stats, 0, sizeof(stats));
+    memset(in_flight, 0, sizeof(in_flight));
+    memset(holdoff, 0, sizeof(holdoff));
+    pending_count = 0;
+    max_in_flight = 0;
+    wake = UINT64_MAX;
+    next_send = 0;
+    now = 0;
+    while (now < RUN_TIME) {
+        /* Advance to the next event. */
+        now = next_send;
+        if (wake < now) {
+            now = wake;
+        }
+        if (pending_count > 0 && pending[pending_count-1].time < now) {
+            now = pending[pending_count-1].time;
+        }
+
+        while (pending_count > 0 && pending[pending_count-1].time <= now) {
+            --pending_count;
+            deliver(test, corr, &pending[pending_count], in_flight, &stats);
+        }
+
+        err = yobd_correlator_expire(
+            corr,
+            now,
+            timeouts,
+            MAX_PIDS,
+            &count,
+            &wake);
+        XASSERT_OK(err);
+        for (i = 0; i < count; ++i) {
+            XASSERT_EQ(timeouts[i].mode, 0x1);
+            XASSERT_EQ(timeouts[i].sent + TIMEOUT <= now, true);
+            XASSERT_NEQ(timeouts[i].responded, timeouts[i].expected);
+            XASSERT_EQ(timeouts[i].responded & ~timeouts[i].expected, 0);
+        }
+        stats.timeouts += count;
+        for (i = 0; i < count; ++i) {
+            index = find_pid(test, timeouts[i].pid);
+            in_flight[index] = false;
+            holdoff[index] = now + HOLDOFF;
+        }
+
+        if (now >= next_send) {
+            for (i = 0; i < test->pid_count; ++i) {
+                if (in_flight[i] || now < holdoff[i]) {
+                    continue;
+                }
+                if (send_query(
+                        test,
+                        corr,
+                        i,
+                        now,
+                        pending,
+                        &pending_count)) {
+                    ++stats.predicted_timeouts;
+                }
+                in_flight[i] = true;
+                ++stats.sent;
+            }
+            next_send = now + SEND_PERIOD;
+
+            err = yobd_correlator_expire(
+                corr,
+                now,
+                timeouts,
+                MAX_PIDS,
+                &count,
+                &wake);
+            XASSERT_OK(err);
+            XASSERT_EQ(count, 0);
+        }
+
+        outstanding = 0;
+        for (i = 0; i < test->pid_count; ++i) {
+            outstanding += in_flight[i];
+        }
+        if (outstanding > max_in_flight) {
+            max_in_flight = outstanding;
+        }
+    }
+
+    err = yobd_correlator_get_stats(corr, &cstats);
+    XASSERT_OK(err);
+    XASSERT_EQ(cstats.sent, stats.sent);
+    XASSERT_EQ(cstats.matched, stats.matched);
+    XASSERT_EQ(cstats.unmatched, stats.unmatched);
+    XASSERT_EQ(cstats.completed, stats.completed);
+    XASSERT_EQ(cstats.timeouts, stats.timeouts);
+    XASSERT_EQ(cstats.sent, cstats.completed + cstats.timeouts +
+                            cstats.in_flight);
+
+    /*
+     * Every query that lost or was late on a response timed out, and all the
+     * others completed. Only queries still in flight may not have yet.
+     */
+    XASSERT_LTE(stats.timeouts, stats.predicted_timeouts);
+    XASSERT_LTE(stats.predicted_timeouts - stats.timeouts, cstats.in_flight);
+    XASSERT_GT(stats.timeouts, 0);
+    XASSERT_GT(stats.unmatched, 0);
+    XASSERT_EQ(max_in_flight, test->pid_count);
+
+    printf(
+        "%zu queries: %zu completed, %zu timed out; %zu responses, "
+        "%zu late; mean latency %.2f ms, max %.2f ms\n",
+        stats.sent,
+        stats.completed,
+        stats.timeouts,
+        stats.responses,
+        stats.unmatched,
+        (double) stats.latency_sum / stats.matched / MS,
+        (double) stats.latency_max / MS);
+
+    yobd_free_correlator(corr);
+}
+
+/* A multi-PID query tracks each PID, and with no ECUs given any one answers. */
+static
+void check_multi(struct test_ctx *test)
+{
+    struct yobd_correlator *corr;
+    size_t count;
+    yobd_err err;
+    struct can_frame frame;
+    size_t i;
+    struct yobd_correlation match;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    struct yobd_correlator_stats stats;
+    struct yobd_correlator_timeout timeouts[2];
+    uint64_t wake;
+
+    err = yobd_new_correlator(test->ctx, TIMEOUT, &corr);
+    XASSERT_OK(err);
+
+    for (i = 0; i < YOBD_MAX_MULTI_PIDS; ++i) {
+        pids[i] = test->pids[i].pid;
+    }
+    err = yobd_make_can_multi_query(
+        test->ctx,
+        0x1,
+        pids,
+        YOBD_MAX_MULTI_PIDS,
+        &frame);
+    XASSERT_OK(err);
+    err = yobd_correlator_add_query(corr, &frame, 0, 1*MS);
+    XASSERT_OK(err);
+    err = yobd_correlator_add(corr, 0x1, test->pids[0].pid, 0, 1*MS);
+    XASSERT_ERRCODE(err, YOBD_QUERY_IN_FLIGHT);
+    err = yobd_correlator_add_query(corr, &frame, 0, 1*MS);
+    XASSERT_ERRCODE(err, YOBD_QUERY_IN_FLIGHT);
+    err = yobd_correlator_get_stats(corr, &stats);
+    XASSERT_OK(err);
+    XASSERT_EQ(stats.in_flight, YOBD_MAX_MULTI_PIDS);
+
+    /* The PIDs of a reassembled multi-PID response are matched one by one. */
+    err = yobd_correlator_match(
+        corr,
+        YOBD_OBD_II_RESPONSE_BASE + 2,
+        0x1,
+        test->pids[1].pid,
+        4*MS,
+        &match);
+    XASSERT_OK(err);
+    XASSERT_EQ(match.matched, true);
+    XASSERT_EQ(match.ecu, 2);
+    XASSERT_EQ(match.latency, 3*MS);
+    XASSERT_EQ(match.complete, true);
+
+    /* A second answer comes too late to match. */
+    err = yobd_correlator_match(
+        corr,
+        YOBD_OBD_II_RESPONSE_BASE,
+        0x1,
+        test->pids[1].pid,
+        5*MS,
+        &match);
+    XASSERT_OK(err);
+    XASSERT_EQ(match.matched, false);
+
+    /* Waiting for two ECUs means the first answer does not complete it. */
+    err = yobd_correlator_add(corr, 0x1, test->pids[1].pid, 0x3, 6*MS);
+    XASSERT_OK(err);
+    err = yobd_correlator_match(
+        corr,
+        YOBD_OBD_II_RESPONSE_BASE + 1,
+        0x1,
+        test->pids[1].pid,
+        8*MS,
+        &match);
+    XASSERT_OK(err);
+    XASSERT_EQ(match.complete, false);
+    err = yobd_correlator_match(
+        corr,
+        YOBD_OBD_II_RESPONSE_BASE + 1,
+        0x1,
+        test->pids[1].pid,
+        9*MS,
+        &match);
+    XASSERT_OK(err);
+    XASSERT_EQ(match.matched, false);
+
+    /* Expiry goes in send order, a few at a time if asked. */
+    err = yobd_correlator_expire(corr, 50*MS, timeouts, 2, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 0);
+    XASSERT_EQ(wake, 51*MS);
+    err = yobd_correlator_expire(corr, 51*MS, timeouts, 2, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 2);
+    XASSERT_EQ(wake, 51*MS);
+    XASSERT_EQ(timeouts[0].pid, test->pids[0].pid);
+    XASSERT_EQ(timeouts[1].pid, test->pids[2].pid);
+    XASSERT_EQ(timeouts[0].responded, 0);
+    err = yobd_correlator_expire(corr, 51*MS, timeouts, 2, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 2);
+    XASSERT_EQ(wake, 51*MS);
+    err = yobd_correlator_expire(corr, 51*MS, timeouts, 2, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+    XASSERT_EQ(timeouts[0].pid, test->pids[5].pid);
+    XASSERT_EQ(wake, 56*MS);
+    err = yobd_correlator_expire(corr, 60*MS, timeouts, 2, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+    XASSERT_EQ(timeouts[0].pid, test->pids[1].pid);
+    XASSERT_EQ(timeouts[0].expected, 0x3);
+    XASSERT_EQ(timeouts[0].responded, 0x2);
+    XASSERT_EQ(wake, UINT64_MAX);
+
+    /* Every PID is free again. */
+    for (i = 0; i < YOBD_MAX_MULTI_PIDS; ++i) {
+        err = yobd_correlator_add(corr, 0x1, test->pids[i].pid, 0, 61*MS);
+        XASSERT_OK(err);
+    }
+
+    yobd_free_correlator(corr);
+}
+
+static
+void check_params(struct test_ctx *test)
+{
+    struct yobd_correlator *corr;
+    size_t count;
+    yobd_err err;
+    struct can_frame frame;
+    struct yobd_correlation match;
+    uint64_t wake;
+
+    err = yobd_new_correlator(NULL, TIMEOUT, &corr);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_new_correlator(test->ctx, 0, &corr);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_new_correlator(test->ctx, TIMEOUT, &corr);
+    XASSERT_OK(err);
+
+    err = yobd_correlator_add(corr, 0x55, 0x1234, 0, 0);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_correlator_add(corr, 0x1, test->pids[0].pid, 0, 10*MS);
+    XASSERT_OK(err);
+    err = yobd_correlator_add(corr, 0x1, test->pids[1].pid, 0, 9*MS);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    /* Responses are not queries, and first frames are not single frames. */
+    err = yobd_make_can_response(
+        test->ctx,
+        0x1,
+        test->pids[0].pid,
+        (const unsigned char *) "\x01\x02",
+        1,
+        &frame);
+    XASSERT_OK(err);
+    err = yobd_correlator_add_query(corr, &frame, 0, 10*MS);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+    frame.data[0] = 0x10;
+    err = yobd_correlator_match_response(corr, &frame, 10*MS, &match);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    err = yobd_correlator_match(
+        corr,
+        YOBD_OBD_II_QUERY_ADDRESS,
+        0x1,
+        test->pids[0].pid,
+        10*MS,
+        &match);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+    err = yobd_correlator_expire(corr, 0, NULL, 1, &count, &wake);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    yobd_free_correlator(corr);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.pid_count = test_get_pids(test.ctx, 0x01, 0x01, test.pids, MAX_PIDS);
+    XASSERT_GTE(test.pid_count, YOBD_MAX_MULTI_PIDS);
+    test.rand_state = 0x9e3779b97f4a7c15ULL;
+
+    check_params(&test);
+    check_multi(&test);
+    check_simulation(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
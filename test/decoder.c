@@ -0,0 +1,204 @@
+/**
+ * @file      decoder.c
+ * @brief     Unit test checking that a generated decoder matches the runtime
+ *            engine.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/*
+ * The build generates the decoder for the same schema we are given, with the
+ * prefix "decoder", and tells us which header to include.
+ */
+#include DECODER_HEADER
+
+/* PIDs too large to check exhaustively get this many random inputs. */
+#define SAMPLES (1 << 16)
+
+struct compare_ctx {
+    struct yobd_ctx *ctx;
+    size_t compared;
+    size_t pids;
+};
+
+static
+void compare_frame(struct compare_ctx *compare, const struct can_frame *frame)
+{
+    yobd_err gen_err;
+    float gen_val;
+    yobd_err ref_err;
+    float ref_val;
+
+    ref_err = yobd_parse_can_response(compare->ctx, frame, &ref_val);
+    gen_err = decoder_parse_can_response(frame, &gen_val);
+    XASSERT_ERRCODE(gen_err, ref_err);
+    if (ref_err == YOBD_OK) {
+        /* The decoder does the same operations in the same order. */
+        XASSERT_EQ(memcmp(&ref_val, &gen_val, sizeof(ref_val)), 0);
+    }
+    ++compare->compared;
+}
+
+static
+void compare_input(
+    struct compare_ctx *compare,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *bytes,
+    uint_fast8_t can_bytes)
+{
+    yobd_err err;
+    struct can_frame frame;
+
+    err = yobd_make_can_response(
+        compare->ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+    compare_frame(compare, &frame);
+}
+
+static
+void compare_errors(
+    struct compare_ctx *compare,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint_fast8_t can_bytes)
+{
+    unsigned char bytes[4] = { 0 };
+    yobd_err err;
+    struct can_frame frame;
+
+    err = yobd_make_can_response(
+        compare->ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+
+    frame.can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    compare_frame(compare, &frame);
+    frame.can_id = YOBD_OBD_II_RESPONSE_BASE;
+
+    frame.can_dlc = 7;
+    compare_frame(compare, &frame);
+    frame.can_dlc = 8;
+
+    ++frame.data[0];
+    compare_frame(compare, &frame);
+    --frame.data[0];
+
+    frame.data[1] -= 0x40;
+    compare_frame(compare, &frame);
+}
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct compare_ctx *compare;
+    const struct yobd_pid_desc *gen_desc;
+    yobd_err err;
+    size_t i;
+    uint_fast8_t j;
+
+    compare = data;
+    ++compare->pids;
+
+    err = decoder_get_pid_descriptor(mode, pid, &gen_desc);
+    XASSERT_OK(err);
+    XASSERT_EQ(strcmp(gen_desc->name, desc->name), 0);
+    XASSERT_EQ(gen_desc->can_bytes, desc->can_bytes);
+    XASSERT_EQ(gen_desc->unit, desc->unit);
+
+    compare_errors(compare, mode, pid, desc->can_bytes);
+
+    if (desc->can_bytes <= 2) {
+        for (i = 0; i < ((size_t) 1) << (8*desc->can_bytes); ++i) {
+            bytes[0] = i & 0xff;
+            bytes[1] = i >> 8;
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+    else {
+        for (i = 0; i < SAMPLES; ++i) {
+            for (j = 0; j < desc->can_bytes; ++j) {
+                bytes[j] = rand() & 0xff;
+            }
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    unsigned char bytes[4] = { 0 };
+    struct compare_ctx compare;
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    struct can_frame frame;
+    yobd_mode mode;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &compare.ctx);
+    XASSERT_OK(err);
+
+    srand(0);
+    compare.compared = 0;
+    compare.pids = 0;
+    err = yobd_pid_foreach(compare.ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+    XASSERT_EQ(compare.pids, DECODER_PID_COUNT);
+
+    /* Neither knows about PIDs outside the schema. */
+    for (mode = 1; mode <= 0x22; mode += 0x21) {
+        err = yobd_make_can_response(
+            compare.ctx,
+            mode,
+            0xff,
+            bytes,
+            sizeof(bytes),
+            &frame);
+        XASSERT_OK(err);
+        compare_frame(&compare, &frame);
+    }
+    err = decoder_get_pid_descriptor(1, 0xff, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+
+    err = decoder_parse_can_response(NULL, NULL);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = decoder_get_pid_descriptor(1, 0xff, NULL);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    yobd_free_ctx(compare.ctx);
+
+    return EXIT_SUCCESS;
+}
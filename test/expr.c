@@ -0,0 +1,139 @@
+/**
+ * @file      expr.c
+ * @brief     Unit test for expression evaluation, covering both linear and
+ *            non-linear expressions.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <float.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+#define PI 3.141593
+
+/* Maximum relative error allowed between yobd and the reference values. */
+#define REL_THRESH 1e-5
+
+struct expr_case {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint8_t can_bytes;
+    unsigned char data[4];
+    double expected;
+};
+
+static const struct expr_case CASES[] = {
+    /* A * B / 4 */
+    { 0x1, 0x01, 2, { 77, 130 }, 77.0 * 130.0 / 4 },
+    { 0x1, 0x01, 2, { 255, 3 }, 255.0 * 3.0 / 4 },
+    /* (256*A + B) / 7, truncated, in kPa. */
+    { 0x1, 0x02, 2, { 1, 2 }, (double) ((256*1 + 2) / 7) },
+    { 0x1, 0x02, 2, { 255, 255 }, (double) ((256*255 + 255) / 7) },
+    /* A - B + 2*C - D/2 + 1.5, in celsius. */
+    { 0x1, 0x03, 4, { 10, 20, 30, 41 }, 10 - 20 + 2*30 - 41/2.0 + 1.5 + 273.15 },
+    { 0x1, 0x03, 4, { 0, 255, 0, 255 }, 0 - 255 + 0 - 255/2.0 + 1.5 + 273.15 },
+    /* 3*(A - 10), in kPa. */
+    { 0x1, 0x04, 1, { 4 }, 3*(4 - 10) * 1000.0 },
+    { 0x1, 0x04, 1, { 200 }, 3*(200 - 10) * 1000.0 },
+    /* (A - B) * (C + 1), in km/h. */
+    { 0x1, 0x05, 3, { 3, 10, 99 }, (3 - 10) * (99 + 1) * 1000.0 / 3600.0 },
+    { 0x1, 0x05, 3, { 255, 0, 255 }, 255 * 256 * 1000.0 / 3600.0 },
+    /* (A + 1) / (B + 1), in g/s. */
+    { 0x1, 0x06, 2, { 9, 3 }, (9 + 1) / 4.0 / 1000.0 },
+    { 0x1, 0x06, 2, { 0, 255 }, 1 / 256.0 / 1000.0 },
+    /* IEEE 754 passthrough (big-endian 1.5). */
+    { 0x1, 0x07, 4, { 0x3f, 0xc0, 0x00, 0x00 }, 1.5 },
+    /* Manufacturer modes, with two-byte PIDs. */
+    { 0x22, 0x1234, 2, { 77, 130 }, (256*77 + 130) / 4.0 * PI / 30.0 },
+    { 0x22, 0xf00d, 2, { 200, 201 }, 200 * 201 },
+    { 0x2f, 0x0001, 2, { 0x12, 0x34 }, 0x1234 },
+};
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    const struct expr_case *c;
+    unsigned char data[5];
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    struct can_frame frame;
+    size_t i;
+    yobd_mode mode;
+    yobd_pid pid;
+    float val;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+
+    for (i = 0; i < ARRAYLEN(CASES); ++i) {
+        c = &CASES[i];
+        err = yobd_make_can_response(
+            ctx,
+            c->mode,
+            c->pid,
+            c->data,
+            c->can_bytes,
+            &frame);
+        XASSERT_OK(err);
+
+        err = yobd_parse_can_headers(ctx, &frame, &mode, &pid);
+        XASSERT_OK(err);
+        XASSERT_EQ(mode, c->mode);
+        XASSERT_EQ(pid, c->pid);
+
+        err = yobd_parse_can_response(ctx, &frame, &val);
+        XASSERT_OK(err);
+        XASSERT_FLTEQ_THRESH(
+            val,
+            c->expected,
+            fabs(c->expected) * REL_THRESH + FLT_MIN);
+    }
+
+    /* Manufacturer-mode PIDs take two bytes, leaving room for 4 data bytes. */
+    memset(data, 0, sizeof(data));
+    err = yobd_make_can_response(ctx, 0x22, 0x1234, data, 4, &frame);
+    XASSERT_OK(err);
+    err = yobd_make_can_response(ctx, 0x22, 0x1234, data, 5, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_response(ctx, 0x1, 0x01, data, 5, &frame);
+    XASSERT_OK(err);
+
+    /* Mode-PIDs that are not in the schema, in both kinds of modes. */
+    err = yobd_get_pid_descriptor(ctx, 0x1, 0x09, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x2, 0x01, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x1, 0x101, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x22, 0x1235, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x22, 0x0000, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x30, 0x0001, &desc);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_descriptor(ctx, 0x2f, 0x0001, &desc);
+    XASSERT_OK(err);
+    XASSERT_STREQ(desc->name, "manufacturer passthrough");
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+/**
+ * @file      filter.c
+ * @brief     Unit test running generated BPF programs in a userspace
+ *            interpreter and checking them against yobd_parse_can_response.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/filter.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+/* The most PIDs the schema may have. */
+#define MAX_PIDS (256)
+
+/* The number of frames in the trace. */
+#define TRACE_FRAMES (100000)
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[MAX_PIDS];
+    size_t count;
+};
+
+/*
+ * Loads size bytes at offset k as the kernel does: big-endian, with an
+ * out-of-bounds load making the program return 0.
+ */
+static
+bool bpf_load(
+    const unsigned char *packet,
+    size_t len,
+    uint32_t k,
+    size_t size,
+    uint32_t *a)
+{
+    size_t i;
+
+    if (k > len || len - k < size) {
+        return false;
+    }
+
+    *a = 0;
+    for (i = 0; i < size; ++i) {
+        *a = (*a << 8) | packet[k + i];
+    }
+
+    return true;
+}
+
+/*
+ * Runs a classic BPF program over a packet, supporting the instructions the
+ * generator emits. Returns what the program returns.
+ */
+static
+uint32_t bpf_run(
+    const struct sock_filter *prog,
+    size_t prog_len,
+    const unsigned char *packet,
+    size_t len)
+{
+    uint32_t a;
+    const struct sock_filter *insn;
+    bool ok;
+    size_t pc;
+
+    a = 0;
+    pc = 0;
+    for (;;) {
+        XASSERT_LT(pc, prog_len);
+        insn = &prog[pc];
+        switch (insn->code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+                ok = bpf_load(packet, len, insn->k, 4, &a);
+                if (!ok) {
+                    return 0;
+                }
+                break;
+            case BPF_LD | BPF_H | BPF_ABS:
+                ok = bpf_load(packet, len, insn->k, 2, &a);
+                if (!ok) {
+                    return 0;
+                }
+                break;
+            case BPF_LD | BPF_B | BPF_ABS:
+                ok = bpf_load(packet, len, insn->k, 1, &a);
+                if (!ok) {
+                    return 0;
+                }
+                break;
+            case BPF_ALU | BPF_AND | BPF_K:
+                a &= insn->k;
+                break;
+            case BPF_JMP | BPF_JA:
+                pc += insn->k;
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                pc += (a == insn->k) ? insn->jt : insn->jf;
+                break;
+            case BPF_RET | BPF_K:
+                return insn->k;
+            default:
+                /* The generator emitted something unexpected. */
+                XASSERT_ERROR;
+        }
+        ++pc;
+    }
+}
+
+/* Makes one frame of a trace that mixes OBD II responses with other traffic. */
+static
+void make_frame(struct test_ctx *test, struct can_frame *frame)
+{
+    unsigned char bytes[4];
+    const struct test_pid *entry;
+    yobd_err err;
+    uint_fast8_t i;
+    int kind;
+
+    kind = rand() % 10;
+    if (kind >= 7) {
+        /* Random bytes, on a random ID or on a response ID. */
+        memset(frame, 0, sizeof(*frame));
+        if (kind == 7) {
+            frame->can_id = rand() & CAN_SFF_MASK;
+        }
+        else {
+            frame->can_id = YOBD_OBD_II_RESPONSE_BASE + rand() % 8;
+        }
+        frame->can_dlc = 8;
+        for (i = 0; i < 8; ++i) {
+            frame->data[i] = rand() & 0xff;
+        }
+        if (kind == 9) {
+            /* Keep the length byte and mode plausible. */
+            frame->data[0] = 1 + rand() % 7;
+            frame->data[1] = 0x40 + test->pids[rand() % test->count].mode;
+        }
+        return;
+    }
+
+    entry = &test->pids[rand() % test->count];
+    for (i = 0; i < entry->can_bytes; ++i) {
+        bytes[i] = rand() & 0xff;
+    }
+    err = yobd_make_can_response(
+        test->ctx,
+        entry->mode,
+        entry->pid,
+        bytes,
+        entry->can_bytes,
+        frame);
+    XASSERT_OK(err);
+    frame->can_id = YOBD_OBD_II_RESPONSE_BASE + rand() % 8;
+
+    /* Most responses are good; the rest are damaged in one way. */
+    switch (kind) {
+        case 0:
+            ++frame->data[0];
+            break;
+        case 1:
+            frame->can_dlc = rand() % 8;
+            break;
+        case 2:
+            frame->can_id = YOBD_OBD_II_QUERY_ADDRESS;
+            break;
+        case 3:
+            frame->can_id |= (rand() % 2) ? CAN_EFF_FLAG : CAN_RTR_FLAG;
+            break;
+        case 4:
+            frame->data[1] = rand() & 0xff;
+            break;
+        default:
+            break;
+    }
+}
+
+static
+void check_filters(struct test_ctx *test)
+{
+    size_t count;
+    yobd_err err;
+    struct can_filter filters[1];
+
+    err = yobd_make_can_filters(test->ctx, NULL, 0, &count);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+    err = yobd_make_can_filters(test->ctx, filters, 0, &count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_filters(NULL, filters, 1, &count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_filters(test->ctx, filters, 1, &count);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+}
+
+/* Checks a frame the way the kernel applies a CAN_RAW filter. */
+static
+bool filter_matches(const struct can_filter *filter, canid_t id)
+{
+    return (id & filter->can_mask) == (filter->can_id & filter->can_mask);
+}
+
+static
+void check_trace(struct test_ctx *test)
+{
+    size_t accepted;
+    bool bpf_accepts;
+    yobd_err err;
+    struct can_filter filter;
+    size_t filter_count;
+    struct can_frame frame;
+    size_t i;
+    size_t len;
+    yobd_err parse_err;
+    struct sock_filter *prog;
+    size_t too_small;
+    float val;
+
+    err = yobd_make_can_bpf(test->ctx, NULL, 0, &len);
+    XASSERT_OK(err);
+    XASSERT_GT(len, 0);
+    XASSERT_LTE(len, BPF_MAXINSNS);
+    prog = malloc(len * sizeof(*prog));
+    XASSERT_NOT_NULL(prog);
+
+    too_small = len - 1;
+    err = yobd_make_can_bpf(test->ctx, prog, too_small, &len);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_bpf(test->ctx, prog, len, &len);
+    XASSERT_OK(err);
+
+    err = yobd_make_can_filters(test->ctx, &filter, 1, &filter_count);
+    XASSERT_OK(err);
+
+    accepted = 0;
+    for (i = 0; i < TRACE_FRAMES; ++i) {
+        make_frame(test, &frame);
+        parse_err = yobd_parse_can_response(test->ctx, &frame, &val);
+
+        bpf_accepts = bpf_run(
+            prog,
+            len,
+            (const unsigned char *) &frame,
+            sizeof(frame)) != 0;
+        XASSERT_EQ(bpf_accepts, parse_err == YOBD_OK);
+        if (bpf_accepts) {
+            ++accepted;
+        }
+
+        /* The coarser filter passes every frame with a response ID. */
+        XASSERT_EQ(
+            filter_matches(&filter, frame.can_id),
+            frame.can_id >= YOBD_OBD_II_RESPONSE_BASE &&
+            frame.can_id <= YOBD_OBD_II_RESPONSE_END);
+    }
+
+    /* The trace exercises both outcomes. */
+    XASSERT_GT(accepted, 0);
+    XASSERT_LT(accepted, TRACE_FRAMES);
+    printf(
+        "%zu-instruction program accepted %zu of %d frames\n",
+        len,
+        accepted,
+        TRACE_FRAMES);
+
+    free(prog);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    static struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.count = test_get_pids(test.ctx, 0x00, 0xff, test.pids, MAX_PIDS);
+    XASSERT_LT(test.count, MAX_PIDS);
+    XASSERT_GT(test.count, 0);
+
+    check_filters(&test);
+    check_trace(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file      fixed.c
+ * @brief     Unit test checking fixed-point decoding against the float path
+ *            for every input of every PID.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* PIDs too large to check exhaustively get this many random inputs. */
+#define SAMPLES (1 << 16)
+
+/*
+ * The float path keeps only 24 bits of precision and rounds at every step, so
+ * it may be off by a few parts in 2^24 of the value. Allow 2^-20 of the value
+ * on top of the half LSB the fixed-point path may round by.
+ */
+#define TOLERANCE_REL (1.0 / (1 << 20))
+
+struct compare_ctx {
+    struct yobd_ctx *ctx;
+    size_t compared;
+    double max_error;
+};
+
+/* Returns 2^exp exactly, without needing libm. */
+static
+double pow2(int exp)
+{
+    double val;
+
+    val = 1;
+    for (; exp > 0; --exp) {
+        val *= 2;
+    }
+    for (; exp < 0; ++exp) {
+        val /= 2;
+    }
+
+    return val;
+}
+
+/* Returns what the fixed-point path should give for a float value. */
+static
+double expected_fixed(float val, int8_t frac_bits)
+{
+    double scaled;
+
+    if (val != val) {
+        return 0;
+    }
+
+    scaled = val * pow2(frac_bits);
+    if (scaled > INT32_MAX) {
+        return INT32_MAX;
+    }
+    if (scaled < INT32_MIN) {
+        return INT32_MIN;
+    }
+
+    return scaled;
+}
+
+static
+void compare_input(
+    struct compare_ctx *compare,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *bytes,
+    uint_fast8_t can_bytes,
+    int8_t *frac_bits)
+{
+    double error;
+    yobd_err err;
+    double expected;
+    int32_t fixed_val;
+    int8_t fixed_bits;
+    struct can_frame frame;
+    float val;
+
+    err = yobd_make_can_response(
+        compare->ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+
+    err = yobd_parse_can_response(compare->ctx, &frame, &val);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response_fixed(
+        compare->ctx,
+        &frame,
+        &fixed_val,
+        &fixed_bits);
+    XASSERT_OK(err);
+
+    /* The scale is fixed per PID. */
+    if (compare->compared == 0) {
+        *frac_bits = fixed_bits;
+    }
+    XASSERT_EQ(fixed_bits, *frac_bits);
+
+    expected = expected_fixed(val, fixed_bits);
+    error = fixed_val - expected;
+    if (error < 0) {
+        error = -error;
+    }
+    if (expected < 0) {
+        expected = -expected;
+    }
+    XASSERT_LTE(error, 0.5 + expected*TOLERANCE_REL);
+    if (error > compare->max_error) {
+        compare->max_error = error;
+    }
+
+    ++compare->compared;
+}
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct compare_ctx *compare;
+    int8_t frac_bits;
+    size_t i;
+    uint_fast8_t j;
+
+    compare = data;
+    compare->compared = 0;
+    compare->max_error = 0;
+    frac_bits = 0;
+
+    if (desc->can_bytes <= 2) {
+        for (i = 0; i < ((size_t) 1) << (8*desc->can_bytes); ++i) {
+            bytes[0] = i & 0xff;
+            bytes[1] = i >> 8;
+            compare_input(
+                compare,
+                mode,
+                pid,
+                bytes,
+                desc->can_bytes,
+                &frac_bits);
+        }
+    }
+    else {
+        for (i = 0; i < SAMPLES; ++i) {
+            for (j = 0; j < desc->can_bytes; ++j) {
+                bytes[j] = rand() & 0xff;
+            }
+            compare_input(
+                compare,
+                mode,
+                pid,
+                bytes,
+                desc->can_bytes,
+                &frac_bits);
+        }
+    }
+
+    printf(
+        "mode 0x%02x, PID 0x%04x (%s): %zu inputs, %d fraction bits, "
+        "max error %.1f LSB\n",
+        (unsigned) mode,
+        (unsigned) pid,
+        desc->name,
+        compare->compared,
+        frac_bits,
+        compare->max_error);
+
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    struct compare_ctx compare;
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    struct can_frame frame;
+    int8_t frac_bits;
+    struct yobd_schema_opts opts;
+    int32_t val;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    /* Fixed point has to be asked for. */
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    err = yobd_make_can_query(ctx, 0x01, 0x00, &frame);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response_fixed(ctx, &frame, &val, &frac_bits);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    yobd_free_ctx(ctx);
+
+    yobd_schema_opts_init(&opts);
+    opts.fixed_point = true;
+    err = yobd_parse_schema_opts(argv[1], &opts, &ctx);
+    XASSERT_OK(err);
+
+    compare.ctx = ctx;
+    err = yobd_pid_foreach(ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,223 @@
+/**
+ * @file      handle.c
+ * @brief     Unit test checking that decoding with PID handles, one frame at a
+ *            time or in batches, matches normal decoding.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/handle.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* PIDs too large to check exhaustively get this many random inputs. */
+#define SAMPLES (1 << 12)
+
+/*
+ * The number of frames to decode as a batch, chosen not to be a multiple of
+ * any SIMD width.
+ */
+#define BATCH_FRAMES (1000 + 3)
+
+struct compare_ctx {
+    struct yobd_ctx *ctx;
+    size_t compared;
+};
+
+static
+void compare_input(
+    struct compare_ctx *compare,
+    const yobd_pid_handle *handle,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *bytes,
+    uint_fast8_t can_bytes)
+{
+    yobd_err err;
+    struct can_frame frame;
+    float handle_val;
+    float inline_val;
+    float ref_val;
+
+    err = yobd_make_can_response(
+        compare->ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+
+    err = yobd_parse_can_response(compare->ctx, &frame, &ref_val);
+    XASSERT_OK(err);
+    err = yobd_decode_with_handle(handle, &frame, &handle_val);
+    XASSERT_OK(err);
+    err = yobd_decode_with_handle_inline(handle, &frame, &inline_val);
+    XASSERT_OK(err);
+
+    XASSERT_EQ(memcmp(&ref_val, &handle_val, sizeof(ref_val)), 0);
+    XASSERT_EQ(memcmp(&ref_val, &inline_val, sizeof(ref_val)), 0);
+
+    /* A frame with the wrong number of data bytes is rejected. */
+    ++frame.data[0];
+    err = yobd_decode_with_handle(handle, &frame, &handle_val);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DATA_BYTES);
+    err = yobd_decode_with_handle_inline(handle, &frame, &inline_val);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DATA_BYTES);
+
+    ++compare->compared;
+}
+
+/*
+ * Checks that batch decoding matches decoding frames one at a time, including
+ * for frames with the wrong number of data bytes.
+ */
+static
+void compare_batch(
+    struct compare_ctx *compare,
+    const yobd_pid_handle *handle,
+    yobd_mode mode,
+    yobd_pid pid,
+    uint_fast8_t can_bytes)
+{
+    unsigned char bytes[4];
+    yobd_err err;
+    static yobd_err errs[BATCH_FRAMES];
+    static struct can_frame frames[BATCH_FRAMES];
+    size_t i;
+    uint_fast8_t j;
+    float ref_val;
+    static float vals[BATCH_FRAMES];
+
+    for (i = 0; i < BATCH_FRAMES; ++i) {
+        for (j = 0; j < can_bytes; ++j) {
+            bytes[j] = rand() & 0xff;
+        }
+        err = yobd_make_can_response(
+            compare->ctx,
+            mode,
+            pid,
+            bytes,
+            can_bytes,
+            &frames[i]);
+        XASSERT_OK(err);
+        if (i % 7 == 0) {
+            ++frames[i].data[0];
+        }
+    }
+
+    err = yobd_decode_batch_with_handle(
+        handle,
+        frames,
+        BATCH_FRAMES,
+        vals,
+        errs);
+    XASSERT_OK(err);
+
+    for (i = 0; i < BATCH_FRAMES; ++i) {
+        err = yobd_parse_can_response(compare->ctx, &frames[i], &ref_val);
+        XASSERT_ERRCODE(errs[i], err);
+        if (err == YOBD_OK) {
+            XASSERT_EQ(memcmp(&ref_val, &vals[i], sizeof(ref_val)), 0);
+        }
+    }
+}
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct compare_ctx *compare;
+    yobd_err err;
+    yobd_pid_handle handle;
+    size_t i;
+    uint_fast8_t j;
+
+    compare = data;
+
+    err = yobd_get_pid_handle(compare->ctx, mode, pid, &handle);
+    XASSERT_OK(err);
+
+    if (desc->can_bytes <= 2) {
+        for (i = 0; i < ((size_t) 1) << (8*desc->can_bytes); ++i) {
+            bytes[0] = i & 0xff;
+            bytes[1] = i >> 8;
+            compare_input(compare, &handle, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+    else {
+        for (i = 0; i < SAMPLES; ++i) {
+            for (j = 0; j < desc->can_bytes; ++j) {
+                bytes[j] = rand() & 0xff;
+            }
+            compare_input(compare, &handle, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+
+    compare_batch(compare, &handle, mode, pid, desc->can_bytes);
+
+    return false;
+}
+
+static
+void test_ctx(struct yobd_ctx *ctx)
+{
+    struct compare_ctx compare;
+    yobd_err err;
+    yobd_pid_handle handle;
+
+    compare.ctx = ctx;
+    compare.compared = 0;
+    err = yobd_pid_foreach(ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+    XASSERT_GT(compare.compared, 0);
+
+    err = yobd_get_pid_handle(ctx, 0x01, 0xff, &handle);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_get_pid_handle(NULL, 0x01, 0x0c, &handle);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    struct yobd_schema_opts opts;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    test_ctx(ctx);
+    yobd_free_ctx(ctx);
+
+    /* Handles for PIDs with lookup tables still decode inline. */
+    yobd_schema_opts_init(&opts);
+    opts.lut_max_bytes = 2;
+    opts.lut_budget = SIZE_MAX;
+    err = yobd_parse_schema_opts(argv[1], &opts, &ctx);
+    XASSERT_OK(err);
+    test_ctx(ctx);
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file      pids.h
+ * @brief     Test code for collecting the PIDs in a schema.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#ifndef YOBD_TEST_PIDS_H_
+#define YOBD_TEST_PIDS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+struct test_pid {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint_fast8_t can_bytes;
+};
+
+struct test_pid_list {
+    yobd_mode min_mode;
+    yobd_mode max_mode;
+    struct test_pid *pids;
+    size_t max;
+    size_t count;
+};
+
+static inline
+bool test_add_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct test_pid_list *list;
+
+    list = data;
+    if (mode < list->min_mode || mode > list->max_mode) {
+        return false;
+    }
+
+    list->pids[list->count].mode = mode;
+    list->pids[list->count].pid = pid;
+    list->pids[list->count].can_bytes = desc->can_bytes;
+    ++list->count;
+
+    return list->count == list->max;
+}
+
+/*
+ * Collects the schema's PIDs in modes min_mode through max_mode, in schema
+ * order, stopping once max are collected. Returns the number collected, so a
+ * count below max means every matching PID was collected.
+ */
+static inline
+size_t test_get_pids(
+    struct yobd_ctx *ctx,
+    yobd_mode min_mode,
+    yobd_mode max_mode,
+    struct test_pid *pids,
+    size_t max)
+{
+    yobd_err err;
+    struct test_pid_list list;
+
+    list.min_mode = min_mode;
+    list.max_mode = max_mode;
+    list.pids = pids;
+    list.max = max;
+    list.count = 0;
+    err = yobd_pid_foreach(ctx, test_add_pid, &list);
+    XASSERT_OK(err);
+
+    return list.count;
+}
+
+#endif /* YOBD_TEST_PIDS_H_ */
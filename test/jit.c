@@ -0,0 +1,125 @@
+/**
+ * @file      jit.c
+ * @brief     Unit test checking that compiled expressions match the
+ *            interpreter.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* PIDs too large to check exhaustively get this many random inputs. */
+#define SAMPLES (1 << 16)
+
+struct compare_ctx {
+    struct yobd_ctx *ref_ctx;
+    struct yobd_ctx *jit_ctx;
+    size_t compared;
+};
+
+static
+void compare_input(
+    struct compare_ctx *compare,
+    yobd_mode mode,
+    yobd_pid pid,
+    const unsigned char *bytes,
+    uint_fast8_t can_bytes)
+{
+    yobd_err err;
+    struct can_frame frame;
+    float jit_val;
+    float ref_val;
+
+    err = yobd_make_can_response(
+        compare->ref_ctx,
+        mode,
+        pid,
+        bytes,
+        can_bytes,
+        &frame);
+    XASSERT_OK(err);
+
+    err = yobd_parse_can_response(compare->ref_ctx, &frame, &ref_val);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response(compare->jit_ctx, &frame, &jit_val);
+    XASSERT_OK(err);
+
+    /* Compiled code does the same operations in the same order. */
+    XASSERT_EQ(memcmp(&ref_val, &jit_val, sizeof(ref_val)), 0);
+    ++compare->compared;
+}
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    unsigned char bytes[4];
+    struct compare_ctx *compare;
+    size_t i;
+    uint_fast8_t j;
+
+    compare = data;
+    if (desc->can_bytes <= 2) {
+        for (i = 0; i < ((size_t) 1) << (8*desc->can_bytes); ++i) {
+            bytes[0] = i & 0xff;
+            bytes[1] = i >> 8;
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+    else {
+        for (i = 0; i < SAMPLES; ++i) {
+            for (j = 0; j < desc->can_bytes; ++j) {
+                bytes[j] = rand() & 0xff;
+            }
+            compare_input(compare, mode, pid, bytes, desc->can_bytes);
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    struct compare_ctx compare;
+    yobd_err err;
+    struct yobd_schema_opts opts;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &compare.ref_ctx);
+    XASSERT_OK(err);
+
+    yobd_schema_opts_init(&opts);
+    XASSERT(!opts.jit);
+    opts.jit = true;
+    err = yobd_parse_schema_opts(argv[1], &opts, &compare.jit_ctx);
+    XASSERT_OK(err);
+
+    srand(0);
+    compare.compared = 0;
+    err = yobd_pid_foreach(compare.jit_ctx, compare_pid, &compare);
+    XASSERT_OK(err);
+    XASSERT_GT(compare.compared, 0);
+
+    yobd_free_ctx(compare.jit_ctx);
+    yobd_free_ctx(compare.ref_ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file      lut.c
+ * @brief     Unit test checking that precomputed lookup tables match normal
+ *            evaluation for every input.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+#define ARRAYLEN(a) (sizeof(a) / sizeof(a[0]))
+
+struct compare_ctx {
+    struct yobd_ctx *ref_ctx;
+    struct yobd_ctx *lut_ctx;
+    size_t compared;
+};
+
+static
+bool compare_pid(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct compare_ctx *compare;
+    unsigned char bytes[2];
+    yobd_err err;
+    struct can_frame frame;
+    size_t i;
+    size_t inputs;
+    size_t j;
+    float lut_val;
+    float ref_val;
+
+    if (desc->can_bytes > 2) {
+        return false;
+    }
+
+    compare = data;
+    inputs = ((size_t) 1) << (8*desc->can_bytes);
+    for (i = 0; i < inputs; ++i) {
+        if (desc->can_bytes == 1) {
+            bytes[0] = i;
+        }
+        else {
+            bytes[0] = i >> 8;
+            bytes[1] = i & 0xff;
+        }
+        err = yobd_make_can_response(
+            compare->ref_ctx,
+            mode,
+            pid,
+            bytes,
+            desc->can_bytes,
+            &frame);
+        XASSERT_OK(err);
+
+        /*
+         * Vary the bytes after the PID's data, which an expression might read
+         * even though a table cannot depend on them.
+         */
+        for (j = frame.data[0] + 1; j < sizeof(frame.data); ++j) {
+            frame.data[j] = i + j;
+        }
+
+        err = yobd_parse_can_response(compare->ref_ctx, &frame, &ref_val);
+        XASSERT_OK(err);
+        err = yobd_parse_can_response(compare->lut_ctx, &frame, &lut_val);
+        XASSERT_OK(err);
+
+        /* Tables come from the same pipeline, so they must match exactly. */
+        XASSERT_EQ(memcmp(&ref_val, &lut_val, sizeof(ref_val)), 0);
+        ++compare->compared;
+    }
+
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    struct compare_ctx compare;
+    yobd_err err;
+    size_t i;
+    struct yobd_schema_opts opts;
+    static const struct {
+        uint_fast8_t max_bytes;
+        size_t budget;
+    } configs[] = {
+        /* Everything fits. */
+        { 2, SIZE_MAX },
+        /* Constrained: 1-byte tables only. */
+        { 1, SIZE_MAX },
+        /* Room for only some of the tables. */
+        { 2, 256*1024 + 2*1024 },
+        /* Out-of-range values are clamped. */
+        { 200, SIZE_MAX },
+        /* Tables enabled, but no budget. */
+        { 2, 0 },
+    };
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema_opts(argv[1], NULL, &compare.ref_ctx);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    err = yobd_parse_schema(argv[1], &compare.ref_ctx);
+    XASSERT_OK(err);
+
+    for (i = 0; i < ARRAYLEN(configs); ++i) {
+        yobd_schema_opts_init(&opts);
+        opts.lut_max_bytes = configs[i].max_bytes;
+        opts.lut_budget = configs[i].budget;
+        err = yobd_parse_schema_opts(argv[1], &opts, &compare.lut_ctx);
+        XASSERT_OK(err);
+
+        compare.compared = 0;
+        err = yobd_pid_foreach(compare.lut_ctx, compare_pid, &compare);
+        XASSERT_OK(err);
+        XASSERT_GT(compare.compared, 0);
+
+        yobd_free_ctx(compare.lut_ctx);
+    }
+
+    yobd_free_ctx(compare.ref_ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,400 @@
+/**
+ * @file      multi.c
+ * @brief     Unit test checking that multi-PID responses decode to the same
+ *            values as single-PID ones, and that they take fewer frames.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/multi.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+/* The most PIDs the schema may have. */
+#define MAX_PIDS (256)
+
+/* The number of random inputs to try for each group of PIDs. */
+#define ROUNDS (1000)
+
+struct test_ctx {
+    struct test_pid pids[MAX_PIDS];
+    size_t count;
+};
+
+/* Decodes a value the single-PID way, to compare against. */
+static
+float single_value(
+    struct yobd_ctx *ctx,
+    const struct test_pid *entry,
+    const unsigned char *data)
+{
+    yobd_err err;
+    struct can_frame frame;
+    float val;
+
+    err = yobd_make_can_response(
+        ctx,
+        entry->mode,
+        entry->pid,
+        data,
+        entry->can_bytes,
+        &frame);
+    XASSERT_OK(err);
+    err = yobd_parse_can_response(ctx, &frame, &val);
+    XASSERT_OK(err);
+
+    return val;
+}
+
+/*
+ * Sends random data for a group of PIDs through a multi-PID response, checks
+ * the values bit-for-bit against single-PID decoding, and returns how many
+ * frames the response took.
+ */
+static
+size_t check_group(
+    struct yobd_ctx *ctx,
+    const struct test_pid *group,
+    size_t count,
+    bool reverse)
+{
+    unsigned char data[YOBD_MAX_MULTI_PAYLOAD];
+    yobd_err err;
+    float expected;
+    struct can_frame frames[YOBD_MAX_MULTI_FRAMES];
+    size_t frame_count;
+    size_t i;
+    size_t j;
+    yobd_mode mode;
+    size_t offset;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    size_t round;
+    size_t size;
+    size_t val_count;
+    yobd_pid val_pids[YOBD_MAX_MULTI_PIDS];
+    float vals[YOBD_MAX_MULTI_PIDS];
+
+    /* ECUs may answer in any order, so try both. */
+    for (i = 0; i < count; ++i) {
+        pids[i] = group[reverse ? count - 1 - i : i].pid;
+    }
+
+    frame_count = 0;
+    for (round = 0; round < ROUNDS; ++round) {
+        size = 0;
+        for (i = 0; i < count; ++i) {
+            size += group[i].can_bytes;
+        }
+        for (i = 0; i < size; ++i) {
+            data[i] = rand() & 0xff;
+        }
+
+        err = yobd_make_can_multi_response(
+            ctx,
+            group[0].mode,
+            pids,
+            count,
+            data,
+            frames,
+            YOBD_MAX_MULTI_FRAMES,
+            &frame_count);
+        XASSERT_OK(err);
+
+        err = yobd_parse_can_multi_response(
+            ctx,
+            frames,
+            frame_count,
+            &mode,
+            val_pids,
+            vals,
+            YOBD_MAX_MULTI_PIDS,
+            &val_count);
+        XASSERT_OK(err);
+        XASSERT_EQ(mode, group[0].mode);
+        XASSERT_EQ(val_count, count);
+
+        offset = 0;
+        for (i = 0; i < count; ++i) {
+            j = reverse ? count - 1 - i : i;
+            XASSERT_EQ(val_pids[i], group[j].pid);
+            expected = single_value(ctx, &group[j], &data[offset]);
+            XASSERT_EQ(memcmp(&vals[i], &expected, sizeof(expected)), 0);
+            offset += group[j].can_bytes;
+        }
+    }
+
+    return frame_count;
+}
+
+static
+void check_errors(struct yobd_ctx *ctx, const struct test_pid *group)
+{
+    unsigned char data[YOBD_MAX_MULTI_PAYLOAD];
+    yobd_err err;
+    struct can_frame frame;
+    struct can_frame frames[YOBD_MAX_MULTI_FRAMES];
+    size_t frame_count;
+    size_t i;
+    yobd_mode mode;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS + 1];
+    size_t val_count;
+    yobd_pid val_pids[YOBD_MAX_MULTI_PIDS];
+    float vals[YOBD_MAX_MULTI_PIDS];
+
+    for (i = 0; i < YOBD_MAX_MULTI_PIDS; ++i) {
+        pids[i] = group[i].pid;
+    }
+    pids[YOBD_MAX_MULTI_PIDS] = group[0].pid;
+    memset(data, 0, sizeof(data));
+
+    /* Queries. */
+    err = yobd_make_can_multi_query(ctx, group[0].mode, pids, 6, &frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame.can_id, YOBD_OBD_II_QUERY_ADDRESS);
+    XASSERT_EQ(frame.data[0], 7);
+    XASSERT_EQ(frame.data[1], group[0].mode);
+    for (i = 0; i < YOBD_MAX_MULTI_PIDS; ++i) {
+        XASSERT_EQ(frame.data[2+i], pids[i]);
+    }
+    err = yobd_make_can_multi_query(ctx, group[0].mode, pids, 0, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_multi_query(ctx, group[0].mode, pids, 7, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_make_can_multi_query(ctx, 0x22, pids, 1, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    pids[0] = 0x100;
+    err = yobd_make_can_multi_query(ctx, group[0].mode, pids, 1, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PID);
+    pids[0] = 0xff;
+    err = yobd_make_can_multi_query(ctx, group[0].mode, pids, 1, &frame);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    pids[0] = group[0].pid;
+
+    /* Responses too big for the caller's frames. */
+    err = yobd_make_can_multi_response(
+        ctx,
+        group[0].mode,
+        pids,
+        YOBD_MAX_MULTI_PIDS,
+        data,
+        frames,
+        1,
+        &frame_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    err = yobd_make_can_multi_response(
+        ctx,
+        group[0].mode,
+        pids,
+        YOBD_MAX_MULTI_PIDS,
+        data,
+        frames,
+        YOBD_MAX_MULTI_FRAMES,
+        &frame_count);
+    XASSERT_OK(err);
+    XASSERT_GT(frame_count, 1);
+
+    /* Flow control goes to the ECU's physical address. */
+    err = yobd_make_can_flow_control(&frames[0], &frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame.can_id, YOBD_OBD_II_RESPONSE_BASE - 8);
+    XASSERT_EQ(frame.data[0], 0x30);
+    err = yobd_make_can_flow_control(&frames[1], &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+
+    /* Missing, out-of-order and foreign frames. */
+    err = yobd_parse_can_multi_response(
+        ctx,
+        frames,
+        frame_count - 1,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    err = yobd_parse_can_multi_response(
+        ctx,
+        &frames[1],
+        frame_count - 1,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+
+    frame = frames[1];
+    frames[1] = frames[2];
+    frames[2] = frame;
+    err = yobd_parse_can_multi_response(
+        ctx,
+        frames,
+        frame_count,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frames[2] = frames[1];
+    frames[1] = frame;
+
+    frames[1].can_id = YOBD_OBD_II_RESPONSE_BASE + 1;
+    err = yobd_parse_can_multi_response(
+        ctx,
+        frames,
+        frame_count,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frames[1].can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    err = yobd_parse_can_multi_response(
+        ctx,
+        frames,
+        frame_count,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+    frames[1].can_id = YOBD_OBD_II_RESPONSE_BASE;
+
+    /* Too little room for the values. */
+    err = yobd_parse_can_multi_response(
+        ctx,
+        frames,
+        frame_count,
+        &mode,
+        val_pids,
+        vals,
+        YOBD_MAX_MULTI_PIDS - 1,
+        &val_count);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+}
+
+/*
+ * Queries need the schema to have every PID, but responses may carry "PIDs
+ * supported" bitmaps that it does not list.
+ */
+static
+void check_supported(struct yobd_ctx *ctx)
+{
+    unsigned char data[2*4];
+    yobd_err err;
+    struct can_frame frame;
+    struct can_frame frames[YOBD_MAX_MULTI_FRAMES];
+    size_t frame_count;
+    static const yobd_pid pids[] = { 0x00, 0x20 };
+
+    memset(data, 0xa5, sizeof(data));
+    err = yobd_make_can_multi_query(ctx, 0x1, pids, 2, &frame);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+
+    err = yobd_make_can_multi_response(
+        ctx,
+        0x1,
+        pids,
+        2,
+        data,
+        frames,
+        YOBD_MAX_MULTI_FRAMES,
+        &frame_count);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame_count, 2);
+    XASSERT_EQ(frames[0].data[0], 0x10);
+    XASSERT_EQ(frames[0].data[1], 1 + 2*(1 + 4));
+    XASSERT_EQ(frames[0].data[2], 0x41);
+    XASSERT_EQ(frames[0].data[3], 0x00);
+    XASSERT_EQ(frames[1].data[1], 0x20);
+
+    /* Other modes have no bitmaps yobd knows about. */
+    err = yobd_make_can_multi_response(
+        ctx,
+        0x2,
+        pids,
+        2,
+        data,
+        frames,
+        YOBD_MAX_MULTI_FRAMES,
+        &frame_count);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    size_t count;
+    yobd_err err;
+    size_t i;
+    size_t multi_frames;
+    size_t response_frames;
+    size_t single_frames;
+    static struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+
+    test.count = test_get_pids(ctx, 0x01, 0x0a, test.pids, MAX_PIDS);
+    XASSERT_LT(test.count, MAX_PIDS);
+    XASSERT_GTE(test.count, YOBD_MAX_MULTI_PIDS);
+
+    /*
+     * Poll every SAE PID once, in groups of up to 6 PIDs from the same mode.
+     * Asking for a PID on its own takes a query and a response. Asking for a
+     * group takes a query, the response frames, and a flow control frame if
+     * the response needs more than one frame.
+     */
+    single_frames = 0;
+    multi_frames = 0;
+    for (i = 0; i < test.count; i += count) {
+        count = 1;
+        while (count < YOBD_MAX_MULTI_PIDS && i + count < test.count &&
+               test.pids[i + count].mode == test.pids[i].mode) {
+            ++count;
+        }
+
+        check_group(ctx, &test.pids[i], count, true);
+        response_frames = check_group(ctx, &test.pids[i], count, false);
+
+        single_frames += 2*count;
+        multi_frames += 1 + response_frames + (response_frames > 1 ? 1 : 0);
+    }
+
+    printf(
+        "%zu PIDs: %zu frames per polling cycle one PID at a time, %zu with "
+        "multi-PID queries\n",
+        test.count,
+        single_frames,
+        multi_frames);
+    XASSERT_LT(multi_frames, single_frames);
+
+    check_errors(ctx, test.pids);
+    check_supported(ctx);
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file      oom.c
+ * @brief     Unit test for cleaning up after running out of memory partway
+ *            through parsing a schema.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* The most PIDs the test schema can have. */
+#define MAX_PIDS (64)
+
+struct name_list {
+    const char *names[MAX_PIDS];
+    size_t count;
+};
+
+static const char *g_fail_name;
+
+/*
+ * yobd copies each PID name with strdup, so overriding it lets us fail an
+ * allocation after some of the PIDs have already been parsed. Other callers,
+ * such as libyaml, copy other strings, so we fail only the chosen name. We
+ * build with hidden visibility, so export it for libyobd to bind to.
+ */
+__attribute__ ((visibility ("default")))
+char *strdup(const char *str)
+{
+    char *copy;
+    size_t size;
+
+    if (g_fail_name != NULL && strcmp(str, g_fail_name) == 0) {
+        return NULL;
+    }
+
+    size = strlen(str) + 1;
+    copy = malloc(size);
+    if (copy != NULL) {
+        memcpy(copy, str, size);
+    }
+
+    return copy;
+}
+
+static
+bool add_name(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct name_list *list;
+
+    (void) mode;
+    (void) pid;
+
+    list = data;
+    XASSERT_LT(list->count, MAX_PIDS);
+    list->names[list->count] = desc->name;
+    ++list->count;
+
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    struct yobd_ctx *fail_ctx;
+    size_t i;
+    struct name_list list;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+
+    list.count = 0;
+    err = yobd_pid_foreach(ctx, add_name, &list);
+    XASSERT_OK(err);
+    XASSERT_GT(list.count, 1);
+
+    /* Fail each PID's name copy in turn, including ones after the first. */
+    for (i = 0; i < list.count; ++i) {
+        g_fail_name = list.names[i];
+        err = yobd_parse_schema(argv[1], &fail_ctx);
+        XASSERT_ERRCODE(err, YOBD_OOM);
+    }
+    g_fail_name = NULL;
+
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
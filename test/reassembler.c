@@ -0,0 +1,444 @@
+/**
+ * @file      reassembler.c
+ * @brief     Unit test driving the ISO-TP reassembler with responses from
+ *            several ECUs, interleaved at random.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/multi.h>
+#include <yobd/reassembler.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+/* The number of ECUs that may respond. */
+#define ECU_COUNT (YOBD_OBD_II_RESPONSE_END - YOBD_OBD_II_RESPONSE_BASE + 1)
+
+/* The number of messages each ECU sends. */
+#define MESSAGES (500)
+
+/* The largest ISO-TP message. */
+#define MAX_PAYLOAD (4095)
+
+/* The most frames an ISO-TP message takes. */
+#define MAX_FRAMES (1 + (MAX_PAYLOAD - 6 + 6) / 7)
+
+/* The longest raw message to send, enough to wrap sequence numbers. */
+#define MAX_RAW (300)
+
+/* The most PIDs the schema may have. */
+#define MAX_PIDS (256)
+
+enum message_kind {
+    MESSAGE_SINGLE_PID,
+    MESSAGE_MULTI_PID,
+    MESSAGE_RAW,
+    MESSAGE_KIND_COUNT
+};
+
+struct ecu {
+    canid_t id;
+    size_t sent;
+    enum message_kind kind;
+    unsigned char payload[MAX_PAYLOAD];
+    size_t size;
+    struct can_frame frames[MAX_FRAMES];
+    size_t frame_count;
+    size_t next_frame;
+};
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[MAX_PIDS];
+    size_t pid_count;
+    struct ecu ecus[ECU_COUNT];
+};
+
+/*
+ * Splits a message into ISO-TP frames independently of the library, so the
+ * test does not check the reassembler against itself.
+ */
+static
+size_t segment(
+    canid_t id,
+    const unsigned char *payload,
+    size_t size,
+    struct can_frame *frames)
+{
+    size_t chunk;
+    size_t i;
+    size_t offset;
+
+    memset(frames, 0xcc, sizeof(*frames));
+    frames[0].can_id = id;
+    frames[0].can_dlc = 8;
+    if (size <= 7) {
+        frames[0].data[0] = size;
+        memcpy(&frames[0].data[1], payload, size);
+        return 1;
+    }
+
+    frames[0].data[0] = 0x10 | (size >> 8);
+    frames[0].data[1] = size & 0xff;
+    memcpy(&frames[0].data[2], payload, 6);
+    offset = 6;
+    for (i = 1; offset < size; ++i) {
+        memset(&frames[i], 0xcc, sizeof(frames[i]));
+        frames[i].can_id = id;
+        frames[i].can_dlc = 8;
+        frames[i].data[0] = 0x20 | (i & 0xf);
+        chunk = size - offset < 7 ? size - offset : 7;
+        memcpy(&frames[i].data[1], &payload[offset], chunk);
+        offset += chunk;
+    }
+
+    return i;
+}
+
+/* Makes the next message an ECU sends. */
+static
+void new_message(struct test_ctx *test, struct ecu *ecu)
+{
+    unsigned char data[YOBD_MAX_MULTI_PAYLOAD];
+    size_t data_size;
+    const struct test_pid *entry;
+    yobd_err err;
+    size_t i;
+    size_t j;
+    size_t pid_count;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+
+    ecu->kind = rand() % MESSAGE_KIND_COUNT;
+    ecu->next_frame = 0;
+
+    switch (ecu->kind) {
+        case MESSAGE_SINGLE_PID:
+            entry = &test->pids[rand() % test->pid_count];
+            for (i = 0; i < entry->can_bytes; ++i) {
+                data[i] = rand() & 0xff;
+            }
+            err = yobd_make_can_response(
+                test->ctx,
+                0x01,
+                entry->pid,
+                data,
+                entry->can_bytes,
+                &ecu->frames[0]);
+            XASSERT_OK(err);
+            ecu->frame_count = 1;
+            ecu->size = ecu->frames[0].data[0];
+            memcpy(ecu->payload, &ecu->frames[0].data[1], ecu->size);
+            break;
+
+        case MESSAGE_MULTI_PID:
+            pid_count = 1 + rand() % YOBD_MAX_MULTI_PIDS;
+            ecu->payload[0] = 0x41;
+            ecu->size = 1;
+            data_size = 0;
+            for (i = 0; i < pid_count; ++i) {
+                entry = &test->pids[rand() % test->pid_count];
+                pids[i] = entry->pid;
+                ecu->payload[ecu->size] = entry->pid;
+                for (j = 0; j < entry->can_bytes; ++j) {
+                    data[data_size] = rand() & 0xff;
+                    ecu->payload[ecu->size + 1 + j] = data[data_size];
+                    ++data_size;
+                }
+                ecu->size += 1 + entry->can_bytes;
+            }
+
+            err = yobd_make_can_multi_response(
+                test->ctx,
+                0x01,
+                pids,
+                pid_count,
+                data,
+                ecu->frames,
+                MAX_FRAMES,
+                &ecu->frame_count);
+            XASSERT_OK(err);
+            break;
+
+        case MESSAGE_RAW:
+            /* Something like a mode 9 VIN or a long DTC list. */
+            ecu->size = 8 + rand() % (MAX_RAW - 8);
+            ecu->payload[0] = 0x49;
+            for (i = 1; i < ecu->size; ++i) {
+                ecu->payload[i] = rand() & 0xff;
+            }
+            ecu->frame_count = segment(
+                ecu->id,
+                ecu->payload,
+                ecu->size,
+                ecu->frames);
+            break;
+
+        default:
+            XASSERT_ERROR;
+    }
+
+    for (i = 0; i < ecu->frame_count; ++i) {
+        ecu->frames[i].can_id = ecu->id;
+    }
+}
+
+/* Checks a completed message against what the ECU sent. */
+static
+void check_message(
+    struct test_ctx *test,
+    const struct ecu *ecu,
+    const struct yobd_reassembly *out)
+{
+    float expected;
+    yobd_err err;
+    yobd_mode mode;
+    yobd_pid pid;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    float val;
+    size_t val_count;
+    float vals[YOBD_MAX_MULTI_PIDS];
+
+    XASSERT_EQ(out->size, ecu->size);
+    XASSERT_EQ(memcmp(out->payload, ecu->payload, ecu->size), 0);
+
+    switch (ecu->kind) {
+        case MESSAGE_SINGLE_PID:
+            /* Decoding the payload must match decoding the frame. */
+            err = yobd_parse_response_payload(
+                test->ctx,
+                out->payload,
+                out->size,
+                &mode,
+                &pid,
+                &val);
+            XASSERT_OK(err);
+            XASSERT_EQ(mode, 0x01);
+            XASSERT_EQ(pid, ecu->payload[1]);
+            err = yobd_parse_can_response(test->ctx, &ecu->frames[0], &expected);
+            XASSERT_OK(err);
+            XASSERT_EQ(memcmp(&val, &expected, sizeof(val)), 0);
+            break;
+
+        case MESSAGE_MULTI_PID:
+            err = yobd_parse_multi_response(
+                test->ctx,
+                out->payload,
+                out->size,
+                &mode,
+                pids,
+                vals,
+                YOBD_MAX_MULTI_PIDS,
+                &val_count);
+            XASSERT_OK(err);
+            XASSERT_EQ(mode, 0x01);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static
+void check_interleaved(struct test_ctx *test, struct yobd_reassembler *r)
+{
+    size_t active;
+    struct ecu *ecu;
+    yobd_err err;
+    const struct can_frame *frame;
+    size_t i;
+    size_t messages;
+    size_t flow_controls;
+    struct yobd_reassembly out;
+
+    for (i = 0; i < ECU_COUNT; ++i) {
+        test->ecus[i].id = YOBD_OBD_II_RESPONSE_BASE + i;
+        test->ecus[i].sent = 0;
+        new_message(test, &test->ecus[i]);
+    }
+
+    active = ECU_COUNT;
+    messages = 0;
+    flow_controls = 0;
+    while (active > 0) {
+        ecu = &test->ecus[rand() % ECU_COUNT];
+        if (ecu->sent == MESSAGES) {
+            continue;
+        }
+
+        frame = &ecu->frames[ecu->next_frame];
+        err = yobd_reassembler_push(r, frame, &out);
+        XASSERT_OK(err);
+        XASSERT_EQ(out.id, ecu->id);
+        ++ecu->next_frame;
+
+        if (out.send_flow_control) {
+            XASSERT_EQ(ecu->next_frame, 1);
+            XASSERT_GT(ecu->frame_count, 1);
+            XASSERT_EQ(out.flow_control.can_id, ecu->id - 8);
+            XASSERT_EQ(out.flow_control.can_dlc, 8);
+            XASSERT_EQ(out.flow_control.data[0], 0x30);
+            ++flow_controls;
+        }
+        else if (ecu->next_frame == 1) {
+            XASSERT_EQ(ecu->frame_count, 1);
+        }
+
+        if (ecu->next_frame < ecu->frame_count) {
+            XASSERT_NULL(out.payload);
+            continue;
+        }
+
+        XASSERT_NOT_NULL(out.payload);
+        check_message(test, ecu, &out);
+        ++messages;
+        ++ecu->sent;
+        if (ecu->sent == MESSAGES) {
+            --active;
+        }
+        else {
+            new_message(test, ecu);
+        }
+    }
+
+    XASSERT_EQ(messages, ECU_COUNT*MESSAGES);
+    printf(
+        "%zu messages from %d ECUs, %zu needing flow control\n",
+        messages,
+        ECU_COUNT,
+        flow_controls);
+}
+
+static
+void check_errors(struct yobd_reassembler *r)
+{
+    yobd_err err;
+    struct can_frame frame;
+    struct can_frame frames[MAX_FRAMES];
+    size_t frame_count;
+    size_t i;
+    struct yobd_reassembly out;
+    unsigned char payload[40];
+
+    for (i = 0; i < sizeof(payload); ++i) {
+        payload[i] = i;
+    }
+    frame_count = segment(YOBD_OBD_II_RESPONSE_BASE, payload, 40, frames);
+    XASSERT_EQ(frame_count, 6);
+
+    /* Not a response, or not ISO-TP. */
+    frame = frames[0];
+    frame.can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    err = yobd_reassembler_push(r, &frame, &out);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+    frame = frames[0];
+    frame.can_dlc = 7;
+    err = yobd_reassembler_push(r, &frame, &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DLC);
+    frame = frames[0];
+    frame.data[0] = 0x30;
+    err = yobd_reassembler_push(r, &frame, &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frame.data[0] = 0x00;
+    err = yobd_reassembler_push(r, &frame, &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    frame.data[0] = 0x10;
+    frame.data[1] = 7;
+    err = yobd_reassembler_push(r, &frame, &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+
+    /* A consecutive frame with no first frame. */
+    err = yobd_reassembler_push(r, &frames[1], &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+
+    /* A skipped frame drops the message. */
+    err = yobd_reassembler_push(r, &frames[0], &out);
+    XASSERT_OK(err);
+    err = yobd_reassembler_push(r, &frames[2], &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+    err = yobd_reassembler_push(r, &frames[3], &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+
+    /* A new first frame abandons the old message. */
+    err = yobd_reassembler_push(r, &frames[0], &out);
+    XASSERT_OK(err);
+    err = yobd_reassembler_push(r, &frames[1], &out);
+    XASSERT_OK(err);
+    for (i = 0; i < frame_count; ++i) {
+        err = yobd_reassembler_push(r, &frames[i], &out);
+        XASSERT_OK(err);
+    }
+    XASSERT_NOT_NULL(out.payload);
+    XASSERT_EQ(out.size, sizeof(payload));
+    XASSERT_EQ(memcmp(out.payload, payload, sizeof(payload)), 0);
+
+    /* Resetting drops partial messages. */
+    err = yobd_reassembler_push(r, &frames[0], &out);
+    XASSERT_OK(err);
+    yobd_reset_reassembler(r);
+    err = yobd_reassembler_push(r, &frames[1], &out);
+    XASSERT_ERRCODE(err, YOBD_INVALID_ISOTP);
+}
+
+static
+void check_payload_errors(struct yobd_ctx *ctx)
+{
+    yobd_err err;
+    yobd_mode mode;
+    unsigned char payload[2];
+    yobd_pid pid;
+    float val;
+
+    /* Payloads too short for a mode or a PID, and a query's mode. */
+    payload[0] = 0x41;
+    payload[1] = 0x0c;
+    err = yobd_parse_response_payload(ctx, payload, 0, &mode, &pid, &val);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    err = yobd_parse_response_payload(ctx, payload, 1, &mode, &pid, &val);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DATA_BYTES);
+    payload[0] = 0x01;
+    err = yobd_parse_response_payload(ctx, payload, 2, &mode, &pid, &val);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct yobd_reassembler *r;
+    static struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.pid_count = test_get_pids(test.ctx, 0x01, 0x01, test.pids, MAX_PIDS);
+    XASSERT_LT(test.pid_count, MAX_PIDS);
+    XASSERT_GT(test.pid_count, 0);
+
+    err = yobd_new_reassembler(&r);
+    XASSERT_OK(err);
+
+    check_interleaved(&test, r);
+    check_errors(r);
+    check_payload_errors(test.ctx);
+
+    yobd_free_reassembler(r);
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,324 @@
+/**
+ * @file      scheduler.c
+ * @brief     Unit test for the query scheduler, run in simulated time.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/multi.h>
+#include <yobd/scheduler.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* The number of mode 1 PIDs the tests use. */
+#define TEST_PIDS (8)
+
+/* The most frames to take from the scheduler per call. */
+#define MAX_FRAMES (4)
+
+/* The simulated run time. */
+#define RUN_TIME (10*S)
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[TEST_PIDS];
+    size_t pid_count;
+};
+
+/* What a simulated run sent. */
+struct run_stats {
+    /* Queries per mode 1 PID. */
+    size_t polls[0x100];
+    size_t frames;
+    size_t multi_frames;
+};
+
+/* Counts the PIDs a mode 1 query asks for. */
+static
+void record_query(const struct can_frame *frame, struct run_stats *stats)
+{
+    size_t count;
+    size_t i;
+
+    XASSERT_EQ(frame->can_id, YOBD_OBD_II_QUERY_ADDRESS);
+    XASSERT_EQ(frame->data[1], 0x1);
+    count = frame->data[0] - 1;
+    XASSERT_GTE(count, 1);
+    XASSERT_LTE(count, YOBD_MAX_MULTI_PIDS);
+
+    for (i = 0; i < count; ++i) {
+        ++stats->polls[frame->data[2+i]];
+    }
+    ++stats->frames;
+    if (count > 1) {
+        ++stats->multi_frames;
+    }
+}
+
+/*
+ * Runs a scheduler for RUN_TIME starting at start, waking only when it asks
+ * to. Returns the time the run ended.
+ */
+static
+uint64_t run(
+    struct yobd_scheduler *sched,
+    uint64_t start,
+    struct run_stats *stats)
+{
+    size_t count;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    uint64_t now;
+    uint64_t wake;
+
+    memset(stats, 0, sizeof(*stats));
+    now = start;
+    while (now <= start + RUN_TIME) {
+        err = yobd_scheduler_next(
+            sched,
+            now,
+            frames,
+            MAX_FRAMES,
+            &count,
+            &wake);
+        XASSERT_OK(err);
+        for (i = 0; i < count; ++i) {
+            record_query(&frames[i], stats);
+        }
+
+        /* Asking to be woken now is fine only if the frames array was full. */
+        XASSERT_GTE(wake, now);
+        if (wake == now) {
+            XASSERT_EQ(count, MAX_FRAMES);
+        }
+        now = wake;
+    }
+
+    return now;
+}
+
+static
+void check_params(struct test_ctx *test)
+{
+    size_t count;
+    yobd_err err;
+    struct can_frame frame;
+    struct yobd_scheduler_opts opts;
+    struct yobd_scheduler *sched;
+    uint64_t wake;
+
+    yobd_scheduler_opts_init(&opts);
+    err = yobd_new_scheduler(NULL, &opts, &sched);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    opts.burst = 1;
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    yobd_scheduler_opts_init(&opts);
+    opts.bitrate = 500000;
+    opts.bus_share = 0;
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    yobd_scheduler_opts_init(&opts);
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    /* Nothing registered means nothing to do, ever. */
+    err = yobd_scheduler_next(sched, 0, &frame, 1, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 0);
+    XASSERT_EQ(wake, UINT64_MAX);
+
+    err = yobd_scheduler_add_pid(sched, 0x1, test->pids[0].pid, 0, 0);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_scheduler_add_pid(sched, 0x55, 0x1234, 100*MS, 0);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+    err = yobd_scheduler_remove_pid(sched, 0x1, test->pids[0].pid);
+    XASSERT_ERRCODE(err, YOBD_PID_DOES_NOT_EXIST);
+
+    yobd_free_scheduler(sched);
+}
+
+/* With no budget, every PID is polled exactly at its period. */
+static
+void check_periods(struct test_ctx *test)
+{
+    uint64_t end;
+    yobd_err err;
+    size_t i;
+    struct yobd_scheduler_opts opts;
+    const uint64_t periods[] = { 50*MS, 100*MS, 300*MS, 1*S, 3*S };
+    struct yobd_scheduler *sched;
+    struct run_stats stats;
+
+    yobd_scheduler_opts_init(&opts);
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    for (i = 0; i < sizeof(periods) / sizeof(periods[0]); ++i) {
+        err = yobd_scheduler_add_pid(
+            sched,
+            0x1,
+            test->pids[i].pid,
+            periods[i],
+            0);
+        XASSERT_OK(err);
+    }
+    end = run(sched, 0, &stats);
+    for (i = 0; i < sizeof(periods) / sizeof(periods[0]); ++i) {
+        XASSERT_EQ(stats.polls[test->pids[i].pid], RUN_TIME / periods[i] + 1);
+    }
+    XASSERT_EQ(stats.multi_frames, 0);
+
+    /* Removing a PID stops it, and leaves the others alone. */
+    err = yobd_scheduler_remove_pid(sched, 0x1, test->pids[0].pid);
+    XASSERT_OK(err);
+    err = yobd_scheduler_remove_pid(sched, 0x1, test->pids[0].pid);
+    XASSERT_ERRCODE(err, YOBD_PID_DOES_NOT_EXIST);
+    run(sched, end, &stats);
+    XASSERT_EQ(stats.polls[test->pids[0].pid], 0);
+    for (i = 1; i < sizeof(periods) / sizeof(periods[0]); ++i) {
+        XASSERT_GTE(stats.polls[test->pids[i].pid], RUN_TIME / periods[i]);
+    }
+    yobd_free_scheduler(sched);
+}
+
+/*
+ * With a tight budget, the high-priority PID keeps its rate, the others share
+ * what is left, and the budget is never exceeded.
+ */
+static
+void check_priority(struct test_ctx *test)
+{
+    uint64_t end;
+    yobd_err err;
+    size_t i;
+    size_t low;
+    struct yobd_scheduler_opts opts;
+    struct yobd_scheduler *sched;
+    struct run_stats stats;
+
+    yobd_scheduler_opts_init(&opts);
+    opts.max_frames_per_sec = 100;
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    /* 20 Hz each, so the five PIDs ask for twice the budget. */
+    for (i = 0; i < 5; ++i) {
+        err = yobd_scheduler_add_pid(
+            sched,
+            0x1,
+            test->pids[i].pid,
+            50*MS,
+            i == 0 ? 10 : 1);
+        XASSERT_OK(err);
+    }
+    end = run(sched, 0, &stats);
+
+    XASSERT_EQ(stats.polls[test->pids[0].pid], RUN_TIME / (50*MS) + 1);
+    low = 0;
+    for (i = 1; i < 5; ++i) {
+        low += stats.polls[test->pids[i].pid];
+        XASSERT_GT(stats.polls[test->pids[i].pid], 0);
+    }
+    XASSERT_LT(low, 4 * (RUN_TIME / (50*MS)));
+
+    /* Each query costs 2 frames; the bucket starts full. */
+    XASSERT_LTE(
+        2*stats.frames,
+        opts.max_frames_per_sec * (RUN_TIME / S) + opts.burst);
+    XASSERT_GTE(
+        2*stats.frames,
+        opts.max_frames_per_sec * (RUN_TIME / S) - opts.burst);
+
+    /* Raising a low PID's priority above the first one takes its place. */
+    err = yobd_scheduler_add_pid(sched, 0x1, test->pids[1].pid, 50*MS, 20);
+    XASSERT_OK(err);
+    err = yobd_scheduler_add_pid(sched, 0x1, test->pids[0].pid, 50*MS, 1);
+    XASSERT_OK(err);
+    run(sched, end, &stats);
+    XASSERT_GTE(stats.polls[test->pids[1].pid], RUN_TIME / (50*MS));
+    XASSERT_GT(stats.polls[test->pids[1].pid], stats.polls[test->pids[0].pid]);
+
+    yobd_free_scheduler(sched);
+}
+
+/* PIDs due together go out together in multi-PID queries. */
+static
+void check_packing(struct test_ctx *test)
+{
+    yobd_err err;
+    size_t i;
+    struct yobd_scheduler_opts opts;
+    struct yobd_scheduler *sched;
+    struct run_stats stats;
+
+    yobd_scheduler_opts_init(&opts);
+    opts.multi_pid = true;
+    err = yobd_new_scheduler(test->ctx, &opts, &sched);
+    XASSERT_OK(err);
+
+    for (i = 0; i < TEST_PIDS; ++i) {
+        err = yobd_scheduler_add_pid(
+            sched,
+            0x1,
+            test->pids[i].pid,
+            i < YOBD_MAX_MULTI_PIDS ? 100*MS : 200*MS,
+            0);
+        XASSERT_OK(err);
+    }
+    run(sched, 0, &stats);
+
+    for (i = 0; i < TEST_PIDS; ++i) {
+        XASSERT_EQ(
+            stats.polls[test->pids[i].pid],
+            RUN_TIME / (i < YOBD_MAX_MULTI_PIDS ? 100*MS : 200*MS) + 1);
+    }
+
+    /* Every 200 ms, 8 PIDs take 2 frames; in between, 6 PIDs take 1. */
+    XASSERT_EQ(stats.frames, 2*(RUN_TIME / (200*MS) + 1) + RUN_TIME / (200*MS));
+    XASSERT_EQ(stats.multi_frames, stats.frames);
+
+    yobd_free_scheduler(sched);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.pid_count = test_get_pids(test.ctx, 0x01, 0x01, test.pids, TEST_PIDS);
+    XASSERT_EQ(test.pid_count, TEST_PIDS);
+
+    check_params(&test);
+    check_periods(&test);
+    check_priority(&test);
+    check_packing(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,735 @@
+/**
+ * @file      sim.c
+ * @brief     Unit test for the simulated ECUs, driven directly and over an
+ *            AF_UNIX socketpair standing in for CAN.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <yobd/multi.h>
+#include <yobd/reassembler.h>
+#include <yobd/sim.h>
+#include <yobd/supported.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+#define US (1000ULL)
+#define MS (1000000ULL)
+#define S (1000000000ULL)
+
+/* Mode 1 PIDs of the SAE standard schema. */
+#define PID_LOAD (0x04)
+#define PID_RPM (0x0c)
+#define PID_SPEED (0x0d)
+
+/* The most frames any check takes from the simulator at once. */
+#define MAX_FRAMES (64)
+
+/* The data bytes of a classic CAN frame. */
+#define OBD_DATA_LEN (8)
+
+/* The queries in the latency and drop check, and the time between them. */
+#define STAT_QUERIES (20000)
+#define STAT_PERIOD (10*MS)
+
+/* The socketpair check sends rounds of queries, each answered by every ECU. */
+#define PUMP_ECUS (3)
+#define PUMP_ROUNDS (20)
+#define PUMP_QUERIES (100)
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[YOBD_MAX_MULTI_PIDS];
+    size_t pid_count;
+};
+
+static
+struct yobd_sim *new_sim(
+    struct test_ctx *test,
+    size_t ecus,
+    uint64_t latency,
+    uint64_t jitter,
+    uint32_t drop_ppm)
+{
+    size_t ecu;
+    yobd_err err;
+    size_t i;
+    struct yobd_sim_ecu_opts opts;
+    struct yobd_sim *sim;
+
+    err = yobd_new_sim(test->ctx, 1234, &sim);
+    XASSERT_OK(err);
+
+    yobd_sim_ecu_opts_init(&opts);
+    opts.latency = latency;
+    opts.jitter = jitter;
+    opts.drop_ppm = drop_ppm;
+    for (i = 0; i < ecus; ++i) {
+        err = yobd_sim_add_ecu(sim, &opts, &ecu);
+        XASSERT_OK(err);
+        XASSERT_EQ(ecu, i);
+    }
+
+    return sim;
+}
+
+static
+void push_query(
+    struct test_ctx *test,
+    struct yobd_sim *sim,
+    yobd_pid pid,
+    uint64_t now)
+{
+    yobd_err err;
+    struct can_frame frame;
+
+    err = yobd_make_can_query(test->ctx, 0x1, pid, &frame);
+    XASSERT_OK(err);
+    err = yobd_sim_push(sim, &frame, now);
+    XASSERT_OK(err);
+}
+
+/*
+ * Queries a PID of a simulator with one ECU and no latency, checks the
+ * response is just what yobd would make, and returns its raw value.
+ */
+static
+unsigned long query_raw(
+    struct test_ctx *test,
+    struct yobd_sim *sim,
+    yobd_pid pid,
+    uint64_t now)
+{
+    size_t count;
+    unsigned char data[4];
+    const struct yobd_pid_desc *desc;
+    yobd_err err;
+    struct can_frame expected;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    unsigned long raw;
+    uint64_t wake;
+
+    push_query(test, sim, pid, now);
+    err = yobd_sim_next(sim, now, frames, MAX_FRAMES, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+    XASSERT_EQ(wake, UINT64_MAX);
+
+    err = yobd_get_pid_descriptor(test->ctx, 0x1, pid, &desc);
+    XASSERT_OK(err);
+    XASSERT_LTE(desc->can_bytes, sizeof(data));
+    memcpy(data, &frames[0].data[3], desc->can_bytes);
+    err = yobd_make_can_response(
+        test->ctx,
+        0x1,
+        pid,
+        data,
+        desc->can_bytes,
+        &expected);
+    XASSERT_OK(err);
+    XASSERT_EQ(frames[0].can_id, expected.can_id);
+    XASSERT_EQ(frames[0].can_dlc, expected.can_dlc);
+    XASSERT_EQ(memcmp(frames[0].data, expected.data, OBD_DATA_LEN), 0);
+
+    raw = 0;
+    for (i = 0; i < desc->can_bytes; ++i) {
+        raw = (raw << 8) | data[i];
+    }
+
+    return raw;
+}
+
+static
+void set_gen(
+    struct yobd_sim *sim,
+    yobd_pid pid,
+    yobd_sim_gen_type type,
+    double value,
+    double param,
+    uint64_t period)
+{
+    yobd_err err;
+    struct yobd_sim_gen gen;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.type = type;
+    gen.value = value;
+    gen.rate = param;
+    gen.amplitude = param;
+    gen.period = period;
+    err = yobd_sim_set_gen(sim, 0x1, pid, &gen);
+    XASSERT_OK(err);
+}
+
+/* Generators follow the time since the first query, clamped to their range. */
+static
+void check_generators(struct test_ctx *test)
+{
+    struct yobd_sim *sim;
+
+    sim = new_sim(test, 1, 0, 0, 0);
+
+    set_gen(sim, PID_SPEED, YOBD_SIM_CONSTANT, 42, 0, 0);
+    set_gen(sim, PID_RPM, YOBD_SIM_RAMP, 100, 1000, 0);
+    set_gen(sim, PID_LOAD, YOBD_SIM_SINE, 100, 50, 4*S);
+
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 5*S), 42);
+    XASSERT_EQ(query_raw(test, sim, PID_RPM, 5*S), 100);
+    XASSERT_EQ(query_raw(test, sim, PID_RPM, 7*S), 2100);
+    XASSERT_EQ(query_raw(test, sim, PID_LOAD, 5*S), 100);
+    XASSERT_EQ(query_raw(test, sim, PID_LOAD, 6*S), 150);
+    XASSERT_EQ(query_raw(test, sim, PID_LOAD, 8*S), 50);
+
+    /* A period starts the ramp over. */
+    set_gen(sim, PID_RPM, YOBD_SIM_RAMP, 0, 100, 2*S);
+    XASSERT_EQ(query_raw(test, sim, PID_RPM, 6*S + 500*MS), 150);
+    XASSERT_EQ(query_raw(test, sim, PID_RPM, 7*S + 500*MS), 50);
+
+    /* Values out of range are clamped. */
+    set_gen(sim, PID_SPEED, YOBD_SIM_CONSTANT, 1000, 0, 0);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 9*S), 255);
+    set_gen(sim, PID_SPEED, YOBD_SIM_CONSTANT, -5, 0, 0);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 9*S), 0);
+    set_gen(sim, PID_RPM, YOBD_SIM_SINE, 60000, 10000, 4*S);
+    XASSERT_EQ(query_raw(test, sim, PID_RPM, 10*S), 65535);
+
+    yobd_free_sim(sim);
+}
+
+/*
+ * Each response comes between latency and latency + jitter after its query,
+ * spread evenly, and about the configured share is dropped.
+ */
+static
+void check_timing(struct test_ctx *test)
+{
+    size_t count;
+    uint64_t delay;
+    uint64_t delay_max;
+    uint64_t delay_min;
+    uint64_t delay_sum;
+    size_t dropped;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    uint64_t now;
+    size_t received;
+    struct yobd_sim *sim;
+    struct yobd_sim_stats stats;
+    uint64_t wake;
+
+    sim = new_sim(test, 1, 2*MS, 3*MS, 100000);
+
+    delay_min = UINT64_MAX;
+    delay_max = 0;
+    delay_sum = 0;
+    dropped = 0;
+    received = 0;
+    now = 0;
+    for (i = 0; i < STAT_QUERIES; ++i) {
+        push_query(test, sim, PID_SPEED, now);
+        err = yobd_sim_next(sim, now, frames, MAX_FRAMES, &count, &wake);
+        XASSERT_OK(err);
+        XASSERT_EQ(count, 0);
+        if (wake == UINT64_MAX) {
+            ++dropped;
+            now += STAT_PERIOD;
+            continue;
+        }
+
+        delay = wake - now;
+        if (delay < delay_min) {
+            delay_min = delay;
+        }
+        if (delay > delay_max) {
+            delay_max = delay;
+        }
+        delay_sum += delay;
+
+        /* Nothing comes early, and the response comes when it is due. */
+        err = yobd_sim_next(sim, wake - 1, frames, MAX_FRAMES, &count, &wake);
+        XASSERT_OK(err);
+        XASSERT_EQ(count, 0);
+        err = yobd_sim_next(sim, wake, frames, MAX_FRAMES, &count, &wake);
+        XASSERT_OK(err);
+        XASSERT_EQ(count, 1);
+        XASSERT_EQ(wake, UINT64_MAX);
+        ++received;
+        now += STAT_PERIOD;
+    }
+
+    XASSERT_GTE(delay_min, 2*MS);
+    XASSERT_LT(delay_min, 2*MS + 100*US);
+    XASSERT_LTE(delay_max, 5*MS);
+    XASSERT_GT(delay_max, 5*MS - 100*US);
+    XASSERT_GT(delay_sum / received, 3500*US - 100*US);
+    XASSERT_LT(delay_sum / received, 3500*US + 100*US);
+
+    /* 10% dropped, give or take 1%. */
+    XASSERT_GT(dropped, STAT_QUERIES * 9 / 100);
+    XASSERT_LT(dropped, STAT_QUERIES * 11 / 100);
+
+    err = yobd_sim_get_stats(sim, &stats);
+    XASSERT_OK(err);
+    XASSERT_EQ(stats.queries, STAT_QUERIES);
+    XASSERT_EQ(stats.frames, received);
+    XASSERT_EQ(stats.dropped, dropped);
+    XASSERT_EQ(stats.ignored, 0);
+
+    printf(
+        "%zu of %d dropped; delay %.3f-%.3f ms, mean %.3f ms\n",
+        dropped,
+        STAT_QUERIES,
+        (double) delay_min / MS,
+        (double) delay_max / MS,
+        (double) delay_sum / received / MS);
+
+    yobd_free_sim(sim);
+}
+
+/*
+ * Sends a query to a simulator and plays the tester until every response is
+ * in, reassembling them and sending flow control with a 5 ms separation time.
+ * Complete payloads are parsed as "PIDs supported" responses if caps is not
+ * NULL, and as multi-PID responses otherwise. Returns the ECUs that answered.
+ */
+static
+uint8_t exchange(
+    struct test_ctx *test,
+    struct yobd_sim *sim,
+    const struct can_frame *query,
+    struct yobd_caps *caps)
+{
+    size_t consecutive;
+    size_t count;
+    uint8_t ecus;
+    yobd_err err;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    size_t j;
+    yobd_mode mode;
+    uint64_t now;
+    struct yobd_reassembly out;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    size_t pid_count;
+    struct yobd_reassembler *reassembler;
+    float vals[YOBD_MAX_MULTI_PIDS];
+    uint64_t wake;
+
+    err = yobd_new_reassembler(&reassembler);
+    XASSERT_OK(err);
+
+    now = 0;
+    err = yobd_sim_push(sim, query, now);
+    XASSERT_OK(err);
+
+    ecus = 0;
+    for (;;) {
+        err = yobd_sim_next(sim, now, frames, MAX_FRAMES, &count, &wake);
+        XASSERT_OK(err);
+        for (i = 0; i < count; ++i) {
+            err = yobd_reassembler_push(reassembler, &frames[i], &out);
+            XASSERT_OK(err);
+            if (out.send_flow_control) {
+                out.flow_control.data[2] = 5;
+                err = yobd_sim_push(sim, &out.flow_control, now);
+                XASSERT_OK(err);
+            }
+            if (out.payload == NULL) {
+                continue;
+            }
+
+            /* Consecutive frames came 5 ms apart, after 1 ms of latency. */
+            ecus |= 1 << (out.id - YOBD_OBD_II_RESPONSE_BASE);
+            consecutive = out.size <= 7 ? 0 : (out.size - 6 + 6) / 7;
+            XASSERT_EQ(now, 1*MS + 5*MS * consecutive);
+
+            if (caps != NULL) {
+                err = yobd_parse_supported_payload(
+                    caps,
+                    out.id,
+                    out.payload,
+                    out.size);
+                XASSERT_OK(err);
+                continue;
+            }
+
+            err = yobd_parse_multi_response(
+                test->ctx,
+                out.payload,
+                out.size,
+                &mode,
+                pids,
+                vals,
+                YOBD_MAX_MULTI_PIDS,
+                &pid_count);
+            XASSERT_OK(err);
+            XASSERT_EQ(mode, 0x1);
+            XASSERT_EQ(pid_count, YOBD_MAX_MULTI_PIDS);
+            for (j = 0; j < pid_count; ++j) {
+                XASSERT_EQ(pids[j], test->pids[j].pid);
+            }
+        }
+
+        /* Flow control may have made more frames due, so look again. */
+        if (count == 0) {
+            if (wake == UINT64_MAX) {
+                break;
+            }
+            XASSERT_GT(wake, now);
+            now = wake;
+        }
+    }
+
+    yobd_free_reassembler(reassembler);
+
+    return ecus;
+}
+
+/* ECUs answer for what they support, in one frame or several. */
+static
+void check_ecus(struct test_ctx *test)
+{
+    struct yobd_caps caps;
+    size_t count;
+    bool done;
+    uint8_t ecus;
+    yobd_err err;
+    struct can_frame frame;
+    struct can_frame frames[MAX_FRAMES];
+    size_t i;
+    yobd_pid next;
+    yobd_pid pid;
+    yobd_pid pids[YOBD_MAX_MULTI_PIDS];
+    struct yobd_sim *sim;
+    uint64_t wake;
+
+    sim = new_sim(test, 3, 1*MS, 0, 0);
+    err = yobd_sim_set_supported(sim, 1, 0x1, PID_SPEED, false);
+    XASSERT_OK(err);
+    err = yobd_sim_set_supported(sim, 2, 0x1, test->pids[0].pid, false);
+    XASSERT_OK(err);
+
+    push_query(test, sim, PID_SPEED, 0);
+    err = yobd_sim_next(sim, 1*MS, frames, MAX_FRAMES, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 2);
+    XASSERT_EQ(frames[0].can_id, YOBD_OBD_II_RESPONSE_BASE);
+    XASSERT_EQ(frames[1].can_id, YOBD_OBD_II_RESPONSE_BASE + 2);
+
+    /* Discovery one bitmap at a time sees the same support. */
+    yobd_caps_init(&caps);
+    pid = 0;
+    done = false;
+    while (!done) {
+        err = yobd_make_supported_query(0x1, pid, &frame);
+        XASSERT_OK(err);
+        err = yobd_sim_push(sim, &frame, 2*MS);
+        XASSERT_OK(err);
+        err = yobd_sim_next(sim, 3*MS, frames, MAX_FRAMES, &count, &wake);
+        XASSERT_OK(err);
+        XASSERT_GT(count, 0);
+        while (count > 0) {
+            --count;
+            err = yobd_parse_supported_response(&caps, &frames[count]);
+            XASSERT_OK(err);
+        }
+        err = yobd_caps_next_supported_pid(&caps, 0x1, pid, &next, &done);
+        XASSERT_OK(err);
+        pid = next;
+    }
+    err = yobd_caps_get_ecus(&caps, 0x1, PID_SPEED, &ecus);
+    XASSERT_OK(err);
+    XASSERT_EQ(ecus, 0x5);
+    err = yobd_caps_get_ecus(&caps, 0x1, PID_RPM, &ecus);
+    XASSERT_OK(err);
+    XASSERT_EQ(ecus, 0x7);
+
+    /* So does discovery in one multi-PID query, answered in several frames. */
+    yobd_free_sim(sim);
+    sim = new_sim(test, 3, 1*MS, 0, 0);
+    err = yobd_sim_set_supported(sim, 1, 0x1, PID_SPEED, false);
+    XASSERT_OK(err);
+    err = yobd_sim_set_supported(sim, 2, 0x1, test->pids[0].pid, false);
+    XASSERT_OK(err);
+    yobd_caps_init(&caps);
+    err = yobd_make_supported_multi_query(&frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(exchange(test, sim, &frame, &caps), 0x7);
+    err = yobd_caps_get_ecus(&caps, 0x1, PID_SPEED, &ecus);
+    XASSERT_OK(err);
+    XASSERT_EQ(ecus, 0x5);
+    err = yobd_caps_get_ecus(&caps, 0x1, test->pids[0].pid, &ecus);
+    XASSERT_OK(err);
+    XASSERT_EQ(ecus, 0x3);
+    yobd_free_sim(sim);
+
+    /* Multi-PID data responses need flow control too. */
+    sim = new_sim(test, 2, 1*MS, 0, 0);
+    for (i = 0; i < YOBD_MAX_MULTI_PIDS; ++i) {
+        pids[i] = test->pids[i].pid;
+    }
+    err = yobd_make_can_multi_query(
+        test->ctx,
+        0x1,
+        pids,
+        YOBD_MAX_MULTI_PIDS,
+        &frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(exchange(test, sim, &frame, NULL), 0x3);
+    yobd_free_sim(sim);
+}
+
+/* Writes a file to a temporary path, filled in with its name. */
+static
+void write_file(char *path, const char *contents)
+{
+    int fd;
+    size_t len;
+
+    strcpy(path, "/tmp/yobd-sim-XXXXXX");
+    fd = mkstemp(path);
+    XASSERT_NEQ(fd, -1);
+    len = strlen(contents);
+    XASSERT_EQ(write(fd, contents, len), (ssize_t) len);
+    close(fd);
+}
+
+/* Replayed responses follow the log, looping at its end. */
+static
+void check_replay(struct test_ctx *test)
+{
+    size_t count;
+    yobd_err err;
+    char path[PATH_MAX];
+    struct yobd_sim *sim;
+
+    write_file(
+        path,
+        "(1000.000000) vcan0 7DF#02010DCCCCCCCCCC\n"
+        "(1000.000100) vcan0 7E8#03410D0ACCCCCCCC\n"
+        "\n"
+        "(1001.0) vcan0 7E8#03410D14CCCCCCCC\n"
+        "(1001.500000) vcan0 7E8#100A410C0BB8040A\n"
+        "(1002.000000) can1 7E9#03410D1ECCCCCCCC\n"
+        "(1004.000000) vcan0 7DF#02010DCCCCCCCCCC\n");
+
+    sim = new_sim(test, 1, 0, 0, 0);
+    err = yobd_sim_load_replay(sim, path, &count);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 3);
+    unlink(path);
+
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 100*S), 10);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 100*S + 500*MS), 10);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 101*S + 500*MS), 20);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 102*S), 30);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 103*S + 900*MS), 30);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 104*S + 500*MS), 10);
+    XASSERT_EQ(query_raw(test, sim, PID_SPEED, 105*S + 200*MS), 20);
+
+    /* PIDs not in the log keep their generators. */
+    XASSERT_NEQ(query_raw(test, sim, PID_RPM, 105*S + 200*MS), 0);
+    yobd_free_sim(sim);
+
+    write_file(path, "(1000.000000) vcan0 7E8#03410D0ACCCCCCCC\ngarbage\n");
+    sim = new_sim(test, 1, 0, 0, 0);
+    err = yobd_sim_load_replay(sim, path, &count);
+    XASSERT_ERRCODE(err, YOBD_PARSE_FAIL);
+    unlink(path);
+    yobd_free_sim(sim);
+}
+
+/* Reads every frame waiting on a socket, checking each decodes. */
+static
+size_t drain(struct test_ctx *test, int fd)
+{
+    size_t count;
+    yobd_err err;
+    struct can_frame frame;
+    ssize_t ret;
+    float val;
+
+    count = 0;
+    for (;;) {
+        ret = recv(fd, &frame, sizeof(frame), MSG_DONTWAIT);
+        if (ret == -1) {
+            XASSERT_EQ(errno, EAGAIN);
+            break;
+        }
+        XASSERT_EQ(ret, sizeof(frame));
+        err = yobd_parse_can_response(test->ctx, &frame, &val);
+        XASSERT_OK(err);
+        ++count;
+    }
+
+    return count;
+}
+
+/*
+ * The simulator serves a socket, holding on to what the socket cannot take
+ * yet rather than blocking or losing it.
+ */
+static
+void check_pump(struct test_ctx *test)
+{
+    yobd_err err;
+    int fds[2];
+    struct can_frame frame;
+    size_t i;
+    uint64_t now;
+    size_t received;
+    int ret;
+    size_t round;
+    struct yobd_sim *sim;
+    struct yobd_sim_stats stats;
+    uint64_t wake;
+
+    /* SOCK_SEQPACKET keeps datagram boundaries, as CAN_RAW does. */
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds);
+    XASSERT_EQ(ret, 0);
+
+    sim = new_sim(test, PUMP_ECUS, 1*MS, 0, 0);
+    err = yobd_make_can_query(test->ctx, 0x1, PID_SPEED, &frame);
+    XASSERT_OK(err);
+
+    received = 0;
+    now = 0;
+    for (round = 0; round < PUMP_ROUNDS; ++round) {
+        for (i = 0; i < PUMP_QUERIES; ++i) {
+            ret = send(fds[1], &frame, sizeof(frame), 0);
+            XASSERT_EQ(ret, sizeof(frame));
+        }
+
+        /* Anything not a CAN frame is ignored. */
+        ret = send(fds[1], "junk", 4, 0);
+        XASSERT_EQ(ret, 4);
+
+        err = yobd_sim_pump(sim, fds[0], now, &wake);
+        XASSERT_OK(err);
+        XASSERT_EQ(wake, now + 1*MS);
+        while (wake != UINT64_MAX) {
+            now = wake;
+            err = yobd_sim_pump(sim, fds[0], now, &wake);
+            XASSERT_OK(err);
+            received += drain(test, fds[1]);
+        }
+    }
+    XASSERT_EQ(received, PUMP_ROUNDS * PUMP_QUERIES * PUMP_ECUS);
+
+    err = yobd_sim_get_stats(sim, &stats);
+    XASSERT_OK(err);
+    XASSERT_EQ(stats.queries, PUMP_ROUNDS * PUMP_QUERIES);
+    XASSERT_EQ(stats.frames, received);
+    XASSERT_EQ(stats.ignored, PUMP_ROUNDS);
+
+    yobd_free_sim(sim);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static
+void check_params(struct test_ctx *test)
+{
+    size_t count;
+    size_t ecu;
+    yobd_err err;
+    struct can_frame frame;
+    struct yobd_sim_gen gen;
+    struct yobd_sim_ecu_opts opts;
+    struct yobd_sim *sim;
+    uint64_t wake;
+
+    err = yobd_new_sim(NULL, 0, &sim);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    sim = new_sim(test, YOBD_SIM_MAX_ECUS, 0, 0, 0);
+    yobd_sim_ecu_opts_init(&opts);
+    err = yobd_sim_add_ecu(sim, &opts, &ecu);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    err = yobd_sim_set_supported(sim, YOBD_SIM_MAX_ECUS, 0x1, PID_SPEED, true);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_sim_set_supported(sim, 0, 0x1, 0xff, true);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+
+    memset(&gen, 0, sizeof(gen));
+    gen.type = YOBD_SIM_REPLAY;
+    err = yobd_sim_set_gen(sim, 0x1, PID_SPEED, &gen);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    gen.type = YOBD_SIM_SINE;
+    err = yobd_sim_set_gen(sim, 0x1, PID_SPEED, &gen);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    gen.type = YOBD_SIM_CONSTANT;
+    err = yobd_sim_set_gen(sim, 0x1, 0xff, &gen);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+
+    err = yobd_sim_load_replay(sim, "/nonexistent/candump.log", &count);
+    XASSERT_ERRCODE(err, YOBD_CANNOT_OPEN_FILE);
+
+    /* Time may not go back before the first frame. */
+    err = yobd_make_can_query(test->ctx, 0x1, PID_SPEED, &frame);
+    XASSERT_OK(err);
+    err = yobd_sim_push(sim, &frame, 10*MS);
+    XASSERT_OK(err);
+    err = yobd_sim_push(sim, &frame, 9*MS);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    /* With no room for frames that are due, wake is now. */
+    err = yobd_sim_next(sim, 10*MS, NULL, 1, &count, &wake);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_sim_next(sim, 10*MS, NULL, 0, &count, &wake);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 0);
+    XASSERT_EQ(wake, 10*MS);
+
+    yobd_free_sim(sim);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.pid_count = test_get_pids(
+        test.ctx,
+        0x01,
+        0x01,
+        test.pids,
+        YOBD_MAX_MULTI_PIDS);
+    XASSERT_EQ(test.pid_count, YOBD_MAX_MULTI_PIDS);
+
+    check_params(&test);
+    check_generators(&test);
+    check_timing(&test);
+    check_ecus(&test);
+    check_replay(&test);
+    check_pump(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+/**
+ * @file      sink.c
+ * @brief     Unit test checking that a sink collects exactly the values that
+ *            decoding frames one at a time would give, in order, per PID.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/sink.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* The number of frames to push. */
+#define FRAMES (1 << 14)
+
+/* Chosen so that columns fill up in the middle of runs and pushes. */
+#define CAPACITY (100)
+
+/* The number of frames passed to each push. */
+#define PUSH_SIZE (777)
+
+/* The longest run of frames for one PID. */
+#define MAX_RUN (150)
+
+struct column {
+    yobd_mode mode;
+    yobd_pid pid;
+    uint_fast8_t can_bytes;
+    bool registered;
+    size_t expected_count;
+    uint64_t expected_timestamps[FRAMES];
+    float expected_vals[FRAMES];
+    size_t count;
+    uint64_t timestamps[FRAMES];
+    float vals[FRAMES];
+};
+
+struct test_ctx {
+    struct column *columns;
+    size_t column_count;
+    size_t flushes;
+};
+
+static
+bool add_column(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    struct column *column;
+    struct test_ctx *test;
+
+    test = data;
+    column = &test->columns[test->column_count];
+    column->mode = mode;
+    column->pid = pid;
+    column->can_bytes = desc->can_bytes;
+    column->registered = test->column_count % 2 == 0;
+    column->expected_count = 0;
+    column->count = 0;
+    ++test->column_count;
+
+    return false;
+}
+
+static
+struct column *find_column(
+    struct test_ctx *test,
+    yobd_mode mode,
+    yobd_pid pid)
+{
+    size_t i;
+
+    for (i = 0; i < test->column_count; ++i) {
+        if (test->columns[i].mode == mode && test->columns[i].pid == pid) {
+            return &test->columns[i];
+        }
+    }
+
+    return NULL;
+}
+
+static
+void flush(
+    yobd_mode mode,
+    yobd_pid pid,
+    const uint64_t *timestamps,
+    const float *vals,
+    size_t count,
+    void *data)
+{
+    struct column *column;
+    struct test_ctx *test;
+
+    test = data;
+    column = find_column(test, mode, pid);
+    XASSERT_NOT_NULL(column);
+    XASSERT(column->registered);
+    XASSERT_GT(count, 0);
+    XASSERT_LTE(count, CAPACITY);
+    XASSERT_LTE(column->count + count, FRAMES);
+
+    memcpy(
+        &column->timestamps[column->count],
+        timestamps,
+        count * sizeof(*timestamps));
+    memcpy(&column->vals[column->count], vals, count * sizeof(*vals));
+    column->count += count;
+    ++test->flushes;
+}
+
+/*
+ * Fills in runs of frames for random PIDs, with a few frames that fail to
+ * parse, and records the values a sink should collect for each of them.
+ */
+static
+void make_frames(
+    struct yobd_ctx *ctx,
+    struct test_ctx *test,
+    struct can_frame *frames,
+    uint64_t *timestamps)
+{
+    unsigned char bytes[4];
+    struct column *column;
+    yobd_err err;
+    size_t i;
+    uint_fast8_t j;
+    size_t run;
+    float val;
+
+    column = NULL;
+    run = 0;
+    for (i = 0; i < FRAMES; ++i) {
+        if (run == 0) {
+            column = &test->columns[rand() % test->column_count];
+            run = 1 + rand() % MAX_RUN;
+        }
+        --run;
+
+        for (j = 0; j < column->can_bytes; ++j) {
+            bytes[j] = rand() & 0xff;
+        }
+        err = yobd_make_can_response(
+            ctx,
+            column->mode,
+            column->pid,
+            bytes,
+            column->can_bytes,
+            &frames[i]);
+        XASSERT_OK(err);
+        if (i % 11 == 0) {
+            ++frames[i].data[0];
+        }
+        else if (i % 13 == 0) {
+            frames[i].can_id = YOBD_OBD_II_QUERY_ADDRESS;
+        }
+        timestamps[i] = 1000 * i;
+
+        err = yobd_parse_can_response(ctx, &frames[i], &val);
+        if (err == YOBD_OK && column->registered) {
+            column->expected_timestamps[column->expected_count] = timestamps[i];
+            column->expected_vals[column->expected_count] = val;
+            ++column->expected_count;
+        }
+    }
+}
+
+static
+void test_sink(struct yobd_ctx *ctx)
+{
+    struct column *column;
+    yobd_err err;
+    struct can_frame *frames;
+    size_t i;
+    size_t n;
+    size_t pid_count;
+    struct yobd_sink *sink;
+    size_t stored;
+    struct test_ctx test;
+    uint64_t *timestamps;
+    size_t total;
+
+    err = yobd_get_pid_count(ctx, &pid_count);
+    XASSERT_OK(err);
+    test.columns = malloc(pid_count * sizeof(*test.columns));
+    XASSERT_NOT_NULL(test.columns);
+    test.column_count = 0;
+    test.flushes = 0;
+    err = yobd_pid_foreach(ctx, add_column, &test);
+    XASSERT_OK(err);
+    XASSERT_GT(test.column_count, 1);
+
+    err = yobd_new_sink(ctx, CAPACITY, flush, &test, &sink);
+    XASSERT_OK(err);
+    for (i = 0; i < test.column_count; ++i) {
+        column = &test.columns[i];
+        if (!column->registered) {
+            continue;
+        }
+        err = yobd_sink_add_pid(sink, column->mode, column->pid);
+        XASSERT_OK(err);
+        /* Registering twice does nothing. */
+        err = yobd_sink_add_pid(sink, column->mode, column->pid);
+        XASSERT_OK(err);
+    }
+    err = yobd_sink_add_pid(sink, 0x01, 0xff);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_MODE_PID);
+
+    frames = malloc(FRAMES * sizeof(*frames));
+    XASSERT_NOT_NULL(frames);
+    timestamps = malloc(FRAMES * sizeof(*timestamps));
+    XASSERT_NOT_NULL(timestamps);
+    make_frames(ctx, &test, frames, timestamps);
+
+    total = 0;
+    for (i = 0; i < FRAMES; i += n) {
+        n = FRAMES - i;
+        if (n > PUSH_SIZE) {
+            n = PUSH_SIZE;
+        }
+        err = yobd_sink_push(sink, &frames[i], &timestamps[i], n, &stored);
+        XASSERT_OK(err);
+        total += stored;
+    }
+    XASSERT_GT(test.flushes, 0);
+    err = yobd_sink_flush(sink);
+    XASSERT_OK(err);
+
+    for (i = 0; i < test.column_count; ++i) {
+        column = &test.columns[i];
+        XASSERT_EQ(column->count, column->expected_count);
+        XASSERT_EQ(
+            memcmp(
+                column->timestamps,
+                column->expected_timestamps,
+                column->count * sizeof(*column->timestamps)),
+            0);
+        XASSERT_EQ(
+            memcmp(
+                column->vals,
+                column->expected_vals,
+                column->count * sizeof(*column->vals)),
+            0);
+        total -= column->count;
+    }
+    XASSERT_EQ(total, 0);
+
+    err = yobd_sink_push(NULL, frames, timestamps, FRAMES, NULL);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_new_sink(ctx, 0, flush, &test, &sink);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    yobd_free_sink(sink);
+    free(frames);
+    free(timestamps);
+    free(test.columns);
+}
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &ctx);
+    XASSERT_OK(err);
+    test_sink(ctx);
+    yobd_free_ctx(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+/**
+ * @file      socketcan.c
+ * @brief     Unit test for batched SocketCAN receive, over an AF_UNIX
+ *            socketpair standing in for CAN, and over vcan0 if it exists.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <yobd/sink.h>
+#include <yobd/socketcan.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+#include <yobd-test/pids.h>
+
+/* The number of frames sent in each round; small enough to fit in a socket. */
+#define ROUND_FRAMES (100)
+
+/* The number of rounds. */
+#define ROUNDS (50)
+
+/* The most frames received per call. */
+#define BATCH (32)
+
+/* The most PIDs the schema may have. */
+#define MAX_PIDS (256)
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct test_pid pids[MAX_PIDS];
+    size_t pid_count;
+    size_t flushed;
+};
+
+static
+void count_flush(
+    yobd_mode mode,
+    yobd_pid pid,
+    const uint64_t *timestamps,
+    const float *vals,
+    size_t count,
+    void *data)
+{
+    struct test_ctx *test;
+
+    (void) mode;
+    (void) pid;
+    (void) timestamps;
+    (void) vals;
+
+    test = data;
+    test->flushed += count;
+}
+
+/* Makes a frame: mostly OBD II responses, with some other bus traffic. */
+static
+void make_frame(struct test_ctx *test, struct can_frame *frame)
+{
+    unsigned char bytes[4];
+    const struct test_pid *entry;
+    yobd_err err;
+    uint_fast8_t i;
+
+    if (rand() % 8 == 0) {
+        memset(frame, 0, sizeof(*frame));
+        frame->can_id = 0x100 + rand() % 0x100;
+        frame->can_dlc = 8;
+        return;
+    }
+
+    entry = &test->pids[rand() % test->pid_count];
+    for (i = 0; i < entry->can_bytes; ++i) {
+        bytes[i] = rand() & 0xff;
+    }
+    err = yobd_make_can_response(
+        test->ctx,
+        entry->mode,
+        entry->pid,
+        bytes,
+        entry->can_bytes,
+        frame);
+    XASSERT_OK(err);
+}
+
+static
+void send_frames(int fd, const struct can_frame *frames, size_t count)
+{
+    size_t i;
+    ssize_t ret;
+
+    for (i = 0; i < count; ++i) {
+        ret = send(fd, &frames[i], sizeof(frames[i]), 0);
+        XASSERT_EQ(ret, (ssize_t) sizeof(frames[i]));
+    }
+}
+
+/*
+ * Sends rounds of frames and checks that they come back in order, in batches,
+ * with sane timestamps, and decoded as yobd_parse_can_response would.
+ */
+static
+void check_recv(struct test_ctx *test, int tx, struct yobd_socketcan *sock)
+{
+    size_t calls;
+    size_t count;
+    yobd_err err;
+    yobd_err errs[BATCH];
+    yobd_err expected_err;
+    float expected_val;
+    const struct can_frame *frames;
+    size_t i;
+    uint64_t last;
+    yobd_mode modes[BATCH];
+    yobd_pid pids[BATCH];
+    size_t received;
+    size_t round;
+    struct can_frame sent[ROUND_FRAMES];
+    size_t total;
+    const uint64_t *timestamps;
+    float vals[BATCH];
+
+    calls = 0;
+    total = 0;
+    last = 0;
+    for (round = 0; round < ROUNDS; ++round) {
+        for (i = 0; i < ROUND_FRAMES; ++i) {
+            make_frame(test, &sent[i]);
+        }
+        send_frames(tx, sent, ROUND_FRAMES);
+
+        /* Alternate between raw frames and decoded ones. */
+        received = 0;
+        while (received < ROUND_FRAMES) {
+            if (round % 2 == 0) {
+                err = yobd_socketcan_recv(
+                    sock,
+                    true,
+                    &frames,
+                    &timestamps,
+                    &count);
+                XASSERT_OK(err);
+                XASSERT_GT(count, 0);
+                XASSERT_LTE(count, BATCH);
+                for (i = 0; i < count; ++i) {
+                    XASSERT_EQ(
+                        memcmp(&frames[i], &sent[received + i], sizeof(frames[i])),
+                        0);
+                    XASSERT_GTE(timestamps[i], last);
+                    last = timestamps[i];
+                }
+            }
+            else {
+                err = yobd_socketcan_recv_responses(
+                    sock,
+                    test->ctx,
+                    true,
+                    vals,
+                    errs,
+                    modes,
+                    pids,
+                    &count);
+                XASSERT_OK(err);
+                XASSERT_GT(count, 0);
+                XASSERT_LTE(count, BATCH);
+                for (i = 0; i < count; ++i) {
+                    expected_err = yobd_parse_can_response(
+                        test->ctx,
+                        &sent[received + i],
+                        &expected_val);
+                    XASSERT_EQ(errs[i], expected_err);
+                    if (errs[i] == YOBD_OK) {
+                        XASSERT_EQ(
+                            memcmp(&vals[i], &expected_val, sizeof(vals[i])),
+                            0);
+                    }
+                }
+            }
+            received += count;
+            ++calls;
+        }
+        XASSERT_EQ(received, ROUND_FRAMES);
+        total += received;
+    }
+
+    /* Nothing is left, so a non-blocking receive comes back empty. */
+    err = yobd_socketcan_recv(sock, false, &frames, &timestamps, &count);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 0);
+
+    XASSERT_LT(calls, total);
+    printf(
+        "%zu frames in %zu receive calls (%.3f calls per frame)\n",
+        total,
+        calls,
+        (double) calls / total);
+}
+
+static
+void check_socketpair(struct test_ctx *test)
+{
+    unsigned char bytes[4];
+    size_t count;
+    yobd_err err;
+    struct can_frame frame;
+    const struct can_frame *frames;
+    struct canfd_frame fd_frame;
+    int fds[2];
+    int ret;
+    struct yobd_sink *sink;
+    struct yobd_socketcan *sock;
+    size_t stored;
+    const uint64_t *timestamps;
+
+    /* SOCK_SEQPACKET keeps datagram boundaries, as CAN_RAW does. */
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    XASSERT_EQ(ret, 0);
+
+    err = yobd_socketcan_from_fd(fds[1], BATCH, &sock);
+    XASSERT_OK(err);
+    XASSERT_EQ(yobd_socketcan_get_fd(sock), fds[1]);
+
+    check_recv(test, fds[0], sock);
+
+    /* Datagrams of the wrong size are dropped. */
+    memset(&fd_frame, 0, sizeof(fd_frame));
+    ret = send(fds[0], &fd_frame, sizeof(fd_frame), 0);
+    XASSERT_EQ(ret, (ssize_t) sizeof(fd_frame));
+    make_frame(test, &frame);
+    send_frames(fds[0], &frame, 1);
+    err = yobd_socketcan_recv(sock, true, &frames, &timestamps, &count);
+    XASSERT_OK(err);
+    XASSERT_LTE(count, 1);
+    if (count == 0) {
+        err = yobd_socketcan_recv(sock, true, &frames, &timestamps, &count);
+        XASSERT_OK(err);
+    }
+    XASSERT_EQ(count, 1);
+    XASSERT_EQ(memcmp(&frames[0], &frame, sizeof(frame)), 0);
+
+    /* Frames flow straight into a sink. */
+    err = yobd_new_sink(test->ctx, 1000, count_flush, test, &sink);
+    XASSERT_OK(err);
+    err = yobd_sink_add_pid(sink, test->pids[0].mode, test->pids[0].pid);
+    XASSERT_OK(err);
+    memset(bytes, 0, sizeof(bytes));
+    err = yobd_make_can_response(
+        test->ctx,
+        test->pids[0].mode,
+        test->pids[0].pid,
+        bytes,
+        test->pids[0].can_bytes,
+        &frame);
+    XASSERT_OK(err);
+    send_frames(fds[0], &frame, 1);
+    err = yobd_socketcan_recv_sink(sock, sink, true, &count, &stored);
+    XASSERT_OK(err);
+    XASSERT_EQ(count, 1);
+    XASSERT_EQ(stored, 1);
+    test->flushed = 0;
+    err = yobd_sink_flush(sink);
+    XASSERT_OK(err);
+    XASSERT_EQ(test->flushed, 1);
+    yobd_free_sink(sink);
+
+    yobd_socketcan_close(sock);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Runs the same checks on vcan0, if this machine has it. */
+static
+void check_vcan(struct test_ctx *test)
+{
+    yobd_err err;
+    struct yobd_socketcan *rx;
+    struct yobd_socketcan *tx;
+
+    err = yobd_socketcan_open("vcan0", BATCH, &rx);
+    if (err != YOBD_OK) {
+        printf("skipping vcan0: %s\n", yobd_strerror(err));
+        return;
+    }
+    err = yobd_socketcan_open("vcan0", 1, &tx);
+    XASSERT_OK(err);
+
+    check_recv(test, yobd_socketcan_get_fd(tx), rx);
+
+    yobd_socketcan_close(tx);
+    yobd_socketcan_close(rx);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct yobd_socketcan *sock;
+    static struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(0);
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    test.pid_count = test_get_pids(test.ctx, 0x00, 0xff, test.pids, MAX_PIDS);
+    XASSERT_LT(test.pid_count, MAX_PIDS);
+    XASSERT_GT(test.pid_count, 0);
+
+    err = yobd_socketcan_from_fd(-1, BATCH, &sock);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_socketcan_open("vcan0", 0, &sock);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_socketcan_open("no-such-interface", BATCH, &sock);
+    XASSERT_ERRCODE(err, ENODEV);
+
+    check_socketpair(&test);
+    check_vcan(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,490 @@
+/**
+ * @file      supported.c
+ * @brief     Unit test for supported-PID discovery against simulated ECUs.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yobd/supported.h>
+#include <yobd/yobd.h>
+#include <yobd-test/assert.h>
+
+/* The simulated ECUs, which answer at the first response IDs. */
+#define TEST_ECUS (3)
+
+/* What each simulated ECU really supports, by mode slot (1 or 9) and PID. */
+struct vehicle {
+    bool pids[TEST_ECUS][2][YOBD_CAPS_PIDS];
+};
+
+struct test_ctx {
+    struct yobd_ctx *ctx;
+    struct vehicle vehicle;
+    /* The schema PIDs the vehicle supports, found by brute force. */
+    size_t expected;
+    size_t seen;
+    const struct yobd_caps *caps;
+};
+
+static
+size_t mode_slot(yobd_mode mode)
+{
+    return mode == 0x9;
+}
+
+/*
+ * Fills in an ECU's 4-byte bitmap for PIDs base+1 through base+0x20. The last
+ * bit says whether the ECU supports anything past them.
+ */
+static
+void make_bitmap(
+    const bool *pids,
+    yobd_pid base,
+    unsigned char *data)
+{
+    size_t i;
+    yobd_pid pid;
+    bool set;
+
+    memset(data, 0, 4);
+    for (i = 0; i < 32; ++i) {
+        pid = base + 1 + i;
+        set = pid < YOBD_CAPS_PIDS && pids[pid];
+        if (i == 31) {
+            for (; pid < YOBD_CAPS_PIDS; ++pid) {
+                set |= pids[pid];
+            }
+        }
+        if (set) {
+            data[i / 8] |= 0x80 >> (i % 8);
+        }
+    }
+}
+
+/* Returns whether an ECU answers a query for a "PIDs supported" PID. */
+static
+bool has_bitmap(const bool *pids, yobd_pid base)
+{
+    yobd_pid pid;
+
+    if (base == 0) {
+        return true;
+    }
+
+    for (pid = base; pid < YOBD_CAPS_PIDS; ++pid) {
+        if (pids[pid]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static
+void make_vehicle(struct test_ctx *test)
+{
+    yobd_pid pid;
+    struct vehicle *v;
+
+    v = &test->vehicle;
+    memset(v, 0, sizeof(*v));
+
+    /* The engine ECU supports most things, reaching into the 0x80 range. */
+    for (pid = 0x1; pid <= 0x20; ++pid) {
+        v->pids[0][0][pid] = pid % 3 != 0;
+    }
+    v->pids[0][0][0x0c] = true;
+    v->pids[0][0][0x0d] = true;
+    v->pids[0][0][0x5c] = true;
+    v->pids[0][0][0x8e] = true;
+    v->pids[0][1][0x02] = true;
+    v->pids[0][1][0x0a] = true;
+
+    /* The transmission ECU has a few PIDs, and only the first bitmap. */
+    v->pids[1][0][0x0c] = true;
+    v->pids[1][0][0x0d] = true;
+    v->pids[1][0][0x1c] = true;
+    v->pids[1][1][0x0a] = true;
+
+    /* A third ECU answers with every bitmap empty. */
+}
+
+/*
+ * Runs discovery for a mode the way a gateway would, answering each query as
+ * the simulated ECUs would. Returns the number of queries sent.
+ */
+static
+size_t discover(
+    const struct vehicle *v,
+    yobd_mode mode,
+    struct yobd_caps *caps)
+{
+    unsigned char data[4];
+    bool done;
+    size_t ecu;
+    yobd_err err;
+    struct can_frame frame;
+    yobd_pid pid;
+    size_t queries;
+    struct can_frame response;
+
+    queries = 0;
+    pid = 0;
+    done = false;
+    while (!done) {
+        err = yobd_make_supported_query(mode, pid, &frame);
+        XASSERT_OK(err);
+        XASSERT_EQ(frame.can_id, YOBD_OBD_II_QUERY_ADDRESS);
+        XASSERT_EQ(frame.data[0], 2);
+        XASSERT_EQ(frame.data[1], mode);
+        XASSERT_EQ(frame.data[2], pid);
+        ++queries;
+
+        for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+            if (!has_bitmap(v->pids[ecu][mode_slot(mode)], pid)) {
+                continue;
+            }
+            make_bitmap(v->pids[ecu][mode_slot(mode)], pid, data);
+            err = yobd_make_can_response_noctx(
+                true,
+                mode,
+                pid,
+                data,
+                sizeof(data),
+                &response);
+            XASSERT_OK(err);
+            response.can_id = YOBD_OBD_II_RESPONSE_BASE + ecu;
+            err = yobd_parse_supported_response(caps, &response);
+            XASSERT_OK(err);
+        }
+
+        err = yobd_caps_next_supported_pid(caps, mode, pid, &pid, &done);
+        XASSERT_OK(err);
+    }
+
+    return queries;
+}
+
+/* Checks that caps say exactly what the vehicle supports. */
+static
+void check_caps(
+    const struct vehicle *v,
+    yobd_mode mode,
+    const struct yobd_caps *caps)
+{
+    size_t ecu;
+    uint8_t ecus;
+    uint8_t expected;
+    yobd_err err;
+    yobd_pid pid;
+    bool supported;
+
+    for (pid = 1; pid < YOBD_CAPS_PIDS; ++pid) {
+        expected = 0;
+        for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+            supported = v->pids[ecu][mode_slot(mode)][pid];
+            /* Bitmap PIDs are supported if the ECU answered them. */
+            if (pid % YOBD_SUPPORTED_PIDS_STRIDE == 0) {
+                supported = has_bitmap(v->pids[ecu][mode_slot(mode)], pid);
+            }
+            if (supported) {
+                expected |= 1 << ecu;
+            }
+        }
+        err = yobd_caps_get_ecus(caps, mode, pid, &ecus);
+        XASSERT_OK(err);
+        XASSERT_EQ(ecus, expected);
+    }
+}
+
+static
+bool count_supported(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    uint8_t ecus;
+    yobd_err err;
+    struct test_ctx *test;
+
+    (void) desc;
+
+    test = data;
+    err = yobd_caps_get_ecus(test->caps, mode, pid, &ecus);
+    XASSERT_OK(err);
+    XASSERT_NEQ(ecus, 0);
+    ++test->seen;
+
+    return false;
+}
+
+static
+bool count_expected(
+    const struct yobd_pid_desc *desc,
+    yobd_mode mode,
+    yobd_pid pid,
+    void *data)
+{
+    size_t ecu;
+    struct test_ctx *test;
+
+    (void) desc;
+
+    test = data;
+    XASSERT_EQ(mode, 0x1);
+    for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+        if (test->vehicle.pids[ecu][0][pid]) {
+            ++test->expected;
+            break;
+        }
+    }
+
+    return false;
+}
+
+static
+void check_discovery(struct test_ctx *test)
+{
+    struct yobd_caps caps;
+    yobd_err err;
+    size_t queries;
+
+    yobd_caps_init(&caps);
+
+    /* The engine ECU goes up to the 0x80 bitmap, so five queries. */
+    queries = discover(&test->vehicle, 0x1, &caps);
+    XASSERT_EQ(queries, 5);
+    queries = discover(&test->vehicle, 0x9, &caps);
+    XASSERT_EQ(queries, 1);
+    XASSERT_EQ(caps.ecus, (1 << TEST_ECUS) - 1);
+    check_caps(&test->vehicle, 0x1, &caps);
+    check_caps(&test->vehicle, 0x9, &caps);
+
+    /* Only the supported schema PIDs are worth querying. */
+    test->expected = 0;
+    err = yobd_pid_foreach(test->ctx, count_expected, test);
+    XASSERT_OK(err);
+    test->seen = 0;
+    test->caps = &caps;
+    err = yobd_caps_foreach(test->ctx, &caps, count_supported, test);
+    XASSERT_OK(err);
+    XASSERT_EQ(test->seen, test->expected);
+    XASSERT_GT(test->seen, 0);
+
+    /* Before discovery, nothing is supported. */
+    yobd_caps_init(&caps);
+    test->seen = 0;
+    err = yobd_caps_foreach(test->ctx, &caps, count_supported, test);
+    XASSERT_OK(err);
+    XASSERT_EQ(test->seen, 0);
+}
+
+/* One multi-PID query gets the first bitmaps of each ECU at once. */
+static
+void check_multi(struct test_ctx *test)
+{
+    struct yobd_caps caps;
+    struct yobd_caps chained;
+    bool done;
+    size_t ecu;
+    yobd_err err;
+    struct can_frame frame;
+    size_t i;
+    unsigned char payload[1 + 6*5];
+    yobd_pid pid;
+    size_t size;
+    const bool *pids;
+
+    err = yobd_make_supported_multi_query(&frame);
+    XASSERT_OK(err);
+    XASSERT_EQ(frame.can_id, YOBD_OBD_II_QUERY_ADDRESS);
+    XASSERT_EQ(frame.data[0], 7);
+    XASSERT_EQ(frame.data[1], 0x1);
+    for (i = 0; i < 6; ++i) {
+        XASSERT_EQ(frame.data[2+i], 0x20*i);
+    }
+
+    yobd_caps_init(&caps);
+    for (ecu = 0; ecu < TEST_ECUS; ++ecu) {
+        /* Each ECU answers with the bitmaps it has, highest first. */
+        pids = test->vehicle.pids[ecu][0];
+        payload[0] = 0x41;
+        size = 1;
+        for (i = 6; i-- > 0;) {
+            pid = 0x20*i;
+            if (has_bitmap(pids, pid)) {
+                payload[size] = pid;
+                make_bitmap(pids, pid, &payload[size+1]);
+                size += 5;
+            }
+        }
+        err = yobd_parse_supported_payload(
+            &caps,
+            YOBD_OBD_II_RESPONSE_BASE + ecu,
+            payload,
+            size);
+        XASSERT_OK(err);
+    }
+
+    /* There is nothing left to ask past 0xa0, and the result is the same. */
+    err = yobd_caps_next_supported_pid(&caps, 0x1, 0xa0, &pid, &done);
+    XASSERT_OK(err);
+    XASSERT_EQ(done, true);
+    check_caps(&test->vehicle, 0x1, &caps);
+
+    yobd_caps_init(&chained);
+    discover(&test->vehicle, 0x1, &chained);
+    XASSERT_EQ(memcmp(caps.ecu, chained.ecu, sizeof(caps.ecu)), 0);
+}
+
+static
+void check_serialize(struct test_ctx *test)
+{
+    unsigned char buf[YOBD_MAX_CAPS_SIZE + 1];
+    struct yobd_caps caps;
+    yobd_err err;
+    struct yobd_caps loaded;
+    size_t size;
+    size_t size2;
+
+    yobd_caps_init(&caps);
+    discover(&test->vehicle, 0x1, &caps);
+    discover(&test->vehicle, 0x9, &caps);
+
+    err = yobd_caps_serialize(&caps, NULL, 0, &size);
+    XASSERT_OK(err);
+    XASSERT_LTE(size, YOBD_MAX_CAPS_SIZE);
+    err = yobd_caps_serialize(&caps, buf, size - 1, &size2);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+    err = yobd_caps_serialize(&caps, buf, sizeof(buf), &size2);
+    XASSERT_OK(err);
+    XASSERT_EQ(size2, size);
+
+    memset(&loaded, 0xff, sizeof(loaded));
+    err = yobd_caps_deserialize(buf, size, &loaded);
+    XASSERT_OK(err);
+    XASSERT_EQ(memcmp(&loaded, &caps, sizeof(caps)), 0);
+
+    /* Bad data is rejected and leaves the output alone. */
+    yobd_caps_init(&loaded);
+    err = yobd_caps_deserialize(buf, size - 1, &loaded);
+    XASSERT_ERRCODE(err, YOBD_INVALID_CAPS);
+    err = yobd_caps_deserialize(buf, size + 1, &loaded);
+    XASSERT_ERRCODE(err, YOBD_INVALID_CAPS);
+    err = yobd_caps_deserialize(buf, 3, &loaded);
+    XASSERT_ERRCODE(err, YOBD_INVALID_CAPS);
+    buf[0] ^= 0xff;
+    err = yobd_caps_deserialize(buf, size, &loaded);
+    XASSERT_ERRCODE(err, YOBD_INVALID_CAPS);
+    buf[0] ^= 0xff;
+    buf[9] |= 0x80;
+    err = yobd_caps_deserialize(buf, size, &loaded);
+    XASSERT_ERRCODE(err, YOBD_INVALID_CAPS);
+    XASSERT_EQ(loaded.ecus, 0);
+
+    /* Knowing nothing still round-trips. */
+    err = yobd_caps_serialize(&loaded, buf, sizeof(buf), &size);
+    XASSERT_OK(err);
+    err = yobd_caps_deserialize(buf, size, &caps);
+    XASSERT_OK(err);
+    XASSERT_EQ(caps.ecus, 0);
+}
+
+static
+void check_params(struct test_ctx *test)
+{
+    struct yobd_caps caps;
+    struct yobd_caps before;
+    unsigned char data[4] = { 0xff, 0xff, 0xff, 0xff };
+    bool done;
+    uint8_t ecus;
+    yobd_err err;
+    struct can_frame frame;
+    const unsigned char payload[] = { 0x41, 0x00, 0xff, 0xff };
+    yobd_pid pid;
+
+    err = yobd_make_supported_query(0x2, 0x00, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    err = yobd_make_supported_query(0x1, 0x0c, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PID);
+    err = yobd_make_supported_query(0x1, 0x100, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PID);
+    err = yobd_make_supported_query(0x1, 0x00, NULL);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+
+    /* Other responses are rejected without touching the capabilities. */
+    yobd_caps_init(&caps);
+    before = caps;
+    err = yobd_make_can_response(test->ctx, 0x1, 0x0c, data, 2, &frame);
+    XASSERT_OK(err);
+    err = yobd_parse_supported_response(&caps, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PID);
+    err = yobd_make_can_response_noctx(true, 0x2, 0x00, data, 4, &frame);
+    XASSERT_OK(err);
+    err = yobd_parse_supported_response(&caps, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    err = yobd_make_can_response_noctx(true, 0x1, 0x00, data, 4, &frame);
+    XASSERT_OK(err);
+    frame.can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    err = yobd_parse_supported_response(&caps, &frame);
+    XASSERT_ERRCODE(err, YOBD_UNKNOWN_ID);
+    frame.can_id = YOBD_OBD_II_RESPONSE_BASE;
+    frame.data[0] = 0x10;
+    err = yobd_parse_supported_response(&caps, &frame);
+    XASSERT_ERRCODE(err, YOBD_INVALID_DLC);
+    err = yobd_parse_supported_payload(
+        &caps,
+        YOBD_OBD_II_RESPONSE_BASE,
+        payload,
+        sizeof(payload));
+    XASSERT_ERRCODE(err, YOBD_INVALID_DATA_BYTES);
+    XASSERT_EQ(memcmp(&caps, &before, sizeof(caps)), 0);
+
+    err = yobd_caps_next_supported_pid(&caps, 0x1, 0x10, &pid, &done);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PID);
+    err = yobd_caps_next_supported_pid(&caps, 0x3, 0x00, &pid, &done);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    err = yobd_caps_next_supported_pid(&caps, 0x1, 0x00, &pid, &done);
+    XASSERT_OK(err);
+    XASSERT_EQ(done, true);
+    err = yobd_caps_get_ecus(&caps, 0x22, 0x1234, &ecus);
+    XASSERT_ERRCODE(err, YOBD_INVALID_MODE);
+    err = yobd_caps_foreach(test->ctx, NULL, count_supported, test);
+    XASSERT_ERRCODE(err, YOBD_INVALID_PARAMETER);
+}
+
+int main(int argc, const char **argv)
+{
+    yobd_err err;
+    struct test_ctx test;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (strnlen(argv[1], PATH_MAX) == PATH_MAX) {
+        fprintf(stderr, "File argument is longer than PATH_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_parse_schema(argv[1], &test.ctx);
+    XASSERT_OK(err);
+    make_vehicle(&test);
+
+    check_discovery(&test);
+    check_multi(&test);
+    check_serialize(&test);
+    check_params(&test);
+
+    yobd_free_ctx(test.ctx);
+
+    return EXIT_SUCCESS;
+}
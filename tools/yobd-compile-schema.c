@@ -0,0 +1,50 @@
+/**
+ * @file      yobd-compile-schema.c
+ * @brief     Compiles a YAML schema into the binary format loaded by
+ *            yobd_load_compiled_schema.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <yobd/yobd.h>
+
+int main(int argc, const char **argv)
+{
+    struct yobd_ctx *ctx;
+    yobd_err err;
+    char path[PATH_MAX];
+    const char *schema;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s SCHEMA-FILE OUTPUT-FILE\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * yobd looks up relative schema paths in the schema directory, but on the
+     * command line, users expect them to be relative to where they are.
+     */
+    schema = argv[1];
+    if (realpath(argv[1], path) != NULL) {
+        schema = path;
+    }
+
+    err = yobd_parse_schema(schema, &ctx);
+    if (err != YOBD_OK) {
+        fprintf(stderr, "%s: %s\n", argv[1], yobd_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_save_compiled_schema(ctx, argv[2]);
+    yobd_free_ctx(ctx);
+    if (err != YOBD_OK) {
+        fprintf(stderr, "%s: %s\n", argv[2], yobd_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    return EXIT_SUCCESS;
+}
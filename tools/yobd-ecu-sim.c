@@ -0,0 +1,355 @@
+/**
+ * @file      yobd-ecu-sim.c
+ * @brief     Simulates the ECUs of a vehicle on a CAN interface, answering
+ *            OBD II queries from a schema.
+ * @author    Martin Kelly <mkelly@xevo.com>
+ * @copyright Copyright (C) 2018 Xevo Inc. All Rights Reserved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <yobd/sim.h>
+#include <yobd/yobd.h>
+
+#define NS_PER_S (1000000000ULL)
+#define NS_PER_US (1000ULL)
+#define NS_PER_MS (1000000ULL)
+
+/* The most -g options. */
+#define MAX_GENS (64)
+
+static volatile sig_atomic_t g_stop;
+
+static
+void usage(const char *name)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [OPTION]... SCHEMA-FILE IFNAME\n"
+        "  -n ECUS      number of ECUs, 1-%d (default 1)\n"
+        "  -l USEC      response latency in microseconds (default 5000)\n"
+        "  -j USEC      most random latency added, in microseconds\n"
+        "  -d PPM       responses dropped, in parts per million\n"
+        "  -r FILE      replay responses from a candump log\n"
+        "  -s SEED      seed for jitter and drops\n"
+        "  -g MODE:PID:TYPE:VALUE[:RATE|AMPLITUDE[:PERIOD-MS]]\n"
+        "               set a generator, with TYPE constant, ramp or sine\n",
+        name,
+        YOBD_SIM_MAX_ECUS);
+    exit(EXIT_FAILURE);
+}
+
+static
+unsigned long long parse_num(const char *name, const char *arg)
+{
+    char *end;
+    unsigned long long val;
+
+    errno = 0;
+    val = strtoull(arg, &end, 0);
+    if (errno != 0 || *arg == '\0' || *end != '\0') {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        usage(name);
+    }
+
+    return val;
+}
+
+/* Parses a -g option, returning false if it is malformed. */
+static
+bool parse_gen(
+    const char *arg,
+    yobd_mode *mode,
+    yobd_pid *pid,
+    struct yobd_sim_gen *gen)
+{
+    char extra;
+    int fields;
+    double param;
+    unsigned long period;
+    long pid_val;
+    int mode_val;
+    char type[16];
+
+    memset(gen, 0, sizeof(*gen));
+    param = 0;
+    period = 0;
+    fields = sscanf(
+        arg,
+        "%i:%li:%15[a-z]:%lf:%lf:%lu%c",
+        &mode_val,
+        &pid_val,
+        type,
+        &gen->value,
+        &param,
+        &period,
+        &extra);
+    if (fields < 4 || fields > 6 || mode_val < 0 || mode_val > UINT8_MAX ||
+        pid_val < 0 || pid_val > UINT16_MAX) {
+        return false;
+    }
+    *mode = mode_val;
+    *pid = pid_val;
+    gen->period = period * NS_PER_MS;
+
+    if (strcmp(type, "constant") == 0) {
+        gen->type = YOBD_SIM_CONSTANT;
+    }
+    else if (strcmp(type, "ramp") == 0) {
+        gen->type = YOBD_SIM_RAMP;
+        gen->rate = param;
+    }
+    else if (strcmp(type, "sine") == 0) {
+        gen->type = YOBD_SIM_SINE;
+        gen->amplitude = param;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+static
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static
+void handle_signal(int sig)
+{
+    (void) sig;
+
+    g_stop = 1;
+}
+
+/* Opens a nonblocking CAN_RAW socket for queries and flow control only. */
+static
+int open_can(const char *ifname)
+{
+    struct sockaddr_can addr;
+    struct can_filter filters[2];
+    int fd;
+    unsigned int index;
+
+    index = if_nametoindex(ifname);
+    if (index == 0) {
+        return -1;
+    }
+
+    fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+    if (fd == -1) {
+        return -1;
+    }
+
+    filters[0].can_id = YOBD_OBD_II_QUERY_ADDRESS;
+    filters[0].can_mask = CAN_SFF_MASK;
+    filters[1].can_id = YOBD_OBD_II_RESPONSE_BASE - 8;
+    filters[1].can_mask = CAN_SFF_MASK & ~0x7;
+    if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+                   sizeof(filters)) == -1) {
+        goto error;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = index;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        goto error;
+    }
+
+    return fd;
+
+error:
+    close(fd);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction act;
+    struct yobd_ctx *ctx;
+    size_t count;
+    size_t ecu;
+    unsigned long long ecus;
+    yobd_err err;
+    int fd;
+    struct yobd_sim_gen gen;
+    const char *gens[MAX_GENS];
+    size_t gen_count;
+    size_t i;
+    yobd_mode mode;
+    uint64_t now;
+    struct yobd_sim_ecu_opts opts;
+    int opt;
+    char path[PATH_MAX];
+    struct pollfd pfd;
+    yobd_pid pid;
+    const char *replay;
+    const char *schema;
+    uint64_t seed;
+    struct yobd_sim *sim;
+    struct yobd_sim_stats stats;
+    struct timespec timeout;
+    uint64_t wake;
+
+    yobd_sim_ecu_opts_init(&opts);
+    ecus = 1;
+    gen_count = 0;
+    replay = NULL;
+    seed = 1;
+    while ((opt = getopt(argc, argv, "n:l:j:d:r:s:g:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ecus = parse_num(argv[0], optarg);
+                break;
+            case 'l':
+                opts.latency = parse_num(argv[0], optarg) * NS_PER_US;
+                break;
+            case 'j':
+                opts.jitter = parse_num(argv[0], optarg) * NS_PER_US;
+                break;
+            case 'd':
+                opts.drop_ppm = parse_num(argv[0], optarg);
+                break;
+            case 'r':
+                replay = optarg;
+                break;
+            case 's':
+                seed = parse_num(argv[0], optarg);
+                break;
+            case 'g':
+                if (gen_count == MAX_GENS) {
+                    fprintf(stderr, "Too many generators\n");
+                    exit(EXIT_FAILURE);
+                }
+                gens[gen_count] = optarg;
+                ++gen_count;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || ecus < 1 || ecus > YOBD_SIM_MAX_ECUS) {
+        usage(argv[0]);
+    }
+
+    /* As in yobd-compile-schema, paths are relative to where the user is. */
+    schema = argv[optind];
+    if (realpath(argv[optind], path) != NULL) {
+        schema = path;
+    }
+
+    err = yobd_parse_schema(schema, &ctx);
+    if (err != YOBD_OK) {
+        fprintf(stderr, "%s: %s\n", argv[optind], yobd_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    err = yobd_new_sim(ctx, seed, &sim);
+    if (err != YOBD_OK) {
+        fprintf(stderr, "Cannot create simulator: %s\n", yobd_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ecus; ++i) {
+        err = yobd_sim_add_ecu(sim, &opts, &ecu);
+        if (err != YOBD_OK) {
+            fprintf(stderr, "Cannot add ECU: %s\n", yobd_strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < gen_count; ++i) {
+        if (!parse_gen(gens[i], &mode, &pid, &gen)) {
+            fprintf(stderr, "Invalid generator: %s\n", gens[i]);
+            usage(argv[0]);
+        }
+        err = yobd_sim_set_gen(sim, mode, pid, &gen);
+        if (err != YOBD_OK) {
+            fprintf(stderr, "%s: %s\n", gens[i], yobd_strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (replay != NULL) {
+        err = yobd_sim_load_replay(sim, replay, &count);
+        if (err != YOBD_OK) {
+            fprintf(stderr, "%s: %s\n", replay, yobd_strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Loaded %zu responses from %s\n", count, replay);
+    }
+
+    fd = open_can(argv[optind+1]);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", argv[optind+1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handle_signal;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    wake = UINT64_MAX;
+    while (!g_stop) {
+        now = now_ns();
+        if (wake != UINT64_MAX) {
+            if (wake < now) {
+                wake = now;
+            }
+            timeout.tv_sec = (wake - now) / NS_PER_S;
+            timeout.tv_nsec = (wake - now) % NS_PER_S;
+        }
+        if (ppoll(&pfd, 1, wake == UINT64_MAX ? NULL : &timeout, NULL) == -1 &&
+            errno != EINTR) {
+            perror("ppoll");
+            break;
+        }
+
+        err = yobd_sim_pump(sim, fd, now_ns(), &wake);
+        if (err != YOBD_OK) {
+            fprintf(stderr, "%s: %s\n", argv[optind+1], yobd_strerror(err));
+            break;
+        }
+    }
+
+    yobd_sim_get_stats(sim, &stats);
+    fprintf(
+        stderr,
+        "%" PRIu64 " queries, %" PRIu64 " frames sent, %" PRIu64 " dropped, "
+        "%" PRIu64 " ignored\n",
+        stats.queries,
+        stats.frames,
+        stats.dropped,
+        stats.ignored);
+
+    close(fd);
+    yobd_free_sim(sim);
+    yobd_free_ctx(ctx);
+
+    return g_stop ? EXIT_SUCCESS : EXIT_FAILURE;
+}